@@ -13,6 +13,7 @@ Abstract:
 #include "BufferManager.hpp"
 #include "BufferPool.hpp"
 #include "KPtr.h"
+#include "SerializedBufferPool.hpp"
 
 // xxx this api needs to be fixed
 #define NETCX_ADAPTER_2
@@ -104,6 +105,61 @@ static const NET_CLIENT_BUFFER_POOL_DISPATCH PoolDispatch =
     &NetClientFreeBuffers,
 };
 
+PAGEDX
+_IRQL_requires_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+NetClientDestroySerializedBufferPool(
+    _In_ NET_CLIENT_BUFFER_POOL BufferPool
+    )
+{
+    PAGED_CODE();
+
+    NxSerializedBufferPool* pool = reinterpret_cast<NxSerializedBufferPool *> (BufferPool);
+    delete pool;
+}
+
+NONPAGEDX
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+static
+ULONG
+NetClientAllocateSerializedBuffers(
+    _In_ NET_CLIENT_BUFFER_POOL BufferPool,
+    _Inout_updates_(NumBuffers) NET_FRAGMENT Buffers[],
+    _In_ ULONG NumBuffers)
+{
+    NxSerializedBufferPool* pool = reinterpret_cast<NxSerializedBufferPool *> (BufferPool);
+
+    return pool->Allocate(Buffers, NumBuffers);
+}
+
+NONPAGEDX
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+NetClientFreeSerializedBuffers(
+    _In_ NET_CLIENT_BUFFER_POOL BufferPool,
+    _Inout_updates_(NumBuffers) PVOID * Buffers,
+    _In_ ULONG NumBuffers)
+{
+    NxSerializedBufferPool* pool = reinterpret_cast<NxSerializedBufferPool *> (BufferPool);
+
+    pool->Free(Buffers, NumBuffers);
+}
+
+static const NET_CLIENT_BUFFER_POOL_DISPATCH SerializedPoolDispatch =
+{
+    sizeof(NET_CLIENT_BUFFER_POOL_DISPATCH),
+    &NetClientDestroySerializedBufferPool,
+    &NetClientAllocateSerializedBuffers,
+    &NetClientFreeSerializedBuffers,
+};
+
 PAGEDX
 _IRQL_requires_(PASSIVE_LEVEL)
 _IRQL_requires_same_
@@ -116,9 +172,6 @@ NetClientCreateBufferPool(
 {
     PAGED_CODE();
 
-    CX_RETURN_NTSTATUS_IF(STATUS_NOT_IMPLEMENTED,
-                          BufferPoolConfig->Flag & NET_CLIENT_BUFFER_POOL_FLAGS_SERIALIZATION);
-
     CX_RETURN_NTSTATUS_IF(STATUS_INVALID_PARAMETER,
                           BufferPoolConfig->BufferAlignment > PAGE_SIZE);
 
@@ -157,6 +210,24 @@ NetClientCreateBufferPool(
 
     CX_RETURN_IF_NOT_NT_SUCCESS(pool->AddMemoryChunks(memoryChunks));
 
+    if (BufferPoolConfig->Flag & NET_CLIENT_BUFFER_POOL_FLAGS_SERIALIZATION)
+    {
+        //
+        // the serialized pool takes ownership of the pool and its buffers,
+        // callers may then allocate and free from any processor concurrently
+        //
+        KPtr<NxSerializedBufferPool> serializedPool;
+        serializedPool.reset(new (std::nothrow) NxSerializedBufferPool());
+        CX_RETURN_NTSTATUS_IF(STATUS_INSUFFICIENT_RESOURCES, !serializedPool.get());
+
+        CX_RETURN_IF_NOT_NT_SUCCESS(serializedPool->Initialize(wistd::move(pool)));
+
+        *BufferPool = reinterpret_cast<NET_CLIENT_BUFFER_POOL>(serializedPool.release());
+        *BufferPoolDispatch = &SerializedPoolDispatch;
+
+        return STATUS_SUCCESS;
+    }
+
     //detach smart ptr
     *BufferPool = reinterpret_cast<NET_CLIENT_BUFFER_POOL>(pool.release());
     *BufferPoolDispatch = &PoolDispatch;
@@ -0,0 +1,374 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+/*++
+
+Abstract:
+
+    Implements a buffer pool which supports concurrent allocation and free
+    from multiple processors.
+
+--*/
+
+#include "BmPrecomp.hpp"
+#include "BufferManager.hpp"
+#include "BufferPool.hpp"
+#include "KPtr.h"
+
+// xxx this api needs to be fixed
+#define NETCX_ADAPTER_2
+#include <net/fragment.h>
+
+#include "SerializedBufferPool.tmh"
+#include "SerializedBufferPool.hpp"
+
+static
+size_t
+GetProcessorCount(
+    void
+)
+{
+#if _KERNEL_MODE
+    return KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+#else
+    return GetMaximumProcessorCount(ALL_PROCESSOR_GROUPS);
+#endif
+}
+
+static
+size_t
+GetCurrentProcessorIndex(
+    void
+)
+{
+#if _KERNEL_MODE
+    return KeGetCurrentProcessorIndex();
+#else
+    return GetCurrentProcessorNumber();
+#endif
+}
+
+NxSerializedBufferPool::NxSerializedBufferPool(
+    void
+)
+{
+    InitializeSListHead(&m_fullMagazines);
+    InitializeSListHead(&m_emptyMagazines);
+}
+
+NxSerializedBufferPool::~NxSerializedBufferPool(
+    void
+)
+{
+    if (m_magazines.count() > 0)
+    {
+        size_t cachedBuffers = 0;
+
+        for (size_t i = 0; i < m_magazines.count(); i++)
+        {
+            cachedBuffers += m_magazines[i].Count;
+        }
+
+        // Every buffer must have been returned before the pool is destroyed
+        NT_ASSERT(cachedBuffers == m_descriptors.count());
+    }
+
+    // Hand everything drained during Initialize back to the backing pool
+    for (size_t i = 0; i < m_descriptors.count(); i++)
+    {
+        m_backingPool->Free(m_descriptors[i].VirtualAddress);
+    }
+
+    for (size_t i = 0; i < m_cacheCount; i++)
+    {
+        m_caches[i].~NxBufferMagazineCache();
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS
+NxSerializedBufferPool::Initialize(
+    KPtr<NxBufferPool> && BackingPool
+)
+{
+    m_backingPool = wistd::move(BackingPool);
+
+    size_t const bufferCount = m_backingPool->AvailableBuffersCount();
+
+    CX_RETURN_NTSTATUS_IF(
+        STATUS_INSUFFICIENT_RESOURCES,
+        !m_descriptors.reserve(bufferCount));
+
+    for (size_t i = 0; i < bufferCount; i++)
+    {
+        NxSerializedBufferDescriptor descriptor;
+
+        CX_RETURN_IF_NOT_NT_SUCCESS(
+            m_backingPool->Allocate(
+                &descriptor.VirtualAddress,
+                &descriptor.LogicalAddress,
+                &m_bufferOffset,
+                &m_bufferCapacity));
+
+        NT_FRE_ASSERT(m_descriptors.append(descriptor));
+
+        // The backing pool hands out buffers in address order, so keeping
+        // the table sorted is normally a plain append
+        for (size_t j = m_descriptors.count() - 1;
+            j > 0 && m_descriptors[j - 1].VirtualAddress > m_descriptors[j].VirtualAddress;
+            j--)
+        {
+            auto const tmp = m_descriptors[j - 1];
+            m_descriptors[j - 1] = m_descriptors[j];
+            m_descriptors[j] = tmp;
+        }
+    }
+
+    size_t const processorCount = GetProcessorCount();
+
+    CX_RETURN_NTSTATUS_IF(
+        STATUS_INSUFFICIENT_RESOURCES,
+        !m_cacheStorage.resize((processorCount + 1) * sizeof(NxBufferMagazineCache)));
+
+    m_caches = reinterpret_cast<NxBufferMagazineCache *>(
+        ALIGN_UP_BY(reinterpret_cast<ULONG_PTR>(&m_cacheStorage[0]), SYSTEM_CACHE_ALIGNMENT_SIZE));
+
+    for (; m_cacheCount < processorCount; m_cacheCount++)
+    {
+        new (&m_caches[m_cacheCount]) NxBufferMagazineCache();
+    }
+
+    // Enough magazines to hold every buffer, plus a loaded and a previous
+    // magazine per processor. With this many there is always an empty
+    // magazine in the depot when a processor needs to free a buffer.
+    size_t const magazineCount =
+        (bufferCount + NX_BUFFER_MAGAZINE_SIZE - 1) / NX_BUFFER_MAGAZINE_SIZE + 2 * processorCount;
+
+    CX_RETURN_NTSTATUS_IF(
+        STATUS_INSUFFICIENT_RESOURCES,
+        !m_magazines.resize(magazineCount));
+
+    size_t next = 0;
+
+    for (size_t i = 0; i < m_magazines.count(); i++)
+    {
+        auto & magazine = m_magazines[i];
+
+        for (; magazine.Count < NX_BUFFER_MAGAZINE_SIZE && next < bufferCount; next++)
+        {
+            magazine.Buffers[magazine.Count++] = m_descriptors[next].VirtualAddress;
+        }
+
+        if (magazine.Count > 0)
+        {
+            DepotPushFull(&magazine);
+        }
+        else
+        {
+            DepotPushEmpty(&magazine);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+ULONG
+NxSerializedBufferPool::Allocate(
+    NET_FRAGMENT Buffers[],
+    ULONG NumBuffers
+)
+{
+    ULONG allocatedCount = 0;
+    auto & cache = GetCurrentCache();
+
+    KAcquireSpinLock lock(cache.Lock);
+
+    while (allocatedCount < NumBuffers)
+    {
+        if (! cache.Loaded || cache.Loaded->Count == 0)
+        {
+            if (cache.Previous && cache.Previous->Count > 0)
+            {
+                auto const tmp = cache.Loaded;
+                cache.Loaded = cache.Previous;
+                cache.Previous = tmp;
+            }
+            else
+            {
+                auto full = DepotPopFull();
+
+                if (! full)
+                {
+                    break;
+                }
+
+                DepotPushEmpty(cache.Previous);
+                cache.Previous = cache.Loaded;
+                cache.Loaded = full;
+            }
+        }
+
+        auto magazine = cache.Loaded;
+        auto const count = static_cast<ULONG>(
+            min(static_cast<size_t>(NumBuffers - allocatedCount), magazine->Count));
+
+        magazine->Count -= count;
+
+        for (ULONG i = 0; i < count; i++)
+        {
+            auto & buffer = Buffers[allocatedCount + i];
+
+            buffer.VirtualAddress = magazine->Buffers[magazine->Count + i];
+            buffer.Mapping.DmaLogicalAddress = GetLogicalAddress(buffer.VirtualAddress);
+            buffer.Offset = m_bufferOffset;
+            buffer.Capacity = m_bufferCapacity;
+        }
+
+        allocatedCount += count;
+    }
+
+    return allocatedCount;
+}
+
+_Use_decl_annotations_
+void
+NxSerializedBufferPool::Free(
+    PVOID * Buffers,
+    ULONG NumBuffers
+)
+{
+    ULONG freedCount = 0;
+    auto & cache = GetCurrentCache();
+
+    KAcquireSpinLock lock(cache.Lock);
+
+    while (freedCount < NumBuffers)
+    {
+        if (! cache.Loaded || cache.Loaded->Count == NX_BUFFER_MAGAZINE_SIZE)
+        {
+            if (cache.Previous && cache.Previous->Count < NX_BUFFER_MAGAZINE_SIZE)
+            {
+                auto const tmp = cache.Loaded;
+                cache.Loaded = cache.Previous;
+                cache.Previous = tmp;
+            }
+            else
+            {
+                auto empty = DepotPopEmpty();
+
+                // Guaranteed by the number of magazines created in Initialize,
+                // unless a buffer that was not allocated is being freed
+                NT_FRE_ASSERT(empty);
+
+                if (cache.Previous)
+                {
+                    DepotPushFull(cache.Previous);
+                }
+
+                cache.Previous = cache.Loaded;
+                cache.Loaded = empty;
+            }
+        }
+
+        auto magazine = cache.Loaded;
+        auto const count = static_cast<ULONG>(
+            min(static_cast<size_t>(NumBuffers - freedCount), NX_BUFFER_MAGAZINE_SIZE - magazine->Count));
+
+        RtlCopyMemory(
+            &magazine->Buffers[magazine->Count],
+            &Buffers[freedCount],
+            count * sizeof(PVOID));
+
+        RtlZeroMemory(
+            &Buffers[freedCount],
+            count * sizeof(PVOID));
+
+        magazine->Count += count;
+        freedCount += count;
+    }
+}
+
+_Use_decl_annotations_
+NxBufferMagazineCache &
+NxSerializedBufferPool::GetCurrentCache(
+    void
+)
+{
+    // The processor might change before the cache lock is acquired, in which
+    // case another processor's cache is used. That is correct, only slower.
+    return m_caches[GetCurrentProcessorIndex() % m_cacheCount];
+}
+
+NxBufferMagazine *
+NxSerializedBufferPool::DepotPopFull(
+    void
+)
+{
+    auto entry = InterlockedPopEntrySList(&m_fullMagazines);
+
+    return entry ? CONTAINING_RECORD(entry, NxBufferMagazine, Linkage) : nullptr;
+}
+
+_Use_decl_annotations_
+void
+NxSerializedBufferPool::DepotPushFull(
+    NxBufferMagazine * Magazine
+)
+{
+    NT_ASSERT(Magazine->Count > 0);
+
+    InterlockedPushEntrySList(&m_fullMagazines, &Magazine->Linkage);
+}
+
+NxBufferMagazine *
+NxSerializedBufferPool::DepotPopEmpty(
+    void
+)
+{
+    auto entry = InterlockedPopEntrySList(&m_emptyMagazines);
+
+    return entry ? CONTAINING_RECORD(entry, NxBufferMagazine, Linkage) : nullptr;
+}
+
+_Use_decl_annotations_
+void
+NxSerializedBufferPool::DepotPushEmpty(
+    NxBufferMagazine * Magazine
+)
+{
+    if (Magazine)
+    {
+        NT_ASSERT(Magazine->Count == 0);
+
+        InterlockedPushEntrySList(&m_emptyMagazines, &Magazine->Linkage);
+    }
+}
+
+_Use_decl_annotations_
+LOGICAL_ADDRESS
+NxSerializedBufferPool::GetLogicalAddress(
+    PVOID VirtualAddress
+) const
+{
+    size_t low = 0;
+    size_t high = m_descriptors.count();
+
+    while (low < high)
+    {
+        size_t const middle = low + (high - low) / 2;
+
+        if (m_descriptors[middle].VirtualAddress < VirtualAddress)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    NT_FRE_ASSERT(low < m_descriptors.count());
+    NT_FRE_ASSERT(m_descriptors[low].VirtualAddress == VirtualAddress);
+
+    return m_descriptors[low].LogicalAddress;
+}
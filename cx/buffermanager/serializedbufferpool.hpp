@@ -0,0 +1,161 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+/*++
+
+Abstract:
+
+    A buffer pool that can be used concurrently from any number of
+    processors (NET_CLIENT_BUFFER_POOL_FLAGS_SERIALIZATION).
+
+    Buffers are cached in fixed size magazines. Each processor owns a
+    loaded and a previous magazine; full and empty magazines are exchanged
+    with a lock-free depot (two interlocked SLISTs). The backing
+    NxBufferPool is drained once at initialization and never touched on
+    the data path.
+
+--*/
+
+#pragma once
+
+#include <KNew.h>
+#include <KPtr.h>
+#include <KSpinLock.h>
+
+#define NX_BUFFER_MAGAZINE_SIZE 64
+
+struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) NxBufferMagazine
+{
+    SLIST_ENTRY
+        Linkage;
+
+    size_t
+        Count = 0;
+
+    PVOID
+        Buffers[NX_BUFFER_MAGAZINE_SIZE];
+};
+
+struct DECLSPEC_CACHEALIGN NxBufferMagazineCache
+{
+    KSpinLock
+        Lock;
+
+    NxBufferMagazine *
+        Loaded = nullptr;
+
+    NxBufferMagazine *
+        Previous = nullptr;
+};
+
+struct NxSerializedBufferDescriptor
+{
+    PVOID
+        VirtualAddress;
+
+    LOGICAL_ADDRESS
+        LogicalAddress;
+};
+
+class NxSerializedBufferPool :
+    public KALLOCATOR_NONPAGED<BUFFER_MANAGER_POOL_TAG>
+{
+public:
+
+    NxSerializedBufferPool(
+        void
+    );
+
+    ~NxSerializedBufferPool(
+        void
+    );
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    NTSTATUS
+    Initialize(
+        _In_ KPtr<NxBufferPool> && BackingPool
+    );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    ULONG
+    Allocate(
+        _Out_writes_to_(NumBuffers, return) NET_FRAGMENT Buffers[],
+        _In_ ULONG NumBuffers
+    );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    void
+    Free(
+        _Inout_updates_(NumBuffers) PVOID * Buffers,
+        _In_ ULONG NumBuffers
+    );
+
+private:
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    NxBufferMagazineCache &
+    GetCurrentCache(
+        void
+    );
+
+    NxBufferMagazine *
+    DepotPopFull(
+        void
+    );
+
+    void
+    DepotPushFull(
+        _In_ NxBufferMagazine * Magazine
+    );
+
+    NxBufferMagazine *
+    DepotPopEmpty(
+        void
+    );
+
+    void
+    DepotPushEmpty(
+        _In_opt_ NxBufferMagazine * Magazine
+    );
+
+    LOGICAL_ADDRESS
+    GetLogicalAddress(
+        _In_ PVOID VirtualAddress
+    ) const;
+
+private:
+
+    KPtr<NxBufferPool>
+        m_backingPool;
+
+    // Sorted by virtual address, used to recover the logical address of
+    // a buffer handed back through Free
+    Rtl::KArray<NxSerializedBufferDescriptor, NonPagedPoolNx>
+        m_descriptors;
+
+    size_t
+        m_bufferOffset = 0;
+
+    size_t
+        m_bufferCapacity = 0;
+
+    Rtl::KArray<NxBufferMagazine, NonPagedPoolNx>
+        m_magazines;
+
+    // Backs m_caches. Pool allocations are only aligned to
+    // MEMORY_ALLOCATION_ALIGNMENT, the storage is one cache larger so the
+    // caches can start on a cache line and never share one
+    Rtl::KArray<UCHAR, NonPagedPoolNx>
+        m_cacheStorage;
+
+    NxBufferMagazineCache *
+        m_caches = nullptr;
+
+    size_t
+        m_cacheCount = 0;
+
+    SLIST_HEADER
+        m_fullMagazines;
+
+    SLIST_HEADER
+        m_emptyMagazines;
+};
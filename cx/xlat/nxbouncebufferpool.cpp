@@ -6,6 +6,13 @@
 
 #include "NxBounceBufferPool.hpp"
 
+//
+// Smallest amount of payload a bounce chunk holds. Chunks are made larger
+// when needed so that a fully bounced packet never needs more than
+// MaximumNumberOfTxFragments fragments.
+//
+#define NX_BOUNCE_CHUNK_SIZE 2048
+
 NxBounceBufferPool::~NxBounceBufferPool(
     void
 )
@@ -23,25 +30,61 @@ NxBounceBufferPool::Initialize(
     NET_CLIENT_DISPATCH const &ClientDispatch,
     NET_RING_COLLECTION const * Descriptor,
     NET_CLIENT_ADAPTER_DATAPATH_CAPABILITIES &DatapathCapabilities,
-    size_t NumberOfBuffers
+    NxDmaAdapter const * DmaAdapter,
+    size_t NumberOfBuffers,
+    NODE_REQUIREMENT PreferredNode
 )
 {
     m_descriptor = Descriptor;
+    m_copyEngine.Initialize();
+
+    m_txPayloadBackfill = DatapathCapabilities.TxPayloadBackfill;
+    m_maximumFragmentSize = DatapathCapabilities.MaximumTxFragmentSize;
+    m_maximumNumberOfFragments = max(DatapathCapabilities.MaximumNumberOfTxFragments, 1U);
+    m_alignmentRequirement = DatapathCapabilities.TxMemoryConstraints.AlignmentRequirement;
+    m_maximumLogicalAddress = static_cast<LOGICAL_ADDRESS>(
+        DatapathCapabilities.TxMemoryConstraints.Dma.MaximumPhysicalAddress.QuadPart);
 
     //
-    // Current bouncing logic ensures that a bounced NET_PACKET always has a single NET_FRAGMENT
-    // So we can include NET_PACKET backfill in the buffer size
+    // Without DMA mapping the NIC uses virtual addresses and any compliant
+    // buffer can be used in place. With DMA mapping that is only possible if
+    // we compute the logical addresses ourselves, when HAL maps the buffers
+    // the packet is copied in full.
     //
-    m_txPayloadBackfill = DatapathCapabilities.TxPayloadBackfill;
-    m_bufferSize = DatapathCapabilities.MaximumTxFragmentSize + m_txPayloadBackfill;
+    if (! DmaAdapter)
+    {
+        m_mapCompliantPages = true;
+    }
+    else if (DmaAdapter->BypassHal() && ! DmaAdapter->AlwaysBounce())
+    {
+        m_mapCompliantPages = true;
+        m_requiresPhysicalAddress = true;
+    }
+
+    //
+    // The pool is made of small chunks instead of maximum sized buffers, only
+    // the non-compliant parts of a packet are copied into them.
+    //
+    auto const minimumChunkSize =
+        (m_maximumFragmentSize + m_maximumNumberOfFragments - 1) / m_maximumNumberOfFragments;
+
+    m_chunkSize = min(max(minimumChunkSize, NX_BOUNCE_CHUNK_SIZE), m_maximumFragmentSize);
+    m_bufferSize = m_chunkSize + m_txPayloadBackfill;
+
+    size_t numberOfChunks;
+    CX_RETURN_IF_NOT_NT_SUCCESS(
+        RtlSizeTMult(
+            NumberOfBuffers,
+            (m_maximumFragmentSize + m_chunkSize - 1) / m_chunkSize,
+            &numberOfChunks));
 
     NET_CLIENT_BUFFER_POOL_CONFIG bufferPoolConfig = {
         &DatapathCapabilities.TxMemoryConstraints,
-        NumberOfBuffers,
+        numberOfChunks,
         m_bufferSize,
         0,
         0,
-        MM_ANY_NODE_OK,
+        PreferredNode,
         NET_CLIENT_BUFFER_POOL_FLAGS_NONE
     };
 
@@ -57,18 +100,31 @@ _Use_decl_annotations_
 bool
 NxBounceBufferPool::BounceNetBuffer(
     NET_BUFFER const &NetBuffer,
-    NET_PACKET &NetPacket
+    NET_PACKET &NetPacket,
+    size_t &BytesCopied,
+    UCHAR const * Header,
+    size_t HeaderLength
 )
 /*
 
 Description:
 
-    This routine tries to allocate a buffer from the buffer pool and bounce
-    the payload described by NetBuffer into *one* NET_FRAGMENT.
+    This routine translates the payload described by NetBuffer into a chain
+    of NET_FRAGMENTs, copying the parts the NIC cannot use in place into
+    chunks from the buffer pool.
+
+    A part is used in place if it is aligned to the NIC's requirement and,
+    when DMA mapped, below the NIC's maximum physical address. The first
+    part is always copied if the NIC requested payload backfill. If using
+    parts in place needs more fragments than the NIC supports the whole
+    payload is copied instead.
+
+    If Header is provided it replaces the first HeaderLength bytes of the
+    NET_BUFFER, which are not read. It is always copied.
 
 Return value:
 
-    true - Bounce operation was successful. NetPacket has one fragment.
+    true - Bounce operation was successful. NetPacket has at least one fragment.
     false - Bounce operation was unsuccessful. NetPacket has no fragments.
 
 Remarks:
@@ -77,45 +133,332 @@ Remarks:
     caller should not try to bounce the buffer again.
 */
 {
+    BytesCopied = 0;
+
+    auto const bytesToCopy = NET_BUFFER_DATA_LENGTH(&NetBuffer);
+
+    if (bytesToCopy == 0 || bytesToCopy > m_maximumNumberOfFragments * m_chunkSize)
+    {
+        NetPacket.Ignore = TRUE;
+        NetPacket.FragmentCount = 0;
+        return false;
+    }
+
     auto& fragmentRing = *NetRingCollectionGetFragmentRing(m_descriptor);
-    auto availableFragments = NetRbFragmentRange::OsRange(fragmentRing);
+    auto const availableFragments = NetRbFragmentRange::OsRange(fragmentRing);
 
     if (availableFragments.Count() == 0)
     {
         return false;
     }
 
-    auto& fragment = *availableFragments.begin();
-    RtlZeroMemory(&fragment, NetPacketFragmentGetSize());
+    auto const fragmentsBegin = availableFragments.begin().GetIndex();
+    UINT32 fragmentsEnd;
+    BounceStatus status;
+
+    {
+        // the copy kernel is chosen by the bytes copied, see NxCopy.hpp
+        NxCopyContext copyContext(m_copyEngine);
 
-    auto allocatedCount = m_bufferPoolDispatch->NetClientAllocateBuffers(
-        m_bufferPool,
-        &fragment,
-        1);
+        status = BuildFragments(NetBuffer, availableFragments, m_mapCompliantPages, Header, HeaderLength, copyContext, fragmentsEnd, BytesCopied);
 
-    if (allocatedCount != 1)
+        if (status == BounceStatus::TooManyFragments && m_mapCompliantPages)
+        {
+            FreeChunks(fragmentsBegin, fragmentsEnd);
+            status = BuildFragments(NetBuffer, availableFragments, false, Header, HeaderLength, copyContext, fragmentsEnd, BytesCopied);
+        }
+    }
+
+    if (status != BounceStatus::Success)
     {
+        FreeChunks(fragmentsBegin, fragmentsEnd);
+        BytesCopied = 0;
+
+        // a full copy always fits within the fragment limit, see Initialize
+        NT_ASSERT(status == BounceStatus::InsufficientResources);
+
         return false;
     }
 
-    fragment.OsReserved_Bounced = TRUE;
+    // Attach the fragment chain to the packet
+    NetPacket.FragmentCount = static_cast<UINT16>(
+        NetRingGetRangeCount(&fragmentRing, fragmentsBegin, fragmentsEnd));
+    NetPacket.FragmentIndex = fragmentsBegin;
+    fragmentRing.EndIndex = fragmentsEnd;
+
+    return true;
+}
 
-    PMDL mdl = NET_BUFFER_CURRENT_MDL(&NetBuffer);
-    size_t mdlOffset = NET_BUFFER_CURRENT_MDL_OFFSET(&NetBuffer);
-    auto bytesToCopy = NET_BUFFER_DATA_LENGTH(&NetBuffer);
+_Use_decl_annotations_
+bool
+NxBounceBufferPool::BounceSegment(
+    UCHAR const * Header,
+    size_t HeaderLength,
+    PMDL &Mdl,
+    size_t &MdlOffset,
+    size_t PayloadLength,
+    NET_PACKET &NetPacket
+)
+/*
 
-    if (bytesToCopy == 0 || bytesToCopy > m_bufferSize)
+Description:
+
+    This routine builds a packet out of Header followed by PayloadLength
+    bytes of the MDL chain starting at Mdl/MdlOffset, always copying both
+    into chunks from the buffer pool. The header is never split between
+    fragments.
+
+    On success Mdl/MdlOffset are moved past the payload that was copied,
+    so that the next segment of the same NET_BUFFER continues from there.
+
+Return value:
+
+    Same as BounceNetBuffer
+
+*/
+{
+    auto const bytesToCopy = HeaderLength + PayloadLength;
+
+    if (HeaderLength == 0 || HeaderLength > m_chunkSize ||
+        bytesToCopy > m_maximumNumberOfFragments * m_chunkSize)
     {
         NetPacket.Ignore = TRUE;
         NetPacket.FragmentCount = 0;
         return false;
     }
 
-    fragment.Offset = m_txPayloadBackfill;
-    size_t currentFragmentOffset = fragment.Offset;
-    auto baseFragmentVa = static_cast<UCHAR *>(fragment.VirtualAddress);
-    for (size_t remain = bytesToCopy; remain > 0; mdl = mdl->Next)
+    auto& fragmentRing = *NetRingCollectionGetFragmentRing(m_descriptor);
+    auto const availableFragments = NetRbFragmentRange::OsRange(fragmentRing);
+    auto const fragmentsBegin = availableFragments.begin().GetIndex();
+    auto fragmentsEnd = fragmentsBegin;
+
+    NxCopyContext copyContext(m_copyEngine);
+    NET_FRAGMENT * current = nullptr;
+
+    auto append = [&](UCHAR const * Source, size_t Length)
+    {
+        for (size_t copied = 0; copied < Length;)
+        {
+            if (current == nullptr || current->ValidLength == m_chunkSize)
+            {
+                if (fragmentsEnd == availableFragments.end().GetIndex())
+                {
+                    return false;
+                }
+
+                auto const first = current == nullptr;
+
+                current = NetRingGetFragmentAtIndex(&fragmentRing, fragmentsEnd);
+                RtlZeroMemory(current, NetPacketFragmentGetSize());
+                fragmentsEnd = NetRingIncrementIndex(&fragmentRing, fragmentsEnd);
+
+                if (1 != m_bufferPoolDispatch->NetClientAllocateBuffers(m_bufferPool, current, 1))
+                {
+                    current->VirtualAddress = nullptr;
+                    return false;
+                }
+
+                current->OsReserved_Bounced = TRUE;
+                current->Offset = first ? m_txPayloadBackfill : 0;
+            }
+
+            auto const copySize = min(Length - copied, m_chunkSize - static_cast<size_t>(current->ValidLength));
+            auto const destination = static_cast<UCHAR *>(current->VirtualAddress) + current->Offset + current->ValidLength;
+
+            copyContext.Copy(destination, Source + copied, copySize);
+
+            current->ValidLength += copySize;
+            copied += copySize;
+        }
+
+        return true;
+    };
+
+    auto mdl = Mdl;
+    auto mdlOffset = MdlOffset;
+    auto success = append(Header, HeaderLength);
+
+    for (size_t remain = PayloadLength; success && remain > 0;)
     {
+        if (! mdl)
+        {
+            success = false;
+            break;
+        }
+
+        size_t const mdlByteCount = MmGetMdlByteCount(mdl);
+
+        if (mdlOffset == mdlByteCount)
+        {
+            mdl = mdl->Next;
+            mdlOffset = 0;
+            continue;
+        }
+
+        auto const mdlVa = static_cast<UCHAR *>(MmGetSystemAddressForMdlSafe(mdl, LowPagePriority | MdlMappingNoExecute));
+        if (! mdlVa)
+        {
+            success = false;
+            break;
+        }
+
+        auto const copySize = min(remain, mdlByteCount - mdlOffset);
+
+        success = append(mdlVa + mdlOffset, copySize);
+
+        mdlOffset += copySize;
+        remain -= copySize;
+    }
+
+    if (! success)
+    {
+        FreeChunks(fragmentsBegin, fragmentsEnd);
+        return false;
+    }
+
+    NetPacket.FragmentCount = static_cast<UINT16>(
+        NetRingGetRangeCount(&fragmentRing, fragmentsBegin, fragmentsEnd));
+    NetPacket.FragmentIndex = fragmentsBegin;
+    fragmentRing.EndIndex = fragmentsEnd;
+
+    Mdl = mdl;
+    MdlOffset = mdlOffset;
+
+    return true;
+}
+
+_Use_decl_annotations_
+NxBounceBufferPool::BounceStatus
+NxBounceBufferPool::BuildFragments(
+    NET_BUFFER const &NetBuffer,
+    NetRbFragmentRange const &AvailableFragments,
+    bool MapCompliantPages,
+    UCHAR const * Header,
+    size_t HeaderLength,
+    NxCopyContext &CopyContext,
+    UINT32 &FragmentsEnd,
+    size_t &BytesCopied
+)
+{
+    auto& fragmentRing = *NetRingCollectionGetFragmentRing(m_descriptor);
+
+    BytesCopied = 0;
+    FragmentsEnd = AvailableFragments.begin().GetIndex();
+
+    NET_FRAGMENT * current = nullptr;
+    size_t numberOfFragments = 0;
+
+    auto nextFragment = [&]() -> NET_FRAGMENT *
+    {
+        if (numberOfFragments == m_maximumNumberOfFragments || FragmentsEnd == AvailableFragments.end().GetIndex())
+        {
+            return nullptr;
+        }
+
+        auto fragment = NetRingGetFragmentAtIndex(&fragmentRing, FragmentsEnd);
+        RtlZeroMemory(fragment, NetPacketFragmentGetSize());
+        FragmentsEnd = NetRingIncrementIndex(&fragmentRing, FragmentsEnd);
+        numberOfFragments++;
+
+        return fragment;
+    };
+
+    auto outOfFragments = [&]()
+    {
+        return numberOfFragments == m_maximumNumberOfFragments ?
+            BounceStatus::TooManyFragments :
+            BounceStatus::InsufficientResources;
+    };
+
+    auto firstPart = true;
+
+    // copies a part, packing it behind the previous copy if that was bounced too
+    auto copyPart = [&](UCHAR const * Source, size_t Length)
+    {
+        for (size_t copied = 0; copied < Length;)
+        {
+            if (current == nullptr ||
+                ! current->OsReserved_Bounced ||
+                current->ValidLength == m_chunkSize)
+            {
+                current = nextFragment();
+                if (! current)
+                {
+                    return outOfFragments();
+                }
+
+                if (1 != m_bufferPoolDispatch->NetClientAllocateBuffers(m_bufferPool, current, 1))
+                {
+                    current->VirtualAddress = nullptr;
+                    return BounceStatus::InsufficientResources;
+                }
+
+                current->OsReserved_Bounced = TRUE;
+                current->Offset = firstPart ? m_txPayloadBackfill : 0;
+            }
+
+            auto const copySize = min(Length - copied, m_chunkSize - static_cast<size_t>(current->ValidLength));
+            auto const destination = static_cast<UCHAR *>(current->VirtualAddress) + current->Offset + current->ValidLength;
+
+            CopyContext.Copy(destination, Source + copied, copySize);
+
+            current->ValidLength += copySize;
+            copied += copySize;
+            BytesCopied += copySize;
+        }
+
+        return BounceStatus::Success;
+    };
+
+    PMDL mdl = NET_BUFFER_CURRENT_MDL(&NetBuffer);
+    size_t mdlOffset = NET_BUFFER_CURRENT_MDL_OFFSET(&NetBuffer);
+    size_t remain = NET_BUFFER_DATA_LENGTH(&NetBuffer);
+
+    //
+    // headers rebuilt by the caller stand in for the start of the NET_BUFFER,
+    // which the translator does not own and never writes to. they are
+    // always copied, the rest of the NET_BUFFER is bounced as usual.
+    //
+    if (HeaderLength > 0)
+    {
+        NT_ASSERT(HeaderLength <= remain);
+
+        auto const status = copyPart(Header, HeaderLength);
+        if (status != BounceStatus::Success)
+        {
+            return status;
+        }
+
+        firstPart = false;
+        remain -= HeaderLength;
+
+        for (size_t skip = HeaderLength; skip > 0;)
+        {
+            if (! mdl)
+            {
+                return BounceStatus::InsufficientResources;
+            }
+
+            size_t const available = MmGetMdlByteCount(mdl) - mdlOffset;
+            if (skip < available)
+            {
+                mdlOffset += skip;
+                break;
+            }
+
+            skip -= available;
+            mdl = mdl->Next;
+            mdlOffset = 0;
+        }
+    }
+
+    for (; remain > 0; mdl = mdl->Next)
+    {
+        if (! mdl)
+        {
+            return BounceStatus::InsufficientResources;
+        }
+
         size_t const mdlByteCount = MmGetMdlByteCount(mdl);
         if (mdlByteCount == 0)
         {
@@ -124,40 +467,149 @@ Remarks:
 
         NT_ASSERT(mdlByteCount > mdlOffset);
 
-        size_t const copySize = min(remain, mdlByteCount - mdlOffset);
-
-        void *sourceBuffer = static_cast<UCHAR *>(MmGetSystemAddressForMdlSafe(mdl, LowPagePriority | MdlMappingNoExecute)) + mdlOffset;
-        void *destinationBuffer = baseFragmentVa + currentFragmentOffset;
+        auto const mdlVa = static_cast<UCHAR *>(MmGetSystemAddressForMdlSafe(mdl, LowPagePriority | MdlMappingNoExecute));
+        if (! mdlVa)
+        {
+            return BounceStatus::InsufficientResources;
+        }
 
-        // If we make the parsing code optional or parse the packets in
-        // batches we might benefit from using RtlCopyMemoryNonTemporal
-        RtlCopyMemory(
-            destinationBuffer,
-            sourceBuffer,
-            copySize);
+        auto va = mdlVa + mdlOffset;
+        auto const vaEnd = va + min(remain, mdlByteCount - mdlOffset);
 
-        fragment.ValidLength += copySize;
+        // walk the MDL one page at a time, a part never crosses a page boundary
+        while (va < vaEnd)
+        {
+            size_t const partLength = min(
+                static_cast<size_t>(vaEnd - va),
+                PAGE_SIZE - BYTE_OFFSET(va));
+
+            LOGICAL_ADDRESS logicalAddress = 0;
+            auto const inPlace =
+                MapCompliantPages &&
+                ! (firstPart && m_txPayloadBackfill > 0) &&
+                IsCompliant(va, logicalAddress);
+
+            if (inPlace && m_requiresPhysicalAddress)
+            {
+                auto const extendsCurrent =
+                    current != nullptr &&
+                    ! current->OsReserved_Bounced &&
+                    static_cast<UCHAR *>(current->VirtualAddress) + current->ValidLength == va &&
+                    current->Mapping.DmaLogicalAddress + current->ValidLength == logicalAddress &&
+                    current->ValidLength + partLength <= m_maximumFragmentSize;
+
+                if (! extendsCurrent)
+                {
+                    current = nextFragment();
+                    if (! current)
+                    {
+                        return outOfFragments();
+                    }
+
+                    current->VirtualAddress = va;
+                    current->Mapping.DmaLogicalAddress = logicalAddress;
+                }
+
+                current->ValidLength += partLength;
+                current->Capacity = current->ValidLength;
+            }
+            else if (inPlace)
+            {
+                //
+                // without a DMA adapter the fragment describes its MDL, as
+                // TranslateMdlChainToFragmentRangeKvmOnly does: the MDL's
+                // address, an offset within the MDL and the MDL itself
+                //
+                auto const extendsCurrent =
+                    current != nullptr &&
+                    ! current->OsReserved_Bounced &&
+                    current->Mapping.Mdl == mdl &&
+                    mdlVa + current->Offset + current->ValidLength == va &&
+                    current->ValidLength + partLength <= m_maximumFragmentSize;
+
+                if (! extendsCurrent)
+                {
+                    current = nextFragment();
+                    if (! current)
+                    {
+                        return outOfFragments();
+                    }
+
+                    current->VirtualAddress = mdlVa;
+                    current->Offset = static_cast<size_t>(va - mdlVa);
+                    current->Capacity = mdlByteCount;
+                    current->Mapping.Mdl = mdl;
+                }
+
+                current->ValidLength += partLength;
+            }
+            else
+            {
+                auto const status = copyPart(va, partLength);
+                if (status != BounceStatus::Success)
+                {
+                    return status;
+                }
+            }
+
+            va += partLength;
+            remain -= partLength;
+            firstPart = false;
+        }
 
         mdlOffset = 0;
-        remain -= copySize;
-        currentFragmentOffset += copySize;
     }
 
-    if (fragment.ValidLength != bytesToCopy)
+    return BounceStatus::Success;
+}
+
+_Use_decl_annotations_
+bool
+NxBounceBufferPool::IsCompliant(
+    UCHAR const * VirtualAddress,
+    LOGICAL_ADDRESS &LogicalAddress
+) const
+{
+    if ((reinterpret_cast<ULONG_PTR>(VirtualAddress) & (m_alignmentRequirement - 1)) != 0)
     {
-        NetPacket.Ignore = TRUE;
-        NetPacket.FragmentCount = 0;
         return false;
     }
 
-    // Attach the fragment chain to the packet
-    NetPacket.FragmentCount = 1;
-    NetPacket.FragmentIndex = availableFragments.begin().GetIndex();
-    fragmentRing.EndIndex = NetRingIncrementIndex(&fragmentRing, fragmentRing.EndIndex);
+    if (m_requiresPhysicalAddress)
+    {
+        LogicalAddress = MmGetPhysicalAddress(const_cast<UCHAR *>(VirtualAddress)).QuadPart;
+
+        if (m_maximumLogicalAddress != 0 && LogicalAddress > m_maximumLogicalAddress)
+        {
+            return false;
+        }
+    }
 
     return true;
 }
 
+_Use_decl_annotations_
+void
+NxBounceBufferPool::FreeChunks(
+    UINT32 FragmentsBegin,
+    UINT32 FragmentsEnd
+)
+{
+    auto fr = NetRingCollectionGetFragmentRing(m_descriptor);
+    for (auto i = FragmentsBegin; i != FragmentsEnd; i = NetRingIncrementIndex(fr, i))
+    {
+        auto fragment = NetRingGetFragmentAtIndex(fr, i);
+
+        if (fragment->OsReserved_Bounced && fragment->VirtualAddress)
+        {
+            m_bufferPoolDispatch->NetClientFreeBuffers(
+                m_bufferPool,
+                &fragment->VirtualAddress,
+                1);
+        }
+    }
+}
+
 _Use_decl_annotations_
 void
 NxBounceBufferPool::FreeBounceBuffers(
@@ -183,4 +635,3 @@ NxBounceBufferPool::FreeBounceBuffers(
         }
     }
 }
-
@@ -2,6 +2,8 @@
 #pragma once
 
 #include "NxRingBufferRange.hpp"
+#include "NxDma.hpp"
+#include "NxCopy.hpp"
 
 class NxBounceBufferPool
 {
@@ -16,12 +18,27 @@ public:
         _In_ NET_CLIENT_DISPATCH const &ClientDispatch,
         _In_ NET_RING_COLLECTION const * Descriptor,
         _In_ NET_CLIENT_ADAPTER_DATAPATH_CAPABILITIES &DatapathCapabilities,
-        _In_ size_t NumberOfBuffers
+        _In_opt_ NxDmaAdapter const * DmaAdapter,
+        _In_ size_t NumberOfBuffers,
+        _In_ NODE_REQUIREMENT PreferredNode
     );
 
     bool
     BounceNetBuffer(
         _In_ NET_BUFFER const &NetBuffer,
+        _Inout_ NET_PACKET &NetPacket,
+        _Out_ size_t &BytesCopied,
+        _In_reads_bytes_opt_(HeaderLength) UCHAR const * Header = nullptr,
+        _In_ size_t HeaderLength = 0
+    );
+
+    bool
+    BounceSegment(
+        _In_reads_bytes_(HeaderLength) UCHAR const * Header,
+        _In_ size_t HeaderLength,
+        _Inout_ PMDL &Mdl,
+        _Inout_ size_t &MdlOffset,
+        _In_ size_t PayloadLength,
         _Inout_ NET_PACKET &NetPacket
     );
 
@@ -30,6 +47,39 @@ public:
         _Inout_ NET_PACKET &NetPacket
     );
 
+private:
+
+    enum class BounceStatus
+    {
+        Success,
+        InsufficientResources,
+        TooManyFragments,
+    };
+
+    BounceStatus
+    BuildFragments(
+        _In_ NET_BUFFER const &NetBuffer,
+        _In_ NetRbFragmentRange const &AvailableFragments,
+        _In_ bool MapCompliantPages,
+        _In_reads_bytes_opt_(HeaderLength) UCHAR const * Header,
+        _In_ size_t HeaderLength,
+        _Inout_ NxCopyContext &CopyContext,
+        _Out_ UINT32 &FragmentsEnd,
+        _Out_ size_t &BytesCopied
+    );
+
+    bool
+    IsCompliant(
+        _In_ UCHAR const * VirtualAddress,
+        _Out_ LOGICAL_ADDRESS &LogicalAddress
+    ) const;
+
+    void
+    FreeChunks(
+        _In_ UINT32 FragmentsBegin,
+        _In_ UINT32 FragmentsEnd
+    );
+
 private:
 
     NET_CLIENT_BUFFER_POOL m_bufferPool = nullptr;
@@ -37,7 +87,21 @@ private:
 
     NET_RING_COLLECTION const * m_descriptor = nullptr;
 
+    // payload bytes a single bounce chunk holds, the first chunk of a
+    // packet reserves m_txPayloadBackfill bytes in front of it
+    size_t m_chunkSize = 0;
     size_t m_bufferSize = 0;
     size_t m_txPayloadBackfill = 0;
-};
 
+    size_t m_maximumFragmentSize = 0;
+    size_t m_maximumNumberOfFragments = 0;
+    size_t m_alignmentRequirement = 0;
+    LOGICAL_ADDRESS m_maximumLogicalAddress = 0;
+
+    // whether compliant pages of the NET_BUFFER may be handed to the NIC
+    // without a copy, and if so whether the NIC needs their physical address
+    bool m_mapCompliantPages = false;
+    bool m_requiresPhysicalAddress = false;
+
+    NxCopyEngine m_copyEngine;
+};
@@ -0,0 +1,661 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+#include "NxXlatPrecomp.hpp"
+#include "NxXlatCommon.hpp"
+#include "NxChecksum.tmh"
+
+#include "NxChecksum.hpp"
+#include "NxPacketLayout.hpp"
+
+#if defined(_M_AMD64)
+#include <immintrin.h>
+#define NX_CHECKSUM_SIMD 1
+#else
+#define NX_CHECKSUM_SIMD 0
+#endif
+
+//
+// Buffer length, in bytes, at which the SSE2 kernel takes over. The kernel
+// widens 16 bit words into 32 bit lanes, which cannot overflow within a
+// block before they are added to the 64 bit sum.
+//
+#define NX_CHECKSUM_SIMD_THRESHOLD 128
+#define NX_CHECKSUM_SIMD_BLOCK_SIZE (64 * 1024)
+
+// offset of the checksum within the UDP header
+#define NX_UDP_CHECKSUM_OFFSET 6
+
+// IPv4 more fragments flag and fragment offset, in host byte order
+#define NX_IPV4_FRAGMENT_MASK 0x3fff
+
+static
+ULONG64
+AddScalar(
+    _In_ ULONG64 Sum,
+    _In_reads_bytes_(Length) UCHAR const * Buffer,
+    _In_ size_t Length
+)
+{
+    // 32 bit words fold to the same 16 bit one's complement sum
+    for (; Length >= 8; Length -= 8, Buffer += 8)
+    {
+        Sum += *reinterpret_cast<ULONG UNALIGNED const *>(Buffer);
+        Sum += *reinterpret_cast<ULONG UNALIGNED const *>(Buffer + 4);
+    }
+
+    for (; Length >= sizeof(USHORT); Length -= sizeof(USHORT), Buffer += sizeof(USHORT))
+    {
+        Sum += *reinterpret_cast<USHORT UNALIGNED const *>(Buffer);
+    }
+
+    if (Length != 0)
+    {
+        USHORT last = 0;
+        RtlCopyMemory(&last, Buffer, 1);
+        Sum += last;
+    }
+
+    return Sum;
+}
+
+#if NX_CHECKSUM_SIMD
+
+static
+ULONG64
+AddSse2(
+    _In_ ULONG64 Sum,
+    _In_reads_bytes_(Length) UCHAR const * Buffer,
+    _In_ size_t Length
+)
+{
+    auto const zero = _mm_setzero_si128();
+
+    while (Length >= 64)
+    {
+        auto blockLength = min(Length & ~static_cast<size_t>(63), static_cast<size_t>(NX_CHECKSUM_SIMD_BLOCK_SIZE));
+        auto low = zero;
+        auto high = zero;
+
+        for (; blockLength > 0; blockLength -= 64, Length -= 64, Buffer += 64)
+        {
+            auto const a = _mm_loadu_si128(reinterpret_cast<__m128i const *>(Buffer));
+            auto const b = _mm_loadu_si128(reinterpret_cast<__m128i const *>(Buffer + 16));
+            auto const c = _mm_loadu_si128(reinterpret_cast<__m128i const *>(Buffer + 32));
+            auto const d = _mm_loadu_si128(reinterpret_cast<__m128i const *>(Buffer + 48));
+
+            low = _mm_add_epi32(low, _mm_unpacklo_epi16(a, zero));
+            high = _mm_add_epi32(high, _mm_unpackhi_epi16(a, zero));
+            low = _mm_add_epi32(low, _mm_unpacklo_epi16(b, zero));
+            high = _mm_add_epi32(high, _mm_unpackhi_epi16(b, zero));
+            low = _mm_add_epi32(low, _mm_unpacklo_epi16(c, zero));
+            high = _mm_add_epi32(high, _mm_unpackhi_epi16(c, zero));
+            low = _mm_add_epi32(low, _mm_unpacklo_epi16(d, zero));
+            high = _mm_add_epi32(high, _mm_unpackhi_epi16(d, zero));
+        }
+
+        ULONG lanes[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), _mm_add_epi32(low, high));
+
+        Sum += static_cast<ULONG64>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    return AddScalar(Sum, Buffer, Length);
+}
+
+#endif
+
+_Use_decl_annotations_
+ULONG64
+NxChecksumAdd(
+    ULONG64 Sum,
+    void const * Buffer,
+    size_t Length
+)
+{
+    auto const buffer = static_cast<UCHAR const *>(Buffer);
+
+#if NX_CHECKSUM_SIMD
+    if (Length >= NX_CHECKSUM_SIMD_THRESHOLD)
+    {
+        return AddSse2(Sum, buffer, Length);
+    }
+#endif
+
+    return AddScalar(Sum, buffer, Length);
+}
+
+_Use_decl_annotations_
+USHORT
+NxChecksumFold(
+    ULONG64 Sum
+)
+{
+    while (Sum >> 16)
+    {
+        Sum = (Sum & 0xffff) + (Sum >> 16);
+    }
+
+    return static_cast<USHORT>(Sum);
+}
+
+_Use_decl_annotations_
+USHORT
+NxChecksumFinish(
+    ULONG64 Sum
+)
+{
+    return static_cast<USHORT>(~NxChecksumFold(Sum));
+}
+
+_Use_decl_annotations_
+ULONG64
+NxChecksumAddPseudoHeader(
+    ULONG64 Sum,
+    UCHAR const * IpHeader,
+    bool IsIPv4,
+    UCHAR Protocol,
+    ULONG Length
+)
+{
+    if (IsIPv4)
+    {
+        auto const ipv4 = reinterpret_cast<IPV4_HEADER UNALIGNED const *>(IpHeader);
+
+        Sum = NxChecksumAdd(Sum, &ipv4->SourceAddress, 2 * sizeof(IN_ADDR));
+    }
+    else
+    {
+        auto const ipv6 = reinterpret_cast<IPV6_HEADER UNALIGNED const *>(IpHeader);
+
+        Sum = NxChecksumAdd(Sum, &ipv6->SourceAddress, 2 * sizeof(IN6_ADDR));
+    }
+
+    // rest of the pseudo header, in network byte order
+    Sum += RtlUshortByteSwap(static_cast<USHORT>(Protocol));
+    Sum += RtlUshortByteSwap(static_cast<USHORT>(Length >> 16));
+    Sum += RtlUshortByteSwap(static_cast<USHORT>(Length));
+
+    return Sum;
+}
+
+//
+// Adds a buffer found Offset bytes into the summed range. A buffer starting
+// at an odd offset contributes its bytes swapped.
+//
+static
+ULONG64
+AddAtOffset(
+    _In_ ULONG64 Sum,
+    _In_ size_t Offset,
+    _In_reads_bytes_(Length) UCHAR const * Buffer,
+    _In_ size_t Length
+)
+{
+    auto const partial = NxChecksumAdd(0, Buffer, Length);
+
+    return Sum + ((Offset % 2 == 0) ? partial : RtlUshortByteSwap(NxChecksumFold(partial)));
+}
+
+_Use_decl_annotations_
+ULONG64
+NxChecksumAddFragments(
+    ULONG64 Sum,
+    NET_RING_COLLECTION const * Rings,
+    NET_PACKET const & Packet,
+    size_t Offset,
+    size_t Length
+)
+{
+    auto const fr = NetRingCollectionGetFragmentRing(Rings);
+    size_t summed = 0;
+
+    for (UINT32 i = 0; i < Packet.FragmentCount && summed < Length; i++)
+    {
+        auto const fragment = NetRingGetFragmentAtIndex(fr, (Packet.FragmentIndex + i) & fr->ElementIndexMask);
+        auto const fragmentLength = static_cast<size_t>(fragment->ValidLength);
+
+        if (Offset >= fragmentLength)
+        {
+            Offset -= fragmentLength;
+            continue;
+        }
+
+        auto const buffer = static_cast<UCHAR const *>(fragment->VirtualAddress) + fragment->Offset + Offset;
+        auto const length = min(fragmentLength - Offset, Length - summed);
+
+        Sum = AddAtOffset(Sum, summed, buffer, length);
+        summed += length;
+        Offset = 0;
+    }
+
+    return Sum;
+}
+
+static
+bool
+AddMdlChain(
+    _Inout_ ULONG64 & Sum,
+    _In_ PMDL Mdl,
+    _In_ size_t MdlOffset,
+    _In_ size_t Length
+)
+{
+    for (size_t summed = 0; summed < Length; Mdl = Mdl->Next)
+    {
+        if (! Mdl)
+        {
+            return false;
+        }
+
+        size_t const mdlByteCount = MmGetMdlByteCount(Mdl);
+        if (MdlOffset >= mdlByteCount)
+        {
+            MdlOffset -= mdlByteCount;
+            continue;
+        }
+
+        auto const mdlVa = static_cast<UCHAR const *>(MmGetSystemAddressForMdlSafe(Mdl, LowPagePriority | MdlMappingNoExecute));
+        if (! mdlVa)
+        {
+            return false;
+        }
+
+        auto const length = min(Length - summed, mdlByteCount - MdlOffset);
+
+        Sum = AddAtOffset(Sum, summed, mdlVa + MdlOffset, length);
+        summed += length;
+        MdlOffset = 0;
+    }
+
+    return true;
+}
+
+static
+bool
+IsIPv4(
+    _In_ NET_PACKET_LAYOUT const & Layout
+)
+{
+    return
+        Layout.Layer3Type == NET_PACKET_LAYER3_TYPE_IPV4_NO_OPTIONS ||
+        Layout.Layer3Type == NET_PACKET_LAYER3_TYPE_IPV4_WITH_OPTIONS;
+}
+
+static
+bool
+IsIPv6(
+    _In_ NET_PACKET_LAYOUT const & Layout
+)
+{
+    return
+        Layout.Layer3Type == NET_PACKET_LAYER3_TYPE_IPV6_NO_EXTENSIONS ||
+        Layout.Layer3Type == NET_PACKET_LAYER3_TYPE_IPV6_WITH_EXTENSIONS;
+}
+
+// length of the transport segment according to the IP header
+static
+bool
+GetTransportLength(
+    _In_ UCHAR const * IpHeader,
+    _In_ NET_PACKET_LAYOUT const & Layout,
+    _Out_ ULONG & Length
+)
+{
+    Length = 0;
+
+    if (IsIPv4(Layout))
+    {
+        auto const totalLength = static_cast<ULONG>(
+            RtlUshortByteSwap(reinterpret_cast<IPV4_HEADER UNALIGNED const *>(IpHeader)->TotalLength));
+
+        if (totalLength < Layout.Layer3HeaderLength)
+        {
+            return false;
+        }
+
+        Length = totalLength - Layout.Layer3HeaderLength;
+    }
+    else
+    {
+        auto const payloadLength = static_cast<ULONG>(
+            RtlUshortByteSwap(reinterpret_cast<IPV6_HEADER UNALIGNED const *>(IpHeader)->PayloadLength));
+        auto const extensionLength = static_cast<ULONG>(Layout.Layer3HeaderLength - sizeof(IPV6_HEADER));
+
+        // a zero payload length is a jumbogram
+        if (payloadLength == 0 || payloadLength < extensionLength)
+        {
+            return false;
+        }
+
+        Length = payloadLength - extensionLength;
+    }
+
+    return Length >= Layout.Layer4HeaderLength;
+}
+
+static
+size_t
+GetChecksumOffset(
+    _In_ UCHAR Protocol
+)
+{
+    return Protocol == IPPROTO_TCP ?
+        FIELD_OFFSET(TCP_HDR, th_sum) :
+        NX_UDP_CHECKSUM_OFFSET;
+}
+
+_Use_decl_annotations_
+void
+NxChecksumEngine::Initialize(
+    bool Enabled,
+    NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES const & HardwareCapabilities
+)
+{
+    m_enabled = Enabled;
+    m_hardwareCapabilities = HardwareCapabilities;
+}
+
+bool
+NxChecksumEngine::IsEnabled(
+    void
+) const
+{
+    return m_enabled;
+}
+
+_Use_decl_annotations_
+bool
+NxChecksumEngine::ChecksumNetBuffer(
+    NDIS_MEDIUM MediaType,
+    NET_BUFFER const & NetBuffer,
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO & Info,
+    UCHAR * Header,
+    size_t & HeaderLength
+) const
+{
+    HeaderLength = 0;
+
+    if (! m_enabled)
+    {
+        return false;
+    }
+
+    auto const ipRequested = Info.Transmit.IsIPv4 && Info.Transmit.IpHeaderChecksum;
+
+    if (! ipRequested && ! Info.Transmit.TcpChecksum && ! Info.Transmit.UdpChecksum)
+    {
+        return false;
+    }
+
+    auto const mdl = NET_BUFFER_CURRENT_MDL(&NetBuffer);
+    size_t const mdlOffset = NET_BUFFER_CURRENT_MDL_OFFSET(&NetBuffer);
+    size_t const dataLength = NET_BUFFER_DATA_LENGTH(&NetBuffer);
+
+    auto const mdlVa = static_cast<UCHAR const *>(MmGetSystemAddressForMdlSafe(mdl, LowPagePriority | MdlMappingNoExecute));
+    if (! mdlVa)
+    {
+        return false;
+    }
+
+    // the stack builds the headers in the first MDL, anything else is left to the NIC
+    auto const frame = mdlVa + mdlOffset;
+    auto const frameLength = min(static_cast<size_t>(MmGetMdlByteCount(mdl)) - mdlOffset, dataLength);
+    auto const layout = NxGetBufferLayout(MediaType, frame, static_cast<ULONG>(frameLength));
+    auto const isIPv4 = IsIPv4(layout);
+
+    if (! isIPv4 && ! IsIPv6(layout))
+    {
+        return false;
+    }
+
+    auto const ipWanted = ipRequested && isIPv4 && ! m_hardwareCapabilities.IPv4;
+
+    UCHAR protocol = 0;
+    BOOLEAN hardwareSupported = TRUE;
+
+    if (Info.Transmit.TcpChecksum && layout.Layer4Type == NET_PACKET_LAYER4_TYPE_TCP)
+    {
+        protocol = IPPROTO_TCP;
+        hardwareSupported = m_hardwareCapabilities.Tcp;
+    }
+    else if (Info.Transmit.UdpChecksum && layout.Layer4Type == NET_PACKET_LAYER4_TYPE_UDP)
+    {
+        protocol = IPPROTO_UDP;
+        hardwareSupported = m_hardwareCapabilities.Udp;
+    }
+
+    // NICs are not expected to find the transport header behind IPv6 extension headers
+    auto transportWanted =
+        protocol != 0 &&
+        (! hardwareSupported || layout.Layer3Type == NET_PACKET_LAYER3_TYPE_IPV6_WITH_EXTENSIONS);
+
+    ULONG transportLength = 0;
+    size_t const transportOffset = layout.Layer2HeaderLength + layout.Layer3HeaderLength;
+
+    if (transportWanted &&
+        (layout.Layer4HeaderLength == 0 ||
+            ! GetTransportLength(frame + layout.Layer2HeaderLength, layout, transportLength) ||
+            transportOffset + transportLength > dataLength))
+    {
+        transportWanted = false;
+    }
+
+    if (! ipWanted && ! transportWanted)
+    {
+        return false;
+    }
+
+    //
+    // the NET_BUFFER belongs to the protocol and may be shared with clones
+    // or reused by the sender, the checksums are written to a copy of the
+    // headers that is sent in place of the original ones
+    //
+    auto const headerLength = transportOffset + (transportWanted ? layout.Layer4HeaderLength : 0);
+
+    if (headerLength > NX_CHECKSUM_MAXIMUM_HEADER_SIZE || headerLength > frameLength)
+    {
+        return false;
+    }
+
+    RtlCopyMemory(Header, frame, headerLength);
+
+    auto const ip = Header + layout.Layer2HeaderLength;
+
+    if (ipWanted)
+    {
+        auto const ipv4 = reinterpret_cast<IPV4_HEADER UNALIGNED *>(ip);
+
+        ipv4->HeaderChecksum = 0;
+        ipv4->HeaderChecksum = NxChecksumFinish(NxChecksumAdd(0, ipv4, layout.Layer3HeaderLength));
+
+        Info.Transmit.IpHeaderChecksum = FALSE;
+    }
+
+    if (transportWanted)
+    {
+        auto const transport = Header + transportOffset;
+        auto const checksum = reinterpret_cast<USHORT UNALIGNED *>(transport + GetChecksumOffset(protocol));
+
+        *checksum = 0;
+
+        // TCP and UDP headers are an even number of bytes, the payload is
+        // summed at the same parity as within the segment
+        NT_ASSERT(layout.Layer4HeaderLength % 2 == 0);
+
+        auto sum = NxChecksumAddPseudoHeader(0, ip, isIPv4, protocol, transportLength);
+        sum = NxChecksumAdd(sum, transport, layout.Layer4HeaderLength);
+
+        if (AddMdlChain(
+                sum,
+                mdl,
+                mdlOffset + transportOffset + layout.Layer4HeaderLength,
+                transportLength - layout.Layer4HeaderLength))
+        {
+            auto result = NxChecksumFinish(sum);
+
+            // a zero UDP checksum means no checksum was computed
+            if (protocol == IPPROTO_UDP && result == 0)
+            {
+                result = 0xffff;
+            }
+
+            *checksum = result;
+
+            if (protocol == IPPROTO_TCP)
+            {
+                Info.Transmit.TcpChecksum = FALSE;
+            }
+            else
+            {
+                Info.Transmit.UdpChecksum = FALSE;
+            }
+        }
+        else if (! ipWanted)
+        {
+            return false;
+        }
+        else
+        {
+            // only the IPv4 header checksum is sent, the NIC gets the
+            // transport request as the stack made it
+            *checksum = *reinterpret_cast<USHORT UNALIGNED const *>(
+                frame + transportOffset + GetChecksumOffset(protocol));
+        }
+    }
+
+    HeaderLength = headerLength;
+
+    return true;
+}
+
+_Use_decl_annotations_
+void
+NxChecksumEngine::ValidatePacket(
+    NET_RING_COLLECTION const * Rings,
+    NET_PACKET const & Packet,
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO & Info
+) const
+{
+    if (! m_enabled)
+    {
+        return;
+    }
+
+    auto const & layout = Packet.Layout;
+    auto const isIPv4 = IsIPv4(layout);
+
+    if (! isIPv4 && ! IsIPv6(layout))
+    {
+        return;
+    }
+
+    // the layout was parsed from the first fragment, the headers are whole within it
+    auto const fr = NetRingCollectionGetFragmentRing(Rings);
+    auto const firstFragment = NetRingGetFragmentAtIndex(fr, Packet.FragmentIndex);
+    auto const ip = static_cast<UCHAR const *>(firstFragment->VirtualAddress) +
+        firstFragment->Offset +
+        layout.Layer2HeaderLength;
+
+    if (isIPv4)
+    {
+        auto const ipv4 = reinterpret_cast<IPV4_HEADER UNALIGNED const *>(ip);
+
+        if (! Info.Receive.IpChecksumSucceeded && ! Info.Receive.IpChecksumFailed)
+        {
+            if (NxChecksumFinish(NxChecksumAdd(0, ipv4, layout.Layer3HeaderLength)) == 0)
+            {
+                Info.Receive.IpChecksumSucceeded = TRUE;
+            }
+            else
+            {
+                Info.Receive.IpChecksumFailed = TRUE;
+            }
+        }
+
+        // a fragment does not carry the whole transport segment
+        if (Info.Receive.IpChecksumFailed ||
+            (RtlUshortByteSwap(ipv4->FlagsAndOffset) & NX_IPV4_FRAGMENT_MASK) != 0)
+        {
+            return;
+        }
+    }
+    else if (layout.Layer3Type == NET_PACKET_LAYER3_TYPE_IPV6_WITH_EXTENSIONS)
+    {
+        // could be a fragment or carry a routing header, left to the stack
+        return;
+    }
+
+    UCHAR protocol;
+
+    switch (layout.Layer4Type)
+    {
+
+    case NET_PACKET_LAYER4_TYPE_TCP:
+        if (Info.Receive.TcpChecksumSucceeded || Info.Receive.TcpChecksumFailed)
+        {
+            return;
+        }
+
+        protocol = IPPROTO_TCP;
+        break;
+
+    case NET_PACKET_LAYER4_TYPE_UDP:
+        if (Info.Receive.UdpChecksumSucceeded || Info.Receive.UdpChecksumFailed)
+        {
+            return;
+        }
+
+        protocol = IPPROTO_UDP;
+        break;
+
+    default:
+        return;
+
+    }
+
+    auto const transport = ip + layout.Layer3HeaderLength;
+
+    // a UDP datagram sent without a checksum is left to the stack
+    if (layout.Layer4HeaderLength == 0 ||
+        (protocol == IPPROTO_UDP &&
+            *reinterpret_cast<USHORT UNALIGNED const *>(transport + GetChecksumOffset(protocol)) == 0))
+    {
+        return;
+    }
+
+    ULONG transportLength;
+    if (! GetTransportLength(ip, layout, transportLength))
+    {
+        return;
+    }
+
+    // Ethernet padding past the IP datagram is not summed
+    size_t const transportOffset = layout.Layer2HeaderLength + layout.Layer3HeaderLength;
+    size_t packetLength = 0;
+
+    for (UINT32 i = 0; i < Packet.FragmentCount; i++)
+    {
+        packetLength += NetRingGetFragmentAtIndex(fr, (Packet.FragmentIndex + i) & fr->ElementIndexMask)->ValidLength;
+    }
+
+    auto valid = false;
+
+    if (transportOffset + transportLength <= packetLength)
+    {
+        auto sum = NxChecksumAddPseudoHeader(0, ip, isIPv4, protocol, transportLength);
+        sum = NxChecksumAddFragments(sum, Rings, Packet, transportOffset, transportLength);
+
+        valid = NxChecksumFinish(sum) == 0;
+    }
+
+    if (protocol == IPPROTO_TCP)
+    {
+        Info.Receive.TcpChecksumSucceeded = valid;
+        Info.Receive.TcpChecksumFailed = ! valid;
+    }
+    else
+    {
+        Info.Receive.UdpChecksumSucceeded = valid;
+        Info.Receive.UdpChecksumFailed = ! valid;
+    }
+}
@@ -0,0 +1,111 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+/*++
+
+Abstract:
+
+    Software checksum offload. Transmit checksums are computed, and receive
+    checksums validated, by the translator for the packets the NIC cannot
+    handle: IP versions or protocols it has no offload for, and layouts it
+    does not parse such as IPv6 extension headers. This lets the union of
+    the NIC's and the software capabilities be advertised to the stack.
+
+    The one's complement sum is accumulated 16 bits at a time, by an SSE2
+    kernel for longer buffers, and carried across buffers that start at odd
+    offsets within the packet.
+
+--*/
+
+#pragma once
+
+// largest copy of the headers a transmit checksum is written to, link layer
+// through TCP options
+#define NX_CHECKSUM_MAXIMUM_HEADER_SIZE 256
+
+// one's complement sum of a buffer in memory order, not folded
+ULONG64
+NxChecksumAdd(
+    _In_ ULONG64 Sum,
+    _In_reads_bytes_(Length) void const * Buffer,
+    _In_ size_t Length
+);
+
+// folds a sum to 16 bits
+USHORT
+NxChecksumFold(
+    _In_ ULONG64 Sum
+);
+
+// folds and complements a sum, ready to be written to a header
+USHORT
+NxChecksumFinish(
+    _In_ ULONG64 Sum
+);
+
+// sum of the TCP/UDP pseudo header of a transport segment of Length bytes
+ULONG64
+NxChecksumAddPseudoHeader(
+    _In_ ULONG64 Sum,
+    _In_ UCHAR const * IpHeader,
+    _In_ bool IsIPv4,
+    _In_ UCHAR Protocol,
+    _In_ ULONG Length
+);
+
+// sum of Length bytes of a packet starting at Offset, across its fragments
+ULONG64
+NxChecksumAddFragments(
+    _In_ ULONG64 Sum,
+    _In_ NET_RING_COLLECTION const * Rings,
+    _In_ NET_PACKET const & Packet,
+    _In_ size_t Offset,
+    _In_ size_t Length
+);
+
+class NxChecksumEngine
+{
+public:
+
+    void
+    Initialize(
+        _In_ bool Enabled,
+        _In_ NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES const & HardwareCapabilities
+    );
+
+    bool
+    IsEnabled(
+        void
+    ) const;
+
+    //
+    // Computes the checksums Info requests that the NIC cannot and clears
+    // them from Info. The NET_BUFFER is not written to: returns true with
+    // a copy of its first HeaderLength bytes, checksums included, in Header.
+    // The packet must then be sent with that copy in place of the original
+    // headers.
+    //
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    bool
+    ChecksumNetBuffer(
+        _In_ NDIS_MEDIUM MediaType,
+        _In_ NET_BUFFER const & NetBuffer,
+        _Inout_ NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO & Info,
+        _Out_writes_bytes_to_(NX_CHECKSUM_MAXIMUM_HEADER_SIZE, HeaderLength) UCHAR * Header,
+        _Out_ size_t & HeaderLength
+    ) const;
+
+    // Validates the checksums of a received packet that the NIC did not
+    void
+    ValidatePacket(
+        _In_ NET_RING_COLLECTION const * Rings,
+        _In_ NET_PACKET const & Packet,
+        _Inout_ NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO & Info
+    ) const;
+
+private:
+
+    bool m_enabled = false;
+
+    NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES
+        m_hardwareCapabilities = {};
+};
@@ -0,0 +1,272 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+#include "NxXlatPrecomp.hpp"
+#include "NxXlatCommon.hpp"
+#include "NxCopy.tmh"
+
+#include "NxCopy.hpp"
+
+#if defined(_M_AMD64)
+#include <immintrin.h>
+#define NX_COPY_SIMD 1
+#else
+#define NX_COPY_SIMD 0
+#endif
+
+#ifndef PF_AVX2_INSTRUCTIONS_AVAILABLE
+#define PF_AVX2_INSTRUCTIONS_AVAILABLE 40
+#endif
+
+//
+// Copy lengths, in bytes, at which the SIMD and the non-temporal kernels
+// take over. Below the first the call overhead dominates, past the second
+// copied by a packet the payload no longer fits comfortably in the cache
+// next to the stack's working set.
+//
+#define NX_COPY_SIMD_THRESHOLD 256
+#define NX_COPY_NON_TEMPORAL_THRESHOLD (16 * 1024)
+
+static
+void
+CopyScalar(
+    void * Destination,
+    void const * Source,
+    size_t Length
+)
+{
+    RtlCopyMemory(Destination, Source, Length);
+}
+
+#if NX_COPY_SIMD
+
+static
+void
+CopySse2(
+    void * Destination,
+    void const * Source,
+    size_t Length
+)
+{
+    auto destination = static_cast<UCHAR *>(Destination);
+    auto source = static_cast<UCHAR const *>(Source);
+
+    for (; Length >= 64; Length -= 64, destination += 64, source += 64)
+    {
+        auto const a = _mm_loadu_si128(reinterpret_cast<__m128i const *>(source));
+        auto const b = _mm_loadu_si128(reinterpret_cast<__m128i const *>(source + 16));
+        auto const c = _mm_loadu_si128(reinterpret_cast<__m128i const *>(source + 32));
+        auto const d = _mm_loadu_si128(reinterpret_cast<__m128i const *>(source + 48));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(destination), a);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(destination + 16), b);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(destination + 32), c);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(destination + 48), d);
+    }
+
+    for (; Length >= 16; Length -= 16, destination += 16, source += 16)
+    {
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i *>(destination),
+            _mm_loadu_si128(reinterpret_cast<__m128i const *>(source)));
+    }
+
+    RtlCopyMemory(destination, source, Length);
+}
+
+static
+void
+CopySse2NonTemporal(
+    void * Destination,
+    void const * Source,
+    size_t Length
+)
+{
+    auto destination = static_cast<UCHAR *>(Destination);
+    auto source = static_cast<UCHAR const *>(Source);
+
+    // streaming stores need an aligned destination
+    auto const head = min(Length, (16 - (reinterpret_cast<ULONG_PTR>(destination) & 15)) & 15);
+    RtlCopyMemory(destination, source, head);
+    destination += head;
+    source += head;
+    Length -= head;
+
+    for (; Length >= 64; Length -= 64, destination += 64, source += 64)
+    {
+        auto const a = _mm_loadu_si128(reinterpret_cast<__m128i const *>(source));
+        auto const b = _mm_loadu_si128(reinterpret_cast<__m128i const *>(source + 16));
+        auto const c = _mm_loadu_si128(reinterpret_cast<__m128i const *>(source + 32));
+        auto const d = _mm_loadu_si128(reinterpret_cast<__m128i const *>(source + 48));
+
+        _mm_stream_si128(reinterpret_cast<__m128i *>(destination), a);
+        _mm_stream_si128(reinterpret_cast<__m128i *>(destination + 16), b);
+        _mm_stream_si128(reinterpret_cast<__m128i *>(destination + 32), c);
+        _mm_stream_si128(reinterpret_cast<__m128i *>(destination + 48), d);
+    }
+
+    for (; Length >= 16; Length -= 16, destination += 16, source += 16)
+    {
+        _mm_stream_si128(
+            reinterpret_cast<__m128i *>(destination),
+            _mm_loadu_si128(reinterpret_cast<__m128i const *>(source)));
+    }
+
+    RtlCopyMemory(destination, source, Length);
+}
+
+static
+void
+CopyAvx2NonTemporal(
+    void * Destination,
+    void const * Source,
+    size_t Length
+)
+{
+    auto destination = static_cast<UCHAR *>(Destination);
+    auto source = static_cast<UCHAR const *>(Source);
+
+    auto const head = min(Length, (32 - (reinterpret_cast<ULONG_PTR>(destination) & 31)) & 31);
+    RtlCopyMemory(destination, source, head);
+    destination += head;
+    source += head;
+    Length -= head;
+
+    for (; Length >= 128; Length -= 128, destination += 128, source += 128)
+    {
+        auto const a = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(source));
+        auto const b = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(source + 32));
+        auto const c = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(source + 64));
+        auto const d = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(source + 96));
+
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(destination), a);
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(destination + 32), b);
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(destination + 64), c);
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(destination + 96), d);
+    }
+
+    for (; Length >= 32; Length -= 32, destination += 32, source += 32)
+    {
+        _mm256_stream_si256(
+            reinterpret_cast<__m256i *>(destination),
+            _mm256_loadu_si256(reinterpret_cast<__m256i const *>(source)));
+    }
+
+    RtlCopyMemory(destination, source, Length);
+}
+
+#endif // NX_COPY_SIMD
+
+_Use_decl_annotations_
+void
+NxCopyEngine::Initialize(
+    void
+)
+{
+#if NX_COPY_SIMD
+    // SSE2 is architectural on x64
+    m_sse2 = true;
+
+#ifdef _KERNEL_MODE
+    m_avx2 =
+        ExIsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE) &&
+        RtlGetEnabledExtendedFeatures(XSTATE_MASK_AVX) != 0;
+#else
+    m_avx2 = !! IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE);
+#endif
+#endif // NX_COPY_SIMD
+}
+
+_Use_decl_annotations_
+NxCopyContext::NxCopyContext(
+    NxCopyEngine const & Engine
+) :
+    m_engine(Engine)
+{
+}
+
+_Use_decl_annotations_
+void
+NxCopyContext::Copy(
+    void * Destination,
+    void const * Source,
+    size_t Length
+)
+{
+    m_bytesCopied += Length;
+
+#if NX_COPY_SIMD
+    if (Length >= NX_COPY_SIMD_THRESHOLD && m_engine.m_sse2)
+    {
+        if (m_bytesCopied >= NX_COPY_NON_TEMPORAL_THRESHOLD)
+        {
+            GetNonTemporalRoutine()(Destination, Source, Length);
+        }
+        else
+        {
+            CopySse2(Destination, Source, Length);
+        }
+
+        return;
+    }
+#endif // NX_COPY_SIMD
+
+    CopyScalar(Destination, Source, Length);
+}
+
+NxCopyRoutine
+NxCopyContext::GetNonTemporalRoutine(
+    void
+)
+{
+#if NX_COPY_SIMD
+    if (m_nonTemporalCopy)
+    {
+        return m_nonTemporalCopy;
+    }
+
+    m_nonTemporal = true;
+    m_nonTemporalCopy = &CopySse2NonTemporal;
+
+    if (m_engine.m_avx2)
+    {
+#ifdef _KERNEL_MODE
+        // YMM state is not preserved for kernel code, it is saved once per
+        // packet and only for packets that copy enough to amortize it
+        m_extendedStateSaved =
+            NT_SUCCESS(KeSaveExtendedProcessorState(XSTATE_MASK_AVX, &m_extendedState));
+
+        if (m_extendedStateSaved)
+        {
+            m_nonTemporalCopy = &CopyAvx2NonTemporal;
+        }
+#else
+        m_nonTemporalCopy = &CopyAvx2NonTemporal;
+#endif
+    }
+
+    return m_nonTemporalCopy;
+#else
+    return &CopyScalar;
+#endif // NX_COPY_SIMD
+}
+
+_Use_decl_annotations_
+NxCopyContext::~NxCopyContext(
+    void
+)
+{
+#if NX_COPY_SIMD
+    if (m_nonTemporal)
+    {
+        // order the streaming stores before the NIC is told about the data
+        _mm_sfence();
+    }
+#endif
+
+#ifdef _KERNEL_MODE
+    if (m_extendedStateSaved)
+    {
+        KeRestoreExtendedProcessorState(&m_extendedState);
+    }
+#endif
+}
@@ -0,0 +1,104 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+/*++
+
+Abstract:
+
+    Copy kernels used to bounce transmit payload. The kernel is chosen per
+    copy from the bytes actually copied and the processor features:
+
+    - short copies use RtlCopyMemory
+    - other copies use an SSE2 loop
+    - once a packet copied enough bytes, the rest of its copies use
+      non-temporal stores (AVX2 when available), so that payload only the
+      NIC will read does not evict the working set from the cache
+
+--*/
+
+#pragma once
+
+using NxCopyRoutine = void (*)(
+    _Out_writes_bytes_all_(Length) void * Destination,
+    _In_reads_bytes_(Length) void const * Source,
+    _In_ size_t Length);
+
+class NxCopyEngine
+{
+    friend class NxCopyContext;
+
+public:
+
+    // detects the processor features, must be called before first use
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    void
+    Initialize(
+        void
+    );
+
+private:
+
+    bool m_sse2 = false;
+    bool m_avx2 = false;
+};
+
+//
+// Copies the bounced bytes of one packet. Extended processor state is only
+// saved the first time the AVX2 kernel is used. Non-temporal stores are
+// fenced and any extended processor state saved for the kernel is restored
+// when the context goes out of scope, which must happen before the copied
+// data is handed to the NIC.
+//
+class NxCopyContext
+{
+
+public:
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    NxCopyContext(
+        _In_ NxCopyEngine const & Engine
+    );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    ~NxCopyContext(
+        void
+    );
+
+    NxCopyContext(NxCopyContext const &) = delete;
+    NxCopyContext & operator=(NxCopyContext const &) = delete;
+
+    void
+    Copy(
+        _Out_writes_bytes_all_(Length) void * Destination,
+        _In_reads_bytes_(Length) void const * Source,
+        _In_ size_t Length
+    );
+
+private:
+
+    NxCopyRoutine
+    GetNonTemporalRoutine(
+        void
+    );
+
+    NxCopyEngine const &
+        m_engine;
+
+    // by this context so far, the copy in progress included
+    size_t
+        m_bytesCopied = 0;
+
+    // chosen on the first non-temporal copy
+    NxCopyRoutine
+        m_nonTemporalCopy = nullptr;
+
+    bool
+        m_nonTemporal = false;
+
+#ifdef _KERNEL_MODE
+    bool
+        m_extendedStateSaved = false;
+
+    XSTATE_SAVE
+        m_extendedState;
+#endif
+};
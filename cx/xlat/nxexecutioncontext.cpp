@@ -12,11 +12,39 @@ Abstract:
 #include "NxXlatCommon.hpp"
 #include "NxExecutionContext.tmh"
 #include "NxExecutionContext.hpp"
+#include "NxPollScheduler.hpp"
 
 #include <netioapi.h>
 
 #define ThreadNameInformation static_cast<THREADINFOCLASS>(38)
 
+// weight of the latest idle period in the average, as a power of two
+#define EC_IDLE_AVERAGE_SHIFT 3
+
+_Use_decl_annotations_
+ULONG64
+NxExecutionContext::QueryPerformanceTicks(
+    ULONG64 * Frequency
+)
+{
+#if _KERNEL_MODE
+    LARGE_INTEGER frequency;
+    auto const ticks = KeQueryPerformanceCounter(&frequency);
+#else
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER ticks;
+    (void)QueryPerformanceFrequency(&frequency);
+    (void)QueryPerformanceCounter(&ticks);
+#endif
+
+    if (Frequency)
+    {
+        *Frequency = static_cast<ULONG64>(frequency.QuadPart);
+    }
+
+    return static_cast<ULONG64>(ticks.QuadPart);
+}
+
 NTSTATUS
 NxExecutionContext::Initialize(PVOID context, EC_START_ROUTINE *callback)
 {
@@ -58,6 +86,61 @@ NxExecutionContext::Initialize(PVOID context, EC_START_ROUTINE *callback)
     return STATUS_SUCCESS;
 }
 
+NTSTATUS
+NxExecutionContext::InitializeShared(
+    _In_ INxExecutionContextTask & Task,
+    _In_ NxPollWorker & Worker
+)
+{
+    m_task = &Task;
+    m_pollWorker = &Worker;
+
+    if (! Worker.Attach(this))
+    {
+        m_task = nullptr;
+        m_pollWorker = nullptr;
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+bool
+NxExecutionContext::HasDedicatedThread() const
+{
+    return m_pollWorker == nullptr;
+}
+
+bool
+NxExecutionContext::Poll()
+{
+    NT_ASSERT(m_pollWorker);
+
+    auto const state = m_ecState;
+    if (state != EcState::Started && state != EcState::Stopping)
+    {
+        m_running = false;
+        return false;
+    }
+
+    if (! m_running)
+    {
+        m_running = true;
+        m_task->EcStartRun();
+    }
+
+    m_haltRequested = false;
+
+    if (! m_task->EcRunIteration())
+    {
+        m_running = false;
+        return false;
+    }
+
+    return ! m_haltRequested;
+}
+
 NxExecutionContext::EcState
 NxExecutionContext::SetState(EcState newState)
 {
@@ -113,6 +196,11 @@ NxExecutionContext::Terminate()
 {
     SetTerminated();
 
+    if (m_pollWorker)
+    {
+        m_pollWorker->Detach(this);
+    }
+
     if (m_workerThreadObject)
     {
 #if _KERNEL_MODE
@@ -169,13 +257,49 @@ NxExecutionContext::Stop()
 void
 NxExecutionContext::SignalWork()
 {
-    m_work.Set();
+    if (m_pollWorker)
+    {
+        m_pollWorker->SignalWork();
+    }
+    else
+    {
+        m_work.Set();
+    }
 }
 
-void
+bool
 NxExecutionContext::WaitForWork()
 {
+    if (m_pollWorker)
+    {
+        m_haltRequested = true;
+        return false;
+    }
+
     m_work.Wait();
+
+    return true;
+}
+
+_Use_decl_annotations_
+void
+NxExecutionContext::Linger(
+    ULONG Microseconds
+)
+{
+    if (m_pollWorker)
+    {
+        return;
+    }
+
+    ULONG64 frequency;
+    auto const start = QueryPerformanceTicks(&frequency);
+    auto const lingerTicks = frequency * Microseconds / 1000000;
+
+    while (QueryPerformanceTicks() - start < lingerTicks)
+    {
+        YieldProcessor();
+    }
 }
 
 bool
@@ -202,6 +326,12 @@ NxExecutionContext::SetDebugNameHint(
     _In_ size_t index,
     _In_ NET_LUID networkInterface)
 {
+    // a shared EC has no thread of its own to name
+    if (m_pollWorker)
+    {
+        return;
+    }
+
     MIB_IF_ROW2 mib;
     mib.InterfaceLuid = networkInterface;
 
@@ -237,10 +367,14 @@ NxExecutionContext::SetDebugNameHint(
 
 void
 NxExecutionContext::UpdateCounters(
-    _In_ bool IsIdleIteration
+    _In_ ULONG Iterations,
+    _In_ ULONG IdleIterations
 )
 {
-    m_ecCounters.IterationCount++;
+    NT_ASSERT(IdleIterations <= Iterations);
+
+    m_ecCounters.IterationCount += Iterations;
+    m_ecCounters.BusyWaitIterationCount += IdleIterations;
     UINT64 threadCycleTime = 0;
     UINT64 threadTimeDelta = 0;
 
@@ -272,15 +406,13 @@ NxExecutionContext::UpdateCounters(
     }
 #endif
 
-    if (IsIdleIteration)
-    {
-        m_ecCounters.BusyWaitIterationCount++;
-        m_ecCounters.BusyWaitCycles += threadTimeDelta;
-    }
-    else
-    {
-        m_ecCounters.ProcessingCycles += threadTimeDelta;
-    }
+    // the cycles of the window are split by the share of idle iterations
+    auto const busyWaitCycles = Iterations != 0
+        ? threadTimeDelta * IdleIterations / Iterations
+        : 0;
+
+    m_ecCounters.BusyWaitCycles += busyWaitCycles;
+    m_ecCounters.ProcessingCycles += threadTimeDelta - busyWaitCycles;
 }
 
 NxExecutionContextCounters
@@ -294,3 +426,85 @@ NxExecutionContext::GetExecutionContextIdentifier() const
 {
     return m_ecIdentifier;
 }
+
+void
+NxExecutionContext::SetBusyPollPolicy(
+    _In_ ULONG MaximumMicroseconds,
+    _In_ ULONG MaximumIterations
+)
+{
+    ULONG64 frequency;
+    (void)QueryPerformanceTicks(&frequency);
+
+    m_busyPollMaximumTicks = frequency * MaximumMicroseconds / 1000000;
+    m_busyPollMaximumIterations = MaximumIterations;
+}
+
+//
+// An idle period lasts from the first iteration without work to the next
+// iteration with work. The EC spins for twice the recent average idle
+// period, so bursts arriving at a steady pace are caught without a wake-up,
+// and does not spin at all when bursts are further apart than the policy
+// allows, since a short spin would only burn cycles before sleeping anyway.
+//
+bool
+NxExecutionContext::ContinueBusyPoll(
+    _In_ bool WorkDone
+)
+{
+    if (m_busyPollMaximumTicks == 0)
+    {
+        return false;
+    }
+
+    auto const now = QueryPerformanceTicks();
+
+    if (WorkDone)
+    {
+        if (m_idle)
+        {
+            auto const idleTicks = now - m_idleStartTicks;
+
+            if (idleTicks < m_busyPollBudgetTicks)
+            {
+                m_ecCounters.BusyPollHitCount++;
+            }
+
+            m_averageIdleTicks +=
+                (idleTicks >> EC_IDLE_AVERAGE_SHIFT) - (m_averageIdleTicks >> EC_IDLE_AVERAGE_SHIFT);
+            m_idle = false;
+        }
+
+        return false;
+    }
+
+    if (! m_idle)
+    {
+        m_idle = true;
+        m_idleStartTicks = now;
+        m_busyPollIterations = 0;
+        m_busyPollBudgetTicks = 2 * m_averageIdleTicks <= m_busyPollMaximumTicks
+            ? 2 * m_averageIdleTicks
+            : 0;
+    }
+
+    if (now - m_idleStartTicks < m_busyPollBudgetTicks &&
+        (m_busyPollMaximumIterations == 0 || m_busyPollIterations < m_busyPollMaximumIterations))
+    {
+        m_busyPollIterations++;
+        YieldProcessor();
+
+        return true;
+    }
+
+    if (m_busyPollBudgetTicks != 0 && m_busyPollIterations != 0)
+    {
+        m_ecCounters.BusyPollMissCount++;
+
+        // count each idle period once
+        m_busyPollIterations = 0;
+        m_busyPollBudgetTicks = 0;
+    }
+
+    return false;
+}
@@ -60,6 +60,30 @@ using EC_START_ROUTINE = wistd::remove_pointer<PTHREAD_START_ROUTINE>::type;
 using EC_RETURN = DWORD;
 #endif
 
+class NxPollWorker;
+
+/// Implemented by the owner of an EC. The EC thread, or the NxPollWorker
+/// running a shared EC, calls EcStartRun each time the EC is started and
+/// then EcRunIteration until it returns false.
+class INxExecutionContextTask
+{
+public:
+
+    virtual
+    void
+    EcStartRun(
+        void
+    ) = 0;
+
+    /// Runs one iteration of the task, returns false once the task called
+    /// SignalStopped.
+    virtual
+    bool
+    EcRunIteration(
+        void
+    ) = 0;
+};
+
 struct NxExecutionContextCounters
 {
     ULONG64 IterationCount = 0; // # of times polling loop runs
@@ -71,6 +95,9 @@ struct NxExecutionContextCounters
     ULONG64 ProcessingCycles = 0;
     ULONG64 BusyWaitCycles = 0;
     ULONG64 IdleCycles = 0;
+
+    ULONG64 BusyPollHitCount = 0; // # of times work arrived while busy polling
+    ULONG64 BusyPollMissCount = 0; // # of times busy polling gave up and slept
 };
 
 /// Encapsulates single-threaded execution of a task that can be suspended and
@@ -85,6 +112,27 @@ public:
         EC_START_ROUTINE * callback
     );
 
+    /// Runs the EC on a NxPollWorker shared with other ECs instead of a
+    /// dedicated thread. Fails if the worker has no room for another EC.
+    NTSTATUS
+    InitializeShared(
+        _In_ INxExecutionContextTask & Task,
+        _In_ NxPollWorker & Worker
+    );
+
+    bool
+    HasDedicatedThread(
+        void
+    ) const;
+
+    /// Called only by the NxPollWorker running a shared EC. Runs one
+    /// iteration of the task if the EC is started, returns true if the
+    /// task wants to run again without waiting for work.
+    bool
+    Poll(
+        void
+    );
+
     void
     Start(
         void
@@ -110,11 +158,22 @@ public:
         void
     );
 
-    void
+    /// Waits until SignalWork is called. A shared EC cannot block its
+    /// worker, it only records that the task wants to halt and returns
+    /// false, the worker halts once all its ECs want to.
+    bool
     WaitForWork(
         void
     );
 
+    /// Spins for Microseconds to give the NIC time to produce more work.
+    /// A timed wait would last at least a clock tick, far longer than a
+    /// linger. A shared EC returns right away.
+    void
+    Linger(
+        _In_ ULONG Microseconds
+    );
+
     void
     SignalStopped(
         void
@@ -145,17 +204,42 @@ public:
         _In_ NET_LUID networkInterface
     );
 
+    // Accounts the cycles spent since the previous call to Iterations
+    // iterations of the polling loop, IdleIterations of which did no work
     void
     UpdateCounters(
-        _In_ bool IsIdleIteration
+        _In_ ULONG Iterations,
+        _In_ ULONG IdleIterations
     );
 
     NxExecutionContextCounters
     GetExecutionContextCounters() const;
 
+    /// Enables busy polling, a MaximumMicroseconds of zero disables it.
+    /// Must be called before Start.
+    void
+    SetBusyPollPolicy(
+        _In_ ULONG MaximumMicroseconds,
+        _In_ ULONG MaximumIterations
+    );
+
+    /// Called only by code running in the EC, once per iteration before it
+    /// prepares to wait for work. Returns true if the EC should poll again
+    /// instead of arming notifications and waiting.
+    bool
+    ContinueBusyPoll(
+        _In_ bool WorkDone
+    );
+
     ULONG
     GetExecutionContextIdentifier() const;
 
+    static
+    ULONG64
+    QueryPerformanceTicks(
+        _Out_opt_ ULONG64 * Frequency = nullptr
+    );
+
 private:
 
     enum EcState : LONG
@@ -196,6 +280,21 @@ private:
 
     NxExecutionContextCounters m_ecCounters;
 
+    // busy poll policy and state, in performance counter ticks
+    ULONG64 m_busyPollMaximumTicks = 0;
+    ULONG m_busyPollMaximumIterations = 0;
+    ULONG64 m_busyPollBudgetTicks = 0;
+    ULONG m_busyPollIterations = 0;
+    ULONG64 m_averageIdleTicks = 0;
+    ULONG64 m_idleStartTicks = 0;
+    bool m_idle = false;
+
+    // set when the EC is run by a shared worker instead of its own thread
+    NxPollWorker * m_pollWorker = nullptr;
+    INxExecutionContextTask * m_task = nullptr;
+    bool m_running = false;
+    bool m_haltRequested = false;
+
 #if _KERNEL_MODE
     unique_zw_handle m_threadHandle;
     unique_pkthread m_workerThreadObject;
@@ -17,7 +17,6 @@ Abstract:
 PAGED
 NxNblQueue::NxNblQueue()
 {
-    ndisInitializeNblQueue(&m_nblQueue.Queue);
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -27,18 +26,57 @@ NxNblQueue::Enqueue(_In_ PNET_BUFFER_LIST pNbl)
     SIZE_T nblCount = 0;
     auto lastNbl = ndisLastNblInNblChainWithCount(pNbl, &nblCount);
 
-    KAcquireSpinLock lock(m_SpinLock);
-    m_nblQueue.NblCount += nblCount;
-    ndisAppendNblChainToNblQueueFast(&m_nblQueue.Queue, pNbl, lastNbl);
+    Enqueue(pNbl, lastNbl, nblCount);
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void
 NxNblQueue::Enqueue(_Inout_ NBL_COUNTED_QUEUE *queue)
 {
-    KAcquireSpinLock lock(m_SpinLock);
-    ndisAppendNblQueueToNblQueueFast(&m_nblQueue.Queue, &(queue->Queue));
-    m_nblQueue.NblCount += queue->NblCount;
+    if (ndisIsNblQueueEmpty(&queue->Queue))
+    {
+        return;
+    }
+
+    Enqueue(
+        queue->Queue.First,
+        CONTAINING_RECORD(queue->Queue.Last, NET_BUFFER_LIST, Next),
+        queue->NblCount);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void
+NxNblQueue::Enqueue(
+    _In_ NET_BUFFER_LIST *first,
+    _In_ NET_BUFFER_LIST *last,
+    _In_ SIZE_T nblCount)
+{
+    last->Next = nullptr;
+
+#ifdef _KERNEL_MODE
+    // The consumer spins until the chain is linked, which may be from a DPC
+    // on this processor. Like the spin lock this replaces, do not let the
+    // producer be preempted between the exchange and the store.
+    KIRQL irql;
+    KeRaiseIrql(DISPATCH_LEVEL, &irql);
+#endif
+
+    auto previous = static_cast<NET_BUFFER_LIST * volatile *>(
+        InterlockedExchangePointer(
+            reinterpret_cast<PVOID volatile *>(&m_tail),
+            &last->Next));
+
+    // Until this store the chain is unreachable from the head, see
+    // DequeueAll
+    WritePointerRelease(reinterpret_cast<PVOID volatile *>(previous), first);
+
+#ifdef _KERNEL_MODE
+    KeLowerIrql(irql);
+#endif
+
+    // Counted once visible. A consumer racing with this may leave the count
+    // of NBLs it already dequeued behind, never miss queued ones.
+    InterlockedAdd64(&m_nblCount, static_cast<LONG64>(nblCount));
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -46,24 +84,91 @@ void
 NxNblQueue::DequeueAll(
     _Out_ NBL_QUEUE *destination)
 {
-    KAcquireSpinLock lock(m_SpinLock);
     ndisInitializeNblQueue(destination);
-    ndisAppendNblQueueToNblQueueFast(destination, &m_nblQueue.Queue);
-    m_nblQueue.NblCount = 0;
+
+    NET_BUFFER_LIST *last;
+    auto first = DetachAll(&last);
+
+    if (first)
+    {
+        ndisAppendNblChainToNblQueueFast(destination, first, last);
+    }
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NET_BUFFER_LIST *
 NxNblQueue::DequeueAll()
 {
-    KAcquireSpinLock lock(m_SpinLock);
-    m_nblQueue.NblCount = 0;
-    return ndisPopAllFromNblQueue(&m_nblQueue.Queue);
+    NET_BUFFER_LIST *last;
+    return DetachAll(&last);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NET_BUFFER_LIST *
+NxNblQueue::DetachAll(
+    _Out_ NET_BUFFER_LIST **last)
+{
+    *last = nullptr;
+
+    auto first = static_cast<NET_BUFFER_LIST *>(
+        ReadPointerAcquire(reinterpret_cast<PVOID volatile *>(&m_head)));
+
+    if (! first)
+    {
+        if (ReadPointerAcquire(reinterpret_cast<PVOID volatile *>(&m_tail)) == &m_head)
+        {
+            return nullptr;
+        }
+
+        // The first producer exchanged the tail but did not link its NBLs
+        // yet. Enqueue raises to DISPATCH_LEVEL around the two, so it is on
+        // another processor and a store away from done.
+        while (nullptr == (first = static_cast<NET_BUFFER_LIST *>(
+            ReadPointerAcquire(reinterpret_cast<PVOID volatile *>(&m_head)))))
+        {
+            YieldProcessor();
+        }
+    }
+
+    InterlockedExchange64(&m_nblCount, 0);
+
+    //
+    // Detach everything enqueued so far. Producers that come after the
+    // exchange link their NBLs from m_head again, which is why it is
+    // cleared first.
+    //
+    WritePointerNoFence(reinterpret_cast<PVOID volatile *>(&m_head), nullptr);
+
+    auto lastLink = static_cast<NET_BUFFER_LIST * volatile *>(
+        InterlockedExchangePointer(
+            reinterpret_cast<PVOID volatile *>(&m_tail),
+            const_cast<NET_BUFFER_LIST **>(&m_head)));
+
+    //
+    // Producers that exchanged the tail before the consumer may not have
+    // linked their NBLs yet, wait for each gap in the chain to be filled.
+    //
+    for (auto nbl = first; &nbl->Next != lastLink;)
+    {
+        NET_BUFFER_LIST *next;
+
+        while (nullptr == (next = static_cast<NET_BUFFER_LIST *>(
+            ReadPointerAcquire(reinterpret_cast<PVOID volatile *>(&nbl->Next)))))
+        {
+            YieldProcessor();
+        }
+
+        nbl = next;
+    }
+
+    *last = CONTAINING_RECORD(lastLink, NET_BUFFER_LIST, Next);
+
+    return first;
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
 ULONG64
 NxNblQueue::GetNblQueueDepth() const
 {
-    return m_nblQueue.NblCount;
+    return static_cast<ULONG64>(ReadNoFence64(const_cast<LONG64 volatile *>(&m_nblCount)));
 }
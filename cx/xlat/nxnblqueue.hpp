@@ -7,12 +7,15 @@ Abstract:
     The NxNblQueue is a FIFO queues of NET_BUFFER_LISTs, with
     built-in synchronization.
 
+    Any number of threads may enqueue concurrently, but only one thread
+    at a time may dequeue. The queue is lock-free for producers: NBLs are
+    linked through NET_BUFFER_LIST::Next and a producer claims its place
+    with a single exchange of the tail.
+
 --*/
 
 #pragma once
 
-#include <KSpinLock.h>
-
 class NxNblQueue
 {
 public:
@@ -36,6 +39,24 @@ public:
 
 private:
 
-    NBL_COUNTED_QUEUE m_nblQueue;
-    KSpinLock m_SpinLock;
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    void Enqueue(
+        _In_ NET_BUFFER_LIST *first,
+        _In_ NET_BUFFER_LIST *last,
+        _In_ SIZE_T nblCount);
+
+    // Only one thread at a time may call this
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    NET_BUFFER_LIST *DetachAll(
+        _Out_ NET_BUFFER_LIST **last);
+
+    // Only written by the consumer, and by the first producer after the
+    // queue was emptied
+    DECLSPEC_CACHEALIGN NET_BUFFER_LIST * volatile m_head = nullptr;
+
+    // The link the next producer appends to, either &m_head or the Next
+    // field of the last NBL enqueued
+    DECLSPEC_CACHEALIGN NET_BUFFER_LIST * volatile * volatile m_tail = &m_head;
+
+    LONG64 volatile m_nblCount = 0;
 };
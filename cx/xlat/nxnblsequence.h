@@ -2,12 +2,23 @@
 
 #include "RtlHomogenousSequence.h"
 
+// most runs of NBLs sharing their receive flags a sequence keeps track of
+#define NX_NBL_SEQUENCE_MAXIMUM_RUNS 4
+
+// smallest run worth an indication of its own
+#define NX_NBL_SEQUENCE_MINIMUM_RUN 16
+
 // Utility class that builds on top of a simple NBL_QUEUE.
 //
 // In addition to tracking how many NBLs are in the queue, this class also
 // tracks additional data needed to populate
 // NdisMIndicateReceiveNetBufferLists, including the length of the NBL chain
-// and whether all the NBLs have the same EtherType.
+// and whether all the NBLs have the same EtherType, receive queue and
+// VLAN.
+//
+// A sequence made of a few long runs of NBLs that are homogenous on their
+// own, IPv4 then IPv6 for instance, is indicated one run at a time so each
+// indication carries the flags.
 
 class NxNblSequence
 {
@@ -22,7 +33,42 @@ public:
     {
         WIN_ASSERT(nbl->Next == nullptr);
 
-        m_frameTypes.AddValue((USHORT)nbl->NetBufferListInfo[NetBufferListFrameType]);
+        auto const frameType = (USHORT)nbl->NetBufferListInfo[NetBufferListFrameType];
+        auto const queueId = (ULONG)NET_BUFFER_LIST_RECEIVE_QUEUE_ID(nbl);
+
+        NDIS_NET_BUFFER_LIST_8021Q_INFO ieee8021Q;
+        ieee8021Q.Value = nbl->NetBufferListInfo[Ieee8021QNetBufferListInfo];
+        auto const vlanId = (USHORT)ieee8021Q.TagHeader.VlanId;
+
+        m_frameTypes.AddValue(frameType);
+        m_queueIds.AddValue(queueId);
+        m_vlanIds.AddValue(vlanId);
+
+        if (m_count == 0 ||
+            frameType != m_runFrameType ||
+            queueId != m_runQueueId ||
+            vlanId != m_runVlanId)
+        {
+            if (m_runCount < NX_NBL_SEQUENCE_MAXIMUM_RUNS)
+            {
+                m_runs[m_runCount++] = { nbl, nbl, 0 };
+            }
+            else
+            {
+                m_tooManyRuns = true;
+            }
+
+            m_runFrameType = frameType;
+            m_runQueueId = queueId;
+            m_runVlanId = vlanId;
+        }
+
+        if (! m_tooManyRuns)
+        {
+            auto & run = m_runs[m_runCount - 1];
+            run.Last = nbl;
+            run.Count += 1;
+        }
 
         m_count += 1;
         ndisAppendNblChainToNblQueueFast(&m_queue, nbl, nbl);
@@ -50,13 +96,80 @@ public:
         if (m_frameTypes.IsHomogenous())
             receiveFlags |= NDIS_RECEIVE_FLAGS_SINGLE_ETHER_TYPE;
 
+        if (m_queueIds.IsHomogenous())
+            receiveFlags |= NDIS_RECEIVE_FLAGS_SINGLE_QUEUE;
+
+        if (m_vlanIds.IsHomogenous())
+            receiveFlags |= NDIS_RECEIVE_FLAGS_SINGLE_VLAN;
+
         return receiveFlags;
     }
 
+    // Calls Indicate(First, Last, Count, ReceiveFlags) for each chain of
+    // NBLs to indicate, either the whole sequence or each of its runs. The
+    // sequence must not be used afterwards.
+    template<typename TIndicate>
+    void Indicate(TIndicate &&indicate)
+    {
+        if (m_count == 0)
+            return;
+
+        if (! ShouldSplit())
+        {
+            indicate(m_queue.First, CONTAINING_RECORD(m_queue.Last, NET_BUFFER_LIST, Next), m_count, GetReceiveFlags());
+            return;
+        }
+
+        // cut every run off before the first one is handed to NDIS
+        for (ULONG i = 0; i < m_runCount; i++)
+            m_runs[i].Last->Next = nullptr;
+
+        for (ULONG i = 0; i < m_runCount; i++)
+            indicate(m_runs[i].First, m_runs[i].Last, m_runs[i].Count, RunReceiveFlags);
+    }
+
 private:
 
+    struct Run
+    {
+        NET_BUFFER_LIST *First;
+        NET_BUFFER_LIST *Last;
+        ULONG Count;
+    };
+
+    // every NBL of a run has the same EtherType, receive queue and VLAN
+    static ULONG const RunReceiveFlags =
+        NDIS_RECEIVE_FLAGS_SINGLE_ETHER_TYPE |
+        NDIS_RECEIVE_FLAGS_SINGLE_QUEUE |
+        NDIS_RECEIVE_FLAGS_SINGLE_VLAN;
+
+    bool ShouldSplit() const
+    {
+        if (m_runCount < 2 || m_tooManyRuns)
+            return false;
+
+        for (ULONG i = 0; i < m_runCount; i++)
+        {
+            if (m_runs[i].Count < NX_NBL_SEQUENCE_MINIMUM_RUN)
+                return false;
+        }
+
+        return true;
+    }
+
     ULONG m_count = 0;
     RtlHomogenousSequence<USHORT> m_frameTypes;
+    RtlHomogenousSequence<ULONG> m_queueIds;
+    RtlHomogenousSequence<USHORT> m_vlanIds;
+
+    // the run being built
+    USHORT m_runFrameType = 0;
+    ULONG m_runQueueId = 0;
+    USHORT m_runVlanId = 0;
+
+    Run m_runs[NX_NBL_SEQUENCE_MAXIMUM_RUNS];
+    ULONG m_runCount = 0;
+    bool m_tooManyRuns = false;
 
     NBL_QUEUE m_queue;
 };
@@ -60,7 +60,9 @@ void
 NxNblTranslator::TranslateNetBufferListOOBDataToNetPacketExtensions(
     NET_BUFFER_LIST const &netBufferList,
     NET_PACKET* netPacket,
-    UINT32 packetIndex
+    UINT32 packetIndex,
+    bool segmented,
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO const &checksumInfo
 ) const
 {
     // For every in-use packet extensions for a NET_PACKET
@@ -73,10 +75,6 @@ NxNblTranslator::TranslateNetBufferListOOBDataToNetPacketExtensions(
             NetExtensionGetPacketChecksum(&m_netPacketChecksumExtension, packetIndex);
         RtlZeroMemory(checksumExt, NET_PACKET_EXTENSION_CHECKSUM_VERSION_1_SIZE);
 
-        auto const &checksumInfo =
-            *(NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO*)
-            &netBufferList.NetBufferListInfo[TcpIpChecksumNetBufferListInfo];
-
 #if DBG
         if (checksumInfo.Transmit.TcpChecksum && netPacket->Layout.Layer4Type == NET_PACKET_LAYER4_TYPE_TCP)
         {
@@ -93,7 +91,8 @@ NxNblTranslator::TranslateNetBufferListOOBDataToNetPacketExtensions(
             NetExtensionGetPacketLargeSendSegmentation(&m_netPacketLsoExtension, packetIndex);
         RtlZeroMemory(lsoExt, NET_PACKET_EXTENSION_LSO_VERSION_1_SIZE);
 
-        if (netPacket->Layout.Layer4Type == NET_PACKET_LAYER4_TYPE_TCP)
+        // a segment built in software must not be segmented again
+        if (netPacket->Layout.Layer4Type == NET_PACKET_LAYER4_TYPE_TCP && ! segmented)
         {
             auto const &lsoInfo =
                 *(NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO*)
@@ -178,6 +177,7 @@ NxNblTranslator::TranslateNetBufferToNetPacket(
         {
             // Commit the fragment chain to the packet
             netPacket->FragmentCount = static_cast<UINT16>(result.FragmentChain.Count());
+            m_stats.Packet.Fragments += netPacket->FragmentCount;
             netPacket->FragmentIndex = result.FragmentChain.begin().GetIndex();
             fragmentRing.EndIndex = result.FragmentChain.end().GetIndex();
 
@@ -215,7 +215,6 @@ NxNblTranslator::ShouldBounceFragment(
 ) const
 {
     auto const alignment = m_datapathCapabilities.TxMemoryConstraints.AlignmentRequirement;
-    auto const maxPhysicalAddress = m_datapathCapabilities.TxMemoryConstraints.Dma.MaximumPhysicalAddress;
 
     if (!IsAddressAligned(Fragment.VirtualAddress, alignment))
     {
@@ -223,9 +222,7 @@ NxNblTranslator::ShouldBounceFragment(
         return true;
     }
 
-    auto const maxLogicalAddress = static_cast<LOGICAL_ADDRESS>(maxPhysicalAddress.QuadPart);
-    auto const checkMaxPhysicalAddress = RequiresDmaMapping() && maxLogicalAddress != 0;
-    if (checkMaxPhysicalAddress && Fragment.Mapping.DmaLogicalAddress > maxLogicalAddress)
+    if (IsAboveMaximumLogicalAddress(Fragment.Mapping.DmaLogicalAddress))
     {
         m_stats.DMA.PhysicalAddressTooLarge += 1;
         return true;
@@ -234,6 +231,19 @@ NxNblTranslator::ShouldBounceFragment(
     return false;
 }
 
+_Use_decl_annotations_
+bool
+NxNblTranslator::IsAboveMaximumLogicalAddress(
+    LOGICAL_ADDRESS LogicalAddress
+) const
+{
+    auto const maxPhysicalAddress = m_datapathCapabilities.TxMemoryConstraints.Dma.MaximumPhysicalAddress;
+    auto const maxLogicalAddress = static_cast<LOGICAL_ADDRESS>(maxPhysicalAddress.QuadPart);
+    auto const checkMaxPhysicalAddress = RequiresDmaMapping() && maxLogicalAddress != 0;
+
+    return checkMaxPhysicalAddress && LogicalAddress > maxLogicalAddress;
+}
+
 _Use_decl_annotations_
 MdlTranlationResult
 NxNblTranslator::TranslateMdlChainToFragmentRangeKvmOnly(
@@ -670,6 +680,9 @@ NxNblTranslator::TranslateMdlChainToDmaMappedFragmentRangeBypassHal(
 {
     auto it = AvailableFragments.begin();
 
+    NET_FRAGMENT * previousFragment = nullptr;
+    auto const maximumFragmentLength = m_datapathCapabilities.MaximumTxFragmentSize;
+
     //
     // While there is remaining data to be copied, and we have MDLs to walk...
     //
@@ -696,6 +709,34 @@ NxNblTranslator::TranslateMdlChainToDmaMappedFragmentRangeBypassHal(
 
         for (auto va = vaStart; va < vaEnd; va = reinterpret_cast<ULONG_PTR>((PAGE_ALIGN(va))) + PAGE_SIZE)
         {
+            auto const fragmentLength = PAGE_ALIGN(va) != PAGE_ALIGN(vaEnd) ?
+                PAGE_SIZE - BYTE_OFFSET(va) :
+                (ULONG)(vaEnd - va);
+
+            auto const logicalAddress = MmGetPhysicalAddress(reinterpret_cast<void *>(va)).QuadPart;
+
+            //
+            // Merge this page into the previous fragment if it continues it both
+            // virtually and physically and the result fits in a single device
+            // fragment. Pages of one MDL are virtually contiguous, pages that
+            // also happen to be physically contiguous are common for large sends.
+            // A page past the device's addressing limit is not merged, it goes
+            // through the bounce check as a fragment of its own.
+            //
+            if (previousFragment != nullptr &&
+                reinterpret_cast<ULONG_PTR>(previousFragment->VirtualAddress) + previousFragment->ValidLength == va &&
+                previousFragment->Mapping.DmaLogicalAddress + previousFragment->ValidLength == logicalAddress &&
+                previousFragment->ValidLength + fragmentLength <= maximumFragmentLength &&
+                ! IsAboveMaximumLogicalAddress(logicalAddress + fragmentLength - 1))
+            {
+                previousFragment->ValidLength += fragmentLength;
+                previousFragment->Capacity = previousFragment->ValidLength;
+
+                m_stats.DMA.CoalescedPages += 1;
+                remain -= fragmentLength;
+                continue;
+            }
+
             size_t numberOfFragments = NetRbFragmentRange(AvailableFragments.begin(), it).Count();
 
             if (numberOfFragments > m_datapathCapabilities.MaximumNumberOfTxFragments)
@@ -708,7 +749,7 @@ NxNblTranslator::TranslateMdlChainToDmaMappedFragmentRangeBypassHal(
                 size_t const currentMdlOffset = va - vaStart + MdlOffset;
 
                 // The total number of fragments is whatever we translated so far plus the number of
-                // remaining pages in the mdl chain
+                // remaining pages in the mdl chain. This ignores coalescing so it is an upper bound.
                 numberOfFragments += CountNumberOfPages(
                     *mdl,
                     currentMdlOffset,
@@ -726,9 +767,7 @@ NxNblTranslator::TranslateMdlChainToDmaMappedFragmentRangeBypassHal(
             auto& currentFragment = *(it++);
             RtlZeroMemory(&currentFragment, NetPacketFragmentGetSize());
 
-            // Performance can be optimized by coalescing adjacent fragments
-
-            currentFragment.Mapping.DmaLogicalAddress = MmGetPhysicalAddress(reinterpret_cast<void *>(va)).QuadPart;
+            currentFragment.Mapping.DmaLogicalAddress = logicalAddress;
             currentFragment.VirtualAddress = reinterpret_cast<void *>(va);
 
             if (ShouldBounceFragment(currentFragment))
@@ -736,14 +775,11 @@ NxNblTranslator::TranslateMdlChainToDmaMappedFragmentRangeBypassHal(
                 return { NxNblTranslationStatus::BounceRequired, EmptyFragmentRange() };
             }
 
-            auto fragmentLength = PAGE_ALIGN(va) != PAGE_ALIGN(vaEnd) ?
-                PAGE_SIZE - BYTE_OFFSET(va) :
-                (ULONG)(vaEnd - va);
-
             currentFragment.ValidLength = fragmentLength;
             currentFragment.Offset = 0;
             currentFragment.Capacity = currentFragment.ValidLength;
 
+            previousFragment = &currentFragment;
             remain -= fragmentLength;
         }
 
@@ -758,13 +794,16 @@ bool
 NxNblTranslator::TranslateNbls(
     NET_BUFFER_LIST *&currentNbl,
     NET_BUFFER *&currentNetBuffer,
-    NxBounceBufferPool &BouncePool
+    NxBounceBufferPool &BouncePool,
+    NxTxSegmenter &Segmenter,
+    NxWorkBudget &Budget
 ) const
 {
     auto pr = NetRingCollectionGetPacketRing(m_rings);
     auto const endIndex = pr->EndIndex;
 
-    while (currentNbl && pr->EndIndex != ((pr->OSReserved0 - 1) & pr->ElementIndexMask))
+    while (currentNbl && pr->EndIndex != ((pr->OSReserved0 - 1) & pr->ElementIndexMask) &&
+        Budget.HasPackets() && Budget.HasBytes())
     {
         if (! currentNetBuffer)
         {
@@ -772,14 +811,53 @@ NxNblTranslator::TranslateNbls(
         }
 
         auto currentPacket = NetRingGetPacketAtIndex(pr, pr->EndIndex);
+        size_t packetBytes = NET_BUFFER_DATA_LENGTH(currentNetBuffer);
+
+        // Large sends the NIC cannot segment are split into several packets here
+        auto const segmented =
+            Segmenter.IsSegmenting() ||
+            Segmenter.ShouldSegment(*currentNbl, *currentNetBuffer);
+
+        // Checksums the NIC cannot compute are written to a copy of the headers, the
+        // NET_BUFFER is then bounced with the copy in front of its payload
+        auto checksumInfo =
+            *(NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO*)
+            &currentNbl->NetBufferListInfo[TcpIpChecksumNetBufferListInfo];
+
+        UCHAR checksumHeader[NX_CHECKSUM_MAXIMUM_HEADER_SIZE];
+        size_t checksumHeaderLength = 0;
 
-        switch (TranslateNetBufferToNetPacket(*currentNetBuffer, currentPacket))
+        if (m_checksumEngine && ! segmented)
+        {
+            m_checksumEngine->ChecksumNetBuffer(
+                m_mediaType,
+                *currentNetBuffer,
+                checksumInfo,
+                checksumHeader,
+                checksumHeaderLength);
+        }
+
+        auto const status =
+            segmented ?
+                TranslateNetBufferToSegment(*currentNbl, *currentNetBuffer, *currentPacket, BouncePool, Segmenter, packetBytes) :
+            checksumHeaderLength > 0 ?
+                NxNblTranslationStatus::BounceRequired :
+                TranslateNetBufferToNetPacket(*currentNetBuffer, currentPacket);
+
+        switch (status)
         {
         case NxNblTranslationStatus::BounceRequired:
+        {
             // The buffers in the NET_BUFFER's MDL chain cannot be transmitted as is. As such we need
-            // to bounce the packet
-
-            if(!BouncePool.BounceNetBuffer(*currentNetBuffer, *currentPacket))
+            // to bounce the parts of the packet the NIC cannot use
+            size_t bytesCopied;
+
+            if(!BouncePool.BounceNetBuffer(
+                *currentNetBuffer,
+                *currentPacket,
+                bytesCopied,
+                checksumHeaderLength > 0 ? checksumHeader : nullptr,
+                checksumHeaderLength))
             {
                 if (currentPacket->Ignore)
                 {
@@ -799,11 +877,17 @@ NxNblTranslator::TranslateNbls(
             }
 
             m_stats.Packet.BounceSuccess += 1;
+            m_stats.Packet.BounceBytes += bytesCopied;
             __fallthrough;
+        }
 
         case NxNblTranslationStatus::Success:
-            currentPacket->Layout = NxGetPacketLayout(m_mediaType, m_rings, currentPacket);
-            TranslateNetBufferListOOBDataToNetPacketExtensions(*currentNbl, currentPacket, pr->EndIndex);
+            if (! segmented)
+            {
+                currentPacket->Layout = NxGetPacketLayout(m_mediaType, m_rings, currentPacket);
+            }
+
+            TranslateNetBufferListOOBDataToNetPacketExtensions(*currentNbl, currentPacket, pr->EndIndex, segmented, checksumInfo);
             break;
 
         case NxNblTranslationStatus::InsufficientResources:
@@ -821,6 +905,16 @@ NxNblTranslator::TranslateNbls(
             break;
         }
 
+        Budget.Consume(1, packetBytes);
+
+        if (Segmenter.IsSegmenting())
+        {
+            // More segments of this NET_BUFFER to go, the NBL is bundled
+            // with the last one
+            pr->EndIndex = NetRingIncrementIndex(pr, pr->EndIndex);
+            continue;
+        }
+
         currentNetBuffer = currentNetBuffer->Next;
 
         if (! currentNetBuffer)
@@ -830,6 +924,7 @@ NxNblTranslator::TranslateNbls(
 
             auto &currentPacketExtension = m_contextBuffer.GetContext<PacketContext>(pr->EndIndex);
             currentPacketExtension.NetBufferListToComplete = currentNbl;
+            currentPacketExtension.SegmentedPayloadLength = segmented ? Segmenter.GetPayloadLength() : 0;
 
             // Now let's advance to the next NBL.
             currentNbl = currentNbl->Next;
@@ -841,14 +936,84 @@ NxNblTranslator::TranslateNbls(
     return endIndex != pr->EndIndex;
 }
 
+_Use_decl_annotations_
+NxNblTranslationStatus
+NxNblTranslator::TranslateNetBufferToSegment(
+    NET_BUFFER_LIST const &netBufferList,
+    NET_BUFFER &netBuffer,
+    NET_PACKET &netPacket,
+    NxBounceBufferPool &BouncePool,
+    NxTxSegmenter &Segmenter,
+    size_t &BytesCopied
+) const
+{
+    BytesCopied = 0;
+
+    auto status = NxTxSegmentStatus::Success;
+
+    if (! Segmenter.IsSegmenting())
+    {
+        status = Segmenter.Start(netBufferList, netBuffer);
+
+        if (status == NxTxSegmentStatus::Success)
+        {
+            m_stats.Packet.Segmented += 1;
+        }
+    }
+
+    if (status == NxTxSegmentStatus::Success)
+    {
+        status = Segmenter.BuildSegment(BouncePool, m_rings, netPacket, BytesCopied);
+    }
+
+    switch (status)
+    {
+    case NxTxSegmentStatus::Success:
+        m_stats.Packet.Segments += 1;
+        return NxNblTranslationStatus::Success;
+
+    case NxTxSegmentStatus::InsufficientResources:
+        // The segment is built again once bounce buffers are returned
+        m_stats.Packet.BounceFailure += 1;
+        return NxNblTranslationStatus::InsufficientResources;
+    }
+
+    // The rest of the NET_BUFFER is dropped
+    Segmenter.Reset();
+
+    return NxNblTranslationStatus::CannotTranslate;
+}
+
 _Use_decl_annotations_
 void
 NxNblTranslator::TranslateNetPacketExtensionsCompletionToNetBufferList(
     const NET_PACKET *netPacket,
+    ULONG segmentedPayloadLength,
     PNET_BUFFER_LIST netBufferList
 ) const
 {
-    if ((netPacket->Layout.Layer4Type == NET_PACKET_LAYER4_TYPE_TCP) &&
+    if (segmentedPayloadLength > 0)
+    {
+        // Segmented in software, the packet only describes the last segment
+        auto &lsoInfo =
+            *reinterpret_cast<NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO*>(
+                &netBufferList->NetBufferListInfo[TcpLargeSendNetBufferListInfo]);
+
+        auto const lsoType = lsoInfo.Transmit.Type;
+        lsoInfo.Value = 0;
+
+        switch (lsoType)
+        {
+        case NDIS_TCP_LARGE_SEND_OFFLOAD_V1_TYPE:
+            lsoInfo.LsoV1TransmitComplete.Type = lsoType;
+            lsoInfo.LsoV1TransmitComplete.TcpPayload = segmentedPayloadLength;
+            break;
+        case NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE:
+            lsoInfo.LsoV2TransmitComplete.Type = lsoType;
+            break;
+        }
+    }
+    else if ((netPacket->Layout.Layer4Type == NET_PACKET_LAYER4_TYPE_TCP) &&
         (IsPacketLargeSendSegmentationEnabled()))
     {
         // lso requires special markings upon completion.
@@ -900,7 +1065,8 @@ NxNblTranslator::TranslateNetPacketExtensionsCompletionToNetBufferList(
 _Use_decl_annotations_
 TxPacketCompletionStatus
 NxNblTranslator::CompletePackets(
-    NxBounceBufferPool &BouncePool
+    NxBounceBufferPool &BouncePool,
+    NxWorkBudget &Budget
 ) const
 {
     TxPacketCompletionStatus result;
@@ -908,7 +1074,7 @@ NxNblTranslator::CompletePackets(
     auto pr = NetRingCollectionGetPacketRing(m_rings);
     auto const osreserved0 = pr->OSReserved0;
 
-    for (; pr->OSReserved0 != pr->BeginIndex;
+    for (; pr->OSReserved0 != pr->BeginIndex && Budget.HasPackets();
         pr->OSReserved0 = NetRingIncrementIndex(pr, pr->OSReserved0))
     {
         auto packet = NetRingGetPacketAtIndex(pr, pr->OSReserved0);
@@ -932,12 +1098,17 @@ NxNblTranslator::CompletePackets(
 
             TranslateNetPacketExtensionsCompletionToNetBufferList(
                 packet,
+                extension.SegmentedPayloadLength,
                 completedNbl);
 
+            extension.SegmentedPayloadLength = 0;
+
             result.NumCompletedNbls += 1;
         }
 
         RtlZeroMemory(packet, pr->ElementStride);
+
+        Budget.Consume(1, 0);
     }
 
     result.CompletedPackets = osreserved0 != pr->OSReserved0;
@@ -7,6 +7,9 @@
 #include "NxDma.hpp"
 #include "NxScatterGatherList.hpp"
 #include "NxBounceBufferPool.hpp"
+#include "NxTxSegmentation.hpp"
+#include "NxChecksum.hpp"
+#include "NxWorkBudget.hpp"
 
 struct NxNblTranslationStats
 {
@@ -16,6 +19,10 @@ struct NxNblTranslationStats
         UINT64 BounceFailure = 0;
         UINT64 CannotTranslate = 0;
         UINT64 UnalignedBuffer = 0;
+        UINT64 BounceBytes = 0;
+        UINT64 Fragments = 0;
+        UINT64 Segmented = 0;
+        UINT64 Segments = 0;
     } Packet;
 
     struct
@@ -25,6 +32,7 @@ struct NxNblTranslationStats
         UINT64 CannotMapSglToFragments = 0;
         UINT64 PhysicalAddressTooLarge = 0;
         UINT64 OtherErrors = 0;
+        UINT64 CoalescedPages = 0;
     } DMA;
 };
 
@@ -78,15 +86,28 @@ class NONPAGED NxNblTranslator
     TranslateNetBufferListOOBDataToNetPacketExtensions(
         _In_ NET_BUFFER_LIST const &netBufferList,
         _Inout_ NET_PACKET* netPacket,
-        _In_ UINT32 packetIndex
+        _In_ UINT32 packetIndex,
+        _In_ bool segmented,
+        _In_ NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO const &checksumInfo
     ) const;
 
     void
     TranslateNetPacketExtensionsCompletionToNetBufferList(
         _In_ const NET_PACKET *netPacket,
+        _In_ ULONG segmentedPayloadLength,
         _Inout_ PNET_BUFFER_LIST netBufferList
     ) const;
 
+    NxNblTranslationStatus
+    TranslateNetBufferToSegment(
+        _In_ NET_BUFFER_LIST const &netBufferList,
+        _In_ NET_BUFFER &netBuffer,
+        _Inout_ NET_PACKET &netPacket,
+        _In_ NxBounceBufferPool &BouncePool,
+        _Inout_ NxTxSegmenter &Segmenter,
+        _Out_ size_t &BytesCopied
+    ) const;
+
     bool
     IsPacketChecksumEnabled() const;
 
@@ -113,6 +134,11 @@ class NONPAGED NxNblTranslator
         _In_ NET_FRAGMENT const & Fragment
     ) const;
 
+    bool
+    IsAboveMaximumLogicalAddress(
+        _In_ LOGICAL_ADDRESS LogicalAddress
+    ) const;
+
     MdlTranlationResult
     TranslateMdlChainToFragmentRangeKvmOnly(
         _In_ MDL &Mdl,
@@ -165,6 +191,10 @@ public:
     struct PAGED PacketContext
     {
         PNET_BUFFER_LIST NetBufferListToComplete = nullptr;
+
+        // TCP payload of a large send segmented in software, the packet
+        // only holds its last segment
+        ULONG SegmentedPayloadLength = 0;
     };
 
     NxNblTranslator(
@@ -186,15 +216,21 @@ public:
     TranslateNbls(
         _Inout_ NET_BUFFER_LIST *&currentNbl,
         _Inout_ NET_BUFFER *&currentNetBuffer,
-        _In_ NxBounceBufferPool &BouncePool
+        _In_ NxBounceBufferPool &BouncePool,
+        _Inout_ NxTxSegmenter &Segmenter,
+        _Inout_ NxWorkBudget &Budget
     ) const;
 
     TxPacketCompletionStatus
     CompletePackets(
-        _In_ NxBounceBufferPool &BouncePool
+        _In_ NxBounceBufferPool &BouncePool,
+        _Inout_ NxWorkBudget &Budget
     ) const;
 
     // packet extension offsets
     NET_EXTENSION m_netPacketChecksumExtension = {};
     NET_EXTENSION m_netPacketLsoExtension = {};
+
+    // checksums the NIC cannot compute, optional
+    NxChecksumEngine const * m_checksumEngine = nullptr;
 };
@@ -0,0 +1,150 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+#include "NxXlatPrecomp.hpp"
+#include "NxXlatCommon.hpp"
+#include "NxNotificationModeration.tmh"
+
+#include "NxExecutionContext.hpp"
+#include "NxNotificationModeration.hpp"
+
+// length of a rate measurement window, in microseconds
+#define NX_MODERATION_WINDOW 1000
+
+// weight of the latest window in the rate averages, as a power of two
+#define NX_MODERATION_AVERAGE_SHIFT 2
+
+struct NX_MODERATION_BAND
+{
+    // Upper bound of the band, in packets per second
+    ULONG64
+        PacketRate;
+
+    // in microseconds
+    ULONG
+        LingerTime;
+};
+
+//
+// Above a few thousand packets per second the next packets are only
+// microseconds away, waiting for them is cheaper than an interrupt per
+// handful of packets.
+//
+static NX_MODERATION_BAND const ModerationBands[] =
+{
+    {    10000,   0 },
+    {   100000,  20 },
+    {   500000,  50 },
+    { MAXULONG64, 100 },
+};
+
+static
+ULONG64
+UpdateRate(
+    _In_ ULONG64 Average,
+    _In_ ULONG64 Count,
+    _In_ ULONG64 ElapsedTicks,
+    _In_ ULONG64 Frequency
+)
+{
+    auto const rate = Count * Frequency / ElapsedTicks;
+
+    return Average + (rate >> NX_MODERATION_AVERAGE_SHIFT) - (Average >> NX_MODERATION_AVERAGE_SHIFT);
+}
+
+_Use_decl_annotations_
+void
+NxNotificationModerator::Initialize(
+    bool Enabled
+)
+{
+    m_enabled = Enabled;
+    m_windowStartTicks = NxExecutionContext::QueryPerformanceTicks(&m_frequency);
+    m_windowTicks = max(m_frequency * NX_MODERATION_WINDOW / 1000000, 1ULL);
+}
+
+_Use_decl_annotations_
+void
+NxNotificationModerator::Sample(
+    ULONG Packets
+)
+{
+    m_windowPackets += Packets;
+
+    auto const now = NxExecutionContext::QueryPerformanceTicks();
+    auto const elapsed = now - m_windowStartTicks;
+
+    if (elapsed < m_windowTicks)
+    {
+        return;
+    }
+
+    m_counters.PacketRate = UpdateRate(m_counters.PacketRate, m_windowPackets, elapsed, m_frequency);
+    m_counters.ArmRate = UpdateRate(m_counters.ArmRate, m_windowArmCount, elapsed, m_frequency);
+    m_counters.WakeRate = UpdateRate(m_counters.WakeRate, m_windowWakeCount, elapsed, m_frequency);
+
+    m_windowStartTicks = now;
+    m_windowPackets = 0;
+    m_windowArmCount = 0;
+    m_windowWakeCount = 0;
+
+    if (! m_enabled)
+    {
+        return;
+    }
+
+    for (auto const & band : ModerationBands)
+    {
+        if (m_counters.PacketRate <= band.PacketRate)
+        {
+            m_counters.LingerTime = band.LingerTime;
+            break;
+        }
+    }
+}
+
+_Use_decl_annotations_
+ULONG
+NxNotificationModerator::GetLingerTime(
+    void
+) const
+{
+    return m_counters.LingerTime;
+}
+
+_Use_decl_annotations_
+void
+NxNotificationModerator::OnArm(
+    void
+)
+{
+    m_counters.ArmCount++;
+    m_windowArmCount++;
+}
+
+_Use_decl_annotations_
+void
+NxNotificationModerator::OnWake(
+    void
+)
+{
+    m_counters.WakeCount++;
+    m_windowWakeCount++;
+}
+
+_Use_decl_annotations_
+void
+NxNotificationModerator::OnLinger(
+    void
+)
+{
+    m_counters.LingerCount++;
+}
+
+_Use_decl_annotations_
+NxNotificationModerationCounters
+NxNotificationModerator::GetCounters(
+    void
+) const
+{
+    return m_counters;
+}
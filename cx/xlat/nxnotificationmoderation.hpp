@@ -0,0 +1,103 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+/*++
+
+Abstract:
+
+    Moderates how often a queue arms the NIC side notification (RX
+    indication, TX completion) and so how often the NIC interrupts.
+
+    The packet rate of the queue is measured over short windows and
+    mapped to a rate band. Each band has a linger time: when an iteration
+    finds no work, the execution context spins that long for the NIC to
+    produce more before it arms the notification. A band of a low packet
+    rate has no linger time, the notification is armed right away to keep
+    the latency low.
+
+--*/
+
+#pragma once
+
+struct NxNotificationModerationCounters
+{
+    ULONG64 ArmCount = 0; // # of times the NIC notification was armed
+    ULONG64 WakeCount = 0; // # of times a halted EC was woken up
+    ULONG64 LingerCount = 0; // # of times the EC lingered instead of arming
+
+    // recent averages, per second
+    ULONG64 PacketRate = 0;
+    ULONG64 ArmRate = 0;
+    ULONG64 WakeRate = 0;
+
+    ULONG LingerTime = 0; // of the current rate band, in microseconds
+};
+
+class NxNotificationModerator
+{
+public:
+
+    void
+    Initialize(
+        _In_ bool Enabled
+    );
+
+    // called once per iteration with the packets the iteration handled
+    void
+    Sample(
+        _In_ ULONG Packets
+    );
+
+    // time to wait for work before arming the NIC notification, in
+    // microseconds, zero to arm it right away
+    ULONG
+    GetLingerTime(
+        void
+    ) const;
+
+    void
+    OnArm(
+        void
+    );
+
+    void
+    OnWake(
+        void
+    );
+
+    void
+    OnLinger(
+        void
+    );
+
+    // a snapshot of the counters, which keep changing while it is taken
+    NxNotificationModerationCounters
+    GetCounters(
+        void
+    ) const;
+
+private:
+
+    bool
+        m_enabled = false;
+
+    ULONG64
+        m_frequency = 0;
+
+    ULONG64
+        m_windowTicks = 0;
+
+    ULONG64
+        m_windowStartTicks = 0;
+
+    ULONG64
+        m_windowPackets = 0;
+
+    ULONG64
+        m_windowArmCount = 0;
+
+    ULONG64
+        m_windowWakeCount = 0;
+
+    NxNotificationModerationCounters
+        m_counters;
+};
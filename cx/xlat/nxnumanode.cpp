@@ -0,0 +1,74 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+#include "NxXlatPrecomp.hpp"
+#include "NxXlatCommon.hpp"
+#include "NxNumaNode.tmh"
+
+#include "NxNumaNode.hpp"
+
+_Use_decl_annotations_
+NODE_REQUIREMENT
+NxGetNodeFromGroupAffinity(
+    GROUP_AFFINITY const & Affinity
+)
+{
+    if (Affinity.Mask == 0)
+    {
+        return MM_ANY_NODE_OK;
+    }
+
+#ifdef _KERNEL_MODE
+    // isolate the lowest processor in the mask
+    auto const processorMask = Affinity.Mask & (~Affinity.Mask + 1);
+
+    for (USHORT node = 0; node <= KeQueryHighestNodeNumber(); node++)
+    {
+        GROUP_AFFINITY nodeAffinity;
+        KeQueryNodeActiveAffinity(node, &nodeAffinity, nullptr);
+
+        if (nodeAffinity.Group == Affinity.Group && (nodeAffinity.Mask & processorMask))
+        {
+            return node;
+        }
+    }
+#endif // _KERNEL_MODE
+
+    return MM_ANY_NODE_OK;
+}
+
+_Use_decl_annotations_
+NxNodeAllocationScope::NxNodeAllocationScope(
+    NODE_REQUIREMENT Node
+)
+{
+#ifdef _KERNEL_MODE
+    if (Node == MM_ANY_NODE_OK || Node > KeQueryHighestNodeNumber())
+    {
+        return;
+    }
+
+    GROUP_AFFINITY nodeAffinity;
+    KeQueryNodeActiveAffinity(static_cast<USHORT>(Node), &nodeAffinity, nullptr);
+
+    if (nodeAffinity.Mask != 0)
+    {
+        KeSetSystemGroupAffinityThread(&nodeAffinity, &m_previousAffinity);
+        m_affinitized = true;
+    }
+#else
+    UNREFERENCED_PARAMETER(Node);
+#endif // _KERNEL_MODE
+}
+
+_Use_decl_annotations_
+NxNodeAllocationScope::~NxNodeAllocationScope(
+    void
+)
+{
+#ifdef _KERNEL_MODE
+    if (m_affinitized)
+    {
+        KeRevertToUserGroupAffinityThread(&m_previousAffinity);
+    }
+#endif // _KERNEL_MODE
+}
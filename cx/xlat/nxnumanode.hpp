@@ -0,0 +1,55 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+/*++
+
+Abstract:
+
+    Helpers to place translator queue memory on the NUMA node of the
+    processors the queue is affinitized to.
+
+--*/
+
+#pragma once
+
+//
+// Returns the node of the lowest processor set in Affinity, or MM_ANY_NODE_OK
+// if the affinity is empty or the node cannot be determined.
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NODE_REQUIREMENT
+NxGetNodeFromGroupAffinity(
+    _In_ GROUP_AFFINITY const & Affinity
+);
+
+//
+// Pool allocations are satisfied from the node of the processor making the
+// request. While an instance of this class is in scope the current thread
+// only runs on processors of Node, so allocations that take no node
+// argument (NBLs, MDLs, ring contexts) land on that node too.
+//
+class NxNodeAllocationScope
+{
+
+public:
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    NxNodeAllocationScope(
+        _In_ NODE_REQUIREMENT Node
+    );
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    ~NxNodeAllocationScope(
+        void
+    );
+
+    NxNodeAllocationScope(NxNodeAllocationScope const &) = delete;
+    NxNodeAllocationScope & operator=(NxNodeAllocationScope const &) = delete;
+
+private:
+
+    bool
+        m_affinitized = false;
+
+    GROUP_AFFINITY
+        m_previousAffinity = {};
+};
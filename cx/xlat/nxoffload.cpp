@@ -9,6 +9,8 @@
 #include "NxOffload.hpp"
 
 #include "NxTranslationApp.hpp"
+#include "NxTxSegmentation.hpp"
+#include "NxXlatParameters.hpp"
 
 #ifdef _KERNEL_MODE
 #include <ntddndis.h>
@@ -70,11 +72,27 @@ NxTaskOffload::Initialize(
 
     m_dispatch.GetChecksumHardwareCapabilities(m_app.GetAdapter(), &checksumHardwareCapabilities);
     m_dispatch.GetChecksumDefaultCapabilities(m_app.GetAdapter(), &checksumDefaultCapabilities);
+    m_hardwareChecksumCapabilities = checksumHardwareCapabilities;
+
+    NxXlatParameters parameters;
+    NxXlatReadParameters(m_app.GetProperties().NdisAdapterHandle, &parameters);
+
+    m_softwareChecksum = parameters.SoftwareChecksum != 0;
+
+    if (m_softwareChecksum)
+    {
+        // NDIS is told about the union of the NIC and software capabilities
+        checksumHardwareCapabilities = AddSoftwareChecksumCapabilities(checksumHardwareCapabilities);
+        checksumDefaultCapabilities = AddSoftwareChecksumCapabilities(checksumDefaultCapabilities);
+    }
+
     m_activeChecksumCapabilities = checksumDefaultCapabilities;
 
+    auto const activeHardwareChecksumCapabilities = GetHardwareChecksumCapabilities(m_activeChecksumCapabilities);
+
     m_dispatch.SetChecksumActiveCapabilities(
         m_app.GetAdapter(),
-        &m_activeChecksumCapabilities);
+        &activeHardwareChecksumCapabilities);
 
     //
     // LSO hardware and default capabilities to indicate to NDIS
@@ -90,11 +108,24 @@ NxTaskOffload::Initialize(
 
     m_dispatch.GetLsoHardwareCapabilities(m_app.GetAdapter(), &lsoHardwareCapabilities);
     m_dispatch.GetLsoDefaultCapabilities(m_app.GetAdapter(), &lsoDefaultCapabilities);
+    m_hardwareLsoCapabilities = lsoHardwareCapabilities;
+
+    m_softwareSegmentation = parameters.SoftwareSegmentation != 0;
+
+    if (m_softwareSegmentation)
+    {
+        // NDIS is told about the union of the NIC and software capabilities
+        lsoHardwareCapabilities = AddSoftwareLsoCapabilities(lsoHardwareCapabilities);
+        lsoDefaultCapabilities = AddSoftwareLsoCapabilities(lsoDefaultCapabilities);
+    }
+
     m_activeLsoCapabilities = lsoDefaultCapabilities;
 
+    auto const activeHardwareLsoCapabilities = GetHardwareLsoCapabilities(m_activeLsoCapabilities);
+
     m_dispatch.SetLsoActiveCapabilities(
         m_app.GetAdapter(),
-        &m_activeLsoCapabilities);
+        &activeHardwareLsoCapabilities);
 
     //
     // Construct the NDIS_OFFLOAD structure encapsulating all offloads
@@ -405,6 +436,103 @@ NxTaskOffload::TranslateLsoCapabilities(
     }
 }
 
+_Use_decl_annotations_
+NET_CLIENT_OFFLOAD_LSO_CAPABILITIES
+NxTaskOffload::AddSoftwareLsoCapabilities(
+    NET_CLIENT_OFFLOAD_LSO_CAPABILITIES const &Capabilities
+) const
+{
+    NET_CLIENT_OFFLOAD_LSO_CAPABILITIES capabilities = Capabilities;
+
+    // An IP version the NIC supports keeps whatever state it was configured
+    // with, the others are always segmented in software
+    capabilities.IPv4 = Capabilities.IPv4 || ! m_hardwareLsoCapabilities.IPv4;
+    capabilities.IPv6 = Capabilities.IPv6 || ! m_hardwareLsoCapabilities.IPv6;
+
+    if (capabilities.IPv4 || capabilities.IPv6)
+    {
+        capabilities.MaximumOffloadSize = max(
+            Capabilities.MaximumOffloadSize,
+            NX_TX_SEGMENTATION_MAXIMUM_OFFLOAD_SIZE);
+
+        if (capabilities.MinimumSegmentCount == 0)
+        {
+            capabilities.MinimumSegmentCount = NX_TX_SEGMENTATION_MINIMUM_SEGMENT_COUNT;
+        }
+    }
+
+    return capabilities;
+}
+
+_Use_decl_annotations_
+NET_CLIENT_OFFLOAD_LSO_CAPABILITIES
+NxTaskOffload::GetHardwareLsoCapabilities(
+    NET_CLIENT_OFFLOAD_LSO_CAPABILITIES const &Capabilities
+) const
+{
+    if (! m_softwareSegmentation)
+    {
+        return Capabilities;
+    }
+
+    NET_CLIENT_OFFLOAD_LSO_CAPABILITIES capabilities = Capabilities;
+
+    capabilities.IPv4 = Capabilities.IPv4 && m_hardwareLsoCapabilities.IPv4;
+    capabilities.IPv6 = Capabilities.IPv6 && m_hardwareLsoCapabilities.IPv6;
+
+    if (capabilities.IPv4 || capabilities.IPv6)
+    {
+        capabilities.MaximumOffloadSize = min(
+            Capabilities.MaximumOffloadSize,
+            m_hardwareLsoCapabilities.MaximumOffloadSize);
+        capabilities.MinimumSegmentCount = m_hardwareLsoCapabilities.MinimumSegmentCount;
+    }
+    else
+    {
+        capabilities.MaximumOffloadSize = 0;
+        capabilities.MinimumSegmentCount = 0;
+    }
+
+    return capabilities;
+}
+
+_Use_decl_annotations_
+NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES
+NxTaskOffload::AddSoftwareChecksumCapabilities(
+    NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES const &Capabilities
+) const
+{
+    NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES capabilities = Capabilities;
+
+    // A checksum the NIC supports keeps whatever state it was configured
+    // with, the others are always computed in software
+    capabilities.IPv4 = Capabilities.IPv4 || ! m_hardwareChecksumCapabilities.IPv4;
+    capabilities.Tcp = Capabilities.Tcp || ! m_hardwareChecksumCapabilities.Tcp;
+    capabilities.Udp = Capabilities.Udp || ! m_hardwareChecksumCapabilities.Udp;
+
+    return capabilities;
+}
+
+_Use_decl_annotations_
+NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES
+NxTaskOffload::GetHardwareChecksumCapabilities(
+    NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES const &Capabilities
+) const
+{
+    if (! m_softwareChecksum)
+    {
+        return Capabilities;
+    }
+
+    NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES capabilities = Capabilities;
+
+    capabilities.IPv4 = Capabilities.IPv4 && m_hardwareChecksumCapabilities.IPv4;
+    capabilities.Tcp = Capabilities.Tcp && m_hardwareChecksumCapabilities.Tcp;
+    capabilities.Udp = Capabilities.Udp && m_hardwareChecksumCapabilities.Udp;
+
+    return capabilities;
+}
+
 _Use_decl_annotations_
 NTSTATUS
 NxTaskOffload::SetActiveCapabilities(
@@ -412,15 +540,19 @@ NxTaskOffload::SetActiveCapabilities(
     NET_CLIENT_OFFLOAD_LSO_CAPABILITIES const & LsoCapabilities
 )
 {
+    auto const hardwareChecksumCapabilities = GetHardwareChecksumCapabilities(ChecksumCapabilities);
+
     m_dispatch.SetChecksumActiveCapabilities(
         m_app.GetAdapter(),
-        &ChecksumCapabilities);
+        &hardwareChecksumCapabilities);
 
     m_activeChecksumCapabilities = ChecksumCapabilities;
 
+    auto const hardwareLsoCapabilities = GetHardwareLsoCapabilities(LsoCapabilities);
+
     m_dispatch.SetLsoActiveCapabilities(
         m_app.GetAdapter(),
-        &LsoCapabilities);
+        &hardwareLsoCapabilities);
 
     m_activeLsoCapabilities = LsoCapabilities;
 
@@ -547,6 +679,11 @@ NxTaskOffload::IsChecksumOffloadSupported(
     void
 )
 {
+    if (m_softwareChecksum)
+    {
+        return true;
+    }
+
     NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES checksumHardwareCapabilities = {};
     m_dispatch.GetChecksumHardwareCapabilities(m_app.GetAdapter(), &checksumHardwareCapabilities);
 
@@ -566,6 +703,11 @@ NxTaskOffload::IsLsoOffloadSupported(
     void
 )
 {
+    if (m_softwareSegmentation)
+    {
+        return true;
+    }
+
     NET_CLIENT_OFFLOAD_LSO_CAPABILITIES lsoHardwareCapabilities = {};
     m_dispatch.GetLsoHardwareCapabilities(m_app.GetAdapter(), &lsoHardwareCapabilities);
 
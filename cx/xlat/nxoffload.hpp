@@ -50,6 +50,22 @@ private:
     NET_CLIENT_OFFLOAD_LSO_CAPABILITIES
         m_activeLsoCapabilities = {};
 
+    NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES
+        m_hardwareChecksumCapabilities = {};
+
+    NET_CLIENT_OFFLOAD_LSO_CAPABILITIES
+        m_hardwareLsoCapabilities = {};
+
+    // checksums the NIC cannot compute or validate are handled by the
+    // queues, see NxChecksumEngine
+    bool
+        m_softwareChecksum = false;
+
+    // large sends the NIC cannot segment are segmented by the Tx queues,
+    // see NxTxSegmenter
+    bool
+        m_softwareSegmentation = false;
+
     //
     // Methods to translate the offload capabilities between different 
     // NDIS and NetAdapter representations
@@ -81,6 +97,35 @@ private:
         _Out_ NDIS_TCP_LARGE_SEND_OFFLOAD_V2 &NdisLsoV2Capabilities
     ) const;
 
+    //
+    // Methods to split the checksum and LSO capabilities between the NIC
+    // and software
+    //
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES
+    AddSoftwareChecksumCapabilities(
+        _In_ NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES const &Capabilities
+    ) const;
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES
+    GetHardwareChecksumCapabilities(
+        _In_ NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES const &Capabilities
+    ) const;
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    NET_CLIENT_OFFLOAD_LSO_CAPABILITIES
+    AddSoftwareLsoCapabilities(
+        _In_ NET_CLIENT_OFFLOAD_LSO_CAPABILITIES const &Capabilities
+    ) const;
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    NET_CLIENT_OFFLOAD_LSO_CAPABILITIES
+    GetHardwareLsoCapabilities(
+        _In_ NET_CLIENT_OFFLOAD_LSO_CAPABILITIES const &Capabilities
+    ) const;
+
     //
     // Methods which are compiled in kernel mode only
     //
@@ -8,6 +8,40 @@
 #define IP_VERSION_4 4
 #define IP_VERSION_6 6
 
+//
+// Steps over the 802.1Q and 802.1ad tags following the Ethernet header.
+// buffer points past the Ethernet header, whose type is the protocol
+// identifier of the first tag.
+//
+static
+void
+ParseVlanTags(
+    _Outref_result_bytebuffer_(bytesRemaining) UCHAR const *&buffer,
+    _Inout_ ULONG &bytesRemaining,
+    _Inout_ USHORT &ethertype,
+    _Out_ NxEthernetTags &tags)
+{
+    tags = {};
+
+    while (tags.Count < NX_MAXIMUM_VLAN_TAGS &&
+        (ethertype == NX_ETHERNET_TYPE_8021Q || ethertype == NX_ETHERNET_TYPE_8021AD) &&
+        bytesRemaining >= NX_VLAN_TAG_SIZE)
+    {
+        auto const control = RtlUshortByteSwap(*(USHORT UNALIGNED const*)buffer);
+
+        if (tags.Count == 0)
+        {
+            tags.OuterProtocol = ethertype;
+            tags.OuterControl = control;
+        }
+
+        ethertype = RtlUshortByteSwap(*(USHORT UNALIGNED const*)(buffer + sizeof(USHORT)));
+        buffer += NX_VLAN_TAG_SIZE;
+        bytesRemaining -= NX_VLAN_TAG_SIZE;
+        tags.Count++;
+    }
+}
+
 _Success_(return)
 bool
 NxGetPacketEtherType(
@@ -28,7 +62,14 @@ NxGetPacketEtherType(
 
     if (*ethertype >= ETHERNET_TYPE_MINIMUM)
     {
-        return true;
+        // the type of a tagged frame is the one behind its tags
+        buffer += sizeof(ETHERNET_HEADER);
+        bytesRemaining -= sizeof(ETHERNET_HEADER);
+
+        NxEthernetTags tags;
+        ParseVlanTags(buffer, bytesRemaining, *ethertype, tags);
+
+        return *ethertype != NX_ETHERNET_TYPE_8021Q && *ethertype != NX_ETHERNET_TYPE_8021AD;
     }
     else if (bytesRemaining >= sizeof(SNAP_HEADER))
     {
@@ -53,13 +94,18 @@ void
 ParseEthernetHeader(
     _Outref_result_bytebuffer_(bytesRemaining) UCHAR const *&buffer,
     _Inout_ ULONG &bytesRemaining,
-    _Out_ NET_PACKET_LAYOUT &layout)
+    _Out_ NET_PACKET_LAYOUT &layout,
+    _Out_ USHORT &ethertype,
+    _Out_ NxEthernetTags &tags)
 {
+    ethertype = 0;
+    tags = {};
+
     if (bytesRemaining < sizeof(ETHERNET_HEADER))
         return;
 
     auto ethernet = (ETHERNET_HEADER UNALIGNED const*)buffer;
-    auto ethertype = RtlUshortByteSwap(ethernet->Type);
+    ethertype = RtlUshortByteSwap(ethernet->Type);
 
     if (ethertype >= ETHERNET_TYPE_MINIMUM)
     {
@@ -67,6 +113,9 @@ ParseEthernetHeader(
         layout.Layer2HeaderLength = sizeof(ETHERNET_HEADER);
         buffer += sizeof(ETHERNET_HEADER);
         bytesRemaining -= sizeof(ETHERNET_HEADER);
+
+        ParseVlanTags(buffer, bytesRemaining, ethertype, tags);
+        layout.Layer2HeaderLength += tags.Count * NX_VLAN_TAG_SIZE;
     }
     else if (bytesRemaining >= sizeof(ETHERNET_HEADER) + sizeof(SNAP_HEADER))
     {
@@ -88,12 +137,14 @@ ParseEthernetHeader(
         else
         {
             layout.Layer2Type = NET_PACKET_LAYER2_TYPE_UNSPECIFIED;
+            ethertype = 0;
             return;
         }
     }
     else
     {
         layout.Layer2Type = NET_PACKET_LAYER2_TYPE_UNSPECIFIED;
+        ethertype = 0;
         return;
     }
 
@@ -347,25 +398,23 @@ ParseUdpHeader(
     bytesRemaining -= UDP_HEADER_SIZE;
 }
 
+static
 NET_PACKET_LAYOUT
-NxGetPacketLayout(
+ParseBuffer(
     _In_ NDIS_MEDIUM mediaType,
-    _In_ NET_RING_COLLECTION const * descriptor,
-    _In_ NET_PACKET const *packet)
+    _In_reads_bytes_(bytesRemaining) UCHAR const *buffer,
+    _In_ ULONG bytesRemaining,
+    _Out_ USHORT &ethertype,
+    _Out_ NxEthernetTags &tags)
 {
-    NT_ASSERT(packet->FragmentCount != 0);
-
-    auto fr = NetRingCollectionGetFragmentRing(descriptor);
-    auto fragment = NetRingGetFragmentAtIndex(fr, packet->FragmentIndex);
-    auto buffer = (UCHAR const*)fragment->VirtualAddress + fragment->Offset;
-    auto bytesRemaining = (ULONG)fragment->ValidLength;
-
     NET_PACKET_LAYOUT layout = { };
+    ethertype = 0;
+    tags = {};
 
     switch (mediaType)
     {
     case NdisMedium802_3:
-        ParseEthernetHeader(buffer, bytesRemaining, layout);
+        ParseEthernetHeader(buffer, bytesRemaining, layout, ethertype, tags);
         break;
     case NdisMediumIP:
     case NdisMediumWiMAX:
@@ -396,3 +445,106 @@ NxGetPacketLayout(
 
     return layout;
 }
+
+static
+NET_PACKET_LAYOUT
+ParsePacket(
+    _In_ NDIS_MEDIUM mediaType,
+    _In_ NET_RING_COLLECTION const * descriptor,
+    _In_ NET_PACKET const *packet,
+    _Out_ USHORT &ethertype,
+    _Out_ NxEthernetTags &tags)
+{
+    NT_ASSERT(packet->FragmentCount != 0);
+
+    auto fr = NetRingCollectionGetFragmentRing(descriptor);
+    auto fragment = NetRingGetFragmentAtIndex(fr, packet->FragmentIndex);
+
+    return ParseBuffer(
+        mediaType,
+        (UCHAR const*)fragment->VirtualAddress + fragment->Offset,
+        (ULONG)fragment->ValidLength,
+        ethertype,
+        tags);
+}
+
+NET_PACKET_LAYOUT
+NxGetPacketLayout(
+    _In_ NDIS_MEDIUM mediaType,
+    _In_ NET_RING_COLLECTION const * descriptor,
+    _In_ NET_PACKET const *packet)
+{
+    USHORT ethertype;
+    NxEthernetTags tags;
+    return ParsePacket(mediaType, descriptor, packet, ethertype, tags);
+}
+
+NET_PACKET_LAYOUT
+NxGetBufferLayout(
+    _In_ NDIS_MEDIUM mediaType,
+    _In_reads_bytes_(length) UCHAR const *buffer,
+    _In_ ULONG length)
+{
+    USHORT ethertype;
+    NxEthernetTags tags;
+    return ParseBuffer(mediaType, buffer, length, ethertype, tags);
+}
+
+NxRxPacketInfo
+NxParseRxPacket(
+    _In_ NDIS_MEDIUM mediaType,
+    _In_ NET_RING_COLLECTION const * descriptor,
+    _In_ NET_PACKET const *packet)
+{
+    NxRxPacketInfo info = { };
+
+    USHORT ethertype;
+    NxEthernetTags tags;
+    info.Layout = ParsePacket(mediaType, descriptor, packet, ethertype, tags);
+
+    //
+    // A lone 802.1Q tag is moved to the NBL by the receive path. NDIS has
+    // no place for a service tag, frames carrying one keep their tags and
+    // are described by the outermost tag protocol.
+    //
+    if (tags.Count == 1 && tags.OuterProtocol == NX_ETHERNET_TYPE_8021Q)
+    {
+        info.HasIeee8021Q = true;
+        info.Ieee8021Q.TagHeader.UserPriority = tags.OuterControl >> 13;
+        info.Ieee8021Q.TagHeader.CanonicalFormatId = (tags.OuterControl >> 12) & 1;
+        info.Ieee8021Q.TagHeader.VlanId = tags.OuterControl & 0xfff;
+    }
+    else if (tags.Count != 0)
+    {
+        info.FrameType = RtlUshortByteSwap(tags.OuterProtocol);
+        return info;
+    }
+
+    switch (info.Layout.Layer3Type)
+    {
+    case NET_PACKET_LAYER3_TYPE_IPV4_UNSPECIFIED_OPTIONS:
+    case NET_PACKET_LAYER3_TYPE_IPV4_WITH_OPTIONS:
+    case NET_PACKET_LAYER3_TYPE_IPV4_NO_OPTIONS:
+        info.FrameType = RtlUshortByteSwap(ETHERNET_TYPE_IPV4);
+        info.NblFlags = NDIS_NBL_FLAGS_IS_IPV4;
+        break;
+
+    case NET_PACKET_LAYER3_TYPE_IPV6_UNSPECIFIED_EXTENSIONS:
+    case NET_PACKET_LAYER3_TYPE_IPV6_WITH_EXTENSIONS:
+    case NET_PACKET_LAYER3_TYPE_IPV6_NO_EXTENSIONS:
+        info.FrameType = RtlUshortByteSwap(ETHERNET_TYPE_IPV6);
+        info.NblFlags = NDIS_NBL_FLAGS_IS_IPV6;
+        break;
+
+    default:
+        // Not IP, report whatever the Ethernet header carried. The ethertype
+        // is only known for Ethernet frames.
+        if (info.Layout.Layer2Type == NET_PACKET_LAYER2_TYPE_ETHERNET)
+        {
+            info.FrameType = RtlUshortByteSwap(ethertype);
+        }
+        break;
+    }
+
+    return info;
+}
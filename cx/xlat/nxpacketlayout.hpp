@@ -2,6 +2,31 @@
 
 #pragma once
 
+// 802.1Q customer and 802.1ad service tag protocol identifiers
+#define NX_ETHERNET_TYPE_8021Q 0x8100
+#define NX_ETHERNET_TYPE_8021AD 0x88a8
+
+// a tag is its protocol identifier and the tag control information
+#define NX_VLAN_TAG_SIZE 4
+
+// tags walked before a frame is left unparsed, enough for QinQ
+#define NX_MAXIMUM_VLAN_TAGS 2
+
+struct NxEthernetTags
+{
+    // tags between the source address and the ethertype
+    UCHAR
+        Count;
+
+    // protocol identifier and tag control information of the outermost
+    // tag, in host byte order
+    USHORT
+        OuterProtocol;
+
+    USHORT
+        OuterControl;
+};
+
 _Success_(return)
 bool
 NxGetPacketEtherType(
@@ -14,3 +39,47 @@ NxGetPacketLayout(
     _In_ NDIS_MEDIUM mediaType,
     _In_ NET_RING_COLLECTION const *descriptor,
     _In_ NET_PACKET const *packet);
+
+//
+// Same as NxGetPacketLayout, for headers held in a contiguous buffer such
+// as a copy of the start of a NET_BUFFER.
+//
+NET_PACKET_LAYOUT
+NxGetBufferLayout(
+    _In_ NDIS_MEDIUM mediaType,
+    _In_reads_bytes_(length) UCHAR const *buffer,
+    _In_ ULONG length);
+
+struct NxRxPacketInfo
+{
+    NET_PACKET_LAYOUT
+        Layout;
+
+    // NetBufferListFrameType value, in network byte order. Zero if unknown.
+    USHORT
+        FrameType;
+
+    // NDIS_NBL_FLAGS_IS_* flags describing the packet
+    ULONG
+        NblFlags;
+
+    // the frame carries a lone 802.1Q tag, to be removed from the frame
+    // and reported in Ieee8021QNetBufferListInfo. The layout still
+    // includes the tag.
+    bool
+        HasIeee8021Q;
+
+    NDIS_NET_BUFFER_LIST_8021Q_INFO
+        Ieee8021Q;
+};
+
+//
+// Walks the headers in the first fragment of a received packet once and
+// returns everything the receive path needs to describe it to NDIS. The
+// layout sees through up to two VLAN tags.
+//
+NxRxPacketInfo
+NxParseRxPacket(
+    _In_ NDIS_MEDIUM mediaType,
+    _In_ NET_RING_COLLECTION const *descriptor,
+    _In_ NET_PACKET const *packet);
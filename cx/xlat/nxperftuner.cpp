@@ -0,0 +1,204 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+#include "NxXlatPrecomp.hpp"
+#include "NxXlatCommon.hpp"
+#include "NxPerfTuner.tmh"
+
+#include "NxPerfTuner.hpp"
+
+struct NX_PERF_RING_SIZING_ENTRY
+{
+    // Upper bound of the row, in bits per second
+    ULONG64
+        LinkSpeed;
+
+    UINT32
+        PacketRingElementCount;
+};
+
+//
+// Packet ring size by link speed. A row covers roughly a millisecond of line
+// rate traffic in standard sized frames, rounded to a power of two.
+//
+static NX_PERF_RING_SIZING_ENTRY const RingSizingTable[] =
+{
+    {      100000000ULL,   64 },
+    {     1000000000ULL,  256 },
+    {    10000000000ULL, 1024 },
+    {    40000000000ULL, 4096 },
+    { MAXULONG64,        NX_PERF_MAXIMUM_RING_SIZE },
+};
+
+// used when the NIC does not report its link speed
+#define NX_PERF_DEFAULT_RING_SIZE 1024
+
+// receive buffer memory a single queue may allocate before its rings are shrunk
+#define NX_PERF_RX_BUFFER_MEMORY_BUDGET (32 * 1024 * 1024)
+
+// upper bound of the fragments a packet is expected to use on average
+#define NX_PERF_MAXIMUM_FRAGMENTS_PER_PACKET 8
+
+#define NX_PERF_MAXIMUM_FRAGMENT_RING_SIZE (NX_PERF_MAXIMUM_RING_SIZE * NX_PERF_MAXIMUM_FRAGMENTS_PER_PACKET)
+
+// samples required before a resize is recommended
+#define NX_PERF_MINIMUM_OCCUPANCY_SAMPLES 4096
+
+static
+UINT32
+RoundUpToPowerOfTwo(
+    _In_ SIZE_T Value
+)
+{
+    UINT32 result = 1;
+
+    while (result < Value && result < NX_PERF_MAXIMUM_FRAGMENT_RING_SIZE)
+    {
+        result <<= 1;
+    }
+
+    return result;
+}
+
+static
+UINT32
+ClampRingSize(
+    _In_ SIZE_T Value
+)
+{
+    return RoundUpToPowerOfTwo(
+        min(max(Value, NX_PERF_MINIMUM_RING_SIZE), NX_PERF_MAXIMUM_RING_SIZE));
+}
+
+static
+UINT32
+GetPacketRingElementCount(
+    _In_ ULONG64 NominalLinkSpeed,
+    _In_ UINT32 PacketRingNumberOfElementsHint
+)
+{
+    if (PacketRingNumberOfElementsHint != 0)
+    {
+        return ClampRingSize(PacketRingNumberOfElementsHint);
+    }
+
+    if (NominalLinkSpeed == 0)
+    {
+        return NX_PERF_DEFAULT_RING_SIZE;
+    }
+
+    for (auto const & entry : RingSizingTable)
+    {
+        if (NominalLinkSpeed <= entry.LinkSpeed)
+        {
+            return entry.PacketRingElementCount;
+        }
+    }
+
+    return NX_PERF_MAXIMUM_RING_SIZE;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+NxPerfTunerInitialize(
+    void
+)
+{
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+void
+NxPerfTunerCleanup(
+    void
+)
+{
+}
+
+_Use_decl_annotations_
+void
+NxPerfTunerCalculateRxParameters(
+    NX_PERF_RX_NIC_CHARACTERISTICS const * Characteristics,
+    NX_PERF_RX_TUNING_PARAMETERS * Parameters
+)
+{
+    auto const fragmentSize = max(Characteristics->MaximumFragmentBufferSize, static_cast<SIZE_T>(1));
+
+    // a frame larger than a fragment buffer (RSC) spans several fragments
+    auto const fragmentsPerPacket = min(
+        max((Characteristics->MaxPacketSizeWithRsc + fragmentSize - 1) / fragmentSize, static_cast<SIZE_T>(1)),
+        static_cast<SIZE_T>(NX_PERF_MAXIMUM_FRAGMENTS_PER_PACKET));
+
+    auto packetCount = GetPacketRingElementCount(
+        Characteristics->NominalLinkSpeed,
+        Characteristics->PacketRingNumberOfElementsHint);
+
+    auto fragmentCount = RoundUpToPowerOfTwo(
+        max(packetCount * fragmentsPerPacket, Characteristics->FragmentRingNumberOfElementsHint));
+
+    //
+    // every fragment in the ring has a buffer and as many are held by the
+    // stack while the packets they belong to are indicated. keep jumbo
+    // frames from blowing the budget by shrinking the rings instead.
+    //
+    while (packetCount > NX_PERF_MINIMUM_RING_SIZE &&
+        static_cast<ULONG64>(fragmentCount) * 2 * fragmentSize > NX_PERF_RX_BUFFER_MEMORY_BUDGET)
+    {
+        packetCount /= 2;
+        fragmentCount /= 2;
+    }
+
+    Parameters->PacketRingElementCount = packetCount;
+    Parameters->FragmentRingElementCount = fragmentCount;
+    Parameters->NumberOfNbls = packetCount * 2;
+    Parameters->NumberOfBuffers = fragmentCount * 2;
+}
+
+_Use_decl_annotations_
+void
+NxPerfTunerCalculateTxParameters(
+    NX_PERF_TX_NIC_CHARACTERISTICS const * Characteristics,
+    NX_PERF_TX_TUNING_PARAMETERS * Parameters
+)
+{
+    // a packet is described by at least one fragment per page it spans
+    auto const fragmentsPerPacket = min(
+        (max(Characteristics->MaxPacketSizeWithLso, static_cast<SIZE_T>(1)) + PAGE_SIZE - 1) / PAGE_SIZE + 1,
+        static_cast<SIZE_T>(NX_PERF_MAXIMUM_FRAGMENTS_PER_PACKET));
+
+    auto const packetCount = GetPacketRingElementCount(
+        Characteristics->NominalLinkSpeed,
+        Characteristics->PacketRingNumberOfElementsHint);
+
+    Parameters->PacketRingElementCount = packetCount;
+    Parameters->FragmentRingElementCount = RoundUpToPowerOfTwo(
+        max(packetCount * fragmentsPerPacket, Characteristics->FragmentRingNumberOfElementsHint));
+
+    // enough to bounce every packet in the ring
+    Parameters->NumberOfBounceBuffers = packetCount;
+}
+
+_Use_decl_annotations_
+UINT32
+NxPerfTunerRecommendPacketRingSize(
+    NX_PERF_RING_OCCUPANCY const & Occupancy
+)
+{
+    if (Occupancy.ElementCount == 0 || Occupancy.Samples < NX_PERF_MINIMUM_OCCUPANCY_SAMPLES)
+    {
+        return 0;
+    }
+
+    // the ring was full in more than 1 in 64 samples, grow it
+    if (Occupancy.FullSamples * 64 > Occupancy.Samples)
+    {
+        return ClampRingSize(static_cast<SIZE_T>(Occupancy.ElementCount) * 2);
+    }
+
+    // never more than a quarter of the ring was in use, shrink it
+    if (Occupancy.PeakOccupancy * 4 < Occupancy.ElementCount)
+    {
+        return ClampRingSize(Occupancy.ElementCount / 2);
+    }
+
+    return Occupancy.ElementCount;
+}
@@ -0,0 +1,179 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+/*++
+
+Abstract:
+
+    Sizes the rings and pools of a translator queue from the link speed
+    and frame size of the NIC, and recommends a different packet ring size
+    for the next datapath restart from the ring occupancy observed while
+    the datapath was running.
+
+--*/
+
+#pragma once
+
+#define NX_PERF_MINIMUM_RING_SIZE 64
+#define NX_PERF_MAXIMUM_RING_SIZE 8192
+
+struct NX_PERF_NIC_CHARACTERISTICS
+{
+    bool
+        IsDriverVerifierEnabled;
+
+    NDIS_MEDIUM
+        MediaType;
+};
+
+struct NX_PERF_RX_NIC_CHARACTERISTICS
+{
+    NX_PERF_NIC_CHARACTERISTICS
+        Nic;
+
+    // Fragment ring size preferred by the NIC, zero if it has no preference
+    SIZE_T
+        FragmentRingNumberOfElementsHint;
+
+    SIZE_T
+        MaximumFragmentBufferSize;
+
+    // In bits per second, zero if unknown
+    ULONG64
+        NominalLinkSpeed;
+
+    SIZE_T
+        MaxPacketSizeWithRsc;
+
+    // Packet ring size recommended by NxPerfTunerRecommendPacketRingSize
+    // during a previous run of the datapath, zero if none
+    UINT32
+        PacketRingNumberOfElementsHint;
+};
+
+struct NX_PERF_RX_TUNING_PARAMETERS
+{
+    UINT32
+        PacketRingElementCount;
+
+    UINT32
+        FragmentRingElementCount;
+
+    UINT32
+        NumberOfNbls;
+
+    UINT32
+        NumberOfBuffers;
+};
+
+struct NX_PERF_TX_NIC_CHARACTERISTICS
+{
+    NX_PERF_NIC_CHARACTERISTICS
+        Nic;
+
+    // Fragment ring size preferred by the NIC, zero if it has no preference
+    SIZE_T
+        FragmentRingNumberOfElementsHint;
+
+    SIZE_T
+        MaximumFragmentBufferSize;
+
+    // In bits per second, zero if unknown
+    ULONG64
+        NominalLinkSpeed;
+
+    SIZE_T
+        MaxPacketSizeWithLso;
+
+    // Packet ring size recommended by NxPerfTunerRecommendPacketRingSize
+    // during a previous run of the datapath, zero if none
+    UINT32
+        PacketRingNumberOfElementsHint;
+};
+
+struct NX_PERF_TX_TUNING_PARAMETERS
+{
+    UINT32
+        PacketRingElementCount;
+
+    UINT32
+        FragmentRingElementCount;
+
+    UINT32
+        NumberOfBounceBuffers;
+};
+
+//
+// Ring occupancy observed by a queue, sampled once per execution context
+// iteration that moved packets. On receive the occupancy is the number of
+// packets the NIC completed since the previous iteration, on transmit the
+// number of packets in the ring, not yet completed to NDIS, after new ones
+// were posted.
+//
+struct NX_PERF_RING_OCCUPANCY
+{
+    UINT32
+        ElementCount;
+
+    UINT32
+        PeakOccupancy;
+
+    ULONG64
+        Samples;
+
+    // Samples in which the whole ring was occupied
+    ULONG64
+        FullSamples;
+};
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+NxPerfTunerInitialize(
+    void
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+void
+NxPerfTunerCleanup(
+    void
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void
+NxPerfTunerCalculateRxParameters(
+    _In_ NX_PERF_RX_NIC_CHARACTERISTICS const * Characteristics,
+    _Out_ NX_PERF_RX_TUNING_PARAMETERS * Parameters
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void
+NxPerfTunerCalculateTxParameters(
+    _In_ NX_PERF_TX_NIC_CHARACTERISTICS const * Characteristics,
+    _Out_ NX_PERF_TX_TUNING_PARAMETERS * Parameters
+);
+
+inline
+void
+NxPerfTunerSampleRingOccupancy(
+    _Inout_ NX_PERF_RING_OCCUPANCY & Occupancy,
+    _In_ UINT32 OccupiedElements
+)
+{
+    Occupancy.Samples++;
+    Occupancy.PeakOccupancy = max(Occupancy.PeakOccupancy, OccupiedElements);
+
+    // a ring can hold one element less than its size
+    if (OccupiedElements + 1 >= Occupancy.ElementCount)
+    {
+        Occupancy.FullSamples++;
+    }
+}
+
+//
+// Returns the packet ring size to use the next time the datapath is
+// created, or zero if too few samples were taken to tell.
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT32
+NxPerfTunerRecommendPacketRingSize(
+    _In_ NX_PERF_RING_OCCUPANCY const & Occupancy
+);
@@ -0,0 +1,230 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+#include "NxXlatPrecomp.hpp"
+#include "NxXlatCommon.hpp"
+#include "NxPollScheduler.tmh"
+
+#include "NxPollScheduler.hpp"
+
+static EC_START_ROUTINE NxPollWorkerThread;
+
+static
+EC_RETURN
+NxPollWorkerThread(
+    PVOID StartContext
+)
+{
+    reinterpret_cast<NxPollWorker *>(StartContext)->WorkerThread();
+    return EC_RETURN();
+}
+
+static
+ULONG
+GetProcessorCount(
+    void
+)
+{
+#if _KERNEL_MODE
+    return KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+#else
+    return GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+#endif
+}
+
+_Use_decl_annotations_
+NxPollWorker::~NxPollWorker(
+    void
+)
+{
+    if (m_started)
+    {
+        m_executionContext.Cancel();
+        m_executionContext.Stop();
+    }
+
+    m_executionContext.Terminate();
+}
+
+_Use_decl_annotations_
+NTSTATUS
+NxPollWorker::Initialize(
+    ULONG ProcessorIndex,
+    ULONG Quantum
+)
+{
+    m_processorIndex = ProcessorIndex;
+    m_quantum = max(Quantum, 1UL);
+
+    CX_RETURN_IF_NOT_NT_SUCCESS_MSG(
+        m_executionContext.Initialize(this, NxPollWorkerThread),
+        "Failed to start poll worker. NxPollWorker=%p", this);
+
+    m_executionContext.Start();
+    m_started = true;
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+bool
+NxPollWorker::Attach(
+    NxExecutionContext * ExecutionContext
+)
+{
+    for (auto & context : m_contexts)
+    {
+        if (! InterlockedCompareExchangePointer(
+            reinterpret_cast<PVOID volatile *>(&context), ExecutionContext, nullptr))
+        {
+            SignalWork();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+_Use_decl_annotations_
+void
+NxPollWorker::Detach(
+    NxExecutionContext * ExecutionContext
+)
+{
+    for (auto & context : m_contexts)
+    {
+        (void)InterlockedCompareExchangePointer(
+            reinterpret_cast<PVOID volatile *>(&context), nullptr, ExecutionContext);
+    }
+
+    // the worker may have picked the context up before it was removed
+    while (InterlockedCompareExchangePointer(
+        reinterpret_cast<PVOID volatile *>(&m_current), nullptr, nullptr) == ExecutionContext)
+    {
+#if _KERNEL_MODE
+        LARGE_INTEGER interval;
+        interval.QuadPart = -10 * 1000;
+        (void)KeDelayExecutionThread(KernelMode, FALSE, &interval);
+#else
+        Sleep(1);
+#endif
+    }
+}
+
+_Use_decl_annotations_
+void
+NxPollWorker::SignalWork(
+    void
+)
+{
+    m_executionContext.SignalWork();
+}
+
+bool
+NxPollWorker::PollContexts(
+    void
+)
+{
+    auto moreWork = false;
+
+    for (auto & slot : m_contexts)
+    {
+        auto const context = static_cast<NxExecutionContext *>(
+            InterlockedCompareExchangePointer(reinterpret_cast<PVOID volatile *>(&slot), nullptr, nullptr));
+
+        if (! context)
+        {
+            continue;
+        }
+
+        // claim the context, then make sure it was not detached meanwhile
+        (void)InterlockedExchangePointer(reinterpret_cast<PVOID volatile *>(&m_current), context);
+
+        if (slot == context)
+        {
+            auto wantsMore = true;
+
+            for (ULONG i = 0; wantsMore && i < m_quantum; i++)
+            {
+                wantsMore = context->Poll();
+            }
+
+            moreWork |= wantsMore;
+        }
+
+        (void)InterlockedExchangePointer(reinterpret_cast<PVOID volatile *>(&m_current), nullptr);
+    }
+
+    return moreWork;
+}
+
+void
+NxPollWorker::WorkerThread(
+    void
+)
+{
+#if _KERNEL_MODE
+    PROCESSOR_NUMBER processorNumber;
+    if (NT_SUCCESS(KeGetProcessorNumberFromIndex(m_processorIndex, &processorNumber)))
+    {
+        GROUP_AFFINITY affinity = {};
+        affinity.Group = processorNumber.Group;
+        affinity.Mask = AFFINITY_MASK(processorNumber.Number);
+
+        KeSetSystemGroupAffinityThread(&affinity, nullptr);
+    }
+#endif
+
+    while (! m_executionContext.IsTerminated())
+    {
+        while (! m_executionContext.IsStopping())
+        {
+            if (! PollContexts())
+            {
+                m_executionContext.WaitForWork();
+            }
+        }
+
+        m_executionContext.SignalStopped();
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS
+NxPollScheduler::Initialize(
+    size_t NumberOfWorkers,
+    ULONG Quantum
+)
+{
+    auto const processorCount = GetProcessorCount();
+
+    NumberOfWorkers = min(NumberOfWorkers, static_cast<size_t>(processorCount));
+
+    CX_RETURN_NTSTATUS_IF(
+        STATUS_INSUFFICIENT_RESOURCES,
+        ! m_workers.resize(NumberOfWorkers));
+
+    for (size_t i = 0; i < m_workers.count(); i++)
+    {
+        auto worker = wil::make_unique_nothrow<NxPollWorker>();
+
+        CX_RETURN_NTSTATUS_IF(
+            STATUS_INSUFFICIENT_RESOURCES,
+            ! worker);
+
+        CX_RETURN_IF_NOT_NT_SUCCESS(
+            worker->Initialize(static_cast<ULONG>(i), Quantum));
+
+        m_workers[i] = wistd::move(worker);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NxPollWorker &
+NxPollScheduler::GetWorker(
+    size_t QueueId
+)
+{
+    return *m_workers[QueueId % m_workers.count()];
+}
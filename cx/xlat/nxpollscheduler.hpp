@@ -0,0 +1,118 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+/*++
+
+Abstract:
+
+    Runs the execution contexts of several translator queues on a small
+    pool of worker threads, one per processor, instead of a thread per
+    queue.
+
+    A worker polls the ECs attached to it in round-robin. An EC that has
+    work keeps the worker for at most a quantum of iterations before the
+    next EC gets its turn. The worker halts when every EC it runs asked to
+    halt, any of them signaling work wakes it up.
+
+--*/
+
+#pragma once
+
+#include <KArray.h>
+
+#include "NxExecutionContext.hpp"
+
+#define NX_POLL_WORKER_MAXIMUM_CONTEXTS 64
+
+class NxPollWorker :
+    public NxNonpagedAllocation<'wPxN'>
+{
+public:
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    ~NxPollWorker(
+        void
+    );
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    NTSTATUS
+    Initialize(
+        _In_ ULONG ProcessorIndex,
+        _In_ ULONG Quantum
+    );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    bool
+    Attach(
+        _In_ NxExecutionContext * ExecutionContext
+    );
+
+    // returns once the worker no longer runs ExecutionContext
+    _IRQL_requires_(PASSIVE_LEVEL)
+    void
+    Detach(
+        _In_ NxExecutionContext * ExecutionContext
+    );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    void
+    SignalWork(
+        void
+    );
+
+    // the worker thread function
+    void
+    WorkerThread(
+        void
+    );
+
+private:
+
+    bool
+    PollContexts(
+        void
+    );
+
+    NxExecutionContext
+        m_executionContext;
+
+    bool
+        m_started = false;
+
+    ULONG
+        m_processorIndex = 0;
+
+    ULONG
+        m_quantum = 1;
+
+    NxExecutionContext * volatile
+        m_contexts[NX_POLL_WORKER_MAXIMUM_CONTEXTS] = {};
+
+    // the context being polled, Detach waits for the worker to leave it
+    NxExecutionContext * volatile
+        m_current = nullptr;
+};
+
+class NxPollScheduler :
+    public NxNonpagedAllocation<'sPxN'>
+{
+public:
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    NTSTATUS
+    Initialize(
+        _In_ size_t NumberOfWorkers,
+        _In_ ULONG Quantum
+    );
+
+    // spreads queues over the workers round-robin by their index
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    NxPollWorker &
+    GetWorker(
+        _In_ size_t QueueId
+    );
+
+private:
+
+    Rtl::KArray<wistd::unique_ptr<NxPollWorker>, NonPagedPoolNx>
+        m_workers;
+};
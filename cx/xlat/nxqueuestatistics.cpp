@@ -0,0 +1,69 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+#include "NxXlatPrecomp.hpp"
+#include "NxXlatCommon.hpp"
+#include "NxQueueStatistics.tmh"
+
+#include "NxQueueStatistics.hpp"
+
+_Use_decl_annotations_
+void
+NxQueueStatisticsSampler::Initialize(
+    NxRingBuffer const & PacketRing
+)
+{
+    m_lastEndIndex = PacketRing.Get()->EndIndex;
+    m_lastNextOSIndex = PacketRing.GetNextOSIndex();
+}
+
+_Use_decl_annotations_
+void
+NxQueueStatisticsSampler::Sample(
+    NxRingBuffer & PacketRing,
+    NxExecutionContext & ExecutionContext
+)
+{
+    auto const ring = PacketRing.Get();
+
+    // packets given to the NIC and packets taken back from it since the last iteration
+    auto const produced = NetRingGetRangeCount(ring, m_lastEndIndex, ring->EndIndex);
+    auto const consumed = NetRingGetRangeCount(ring, m_lastNextOSIndex, PacketRing.GetNextOSIndex());
+
+    m_lastEndIndex = ring->EndIndex;
+    m_lastNextOSIndex = PacketRing.GetNextOSIndex();
+
+    m_delta.NumberOfNetPacketsProduced += produced;
+    m_delta.NumberOfNetPacketsConsumed += consumed;
+
+    m_iterations++;
+
+    if (produced == 0 && consumed == 0)
+    {
+        m_idleIterations++;
+    }
+
+    if (m_iterations < NX_QUEUE_STATISTICS_SAMPLE_INTERVAL)
+    {
+        return;
+    }
+
+    PacketRing.UpdateRingbufferPacketCounters(m_delta);
+    PacketRing.UpdateRingbufferDepthCounters();
+    ExecutionContext.UpdateCounters(m_iterations, m_idleIterations);
+
+    m_delta = {};
+    m_iterations = 0;
+    m_idleIterations = 0;
+}
+
+_Use_decl_annotations_
+void
+NxQueueStatisticsCalculateCyclesPerPacket(
+    NxQueueStatistics & Statistics
+)
+{
+    auto const packets = Statistics.Ring.NumberOfNetPacketsConsumed;
+    auto const cycles = Statistics.ExecutionContext.ProcessingCycles + Statistics.ExecutionContext.BusyWaitCycles;
+
+    Statistics.CyclesPerPacket = packets != 0 ? cycles / packets : 0;
+}
@@ -0,0 +1,94 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+/*++
+
+Abstract:
+
+    Per-queue datapath statistics. The execution context of a queue feeds
+    a NxQueueStatisticsSampler once per iteration, the sampler folds the
+    iterations into the ring buffer and execution context counters every
+    NX_QUEUE_STATISTICS_SAMPLE_INTERVAL iterations.
+
+--*/
+
+#pragma once
+
+#include "NxExecutionContext.hpp"
+#include "NxRingBuffer.hpp"
+#include "NxNblTranslation.hpp"
+#include "NxNotificationModeration.hpp"
+
+#define NX_QUEUE_STATISTICS_SAMPLE_INTERVAL 32
+
+enum class NxQueueType
+{
+    Rx,
+    Tx,
+};
+
+struct NxQueueStatistics
+{
+    NxRingBufferCounters
+        Ring;
+
+    NxExecutionContextCounters
+        ExecutionContext;
+
+    NxNotificationModerationCounters
+        Notification;
+
+    // Transmit queues only
+    NxNblTranslationStats
+        Translation;
+
+    // Cycles the execution context spent, processing or busy waiting, for
+    // each packet it completed. Zero until a packet was completed.
+    ULONG64
+        CyclesPerPacket = 0;
+};
+
+//
+// Owned and updated by the execution context thread only. Aligned so the
+// state it writes every iteration does not share a cache line with queue
+// state written by other threads.
+//
+class DECLSPEC_CACHEALIGN NxQueueStatisticsSampler
+{
+public:
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    void
+    Initialize(
+        _In_ NxRingBuffer const & PacketRing
+    );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    void
+    Sample(
+        _Inout_ NxRingBuffer & PacketRing,
+        _Inout_ NxExecutionContext & ExecutionContext
+    );
+
+private:
+
+    NxRingBufferCounters
+        m_delta;
+
+    UINT32
+        m_lastEndIndex = 0;
+
+    UINT32
+        m_lastNextOSIndex = 0;
+
+    ULONG
+        m_iterations = 0;
+
+    ULONG
+        m_idleIterations = 0;
+};
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void
+NxQueueStatisticsCalculateCyclesPerPacket(
+    _Inout_ NxQueueStatistics & Statistics
+);
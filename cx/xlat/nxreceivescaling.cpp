@@ -9,9 +9,13 @@
 #include "NxReceiveScaling.hpp"
 
 #include "NxTranslationApp.hpp"
+#include "NxNumaNode.hpp"
 
 #define SET_INDIRECTION_ENTRIES_RETRY 3
 
+// stands in for the cycle counters of queues that do not report them
+#define NX_RSS_NOMINAL_CYCLES_PER_PACKET 2000
+
 #ifdef _KERNEL_MODE
 #include <ntddndis.h>
 #include <affinity.h> // for MAXIMUM_GROUPS
@@ -41,17 +45,41 @@ NdisConvertNdisStatusToNtStatus(NDIS_STATUS NdisStatus)
     }
 }
 
+//
+// Returns the processors sharing a core with Processor, including itself
+//
+_IRQL_requires_(PASSIVE_LEVEL)
+static
+GROUP_AFFINITY
+GetCoreAffinity(
+    _In_ PROCESSOR_NUMBER & Processor
+)
+{
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX information;
+    ULONG length = sizeof(information);
+
+    if (NT_SUCCESS(KeQueryLogicalProcessorRelationship(&Processor, RelationProcessorCore, &information, &length)) &&
+        information.Processor.GroupCount > 0)
+    {
+        return information.Processor.GroupMask[0];
+    }
+
+    return { 1ULL << Processor.Number, Processor.Group };
+}
+
 #endif // _KERNEL_MODE
 
 _Use_decl_annotations_
 NxReceiveScaling::NxReceiveScaling(
     NxTranslationApp & App,
     Rtl::KArray<wistd::unique_ptr<NxRxXlat>, NonPagedPoolNx> const & Queues,
-    NET_CLIENT_ADAPTER_RECEIVE_SCALING_DISPATCH const & Dispatch
+    NET_CLIENT_ADAPTER_RECEIVE_SCALING_DISPATCH const & Dispatch,
+    NxRxSteering * Steering
 ) noexcept :
     m_app(App),
     m_queues(Queues),
-    m_dispatch(Dispatch)
+    m_dispatch(Dispatch),
+    m_steering(Steering)
 {
 }
 
@@ -167,9 +195,53 @@ NxReceiveScaling::Initialize(
     m_numberOfQueues = numberOfQueues;
 #endif // _KERNEL_MODE
 
+    if (m_steering)
+    {
+        // packets are spread over processors from the single queue
+        m_numberOfQueues = 1;
+
+        // entries past the end of the steering table are ignored
+        for (size_t i = 0; i < NDIS_RSS_INDIRECTION_TABLE_MAX_SIZE_REVISION_1; i++)
+        {
+            m_steering->SetIndirectionEntry(i, m_defaultProcessor);
+        }
+    }
+
+    CX_RETURN_NTSTATUS_IF(
+        STATUS_INSUFFICIENT_RESOURCES,
+        ! m_affinitizedQueues.resize(m_maxProcessorIndex - m_minProcessorIndex + 1));
+
+    CX_RETURN_NTSTATUS_IF(
+        STATUS_INSUFFICIENT_RESOURCES,
+        ! m_processorTopology.resize(m_affinitizedQueues.count()));
+
+#ifdef _KERNEL_MODE
+    for (size_t i = 0; i < m_processorTopology.count(); i++)
+    {
+        auto const enumerated = m_minProcessorIndex + i;
+        PROCESSOR_NUMBER processorNumber = {
+            static_cast<UINT16>(enumerated / m_maxGroupProcessorCount),
+            static_cast<UINT8>(enumerated % m_maxGroupProcessorCount),
+        };
+
+        if (KeGetProcessorIndexFromNumber(&processorNumber) == INVALID_PROCESSOR_INDEX)
+        {
+            continue;
+        }
+
+        GROUP_AFFINITY const affinity = {
+            1ULL << processorNumber.Number,
+            processorNumber.Group
+        };
+
+        m_processorTopology[i].Node = NxGetNodeFromGroupAffinity(affinity);
+        m_processorTopology[i].Core = GetCoreAffinity(processorNumber);
+    }
+#endif // _KERNEL_MODE
+
     CX_RETURN_NTSTATUS_IF(
         STATUS_INSUFFICIENT_RESOURCES,
-        ! m_affinitizedQueues.resize(m_maxProcessorIndex - m_minProcessorIndex));
+        ! m_queueLoads.resize(m_numberOfQueues));
 
     CX_RETURN_NTSTATUS_IF(
         STATUS_INSUFFICIENT_RESOURCES,
@@ -360,6 +432,44 @@ NxReceiveScaling::SetAffinitizedQueue(
     m_affinitizedQueues[Index] = { Queue, Queue->GetQueueId(), Affinity };
 }
 
+//
+// Returns the affinity last assigned to the queue with QueueId. Queues are
+// recreated with the data path, this lets a new queue allocate its memory
+// on the right node before Configure restores the affinity.
+//
+_Use_decl_annotations_
+bool
+NxReceiveScaling::GetQueueAffinity(
+    size_t QueueId,
+    GROUP_AFFINITY & Affinity
+)
+{
+    KAcquireSpinLock lock(m_receiveScalingLock);
+
+    for (size_t i = 0; i < m_affinitizedQueues.count(); i++)
+    {
+        auto const & affinitizedQueue = m_affinitizedQueues[i];
+        if (affinitizedQueue.Queue && affinitizedQueue.QueueId == QueueId)
+        {
+            Affinity = affinitizedQueue.Affinity;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+_Use_decl_annotations_
+NxReceiveScalingCounters
+NxReceiveScaling::GetCounters(
+    void
+)
+{
+    KAcquireSpinLock lock(m_indirectionLock);
+
+    return m_counters;
+}
+
 _Use_decl_annotations_
 NxRxXlat *
 NxReceiveScaling::MapAffinitizedQueue(
@@ -393,23 +503,182 @@ NxReceiveScaling::MapAffinitizedQueue(
         }
     }
 
-#ifdef _KERNEL_MODE
     //
-    // if we reach here there are no unmapped queues. remap the
-    // queue mapped to the source processor to the target processor.
+    // if we reach here there are no unmapped queues. move the queue that
+    // is cheapest to move to the target processor.
     //
-    PROCESSOR_NUMBER processorNumber;
-    (void)KeGetCurrentProcessorNumberEx(&processorNumber);
-    auto const processorIndex = EnumerateProcessor(processorNumber);
-    auto sourceQueue = GetAffinitizedQueue(processorIndex);
+    auto const meanLoad = GetMeanQueueLoad();
+    auto lowestCost = MAXULONG64;
+    size_t sourceIndex = 0;
+
+    for (size_t i = 0; i < m_affinitizedQueues.count(); i++)
+    {
+        if (! m_affinitizedQueues[i].Queue)
+        {
+            continue;
+        }
+
+        auto const cost = GetRemapCost(i, Index, meanLoad);
+        if (cost < lowestCost)
+        {
+            lowestCost = cost;
+            sourceIndex = i;
+        }
+    }
+
+    if (lowestCost == MAXULONG64)
+    {
+        return nullptr;
+    }
 
-    m_affinitizedQueues[processorIndex] = {};
+    auto sourceQueue = GetAffinitizedQueue(sourceIndex);
+
+    m_affinitizedQueues[sourceIndex] = {};
     SetAffinitizedQueue(Index, sourceQueue, Affinity);
 
+    // the queue keeps the entries of the source processor and takes on the
+    // ones of the target, keep it from being picked again right away
+    if (sourceQueue->GetQueueId() < m_queueLoads.count())
+    {
+        m_queueLoads[sourceQueue->GetQueueId()].Load += meanLoad + 1;
+    }
+
     return sourceQueue;
-#else
-    return nullptr;
-#endif // _KERNEL_MODE
+}
+
+//
+// Samples the work each queue did since the last sample. Queues that do
+// not count cycles are weighed by the packets they received.
+//
+_Use_decl_annotations_
+void
+NxReceiveScaling::SampleQueueLoads(
+    void
+)
+{
+    KAcquireSpinLock lock(m_receiveScalingLock);
+
+    for (auto & queue : m_queues)
+    {
+        auto const queueId = queue->GetQueueId();
+        if (queueId >= m_queueLoads.count())
+        {
+            continue;
+        }
+
+        NxQueueStatistics statistics;
+        queue->GetStatistics(statistics);
+
+        auto & load = m_queueLoads[queueId];
+        auto const cycles = statistics.ExecutionContext.ProcessingCycles;
+        auto const packets = statistics.Ring.NumberOfNetPacketsConsumed;
+
+        // the counters start over when the queue is recreated
+        if (cycles < load.ProcessingCycles || packets < load.Packets)
+        {
+            load.ProcessingCycles = 0;
+            load.Packets = 0;
+        }
+
+        auto const cyclesDelta = cycles - load.ProcessingCycles;
+        auto const packetsDelta = packets - load.Packets;
+
+        load.Load = cyclesDelta != 0
+            ? cyclesDelta
+            : packetsDelta * NX_RSS_NOMINAL_CYCLES_PER_PACKET;
+        load.ProcessingCycles = cycles;
+        load.Packets = packets;
+    }
+}
+
+_Use_decl_annotations_
+ULONG64
+NxReceiveScaling::GetQueueLoad(
+    NxRxXlat const & Queue
+) const
+{
+    auto const queueId = Queue.GetQueueId();
+
+    return queueId < m_queueLoads.count() ? m_queueLoads[queueId].Load : 0;
+}
+
+_Use_decl_annotations_
+ULONG64
+NxReceiveScaling::GetMeanQueueLoad(
+    void
+) const
+{
+    if (m_queueLoads.count() == 0)
+    {
+        return 0;
+    }
+
+    ULONG64 total = 0;
+    for (auto const & load : m_queueLoads)
+    {
+        total += load.Load;
+    }
+
+    return total / m_queueLoads.count();
+}
+
+//
+// The cost of moving the queue mapped to the source processor over to the
+// target processor is the queue's load, plus a penalty, worth the mean load
+// of a queue, for each of:
+//
+// - a target on another NUMA node than the source. The queue's memory stays
+//   on the node it was allocated on until the data path is recreated.
+//
+// - another queue mapped to an SMT sibling of the target. Two queue threads
+//   would share one core. Moving the sibling's own queue avoids it.
+//
+_Use_decl_annotations_
+ULONG64
+NxReceiveScaling::GetRemapCost(
+    size_t SourceIndex,
+    size_t TargetIndex,
+    ULONG64 MeanLoad
+) const
+{
+    auto const queue = m_affinitizedQueues[SourceIndex].Queue;
+    auto const penalty = MeanLoad + 1;
+    auto cost = GetQueueLoad(*queue);
+
+    if (TargetIndex >= m_processorTopology.count())
+    {
+        return cost;
+    }
+
+    auto const & source = m_processorTopology[SourceIndex];
+    auto const & target = m_processorTopology[TargetIndex];
+
+    if (source.Node != target.Node)
+    {
+        cost += penalty;
+    }
+
+    for (UINT8 number = 0; number < sizeof(KAFFINITY) * 8; number++)
+    {
+        if (! (target.Core.Mask & (1ULL << number)))
+        {
+            continue;
+        }
+
+        auto const sibling = EnumerateProcessor(target.Core.Group, number) - m_minProcessorIndex;
+
+        if (sibling != TargetIndex &&
+            sibling != SourceIndex &&
+            sibling < m_affinitizedQueues.count() &&
+            m_affinitizedQueues[sibling].Queue &&
+            m_affinitizedQueues[sibling].Queue != queue)
+        {
+            cost += penalty;
+            break;
+        }
+    }
+
+    return cost;
 }
 
 _Use_decl_annotations_
@@ -418,8 +687,21 @@ NxReceiveScaling::SetEnabled(
     void
 )
 {
-    CX_RETURN_IF_NOT_NT_SUCCESS(
-        m_dispatch.Enable(m_app.GetAdapter(), m_hashFunction, m_hashType));
+    if (m_steering)
+    {
+        CX_RETURN_NTSTATUS_IF_MSG(
+            STATUS_NOT_SUPPORTED,
+            m_hashFunction != NdisHashFunctionToeplitz,
+            "Software receive scaling only supports the Toeplitz hash function.");
+
+        m_steering->SetHashType(m_hashType);
+        m_steering->SetEnabled(true);
+    }
+    else
+    {
+        CX_RETURN_IF_NOT_NT_SUCCESS(
+            m_dispatch.Enable(m_app.GetAdapter(), m_hashFunction, m_hashType));
+    }
 
     m_enabled = true;
 
@@ -432,7 +714,14 @@ NxReceiveScaling::SetDisabled(
     void
 )
 {
-    m_dispatch.Disable(m_app.GetAdapter());
+    if (m_steering)
+    {
+        m_steering->SetEnabled(false);
+    }
+    else
+    {
+        m_dispatch.Disable(m_app.GetAdapter());
+    }
 
     m_enabled = false;
 }
@@ -443,6 +732,13 @@ NxReceiveScaling::SetHashSecretKey(
     void
 )
 {
+    if (m_steering)
+    {
+        m_steering->SetHashSecretKey(m_hashSecretKey);
+
+        return STATUS_SUCCESS;
+    }
+
     NET_CLIENT_RECEIVE_SCALING_HASH_SECRET_KEY const hashSecretKey = {
         &m_hashSecretKey[0],
         sizeof(m_hashSecretKey),
@@ -498,6 +794,7 @@ NxReceiveScaling::SetIndirectionEntries(
                     //
                     // restore state of indirection table
                     //
+                    KAcquireSpinLock lock(m_indirectionLock);
                     m_indirectionTable[entry.Index] = TranslatedEntries.Restore[i];
                 }
                 else
@@ -560,45 +857,291 @@ NxReceiveScaling::SetIndirectionEntries(
         (! (tableEnd > table)) || tableEnd > buffer + length,
         "RssEntryTable does not start and finish within the InformationBuffer.");
 
-    TranslatedIndirectionEntries translatedEntries = {};
     auto const entries = reinterpret_cast<NDIS_RSS_SET_INDIRECTION_ENTRY const *>(table);
+
+    // the steering table has as many entries as the adapter's, both modes
+    // reject the same OIDs
     for (size_t i = 0; i < parameters->NumberOfRssEntries; i++)
     {
-        auto const processorNumber = entries[i].TargetProcessorNumber;
-        auto const processorIndex = EnumerateProcessor(processorNumber);
-        auto const indirectionTableIndex = entries[i].IndirectionTableIndex;
-        GROUP_AFFINITY const groupAffinity = {
-            1ULL << processorNumber.Number,
-            processorNumber.Group
-        };
+        CX_RETURN_NTSTATUS_IF_MSG(
+            STATUS_INVALID_PARAMETER,
+            entries[i].IndirectionTableIndex >= m_indirectionTable.count() ||
+            entries[i].IndirectionTableIndex >= NDIS_RSS_INDIRECTION_TABLE_MAX_SIZE_REVISION_1,
+            "IndirectionTableIndex %u past the end of the indirection table.",
+            entries[i].IndirectionTableIndex);
+    }
 
-        //
-        // get the queue mapped to the target processor. if no queue is mapped
-        // then find a new queue to map to the target or remap the queue used
-        // by the source processor to the target processor.
-        //
-        auto queue = GetAffinitizedQueue(processorIndex);
-        if (! queue)
+    //
+    // in software the entries point straight at processors, the single
+    // queue is left where it is
+    //
+    if (m_steering)
+    {
+        for (size_t i = 0; i < parameters->NumberOfRssEntries; i++)
         {
-            queue = MapAffinitizedQueue(processorIndex, groupAffinity);
+            m_steering->SetIndirectionEntry(
+                entries[i].IndirectionTableIndex,
+                entries[i].TargetProcessorNumber);
         }
 
-        NT_FRE_ASSERT(queue);
+        return STATUS_SUCCESS;
+    }
 
-        //
-        // build an indirection entry for the Cx, keep the current queue
-        // at the cached indirection table index in case we need to restore it.
-        //
-        translatedEntries.Restore[i] = static_cast<UINT32>(m_indirectionTable[indirectionTableIndex]);
-        translatedEntries.Entries[i] = { queue->GetQueue(), STATUS_SUCCESS, indirectionTableIndex };
+    // queues mapped to new processors are chosen by their recent load
+    SampleQueueLoads();
+
+    //
+    // only the entries whose queue changes are pushed to the adapter. an
+    // index set more than once by the OID is pushed once, with the last
+    // queue requested.
+    //
+    static_assert(NDIS_RSS_INDIRECTION_TABLE_MAX_SIZE_REVISION_1 <= MAXUINT8,
+                  "translated entry positions are tracked in a UINT8");
+
+    UINT8 positions[NDIS_RSS_INDIRECTION_TABLE_MAX_SIZE_REVISION_1];
+    RtlFillMemory(positions, sizeof(positions), MAXUINT8);
+
+    TranslatedIndirectionEntries translatedEntries = {};
+    IndirectionUpdate update;
+    update.TranslatedEntries = &translatedEntries;
+    bool combiner = false;
 
-        m_indirectionTable[indirectionTableIndex] = queue->GetQueueId();
+#ifdef _KERNEL_MODE
+    //
+    // the combiner role is claimed under the lock and the other OIDs spin
+    // until the combiner completes their update. hold DISPATCH_LEVEL from
+    // the lock to the end of combining so the combiner is never preempted,
+    // not even by an OID raised on its own processor.
+    //
+    KIRQL irql;
+    KeRaiseIrql(DISPATCH_LEVEL, &irql);
+#endif
+
+    {
+        KAcquireSpinLock lock(m_indirectionLock);
+
+        for (size_t i = 0; i < parameters->NumberOfRssEntries; i++)
+        {
+            auto const processorNumber = entries[i].TargetProcessorNumber;
+            auto const processorIndex = EnumerateProcessor(processorNumber);
+            auto const indirectionTableIndex = entries[i].IndirectionTableIndex;
+            GROUP_AFFINITY const groupAffinity = {
+                1ULL << processorNumber.Number,
+                processorNumber.Group
+            };
+
+            //
+            // get the queue mapped to the target processor. if no queue is mapped
+            // then find a new queue to map to the target or remap the queue used
+            // by the source processor to the target processor.
+            //
+            auto queue = GetAffinitizedQueue(processorIndex);
+            if (! queue)
+            {
+                queue = MapAffinitizedQueue(processorIndex, groupAffinity);
+            }
+
+            NT_FRE_ASSERT(queue);
+
+            auto & position = positions[indirectionTableIndex];
+
+            if (position != MAXUINT8)
+            {
+                translatedEntries.Entries[position].Queue = queue->GetQueue();
+            }
+            else if (m_indirectionTable[indirectionTableIndex] == queue->GetQueueId())
+            {
+                m_counters.SkippedIndirectionEntries++;
+
+                continue;
+            }
+            else
+            {
+                //
+                // build an indirection entry for the Cx, keep the current queue
+                // at the cached indirection table index in case we need to restore it.
+                //
+                position = static_cast<UINT8>(update.NumberOfEntries++);
+                translatedEntries.Restore[position] = static_cast<UINT32>(m_indirectionTable[indirectionTableIndex]);
+                translatedEntries.Entries[position] = { queue->GetQueue(), STATUS_SUCCESS, indirectionTableIndex };
+            }
+
+            m_indirectionTable[indirectionTableIndex] = queue->GetQueueId();
+        }
+
+        if (update.NumberOfEntries == 0)
+        {
+            m_counters.SavedAdapterCalls++;
+        }
+        else
+        {
+            // queued along with the table change, the adapter sees the updates
+            // in the order the cached table went through them
+            combiner = QueueIndirectionUpdate(update);
+        }
     }
 
-    return SetIndirectionEntries(
-        parameters->NumberOfRssEntries,
-        0,
-        translatedEntries);
+    auto const status = update.NumberOfEntries != 0
+        ? CommitIndirectionUpdate(update, combiner)
+        : STATUS_SUCCESS;
+
+#ifdef _KERNEL_MODE
+    KeLowerIrql(irql);
+#endif
+
+    return status;
+}
+
+//
+// Returns true if the caller is to combine the pending updates, as no
+// other OID is pushing them to the adapter.
+//
+_Use_decl_annotations_
+bool
+NxReceiveScaling::QueueIndirectionUpdate(
+    IndirectionUpdate & Update
+)
+{
+    if (m_pendingUpdatesTail)
+    {
+        m_pendingUpdatesTail->Next = &Update;
+    }
+    else
+    {
+        m_pendingUpdatesHead = &Update;
+    }
+
+    m_pendingUpdatesTail = &Update;
+
+    if (m_combiningUpdates)
+    {
+        return false;
+    }
+
+    m_combiningUpdates = true;
+
+    return true;
+}
+
+//
+// The combiner pushes every queued update, its own included, until the
+// queue is empty. The other OIDs wait for their update to be completed by
+// the combiner.
+//
+_Use_decl_annotations_
+NTSTATUS
+NxReceiveScaling::CommitIndirectionUpdate(
+    IndirectionUpdate & Update,
+    bool Combiner
+)
+{
+    if (Combiner)
+    {
+        CombineIndirectionUpdates();
+    }
+
+    while (! ReadAcquire(&Update.Completed))
+    {
+        YieldProcessor();
+    }
+
+    return Update.Status;
+}
+
+//
+// Pushes the pending updates to the adapter, as many as fit in one call at
+// a time. Failed entries are restored in the cached indirection table by
+// SetIndirectionEntries and fail the update they came from.
+//
+_Use_decl_annotations_
+void
+NxReceiveScaling::CombineIndirectionUpdates(
+    void
+)
+{
+    for (;;)
+    {
+        IndirectionUpdate * first;
+        IndirectionUpdate * last;
+        size_t numberOfEntries = 0;
+        size_t numberOfUpdates = 0;
+
+        {
+            KAcquireSpinLock lock(m_indirectionLock);
+
+            first = m_pendingUpdatesHead;
+            if (! first)
+            {
+                m_combiningUpdates = false;
+                return;
+            }
+
+            last = first;
+            while (last)
+            {
+                if (numberOfEntries + last->NumberOfEntries > NDIS_RSS_INDIRECTION_TABLE_MAX_SIZE_REVISION_1)
+                {
+                    break;
+                }
+
+                auto const & translatedEntries = *last->TranslatedEntries;
+
+                RtlCopyMemory(
+                    &m_combinedEntries.Entries[numberOfEntries],
+                    translatedEntries.Entries,
+                    last->NumberOfEntries * sizeof(translatedEntries.Entries[0]));
+
+                RtlCopyMemory(
+                    &m_combinedEntries.Restore[numberOfEntries],
+                    translatedEntries.Restore,
+                    last->NumberOfEntries * sizeof(translatedEntries.Restore[0]));
+
+                numberOfEntries += last->NumberOfEntries;
+                numberOfUpdates++;
+                last = last->Next;
+            }
+
+            // last is the first update left for the next call
+            m_pendingUpdatesHead = last;
+            if (! last)
+            {
+                m_pendingUpdatesTail = nullptr;
+            }
+
+            m_counters.SavedAdapterCalls += numberOfUpdates - 1;
+        }
+
+        auto const status = SetIndirectionEntries(
+            numberOfEntries,
+            0,
+            m_combinedEntries);
+
+        size_t position = 0;
+        for (auto update = first; update != last;)
+        {
+            update->Status = STATUS_SUCCESS;
+
+            if (! NT_SUCCESS(status))
+            {
+                for (size_t i = 0; i < update->NumberOfEntries; i++)
+                {
+                    if (! NT_SUCCESS(m_combinedEntries.Entries[position + i].Status))
+                    {
+                        update->Status = status;
+                        break;
+                    }
+                }
+            }
+
+            position += update->NumberOfEntries;
+
+            // the update lives on the stack of its OID, which may return
+            // as soon as it is completed
+            auto const next = update->Next;
+            WriteRelease(&update->Completed, TRUE);
+            update = next;
+        }
+    }
 }
 
 //
@@ -614,6 +1157,15 @@ NxReceiveScaling::Configure(
     void
 )
 {
+    //
+    // Software receive scaling keeps its configuration across data paths,
+    // there is nothing to push down to the adapter.
+    //
+    if (m_steering)
+    {
+        return STATUS_SUCCESS;
+    }
+
     //
     // Affinitize all queues to the default group affinity if they aren't
     // already affinitized.
@@ -627,7 +1179,7 @@ NxReceiveScaling::Configure(
                 m_defaultProcessor.Group
                 };
 
-            (void)MapAffinitizedQueue(m_minProcessorIndex, groupAffinity);
+            (void)MapAffinitizedQueue(EnumerateProcessor(m_defaultProcessor), groupAffinity);
         }
     }
 
@@ -5,9 +5,20 @@
 #include <KArray.h>
 
 #include "NxRxXlat.hpp"
+#include "NxRxSteering.hpp"
 
 class NxTranslationApp;
 
+struct NxReceiveScalingCounters
+{
+    // entries requested that already pointed at their queue
+    ULONG64 SkippedIndirectionEntries = 0;
+
+    // OIDs that required no adapter call of their own, because they
+    // changed nothing or were combined with another OID
+    ULONG64 SavedAdapterCalls = 0;
+};
+
 class NxReceiveScaling :
     public NxNonpagedAllocation<'RxrN'>
 {
@@ -18,7 +29,8 @@ public:
     NxReceiveScaling(
         NxTranslationApp & App,
         Rtl::KArray<wistd::unique_ptr<NxRxXlat>, NonPagedPoolNx> const & Queues,
-        NET_CLIENT_ADAPTER_RECEIVE_SCALING_DISPATCH const & Dispatch
+        NET_CLIENT_ADAPTER_RECEIVE_SCALING_DISPATCH const & Dispatch,
+        NxRxSteering * Steering
     ) noexcept;
 
     _IRQL_requires_(PASSIVE_LEVEL)
@@ -51,6 +63,19 @@ public:
         _In_ NDIS_OID_REQUEST const & Request
     );
 
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    bool
+    GetQueueAffinity(
+        _In_ size_t QueueId,
+        _Out_ GROUP_AFFINITY & Affinity
+    );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    NxReceiveScalingCounters
+    GetCounters(
+        void
+    );
+
 private:
 
     struct AffinitizedQueue
@@ -65,6 +90,31 @@ private:
             Affinity = {};
     };
 
+    struct QueueLoad
+    {
+        // counters of the queue when its load was last sampled
+        ULONG64
+            ProcessingCycles = 0;
+
+        ULONG64
+            Packets = 0;
+
+        // cycles the queue spent between the last two samples, plus an
+        // estimate for each processor it was mapped to since
+        ULONG64
+            Load = 0;
+    };
+
+    struct ProcessorTopology
+    {
+        NODE_REQUIREMENT
+            Node = MM_ANY_NODE_OK;
+
+        // the processor and its SMT siblings
+        GROUP_AFFINITY
+            Core = {};
+    };
+
     struct TranslatedIndirectionEntries
     {
         NET_CLIENT_RECEIVE_SCALING_INDIRECTION_ENTRY
@@ -74,6 +124,29 @@ private:
             Restore[NDIS_RSS_INDIRECTION_TABLE_MAX_SIZE_REVISION_1];
     };
 
+    //
+    // The entries of one OID that change the indirection table. Updates
+    // issued concurrently are combined into a single adapter call by the
+    // first OID to get there, the others wait for it to complete theirs.
+    //
+    struct IndirectionUpdate
+    {
+        IndirectionUpdate *
+            Next = nullptr;
+
+        TranslatedIndirectionEntries *
+            TranslatedEntries = nullptr;
+
+        size_t
+            NumberOfEntries = 0;
+
+        NTSTATUS
+            Status = STATUS_SUCCESS;
+
+        LONG volatile
+            Completed = FALSE;
+    };
+
     _IRQL_requires_(PASSIVE_LEVEL)
     NTSTATUS
     SetEnabled(
@@ -100,6 +173,26 @@ private:
         _In_ TranslatedIndirectionEntries & TranslatedEntries
     );
 
+    _Requires_lock_held_(this->m_indirectionLock)
+    _IRQL_requires_(DISPATCH_LEVEL)
+    bool
+    QueueIndirectionUpdate(
+        _In_ IndirectionUpdate & Update
+    );
+
+    _IRQL_requires_(DISPATCH_LEVEL)
+    NTSTATUS
+    CommitIndirectionUpdate(
+        _Inout_ IndirectionUpdate & Update,
+        _In_ bool Combiner
+    );
+
+    _IRQL_requires_(DISPATCH_LEVEL)
+    void
+    CombineIndirectionUpdates(
+        void
+    );
+
     _IRQL_requires_max_(DISPATCH_LEVEL)
     size_t
     EnumerateProcessor(
@@ -128,6 +221,35 @@ private:
         GROUP_AFFINITY const & Affinity
     );
 
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    void
+    SampleQueueLoads(
+        void
+    );
+
+    _Requires_lock_held_(this->m_receiveScalingLock)
+    _IRQL_requires_(DISPATCH_LEVEL)
+    ULONG64
+    GetQueueLoad(
+        _In_ NxRxXlat const & Queue
+    ) const;
+
+    _Requires_lock_held_(this->m_receiveScalingLock)
+    _IRQL_requires_(DISPATCH_LEVEL)
+    ULONG64
+    GetMeanQueueLoad(
+        void
+    ) const;
+
+    _Requires_lock_held_(this->m_receiveScalingLock)
+    _IRQL_requires_(DISPATCH_LEVEL)
+    ULONG64
+    GetRemapCost(
+        _In_ size_t SourceIndex,
+        _In_ size_t TargetIndex,
+        _In_ ULONG64 MeanLoad
+    ) const;
+
     _IRQL_requires_(DISPATCH_LEVEL)
     NxRxXlat *
     MapAffinitizedQueue(
@@ -165,12 +287,47 @@ private:
     NET_CLIENT_ADAPTER_RECEIVE_SCALING_DISPATCH const &
         m_dispatch;
 
+    // set when receive scaling is done in software instead of by the NIC
+    NxRxSteering *
+        m_steering = nullptr;
+
     Rtl::KArray<AffinitizedQueue, NonPagedPoolNx>
         m_affinitizedQueues;
 
+    // indexed like m_affinitizedQueues
+    Rtl::KArray<ProcessorTopology, NonPagedPoolNx>
+        m_processorTopology;
+
+    // indexed by queue id
+    Rtl::KArray<QueueLoad, NonPagedPoolNx>
+        m_queueLoads;
+
     Rtl::KArray<size_t, NonPagedPoolNx>
         m_indirectionTable;
 
+    // serializes the OIDs' changes to m_indirectionTable and the queue of
+    // updates waiting for the adapter
+    KSpinLock
+        m_indirectionLock;
+
+    IndirectionUpdate *
+        m_pendingUpdatesHead = nullptr;
+
+    IndirectionUpdate *
+        m_pendingUpdatesTail = nullptr;
+
+    // an OID is pushing pending updates to the adapter
+    bool
+        m_combiningUpdates = false;
+
+    // owned by the OID combining the updates
+    TranslatedIndirectionEntries
+        m_combinedEntries;
+
+    // updated under m_indirectionLock
+    NxReceiveScalingCounters
+        m_counters;
+
     bool
         m_enabled = false;
 
@@ -0,0 +1,432 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+#include "NxXlatPrecomp.hpp"
+#include "NxXlatCommon.hpp"
+#include "NxRxCoalescing.tmh"
+
+#include "NxRxCoalescing.hpp"
+#include "NxChecksum.hpp"
+
+// TCP options of a segment carrying only a timestamp, as sent by every
+// common stack: NOP, NOP, kind 8, length 10, value, echo
+#define NX_RSC_TIMESTAMP_OPTIONS_LENGTH 12
+
+// largest IPv4 total length or IPv6 payload length
+#define NX_RSC_MAXIMUM_IP_LENGTH MAXUSHORT
+
+static
+ULONG
+ReadUlong(
+    _In_reads_bytes_(sizeof(ULONG)) UCHAR const * Buffer
+)
+{
+    return RtlUlongByteSwap(*reinterpret_cast<ULONG UNALIGNED const *>(Buffer));
+}
+
+static
+bool
+IsSameFlow(
+    _In_ NxRscSegment const & Left,
+    _In_ NxRscSegment const & Right
+)
+{
+    if (Left.IsIPv4 != Right.IsIPv4 ||
+        Left.Layer2HeaderLength != Right.Layer2HeaderLength ||
+        Left.Ieee8021Q != Right.Ieee8021Q)
+    {
+        return false;
+    }
+
+    auto const leftTcp = reinterpret_cast<TCP_HDR UNALIGNED const *>(
+        Left.Frame + Left.Layer2HeaderLength + Left.Layer3HeaderLength);
+    auto const rightTcp = reinterpret_cast<TCP_HDR UNALIGNED const *>(
+        Right.Frame + Right.Layer2HeaderLength + Right.Layer3HeaderLength);
+
+    if (leftTcp->th_sport != rightTcp->th_sport || leftTcp->th_dport != rightTcp->th_dport)
+    {
+        return false;
+    }
+
+    auto const leftIp = Left.Frame + Left.Layer2HeaderLength;
+    auto const rightIp = Right.Frame + Right.Layer2HeaderLength;
+
+    if (Left.IsIPv4)
+    {
+        auto const leftIPv4 = reinterpret_cast<IPV4_HEADER UNALIGNED const *>(leftIp);
+        auto const rightIPv4 = reinterpret_cast<IPV4_HEADER UNALIGNED const *>(rightIp);
+
+        if (! RtlEqualMemory(&leftIPv4->SourceAddress, &rightIPv4->SourceAddress, sizeof(IN_ADDR)) ||
+            ! RtlEqualMemory(&leftIPv4->DestinationAddress, &rightIPv4->DestinationAddress, sizeof(IN_ADDR)))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        auto const leftIPv6 = reinterpret_cast<IPV6_HEADER UNALIGNED const *>(leftIp);
+        auto const rightIPv6 = reinterpret_cast<IPV6_HEADER UNALIGNED const *>(rightIp);
+
+        if (! RtlEqualMemory(&leftIPv6->SourceAddress, &rightIPv6->SourceAddress, sizeof(IN6_ADDR)) ||
+            ! RtlEqualMemory(&leftIPv6->DestinationAddress, &rightIPv6->DestinationAddress, sizeof(IN6_ADDR)))
+        {
+            return false;
+        }
+    }
+
+    // same addresses, and the same VLAN tags if any
+    return RtlEqualMemory(Left.Frame, Right.Frame, Left.Layer2HeaderLength);
+}
+
+_Use_decl_annotations_
+NxRscSegmentType
+NxRscParseSegment(
+    NET_PACKET_LAYOUT const & Layout,
+    UCHAR * Frame,
+    ULONG FirstFragmentLength,
+    ULONG FrameLength,
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO ChecksumInfo,
+    NxRscSegment & Segment
+)
+{
+    if (Layout.Layer4Type != NET_PACKET_LAYER4_TYPE_TCP)
+    {
+        return NxRscSegmentType::NotTcp;
+    }
+
+    Segment = {};
+    Segment.Frame = Frame;
+    Segment.Layer2HeaderLength = Layout.Layer2HeaderLength;
+    Segment.Layer3HeaderLength = Layout.Layer3HeaderLength;
+    Segment.Layer4HeaderLength = Layout.Layer4HeaderLength;
+    Segment.IsIPv4 =
+        Layout.Layer3Type == NET_PACKET_LAYER3_TYPE_IPV4_NO_OPTIONS ||
+        Layout.Layer3Type == NET_PACKET_LAYER3_TYPE_IPV4_WITH_OPTIONS;
+
+    auto const headerLength = Segment.GetHeaderLength();
+
+    if (headerLength > FirstFragmentLength || headerLength > FrameLength)
+    {
+        return NxRscSegmentType::Unknown;
+    }
+
+    auto const ip = Frame + Layout.Layer2HeaderLength;
+    auto const tcp = reinterpret_cast<TCP_HDR UNALIGNED const *>(ip + Layout.Layer3HeaderLength);
+    ULONG ipLength;
+
+    if (Segment.IsIPv4)
+    {
+        auto const ipv4 = reinterpret_cast<IPV4_HEADER UNALIGNED const *>(ip);
+
+        // the TCP header of a non-first fragment is payload
+        if ((RtlUshortByteSwap(ipv4->FlagsAndOffset) & 0x3fff) != 0)
+        {
+            return NxRscSegmentType::Unknown;
+        }
+
+        ipLength = RtlUshortByteSwap(ipv4->TotalLength);
+    }
+    else
+    {
+        auto const ipv6 = reinterpret_cast<IPV6_HEADER UNALIGNED const *>(ip);
+
+        ipLength = sizeof(IPV6_HEADER) + RtlUshortByteSwap(ipv6->PayloadLength);
+    }
+
+    Segment.SequenceNumber = RtlUlongByteSwap(tcp->th_seq);
+    Segment.Flags = tcp->th_flags;
+
+    if (ipLength < Layout.Layer3HeaderLength + Layout.Layer4HeaderLength)
+    {
+        return NxRscSegmentType::Unknown;
+    }
+
+    Segment.PayloadLength = ipLength - Layout.Layer3HeaderLength - Layout.Layer4HeaderLength;
+
+    // the coalesced segment has room for neither IP options, extension
+    // headers nor the Ethernet padding of short frames
+    if (Layout.Layer3Type != NET_PACKET_LAYER3_TYPE_IPV4_NO_OPTIONS &&
+        Layout.Layer3Type != NET_PACKET_LAYER3_TYPE_IPV6_NO_EXTENSIONS)
+    {
+        return NxRscSegmentType::Ineligible;
+    }
+
+    if (Layout.Layer2HeaderLength + ipLength != FrameLength)
+    {
+        return NxRscSegmentType::Ineligible;
+    }
+
+    // only plain data segments, PSH ends the coalesced segment
+    if ((Segment.Flags & ~TH_PSH) != TH_ACK || Segment.PayloadLength == 0)
+    {
+        return NxRscSegmentType::Ineligible;
+    }
+
+    // the checksum of a coalesced segment is not recalculated, it is
+    // indicated as validated by the NIC
+    if (! ChecksumInfo.Receive.TcpChecksumSucceeded ||
+        (Segment.IsIPv4 && ! ChecksumInfo.Receive.IpChecksumSucceeded))
+    {
+        return NxRscSegmentType::Ineligible;
+    }
+
+    auto const optionsLength = Layout.Layer4HeaderLength - sizeof(TCP_HDR);
+
+    if (optionsLength == NX_RSC_TIMESTAMP_OPTIONS_LENGTH)
+    {
+        auto const options = reinterpret_cast<UCHAR const *>(tcp + 1);
+
+        if (options[0] != TH_OPT_NOP || options[1] != TH_OPT_NOP ||
+            options[2] != TH_OPT_TS || options[3] != 10)
+        {
+            return NxRscSegmentType::Ineligible;
+        }
+
+        Segment.HasTimestamp = true;
+        Segment.TimestampValue = ReadUlong(&options[4]);
+    }
+    else if (optionsLength != 0)
+    {
+        return NxRscSegmentType::Ineligible;
+    }
+
+    // the payload of a merged segment is described by trimming its first
+    // MDL past the headers, which needs some payload there
+    if (headerLength >= FirstFragmentLength)
+    {
+        return NxRscSegmentType::Ineligible;
+    }
+
+    return NxRscSegmentType::Eligible;
+}
+
+_Use_decl_annotations_
+void
+NxRxCoalescer::Initialize(
+    ULONG MaximumFlows
+)
+{
+    m_maximumFlows = min(max(MaximumFlows, 1UL), static_cast<ULONG>(NX_RSC_MAXIMUM_FLOWS));
+}
+
+_Use_decl_annotations_
+NxRscFlow *
+NxRxCoalescer::Lookup(
+    NxRscSegmentType Type,
+    NxRscSegment const & Segment
+)
+{
+    if (m_activeFlows == 0 || Type == NxRscSegmentType::NotTcp)
+    {
+        return nullptr;
+    }
+
+    if (Type == NxRscSegmentType::Unknown)
+    {
+        FlushAll();
+        return nullptr;
+    }
+
+    for (ULONG i = 0; i < m_maximumFlows; i++)
+    {
+        auto & flow = m_flows[i];
+
+        if (! flow.NetBufferList || ! IsSameFlow(flow.Head, Segment))
+        {
+            continue;
+        }
+
+        auto const ipLength = flow.Head.Layer3HeaderLength + flow.Head.Layer4HeaderLength +
+            flow.PayloadLength + Segment.PayloadLength;
+
+        if (Type == NxRscSegmentType::Eligible &&
+            Segment.SequenceNumber == flow.NextSequenceNumber &&
+            Segment.Layer4HeaderLength == flow.Head.Layer4HeaderLength &&
+            flow.SegmentCount < NX_RSC_MAXIMUM_SEGMENTS &&
+            ipLength <= NX_RSC_MAXIMUM_IP_LENGTH)
+        {
+            flow.LastUse = ++m_clock;
+            return &flow;
+        }
+
+        // the segment would be indicated after the coalesced one, which
+        // must not grow past it
+        Flush(flow);
+        return nullptr;
+    }
+
+    return nullptr;
+}
+
+_Use_decl_annotations_
+void
+NxRxCoalescer::Start(
+    NxRscSegment const & Segment,
+    NET_BUFFER_LIST * NetBufferList,
+    MDL * TailMdl
+)
+{
+    // a PSH segment is indicated right away, nothing may be merged into it
+    if (Segment.Flags & TH_PSH)
+    {
+        return;
+    }
+
+    NxRscFlow * slot = nullptr;
+
+    for (ULONG i = 0; i < m_maximumFlows; i++)
+    {
+        auto & flow = m_flows[i];
+
+        if (! flow.NetBufferList)
+        {
+            slot = &flow;
+            break;
+        }
+
+        if (! slot || flow.LastUse < slot->LastUse)
+        {
+            slot = &flow;
+        }
+    }
+
+    if (slot->NetBufferList)
+    {
+        Flush(*slot);
+    }
+
+    auto const tcp = reinterpret_cast<TCP_HDR UNALIGNED const *>(
+        Segment.Frame + Segment.Layer2HeaderLength + Segment.Layer3HeaderLength);
+
+    slot->NetBufferList = NetBufferList;
+    slot->TailMdl = TailMdl;
+    slot->Head = Segment;
+    slot->SegmentCount = 1;
+    slot->PayloadLength = Segment.PayloadLength;
+    slot->NextSequenceNumber = Segment.SequenceNumber + Segment.PayloadLength;
+    slot->AcknowledgementNumber = tcp->th_ack;
+    slot->Window = tcp->th_win;
+    slot->LastTimestampValue = Segment.TimestampValue;
+    slot->TimestampEcho = Segment.HasTimestamp
+        ? *reinterpret_cast<ULONG UNALIGNED const *>(reinterpret_cast<UCHAR const *>(tcp + 1) + 8)
+        : 0;
+    slot->LastUse = ++m_clock;
+
+    m_activeFlows++;
+}
+
+_Use_decl_annotations_
+void
+NxRxCoalescer::Append(
+    NxRscFlow & Flow,
+    NxRscSegment const & Segment,
+    MDL * TailMdl
+)
+{
+    auto const tcp = reinterpret_cast<TCP_HDR UNALIGNED const *>(
+        Segment.Frame + Segment.Layer2HeaderLength + Segment.Layer3HeaderLength);
+
+    Flow.TailMdl = TailMdl;
+    Flow.SegmentCount++;
+    Flow.PayloadLength += Segment.PayloadLength;
+    Flow.NextSequenceNumber += Segment.PayloadLength;
+    Flow.AcknowledgementNumber = tcp->th_ack;
+    Flow.Window = tcp->th_win;
+
+    if (Segment.HasTimestamp)
+    {
+        Flow.LastTimestampValue = Segment.TimestampValue;
+        Flow.TimestampEcho = *reinterpret_cast<ULONG UNALIGNED const *>(reinterpret_cast<UCHAR const *>(tcp + 1) + 8);
+    }
+
+    m_coalescedSegmentCount++;
+
+    if (Segment.Flags & TH_PSH)
+    {
+        auto headTcp = reinterpret_cast<TCP_HDR UNALIGNED *>(
+            Flow.Head.Frame + Flow.Head.Layer2HeaderLength + Flow.Head.Layer3HeaderLength);
+
+        headTcp->th_flags |= TH_PSH;
+
+        Flush(Flow);
+    }
+}
+
+_Use_decl_annotations_
+void
+NxRxCoalescer::FlushAll(
+    void
+)
+{
+    for (ULONG i = 0; m_activeFlows != 0 && i < m_maximumFlows; i++)
+    {
+        if (m_flows[i].NetBufferList)
+        {
+            Flush(m_flows[i]);
+        }
+    }
+}
+
+_Use_decl_annotations_
+ULONG64
+NxRxCoalescer::GetCoalescedSegmentCount(
+    void
+) const
+{
+    return m_coalescedSegmentCount;
+}
+
+//
+// Rewrites the headers of the first segment to describe the coalesced
+// segment: the IP length covers all the payload, the acknowledgement,
+// window and timestamp echo are those of the last segment.
+//
+_Use_decl_annotations_
+void
+NxRxCoalescer::Flush(
+    NxRscFlow & Flow
+)
+{
+    auto & head = Flow.Head;
+
+    if (Flow.SegmentCount > 1)
+    {
+        auto const ip = head.Frame + head.Layer2HeaderLength;
+        auto const tcp = reinterpret_cast<TCP_HDR UNALIGNED *>(ip + head.Layer3HeaderLength);
+
+        if (head.IsIPv4)
+        {
+            auto const ipv4 = reinterpret_cast<IPV4_HEADER UNALIGNED *>(ip);
+
+            ipv4->TotalLength = RtlUshortByteSwap(static_cast<USHORT>(
+                head.Layer3HeaderLength + head.Layer4HeaderLength + Flow.PayloadLength));
+            ipv4->HeaderChecksum = 0;
+            ipv4->HeaderChecksum = NxChecksumFinish(NxChecksumAdd(0, ipv4, head.Layer3HeaderLength));
+        }
+        else
+        {
+            auto const ipv6 = reinterpret_cast<IPV6_HEADER UNALIGNED *>(ip);
+
+            ipv6->PayloadLength = RtlUshortByteSwap(static_cast<USHORT>(
+                head.Layer4HeaderLength + Flow.PayloadLength));
+        }
+
+        tcp->th_ack = Flow.AcknowledgementNumber;
+        tcp->th_win = Flow.Window;
+
+        if (head.HasTimestamp)
+        {
+            *reinterpret_cast<ULONG UNALIGNED *>(reinterpret_cast<UCHAR *>(tcp + 1) + 8) = Flow.TimestampEcho;
+
+            Flow.NetBufferList->NetBufferListInfo[RscTcpTimestampDelta] =
+                ULongToPtr(Flow.LastTimestampValue - head.TimestampValue);
+        }
+
+        NET_BUFFER_LIST_COALESCED_SEG_COUNT(Flow.NetBufferList) = static_cast<USHORT>(Flow.SegmentCount);
+        NET_BUFFER_LIST_DUP_ACK_COUNT(Flow.NetBufferList) = 0;
+    }
+
+    Flow.NetBufferList = nullptr;
+    Flow.TailMdl = nullptr;
+
+    m_activeFlows--;
+}
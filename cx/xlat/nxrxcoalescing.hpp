@@ -0,0 +1,216 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+/*++
+
+Abstract:
+
+    Software receive segment coalescing. Within one receive indication
+    batch, in order TCP segments of a flow are merged into the NBL of the
+    first segment of the flow, so the stack sees one large segment with
+    the NDIS RSC information filled in.
+
+    NxRxCoalescer decides which segments can be merged and rewrites the
+    headers of the coalesced segment when its flow is flushed. Moving the
+    payload MDLs from one NBL to another is left to the receive queue,
+    which owns them.
+
+    Flows are flushed when the batch ends, when a segment of the flow
+    cannot be merged (out of order, PSH, FIN, pure ACK...), when the
+    coalesced segment is full, and when the flow table is full and the
+    least recently used flow has to make room for a new one.
+
+--*/
+
+#pragma once
+
+// largest number of flows tracked within a batch
+#define NX_RSC_MAXIMUM_FLOWS 64
+
+// largest number of segments merged into one
+#define NX_RSC_MAXIMUM_SEGMENTS 64
+
+enum class NxRscSegmentType
+{
+    // not TCP, does not affect any flow
+    NotTcp,
+
+    // TCP but the headers could not be read, flushes every flow
+    Unknown,
+
+    // TCP that cannot be coalesced, flushes its flow
+    Ineligible,
+
+    Eligible,
+};
+
+struct NxRscSegment
+{
+    // start of the frame and its headers, all within the first fragment
+    UCHAR *
+        Frame;
+
+    ULONG
+        Layer2HeaderLength;
+
+    ULONG
+        Layer3HeaderLength;
+
+    ULONG
+        Layer4HeaderLength;
+
+    bool
+        IsIPv4;
+
+    ULONG
+        PayloadLength;
+
+    // host byte order
+    ULONG
+        SequenceNumber;
+
+    UCHAR
+        Flags;
+
+    bool
+        HasTimestamp;
+
+    // host byte order
+    ULONG
+        TimestampValue;
+
+    // Ieee8021QNetBufferListInfo of a frame whose tag was removed
+    ULONG_PTR
+        Ieee8021Q;
+
+    ULONG
+    GetHeaderLength(
+        void
+    ) const
+    {
+        return Layer2HeaderLength + Layer3HeaderLength + Layer4HeaderLength;
+    }
+};
+
+//
+// Reads the headers of a received frame. FirstFragmentLength bytes of the
+// frame are contiguous at Frame, FrameLength is the length of the whole
+// frame. ChecksumInfo is the checksum result indicated with the frame.
+//
+NxRscSegmentType
+NxRscParseSegment(
+    _In_ NET_PACKET_LAYOUT const & Layout,
+    _In_reads_bytes_(FirstFragmentLength) UCHAR * Frame,
+    _In_ ULONG FirstFragmentLength,
+    _In_ ULONG FrameLength,
+    _In_ NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO ChecksumInfo,
+    _Out_ NxRscSegment & Segment
+);
+
+struct NxRscFlow
+{
+    // NBL of the first segment, the coalesced segment. nullptr if the
+    // slot is free.
+    NET_BUFFER_LIST *
+        NetBufferList;
+
+    // last MDL of the coalesced segment, the next segment is linked to it
+    MDL *
+        TailMdl;
+
+    NxRscSegment
+        Head;
+
+    ULONG
+        SegmentCount;
+
+    ULONG
+        PayloadLength;
+
+    // host byte order
+    ULONG
+        NextSequenceNumber;
+
+    // of the last segment, network byte order
+    ULONG
+        AcknowledgementNumber;
+
+    USHORT
+        Window;
+
+    ULONG
+        TimestampEcho;
+
+    // host byte order
+    ULONG
+        LastTimestampValue;
+
+    ULONG64
+        LastUse;
+};
+
+class NxRxCoalescer
+{
+public:
+
+    void
+    Initialize(
+        _In_ ULONG MaximumFlows
+    );
+
+    // Returns the flow Segment continues, if it can be merged into it. A
+    // flow Segment belongs to but cannot be merged into is flushed.
+    NxRscFlow *
+    Lookup(
+        _In_ NxRscSegmentType Type,
+        _In_ NxRscSegment const & Segment
+    );
+
+    // Starts a flow with an eligible segment which did not continue one
+    void
+    Start(
+        _In_ NxRscSegment const & Segment,
+        _In_ NET_BUFFER_LIST * NetBufferList,
+        _In_ MDL * TailMdl
+    );
+
+    // Records a segment whose payload MDLs were linked to the flow
+    void
+    Append(
+        _Inout_ NxRscFlow & Flow,
+        _In_ NxRscSegment const & Segment,
+        _In_ MDL * TailMdl
+    );
+
+    // Called at the end of a batch, before the NBLs are indicated
+    void
+    FlushAll(
+        void
+    );
+
+    ULONG64
+    GetCoalescedSegmentCount(
+        void
+    ) const;
+
+private:
+
+    void
+    Flush(
+        _Inout_ NxRscFlow & Flow
+    );
+
+    ULONG
+        m_maximumFlows = 0;
+
+    ULONG
+        m_activeFlows = 0;
+
+    ULONG64
+        m_clock = 0;
+
+    ULONG64
+        m_coalescedSegmentCount = 0;
+
+    NxRscFlow
+        m_flows[NX_RSC_MAXIMUM_FLOWS] = {};
+};
@@ -0,0 +1,454 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+#include "NxXlatPrecomp.hpp"
+#include "NxXlatCommon.hpp"
+#include "NxRxSteering.tmh"
+
+#include "NxRxSteering.hpp"
+
+#include <net/packet.h>
+
+#include "NxNblSequence.h"
+
+// IPv4 source and destination addresses, then the ports
+#define NX_STEERING_IPV4_ADDRESSES_SIZE 8
+#define NX_STEERING_IPV6_ADDRESSES_SIZE 32
+#define NX_STEERING_PORTS_SIZE 4
+
+#ifdef _KERNEL_MODE
+
+static KDEFERRED_ROUTINE SteeringWorkerDpc;
+
+_Use_decl_annotations_
+static
+void
+SteeringWorkerDpc(
+    KDPC * Dpc,
+    void * DeferredContext,
+    void * SystemArgument1,
+    void * SystemArgument2
+)
+{
+    UNREFERENCED_PARAMETER((Dpc, SystemArgument1, SystemArgument2));
+
+    auto worker = static_cast<NxRxSteeringWorker *>(DeferredContext);
+
+    worker->Steering->Indicate(*worker);
+}
+
+#endif // _KERNEL_MODE
+
+static
+bool
+IsIPv4(
+    _In_ NET_PACKET_LAYOUT const & Layout
+)
+{
+    return
+        Layout.Layer3Type == NET_PACKET_LAYER3_TYPE_IPV4_NO_OPTIONS ||
+        Layout.Layer3Type == NET_PACKET_LAYER3_TYPE_IPV4_WITH_OPTIONS;
+}
+
+static
+bool
+IsIPv6(
+    _In_ NET_PACKET_LAYOUT const & Layout
+)
+{
+    return
+        Layout.Layer3Type == NET_PACKET_LAYER3_TYPE_IPV6_NO_EXTENSIONS ||
+        Layout.Layer3Type == NET_PACKET_LAYER3_TYPE_IPV6_WITH_EXTENSIONS;
+}
+
+//
+// Picks the most specific of the enabled hash types that applies to the
+// packet. IP fragments have no ports to hash, they fall back to the
+// addresses only.
+//
+static
+UINT32
+GetPacketHashType(
+    _In_ NET_PACKET_LAYOUT const & Layout,
+    _In_ UINT32 EnabledHashTypes
+)
+{
+    auto const isTcp = Layout.Layer4Type == NET_PACKET_LAYER4_TYPE_TCP;
+    auto const isUdp = Layout.Layer4Type == NET_PACKET_LAYER4_TYPE_UDP;
+
+    UINT32 tcp, udp, ip;
+
+    if (IsIPv4(Layout))
+    {
+        tcp = NDIS_HASH_TCP_IPV4;
+        udp = NDIS_HASH_UDP_IPV4;
+        ip = NDIS_HASH_IPV4;
+    }
+    else if (IsIPv6(Layout))
+    {
+        tcp = NDIS_HASH_TCP_IPV6;
+        udp = NDIS_HASH_UDP_IPV6;
+        ip = NDIS_HASH_IPV6;
+    }
+    else
+    {
+        return 0;
+    }
+
+    if (isTcp && WI_IsFlagSet(EnabledHashTypes, tcp))
+    {
+        return tcp;
+    }
+
+    if (isUdp && WI_IsFlagSet(EnabledHashTypes, udp))
+    {
+        return udp;
+    }
+
+    if (WI_IsFlagSet(EnabledHashTypes, ip))
+    {
+        return ip;
+    }
+
+    return 0;
+}
+
+_Use_decl_annotations_
+NxRxSteering::~NxRxSteering(
+    void
+)
+{
+#ifdef _KERNEL_MODE
+    // the workers' DPCs reference this object
+    if (m_workers.count() > 0)
+    {
+        KeFlushQueuedDpcs();
+    }
+#endif
+}
+
+_Use_decl_annotations_
+NTSTATUS
+NxRxSteering::Initialize(
+    INxNblDispatcher * NblDispatcher,
+    INxNblRx * NblRx,
+    size_t NumberOfIndirectionEntries
+)
+{
+#ifdef _KERNEL_MODE
+    m_nblDispatcher = NblDispatcher;
+    m_nblRx = NblRx;
+
+    // the hash is masked into the table, which NDIS sizes to a power of two
+    auto numberOfEntries = NumberOfIndirectionEntries;
+    if (numberOfEntries == 0 || (numberOfEntries & (numberOfEntries - 1)) != 0)
+    {
+        numberOfEntries = NDIS_RSS_INDIRECTION_TABLE_MAX_SIZE_REVISION_1;
+    }
+
+    CX_RETURN_NTSTATUS_IF(
+        STATUS_INSUFFICIENT_RESOURCES,
+        ! m_indirectionTable.resize(numberOfEntries));
+
+    for (auto & entry : m_indirectionTable)
+    {
+        entry = 0U;
+    }
+
+    auto const processorCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    CX_RETURN_NTSTATUS_IF(
+        STATUS_INSUFFICIENT_RESOURCES,
+        ! m_batchedWorkers.resize(processorCount));
+
+    CX_RETURN_NTSTATUS_IF(
+        STATUS_INSUFFICIENT_RESOURCES,
+        ! m_workers.resize(processorCount));
+
+    for (ULONG i = 0; i < processorCount; i++)
+    {
+        auto & worker = m_workers[i];
+
+        ndisInitializeNblQueue(&worker.Batch.Queue);
+        worker.Batch.NblCount = 0;
+
+        //
+        // processors that may be added later have an index but no number
+        // yet, packets for them are indicated from the receive queue
+        //
+        PROCESSOR_NUMBER processorNumber;
+        if (! NT_SUCCESS(KeGetProcessorNumberFromIndex(i, &processorNumber)))
+        {
+            continue;
+        }
+
+        KeInitializeDpc(&worker.Dpc, SteeringWorkerDpc, &worker);
+
+        CX_RETURN_IF_NOT_NT_SUCCESS(
+            KeSetTargetProcessorDpcEx(&worker.Dpc, &processorNumber));
+
+        // the target processor is interrupted to run the worker right away
+        KeSetImportanceDpc(&worker.Dpc, MediumHighImportance);
+
+        worker.Steering = this;
+    }
+
+    return STATUS_SUCCESS;
+#else
+    UNREFERENCED_PARAMETER((NblDispatcher, NblRx, NumberOfIndirectionEntries));
+
+    return STATUS_NOT_SUPPORTED;
+#endif // _KERNEL_MODE
+}
+
+_Use_decl_annotations_
+bool
+NxRxSteering::IsEnabled(
+    void
+) const
+{
+    return m_enabled;
+}
+
+_Use_decl_annotations_
+void
+NxRxSteering::SetEnabled(
+    bool Enabled
+)
+{
+    m_enabled = Enabled;
+}
+
+_Use_decl_annotations_
+void
+NxRxSteering::SetHashType(
+    UINT32 HashType
+)
+{
+    m_hashType = HashType;
+}
+
+//
+// The table is rebuilt while the receive queue may be hashing. NDIS only
+// changes the key along with the hash types, and a few packets hashed
+// with a mix of both keys land on a wrong processor at worst.
+//
+_Use_decl_annotations_
+void
+NxRxSteering::SetHashSecretKey(
+    UINT8 const * Key
+)
+{
+    m_hash.SetKey(Key);
+}
+
+//
+// Entries are single ULONG stores, read by the receive queue without a
+// lock. A packet looked up while its entry changes goes to either the old
+// or the new processor, as it would with a NIC updating its table.
+//
+_Use_decl_annotations_
+void
+NxRxSteering::SetIndirectionEntry(
+    size_t Index,
+    PROCESSOR_NUMBER const & Processor
+)
+{
+#ifdef _KERNEL_MODE
+    if (Index >= m_indirectionTable.count())
+    {
+        return;
+    }
+
+    auto processorNumber = Processor;
+    auto const processorIndex = KeGetProcessorIndexFromNumber(&processorNumber);
+
+    if (processorIndex != INVALID_PROCESSOR_INDEX)
+    {
+        WriteULongNoFence(
+            reinterpret_cast<ULONG volatile *>(&m_indirectionTable[Index]),
+            processorIndex);
+    }
+#else
+    UNREFERENCED_PARAMETER((Index, Processor));
+#endif // _KERNEL_MODE
+}
+
+_Use_decl_annotations_
+void
+NxRxSteering::HashPacket(
+    NET_PACKET_LAYOUT const & Layout,
+    UCHAR const * Frame,
+    size_t FirstFragmentLength,
+    NET_BUFFER_LIST * Nbl
+) const
+{
+    Nbl->NetBufferListInfo[NetBufferListHashValue] = nullptr;
+    Nbl->NetBufferListInfo[NetBufferListHashInfo] = nullptr;
+
+    if (! m_enabled)
+    {
+        return;
+    }
+
+    auto const hashType = GetPacketHashType(Layout, m_hashType);
+
+    if (hashType == 0)
+    {
+        return;
+    }
+
+    auto const hasPorts =
+        hashType != NDIS_HASH_IPV4 &&
+        hashType != NDIS_HASH_IPV6;
+
+    size_t addressesOffset;
+    size_t addressesSize;
+
+    if (IsIPv4(Layout))
+    {
+        addressesOffset = Layout.Layer2HeaderLength + FIELD_OFFSET(IPV4_HEADER, SourceAddress);
+        addressesSize = NX_STEERING_IPV4_ADDRESSES_SIZE;
+    }
+    else
+    {
+        addressesOffset = Layout.Layer2HeaderLength + FIELD_OFFSET(IPV6_HEADER, SourceAddress);
+        addressesSize = NX_STEERING_IPV6_ADDRESSES_SIZE;
+    }
+
+    size_t const portsOffset = Layout.Layer2HeaderLength + Layout.Layer3HeaderLength;
+
+    // headers outside of the first fragment are not hashed
+    if (addressesOffset + addressesSize > FirstFragmentLength ||
+        (hasPorts && portsOffset + NX_STEERING_PORTS_SIZE > FirstFragmentLength))
+    {
+        return;
+    }
+
+    UINT8 input[NX_TOEPLITZ_MAXIMUM_INPUT_SIZE];
+    size_t inputSize = addressesSize;
+
+    RtlCopyMemory(input, Frame + addressesOffset, addressesSize);
+
+    if (hasPorts)
+    {
+        RtlCopyMemory(input + inputSize, Frame + portsOffset, NX_STEERING_PORTS_SIZE);
+        inputSize += NX_STEERING_PORTS_SIZE;
+    }
+
+    NET_BUFFER_LIST_SET_HASH_VALUE(Nbl, m_hash.Hash(input, inputSize));
+    NET_BUFFER_LIST_SET_HASH_TYPE(Nbl, hashType);
+    NET_BUFFER_LIST_SET_HASH_FUNCTION(Nbl, NdisHashFunctionToeplitz);
+}
+
+_Use_decl_annotations_
+bool
+NxRxSteering::Steer(
+    NET_BUFFER_LIST * Nbl
+)
+{
+#ifdef _KERNEL_MODE
+    if (! m_enabled || NET_BUFFER_LIST_GET_HASH_TYPE(Nbl) == 0)
+    {
+        return false;
+    }
+
+    auto const hash = NET_BUFFER_LIST_GET_HASH_VALUE(Nbl);
+    auto const processorIndex = ReadULongNoFence(
+        reinterpret_cast<ULONG volatile *>(&m_indirectionTable[hash & (m_indirectionTable.count() - 1)]));
+
+    // packets for this processor are indicated with the rest of the batch
+    if (processorIndex == KeGetCurrentProcessorIndex() ||
+        processorIndex >= m_workers.count())
+    {
+        return false;
+    }
+
+    auto & worker = m_workers[processorIndex];
+
+    if (! worker.Steering)
+    {
+        return false;
+    }
+
+    if (worker.Batch.NblCount == 0)
+    {
+        m_batchedWorkers[m_batchedWorkerCount++] = processorIndex;
+    }
+
+    ndisAppendSingleNblToNblQueue(&worker.Batch.Queue, Nbl);
+    worker.Batch.NblCount += 1;
+
+    return true;
+#else
+    UNREFERENCED_PARAMETER(Nbl);
+
+    return false;
+#endif // _KERNEL_MODE
+}
+
+_Use_decl_annotations_
+void
+NxRxSteering::Flush(
+    void
+)
+{
+#ifdef _KERNEL_MODE
+    for (size_t i = 0; i < m_batchedWorkerCount; i++)
+    {
+        auto & worker = m_workers[m_batchedWorkers[i]];
+
+        worker.Queue.Enqueue(&worker.Batch);
+
+        ndisInitializeNblQueue(&worker.Batch.Queue);
+        worker.Batch.NblCount = 0;
+
+        // already queued if the worker has not drained an earlier batch yet
+        (void)KeInsertQueueDpc(&worker.Dpc, nullptr, nullptr);
+    }
+#endif // _KERNEL_MODE
+
+    m_batchedWorkerCount = 0;
+}
+
+//
+// Runs on the worker's processor. NBLs that cannot be indicated because the
+// datapath is stopping are returned to their receive queue as if NDIS had
+// returned them.
+//
+_Use_decl_annotations_
+void
+NxRxSteering::Indicate(
+    NxRxSteeringWorker & Worker
+)
+{
+    auto nbl = Worker.Queue.DequeueAll();
+
+    NxNblSequence nbls;
+    while (nbl)
+    {
+        auto const next = nbl->Next;
+        nbl->Next = nullptr;
+        nbls.AddNbl(nbl);
+        nbl = next;
+    }
+
+    if (! nbls)
+    {
+        return;
+    }
+
+    nbls.Indicate(
+        [this](NET_BUFFER_LIST * First, NET_BUFFER_LIST *, ULONG Count, ULONG ReceiveFlags)
+        {
+            if (! m_nblDispatcher->IndicateReceiveNetBufferLists(
+                    First,
+                    NDIS_DEFAULT_PORT_NUMBER,
+                    Count,
+                    ReceiveFlags | NDIS_RECEIVE_FLAGS_DISPATCH_LEVEL))
+            {
+                (void)m_nblRx->ReturnNetBufferLists(
+                    First,
+                    NDIS_RETURN_FLAGS_DISPATCH_LEVEL);
+            }
+        });
+}
@@ -0,0 +1,161 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+/*++
+
+Abstract:
+
+    Software receive side scaling, for NICs with a single receive queue.
+
+    The receive queue hashes every packet with the Toeplitz key and hash
+    types NDIS configured, reports the hash in the NBL and looks the hash
+    up in the indirection table to find the processor the packet is meant
+    for. Packets for another processor are handed to that processor's
+    worker, a DPC targeted at it, which indicates them to NDIS from there.
+
+    The receive queue stays the only producer of the workers' batches, the
+    workers only share their NBL queues with it.
+
+--*/
+
+#pragma once
+
+#include <KArray.h>
+
+#include "NxNblQueue.hpp"
+#include "NxToeplitz.hpp"
+
+class NxRxSteering;
+
+struct DECLSPEC_CACHEALIGN NxRxSteeringWorker
+{
+#ifdef _KERNEL_MODE
+    KDPC
+        Dpc;
+#endif
+
+    NxRxSteering *
+        Steering = nullptr;
+
+    NxNblQueue
+        Queue;
+
+    // NBLs steered to the worker by the current batch, only touched by the
+    // receive queue
+    NBL_COUNTED_QUEUE
+        Batch;
+};
+
+class NxRxSteering :
+    public NxNonpagedAllocation<'tSxN'>
+{
+public:
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    ~NxRxSteering(
+        void
+    );
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    NTSTATUS
+    Initialize(
+        _In_ INxNblDispatcher * NblDispatcher,
+        _In_ INxNblRx * NblRx,
+        _In_ size_t NumberOfIndirectionEntries
+    );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    bool
+    IsEnabled(
+        void
+    ) const;
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    void
+    SetEnabled(
+        _In_ bool Enabled
+    );
+
+    // takes the NDIS_HASH_* types to hash, packets of other types are not
+    // steered
+    _IRQL_requires_(PASSIVE_LEVEL)
+    void
+    SetHashType(
+        _In_ UINT32 HashType
+    );
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    void
+    SetHashSecretKey(
+        _In_reads_bytes_(NX_TOEPLITZ_KEY_SIZE) UINT8 const * Key
+    );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    void
+    SetIndirectionEntry(
+        _In_ size_t Index,
+        _In_ PROCESSOR_NUMBER const & Processor
+    );
+
+    // fills the hash information of Nbl from the headers in Frame, or
+    // clears it if the packet's type is not hashed
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    void
+    HashPacket(
+        _In_ NET_PACKET_LAYOUT const & Layout,
+        _In_reads_bytes_(FirstFragmentLength) UCHAR const * Frame,
+        _In_ size_t FirstFragmentLength,
+        _Inout_ NET_BUFFER_LIST * Nbl
+    ) const;
+
+    // returns false if Nbl is to be indicated by the caller, on the
+    // current processor
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    bool
+    Steer(
+        _In_ NET_BUFFER_LIST * Nbl
+    );
+
+    // hands the NBLs steered since the last flush to their workers
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    void
+    Flush(
+        void
+    );
+
+    _IRQL_requires_(DISPATCH_LEVEL)
+    void
+    Indicate(
+        _In_ NxRxSteeringWorker & Worker
+    );
+
+private:
+
+    INxNblDispatcher *
+        m_nblDispatcher = nullptr;
+
+    INxNblRx *
+        m_nblRx = nullptr;
+
+    bool
+        m_enabled = false;
+
+    UINT32
+        m_hashType = 0;
+
+    NxToeplitzHash
+        m_hash;
+
+    // processor index of each entry, the number of entries is a power of two
+    Rtl::KArray<ULONG, NonPagedPoolNx>
+        m_indirectionTable;
+
+    Rtl::KArray<NxRxSteeringWorker, NonPagedPoolNx>
+        m_workers;
+
+    // workers with a non-empty batch
+    Rtl::KArray<ULONG, NonPagedPoolNx>
+        m_batchedWorkers;
+
+    size_t
+        m_batchedWorkerCount = 0;
+};
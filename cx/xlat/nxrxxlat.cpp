@@ -14,6 +14,7 @@ Abstract:
 
 #include "NxRxXlat.tmh"
 #include "NxRxXlat.hpp"
+#include "NxNumaNode.hpp"
 
 #include <net/ring.h>
 #include <net/packet.h>
@@ -23,6 +24,7 @@ Abstract:
 #include "NxPacketLayout.hpp"
 #include "NxChecksumInfo.hpp"
 #include "NxNblSequence.h"
+#include "NxRxCoalescing.hpp"
 
 struct RX_NBL_CONTEXT
 {
@@ -39,7 +41,12 @@ GetRxContextFromNbl(PNET_BUFFER_LIST Nbl)
 static_assert(sizeof(RX_NBL_CONTEXT) <= FIELD_SIZE(NET_BUFFER_LIST, MiniportReserved),
               "the size of RX_NBL_CONTEXT struct is larger than available space on NBL reserved for miniport");
 
-struct RX_NB_CONTEXT
+//
+// Receive buffers are described by MDLs bound to fragments, not to NBLs, so
+// a packet can span any number of fragments. Each MDL in m_MdlPool is
+// preceded by a RX_MDL_CONTEXT describing the buffer it maps.
+//
+struct RX_MDL_CONTEXT
 {
     union
     {
@@ -48,18 +55,27 @@ struct RX_NB_CONTEXT
         //used when driver manages the buffers
         PVOID RxBufferReturnContext;
     } DUMMYUNIONNAME;
+
+    //used when system fully manages the Rx buffers, capacity of the attached buffer
+    ULONG BufferSize;
+
+    //class of the attached buffer, always the large class in the other modes
+    UINT8 BufferClass;
+
+    //bytes at the start of the buffer the MDL was moved past, the headers
+    //of a segment merged by receive segment coalescing
+    ULONG TrimmedBytes;
 };
 
-RX_NB_CONTEXT*
-GetRxContextFromNb(PNET_BUFFER Nb)
+static size_t const RX_MDL_CONTEXT_SIZE = ALIGN_UP(sizeof(RX_MDL_CONTEXT), PVOID);
+
+RX_MDL_CONTEXT*
+GetRxContextFromMdl(PMDL Mdl)
 {
     return
-        reinterpret_cast<RX_NB_CONTEXT*>(&NET_BUFFER_MINIPORT_RESERVED(Nb)[0]);
+        reinterpret_cast<RX_MDL_CONTEXT*>(reinterpret_cast<UCHAR*>(Mdl) - RX_MDL_CONTEXT_SIZE);
 }
 
-static_assert(sizeof(RX_NB_CONTEXT) <= FIELD_SIZE(NET_BUFFER, MiniportReserved),
-              "the size of RX_NB_CONTEXT struct is larger than available space on NB reserved for miniport");
-
 static
 void
 NetClientQueueNotify(
@@ -78,14 +94,19 @@ static const NET_CLIENT_QUEUE_NOTIFY_DISPATCH QueueDispatch
 ULONG const MAX_DYNAMIC_PAGES = 16;
 ULONG const MAX_DYNAMIC_PACKET_SIZE = (MAX_DYNAMIC_PAGES - 1) * PAGE_SIZE + 1;
 
-constexpr
-USHORT
-ByteSwap(
-    _In_ USHORT in
-)
-{
-    return (USHORT)((in >> 8) | (in << 8));
-}
+//
+// When a small receive buffer class is configured the share of small
+// buffers posted to the NIC, out of RX_BUFFER_CLASS_RATIO_SCALE, follows
+// the share of small frames received over each sampling window. Some
+// buffers of both classes are always posted.
+//
+UINT32 const RX_BUFFER_CLASS_RATIO_SCALE = 256;
+UINT32 const RX_BUFFER_CLASS_MIN_SMALL_RATIO = RX_BUFFER_CLASS_RATIO_SCALE / 8;
+UINT32 const RX_BUFFER_CLASS_MAX_SMALL_RATIO = RX_BUFFER_CLASS_RATIO_SCALE - RX_BUFFER_CLASS_MIN_SMALL_RATIO;
+UINT32 const RX_BUFFER_CLASS_SAMPLE_FRAMES = 1024;
+
+// share of the receive buffers allocated from the large class when a small class is configured
+size_t const RX_LARGE_BUFFER_CLASS_DIVISOR = 4;
 
 PNET_BUFFER_LIST
 GetLongestSpanWithSameQueue(
@@ -207,15 +228,68 @@ NxRxXlat::SetGroupAffinity(
 )
 {
     m_groupAffinity = GroupAffinity;
+    m_preferredNode = NxGetNodeFromGroupAffinity(GroupAffinity);
     (void)InterlockedExchange(&m_groupAffinityChanged, 1);
 }
 
+_Use_decl_annotations_
+void
+NxRxXlat::SetPollWorker(
+    NxPollWorker * PollWorker
+)
+{
+    m_pollWorker = PollWorker;
+}
+
+_Use_decl_annotations_
+void
+NxRxXlat::SetPacketRingSizeHint(
+    UINT32 PacketRingSizeHint
+)
+{
+    m_packetRingSizeHint = PacketRingSizeHint;
+}
+
+_Use_decl_annotations_
+void
+NxRxXlat::SetRxSteering(
+    NxRxSteering * RxSteering
+)
+{
+    m_rxSteering = RxSteering;
+}
+
+_Use_decl_annotations_
+UINT32
+NxRxXlat::GetRecommendedPacketRingSize(
+    void
+) const
+{
+    return NxPerfTunerRecommendPacketRingSize(m_packetRingOccupancy);
+}
+
+_Use_decl_annotations_
+void
+NxRxXlat::GetStatistics(
+    NxQueueStatistics & Statistics
+) const
+{
+    Statistics = {};
+    Statistics.Ring = m_packetRing.GetRingbufferCounters();
+    Statistics.ExecutionContext = m_executionContext.GetExecutionContextCounters();
+    Statistics.Notification = m_moderator.GetCounters();
+
+    NxQueueStatisticsCalculateCyclesPerPacket(Statistics);
+}
+
 NxRxXlat::ArmedNotifications
 NxRxXlat::GetNotificationsToArm()
 {
     ArmedNotifications notifications;
 
-    if (m_postedPackets == 0 && m_returnedPackets == 0)
+    // a stage that ran out of budget has work left, keep polling
+    if (m_postedPackets == 0 && m_returnedPackets == 0 &&
+        ! m_indicateBudget.WasExhausted() && ! m_prepareBudget.WasExhausted())
     {
         notifications.Flags.ShouldArmNblReturned = true;
 
@@ -251,6 +325,8 @@ NxRxXlat::ArmNetBufferListReturnedNotification()
 void
 NxRxXlat::ArmAdapterRxNotification()
 {
+    m_moderator.OnArm();
+
     m_queueDispatch->SetArmed(m_queue, true);
 }
 
@@ -277,55 +353,87 @@ NxRxXlat::EcPrepareBuffersForNetAdapter()
 {
     m_returnedPackets = 0;
 
-    auto pr = NetRingCollectionGetPacketRing(&m_rings);
-    auto fr = NetRingCollectionGetFragmentRing(&m_rings);
-    auto const lastIndex = (pr->OSReserved0 - 1) & pr->ElementIndexMask;
+    m_prepareBudget.Begin();
 
-    NT_FRE_ASSERT(pr->EndIndex == fr->EndIndex);
-    NT_FRE_ASSERT(pr->OSReserved0 == fr->OSReserved0);
+    auto pr = NetRingCollectionGetPacketRing(&m_rings);
+    auto const lastPacketIndex = (pr->OSReserved0 - 1) & pr->ElementIndexMask;
 
-    // 1:1 packet:fragment, iterate packet,fragment owned by framework
-    for (; ! NblStackIsEmpty() && pr->EndIndex != lastIndex;
-        fr->EndIndex = pr->EndIndex = NetRingIncrementIndex(pr, pr->EndIndex))
+    // packets and fragments are replenished independently, iterate packets owned by framework
+    for (; ! NblStackIsEmpty() && pr->EndIndex != lastPacketIndex && m_prepareBudget.HasPackets();
+        pr->EndIndex = NetRingIncrementIndex(pr, pr->EndIndex))
     {
-
         auto & context = m_packetContext.GetContext<PacketContext>(pr->EndIndex);
         auto packet = NetRingGetPacketAtIndex(pr, pr->EndIndex);
-        auto fragment = NetRingGetFragmentAtIndex(fr, fr->EndIndex);
 
         NT_FRE_ASSERT(context.NetBufferList == nullptr);
 
         context.NetBufferList = NblStackPop();
         context.NetBufferList->Next = nullptr;
+        context.Parsed = false;
 
         // XXX we need to review whether we zero the entire packet + extension
         RtlZeroMemory(packet, pr->ElementStride);
 
+        --m_outstandingPackets;
+
+        m_prepareBudget.Consume(1, 0);
+    }
+
+    auto morePackets = ! NblStackIsEmpty() && pr->EndIndex != lastPacketIndex;
+
+    auto fr = NetRingCollectionGetFragmentRing(&m_rings);
+    auto const lastFragmentIndex = (fr->OSReserved0 - 1) & fr->ElementIndexMask;
+
+    // iterate fragments owned by framework, the byte budget counts the
+    // buffer space posted
+    for (; fr->EndIndex != lastFragmentIndex && m_prepareBudget.HasBytes();
+        fr->EndIndex = NetRingIncrementIndex(fr, fr->EndIndex))
+    {
+        auto fragment = NetRingGetFragmentAtIndex(fr, fr->EndIndex);
+
         // XXX we need to review whether we zero the entire fragment
         if (m_rxBufferAllocationMode == NET_CLIENT_MEMORY_MANAGEMENT_MODE_OS_ALLOCATE_AND_ATTACH)
         {
-            auto nb = NET_BUFFER_LIST_FIRST_NB(context.NetBufferList);
-            auto mdl = NET_BUFFER_CURRENT_MDL(nb);
+            auto const bufferClass = EcSelectBufferClass();
+
+            if (MdlStackIsEmpty(bufferClass))
+            {
+                break;
+            }
+
+            auto & context = m_fragmentContext.GetContext<FragmentContext>(fr->EndIndex);
+
+            NT_FRE_ASSERT(context.Mdl == nullptr);
+
+            auto mdl = MdlStackPop(bufferClass);
+            auto const mdlContext = GetRxContextFromMdl(mdl);
+
+            // the previous indication may have trimmed the MDL to the received data
+            mdl->ByteCount = mdlContext->BufferSize;
+            context.Mdl = mdl;
 
             fragment->VirtualAddress = MmGetMdlVirtualAddress(mdl);
-            fragment->Mapping.DmaLogicalAddress = GetRxContextFromNb(nb)->DmaLogicalAddress;
-            fragment->Capacity = MmGetMdlByteCount(mdl);
+            fragment->Mapping.DmaLogicalAddress = mdlContext->DmaLogicalAddress;
+            fragment->Capacity = mdlContext->BufferSize;
             fragment->Offset = m_backfillSize;
             fragment->Scratch = 0;
+
+            m_prepareBudget.Consume(0, mdlContext->BufferSize);
         }
         else
         {
             RtlZeroMemory(fragment, fr->ElementStride);
         }
-
-        --m_outstandingPackets;
     }
+
+    m_prepareBudget.End(morePackets || fr->EndIndex != lastFragmentIndex);
 }
 
 void
 NxRxXlat::EcUpdateAffinity()
 {
-    if (m_groupAffinityChanged)
+    // the poll worker running a shared EC is pinned to its own processor
+    if (m_groupAffinityChanged && m_executionContext.HasDedicatedThread())
     {
         while (InterlockedExchange(&m_groupAffinityChanged, 0))
         {
@@ -379,57 +487,372 @@ PrefetchPacketPayloadForReceiveIndication(
     PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, payload + firstReadFieldOffset);
 }
 
+//
+// Stage 1 of the indication pipeline, pulls in the cache lines the later
+// stages touch for the packet at PacketIndex.
+//
+void
+NxRxXlat::EcPrefetchPacket(
+    _In_ UINT32 PacketIndex
+)
+{
+    auto const pr = NetRingCollectionGetPacketRing(&m_rings);
+    auto const packet = NetRingGetPacketAtIndex(pr, PacketIndex);
+
+    PrefetchNblForReceiveIndication(m_packetContext.GetContext<PacketContext>(PacketIndex).NetBufferList);
+
+    if (! packet->Ignore && packet->FragmentCount != 0)
+    {
+        auto const fr = NetRingCollectionGetFragmentRing(&m_rings);
+        PrefetchPacketPayloadForReceiveIndication(NetRingGetFragmentAtIndex(fr, packet->FragmentIndex));
+    }
+}
+
+//
+// Stage 2 of the indication pipeline, parses the headers the prefetch
+// stage pulled in and fills the NBL metadata derived from them.
+//
+void
+NxRxXlat::EcParsePacket(
+    _In_ UINT32 PacketIndex
+)
+{
+    auto const pr = NetRingCollectionGetPacketRing(&m_rings);
+    auto const packet = NetRingGetPacketAtIndex(pr, PacketIndex);
+
+    auto & context = m_packetContext.GetContext<PacketContext>(PacketIndex);
+
+    if (packet->Ignore || packet->FragmentCount == 0 || context.Parsed)
+    {
+        return;
+    }
+
+    context.Parsed = true;
+
+    auto nbl = context.NetBufferList;
+
+    // Always compute packet layout in software on RX path now.
+    auto const info = NxParseRxPacket(m_adapterProperties.MediaType, &m_rings, packet);
+    packet->Layout = info.Layout;
+
+    nbl->NetBufferListInfo[Ieee8021QNetBufferListInfo] = nullptr;
+
+    if (info.HasIeee8021Q)
+    {
+        // the addresses slide over the tag and the frame starts past it
+        auto const fr = NetRingCollectionGetFragmentRing(&m_rings);
+        auto const firstFragment = NetRingGetFragmentAtIndex(fr, packet->FragmentIndex);
+        auto const frame = static_cast<UCHAR *>(firstFragment->VirtualAddress) + firstFragment->Offset;
+
+        RtlMoveMemory(
+            frame + NX_VLAN_TAG_SIZE,
+            frame,
+            FIELD_OFFSET(ETHERNET_HEADER, Type));
+
+        firstFragment->Offset += NX_VLAN_TAG_SIZE;
+        firstFragment->ValidLength -= NX_VLAN_TAG_SIZE;
+        packet->Layout.Layer2HeaderLength -= NX_VLAN_TAG_SIZE;
+
+        nbl->NetBufferListInfo[Ieee8021QNetBufferListInfo] = info.Ieee8021Q.Value;
+    }
+
+    // the hash is reported whether or not the packet ends up steered
+    auto const rxSteering = m_rxSteering;
+    if (rxSteering)
+    {
+        auto const fr = NetRingCollectionGetFragmentRing(&m_rings);
+        auto const firstFragment = NetRingGetFragmentAtIndex(fr, packet->FragmentIndex);
+
+        rxSteering->HashPacket(
+            packet->Layout,
+            static_cast<UCHAR const *>(firstFragment->VirtualAddress) + firstFragment->Offset,
+            static_cast<size_t>(firstFragment->ValidLength),
+            nbl);
+    }
+
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO checksumInfo = {};
+
+    if (IsPacketChecksumEnabled())
+    {
+        checksumInfo = NxTranslateRxPacketChecksum(packet, &m_checksumExtension, PacketIndex);
+    }
+
+    // whatever the NIC did not check is validated in software, if enabled
+    m_checksumEngine.ValidatePacket(&m_rings, *packet, checksumInfo);
+
+    nbl->NetBufferListInfo[TcpIpChecksumNetBufferListInfo] = checksumInfo.Value;
+
+    nbl->NblFlags = info.NblFlags;
+    nbl->NetBufferListInfo[NetBufferListFrameType] = (PVOID)info.FrameType;
+    nbl->NetBufferListInfo[TcpRecvSegCoalesceInfo] = nullptr;
+    nbl->NetBufferListInfo[RscTcpTimestampDelta] = nullptr;
+
+    // every queue of the translator is the default VMQ queue
+    nbl->NetBufferListInfo[NetBufferListFilteringInfo] = nullptr;
+}
+
+//
+// Software receive segment coalescing, between the translation of a packet
+// to its NBL and the indication. Returns true if the payload of Nbl was
+// merged into the NBL of an earlier segment of the same flow, in which case
+// Nbl is left without MDLs and must not be indicated.
+//
+_Use_decl_annotations_
+bool
+NxRxXlat::EcCoalescePacket(
+    NET_PACKET const * Packet,
+    NET_BUFFER_LIST * Nbl
+)
+{
+    auto const fr = NetRingCollectionGetFragmentRing(&m_rings);
+    auto const firstFragment = NetRingGetFragmentAtIndex(fr, Packet->FragmentIndex);
+    auto const nb = NET_BUFFER_LIST_FIRST_NB(Nbl);
+
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO checksumInfo;
+    checksumInfo.Value = reinterpret_cast<ULONG_PTR>(Nbl->NetBufferListInfo[TcpIpChecksumNetBufferListInfo]);
+
+    NxRscSegment segment;
+    auto const type = NxRscParseSegment(
+        Packet->Layout,
+        static_cast<UCHAR *>(firstFragment->VirtualAddress) + firstFragment->Offset,
+        static_cast<ULONG>(firstFragment->ValidLength),
+        NET_BUFFER_DATA_LENGTH(nb),
+        checksumInfo,
+        segment);
+
+    // the tag was moved out of the frame, it is compared from the NBL
+    segment.Ieee8021Q = reinterpret_cast<ULONG_PTR>(Nbl->NetBufferListInfo[Ieee8021QNetBufferListInfo]);
+
+    auto flow = m_coalescer.Lookup(type, segment);
+
+    if (type != NxRscSegmentType::Eligible)
+    {
+        return false;
+    }
+
+    auto tailMdl = NET_BUFFER_FIRST_MDL(nb);
+    while (NDIS_MDL_LINKAGE(tailMdl))
+    {
+        tailMdl = NDIS_MDL_LINKAGE(tailMdl);
+    }
+
+    if (! flow)
+    {
+        m_coalescer.Start(segment, Nbl, tailMdl);
+        return false;
+    }
+
+    //
+    // move the first MDL past the headers, the buffer it maps is given back
+    // from its original address when the coalesced NBL is returned
+    //
+    auto const firstMdl = NET_BUFFER_FIRST_MDL(nb);
+    auto const trimmedBytes = NET_BUFFER_DATA_OFFSET(nb) + segment.GetHeaderLength();
+    auto const mdlContext = GetRxContextFromMdl(firstMdl);
+
+    NT_ASSERT(mdlContext->TrimmedBytes == 0);
+
+    MmInitializeMdl(
+        firstMdl,
+        static_cast<UCHAR *>(MmGetMdlVirtualAddress(firstMdl)) + trimmedBytes,
+        MmGetMdlByteCount(firstMdl) - trimmedBytes);
+    MmBuildMdlForNonPagedPool(firstMdl);
+    mdlContext->TrimmedBytes = trimmedBytes;
+
+    NDIS_MDL_LINKAGE(flow->TailMdl) = firstMdl;
+    NET_BUFFER_DATA_LENGTH(NET_BUFFER_LIST_FIRST_NB(flow->NetBufferList)) += segment.PayloadLength;
+
+    m_coalescer.Append(*flow, segment, tailMdl);
+
+    NET_BUFFER_FIRST_MDL(nb) = NET_BUFFER_CURRENT_MDL(nb) = nullptr;
+    NET_BUFFER_DATA_LENGTH(nb) = 0;
+
+    return true;
+}
+
+//
+// Packets completed by the NIC go through a three stage pipeline: packet
+// i + K is prefetched, packet i + K / 2 is parsed and packet i is translated
+// to its NBL, where K is RxPrefetchDistance. By the time a stage touches a
+// packet the previous stage has had a few packets worth of time to bring
+// its cache lines in.
+//
 void
 NxRxXlat::EcIndicateNblsToNdis()
 {
     auto pr = NetRingCollectionGetPacketRing(&m_rings);
-    auto fr = NetRingCollectionGetFragmentRing(&m_rings);
 
-    NT_FRE_ASSERT(pr->OSReserved0 == fr->OSReserved0);
-    NT_FRE_ASSERT(pr->BeginIndex == fr->BeginIndex);
+    m_indicateBudget.Begin();
+
+    auto const fr = NetRingCollectionGetFragmentRing(&m_rings);
+    auto fragmentEnd = fr->OSReserved0;
+
+    auto const begin = pr->OSReserved0;
+    auto const available = NetRingGetRangeCount(pr, begin, pr->BeginIndex);
+    auto count = m_indicateBudget.GetPacketLimit(available);
+    auto const prefetchDistance = static_cast<UINT32>(m_parameters.RxPrefetchDistance);
+    auto const parseDistance = prefetchDistance / 2;
+
+    auto packetIndex = [&](UINT32 Offset)
+    {
+        return (begin + Offset) & pr->ElementIndexMask;
+    };
+
+    for (UINT32 i = 0; i < min(prefetchDistance, count); i++)
+    {
+        EcPrefetchPacket(packetIndex(i));
+    }
+
+    for (UINT32 i = 0; i < min(parseDistance, count); i++)
+    {
+        EcParsePacket(packetIndex(i));
+    }
+
+    auto const rxSteering = m_rxSteering;
+    ULONG steeredCount = 0;
 
     NxNblSequence nblsToIndicate;
-    for (; pr->OSReserved0 != pr->BeginIndex;
-        fr->OSReserved0 = pr->OSReserved0 = NetRingIncrementIndex(pr, pr->OSReserved0))
+    for (UINT32 i = 0; i < count; i++)
     {
-        auto & context = m_packetContext.GetContext<PacketContext>(pr->OSReserved0);
-        auto packet = NetRingGetPacketAtIndex(pr, pr->OSReserved0);
+        // out of bytes, leave the rest of the packets to the next iteration
+        if (! m_indicateBudget.HasBytes())
+        {
+            count = i;
+            break;
+        }
+
+        if (prefetchDistance != 0 && i + prefetchDistance < count)
+        {
+            EcPrefetchPacket(packetIndex(i + prefetchDistance));
+        }
+
+        if (i + parseDistance < count)
+        {
+            EcParsePacket(packetIndex(i + parseDistance));
+        }
+
+        auto const index = packetIndex(i);
+        auto & context = m_packetContext.GetContext<PacketContext>(index);
+        auto packet = NetRingGetPacketAtIndex(pr, index);
+
+        if (! packet->Ignore)
+        {
+            fragmentEnd = (packet->FragmentIndex + packet->FragmentCount) & fr->ElementIndexMask;
+        }
 
         NT_FRE_ASSERT(context.NetBufferList != nullptr);
         NT_FRE_ASSERT(context.NetBufferList->Next == nullptr);
 
         if (! packet->Ignore &&
-            TransferDataBufferFromNetPacketToNbl(packet, context.NetBufferList, pr->OSReserved0))
+            TransferDataBufferFromNetPacketToNbl(packet, context.NetBufferList))
         {
-            nblsToIndicate.AddNbl(context.NetBufferList);
+            auto const dataLength = NET_BUFFER_DATA_LENGTH(NET_BUFFER_LIST_FIRST_NB(context.NetBufferList));
+
+            if (IsSmallBufferClassEnabled())
+            {
+                EcUpdateBufferClassRatio(dataLength);
+            }
+
+            m_indicateBudget.Consume(1, dataLength);
+
+            if (m_parameters.RxCoalescing && EcCoalescePacket(packet, context.NetBufferList))
+            {
+                // only the empty NBL is left, it goes back with the discarded ones
+                ndisAppendSingleNblToNblQueue(&m_discardedNbl, context.NetBufferList);
+            }
+            else if (rxSteering && rxSteering->Steer(context.NetBufferList))
+            {
+                // indicated by the worker of the processor it hashes to
+                steeredCount++;
+            }
+            else
+            {
+                nblsToIndicate.AddNbl(context.NetBufferList);
+            }
         }
         else
         {
+            m_indicateBudget.Consume(1, 0);
+
             ndisAppendSingleNblToNblQueue(&m_discardedNbl, context.NetBufferList);
         }
 
         context.NetBufferList = nullptr;
     }
 
-    m_postedPackets = nblsToIndicate.GetCount();
+    pr->OSReserved0 = packetIndex(count);
+
+    if (count != 0)
+    {
+        NxPerfTunerSampleRingOccupancy(m_packetRingOccupancy, available);
+    }
+
+    m_indicateBudget.End(count != available);
+
+    // coalesced segments are complete once the batch is
+    m_coalescer.FlushAll();
+
+    // the fragments of packets left for the next iteration still carry
+    // their buffers, stop at the last fragment of the last packet handled
+    EcReclaimReturnedFragments(count == available ? fr->BeginIndex : fragmentEnd);
+
+    m_postedPackets = nblsToIndicate.GetCount() + steeredCount;
+    m_outstandingPackets += steeredCount;
+
+    // steered NBLs are complete once coalescing is flushed, they come back
+    // through the same return path as the ones indicated from here
+    if (rxSteering)
+    {
+        rxSteering->Flush();
+    }
 
     if (!nblsToIndicate)
         return;
 
     m_outstandingPackets += nblsToIndicate.GetCount();
 
-    if (!m_nblDispatcher->IndicateReceiveNetBufferLists(
-            nblsToIndicate.GetNblQueue().First,
-            NDIS_DEFAULT_PORT_NUMBER,
-            nblsToIndicate.GetCount(),
-            nblsToIndicate.GetReceiveFlags()))
+    nblsToIndicate.Indicate(
+        [this](NET_BUFFER_LIST * First, NET_BUFFER_LIST * Last, ULONG Count, ULONG ReceiveFlags)
+        {
+            if (!m_nblDispatcher->IndicateReceiveNetBufferLists(
+                    First,
+                    NDIS_DEFAULT_PORT_NUMBER,
+                    Count,
+                    ReceiveFlags))
+            {
+                // While stopping the queue, the NBL packet gate may close while this thread
+                // is still trying to indicate a receive.
+                //
+                // If that happens, we're in the process of tearing down this queue, so just
+                // mark the NBLs as returned and bail out.
+                ndisAppendNblChainToNblQueueFast(&m_discardedNbl, First, Last);
+            }
+        });
+}
+
+//
+// The fragments of indicated packets were detached from the fragment ring
+// when their MDL chain was built. The fragments that still carry a MDL
+// belong to ignored packets and go back to the MDL stack.
+//
+_Use_decl_annotations_
+void
+NxRxXlat::EcReclaimReturnedFragments(
+    UINT32 EndIndex
+)
+{
+    auto fr = NetRingCollectionGetFragmentRing(&m_rings);
+
+    for (; fr->OSReserved0 != EndIndex;
+        fr->OSReserved0 = NetRingIncrementIndex(fr, fr->OSReserved0))
     {
-        // While stopping the queue, the NBL packet gate may close while this thread
-        // is still trying to indicate a receive.
-        //
-        // If that happens, we're in the process of tearing down this queue, so just
-        // mark the NBLs as returned and bail out.
-        ndisAppendNblQueueToNblQueueFast(&m_discardedNbl, &nblsToIndicate.GetNblQueue());
+        auto & context = m_fragmentContext.GetContext<FragmentContext>(fr->OSReserved0);
+
+        if (context.Mdl)
+        {
+            MdlStackPush(context.Mdl);
+            context.Mdl = nullptr;
+        }
     }
 }
 
@@ -438,13 +861,49 @@ NxRxXlat::WaitForWork()
 {
     auto notificationsToArm = GetNotificationsToArm();
 
+    m_moderator.Sample(m_postedPackets);
+
+    if (notificationsToArm.Value == 0)
+    {
+        m_lingered = false;
+    }
+
+    // poll a while longer before arming notifications and going to sleep
+    if (m_executionContext.ContinueBusyPoll(notificationsToArm.Value == 0))
+    {
+        return;
+    }
+
+    // at a high packet rate give the NIC a while to produce more work
+    // before arming its notification, once per idle period
+    if (notificationsToArm.Flags.ShouldArmRxIndication && ! m_lingered)
+    {
+        auto const lingerTime = m_moderator.GetLingerTime();
+
+        if (lingerTime != 0 && m_executionContext.HasDedicatedThread())
+        {
+            m_lingered = true;
+            m_moderator.OnLinger();
+
+            m_executionContext.Linger(lingerTime);
+            return;
+        }
+    }
+
     // In order to handle race conditions, the notifications that should
     // be armed at halt cannot change between the halt preparation and the
     // actual halt. If they do change, re-arm the necessary notifications
     // and loop again.
     if (notificationsToArm.Value != 0 && notificationsToArm.Value == m_lastArmedNotifications.Value)
     {
-        m_executionContext.WaitForWork();
+        // a shared EC does not halt here, it gives the poll worker back with
+        // the notifications left armed
+        if (! m_executionContext.WaitForWork())
+        {
+            return;
+        }
+
+        m_moderator.OnWake();
 
         // after halting, don't arm any notifications
         notificationsToArm.Value = 0;
@@ -505,70 +964,107 @@ NxRxXlat::ReceiveThread()
 
     while (! m_executionContext.IsTerminated())
     {
-        m_queueDispatch->Start(m_queue);
+        EcStartRun();
 
-        auto cancelIssued = false;
-
-        while (true)
+        while (EcRunIteration())
         {
-            EcReturnBuffers();
-
-            // provide buffers to NetAdapter only if running
-            if (! m_executionContext.IsStopping())
-            {
-                EcPrepareBuffersForNetAdapter();
-            }
-
-            EcUpdateAffinity();
-            EcYieldToNetAdapter();
-            EcIndicateNblsToNdis();
-
-            WaitForWork();
-
-            // This represents the wind down of Rx
-            if (m_executionContext.IsStopping())
-            {
-                if (!cancelIssued)
-                {
-                    // Indicate cancellation to the adapter
-                    // and drop all outstanding NBLs.
-                    //
-                    // One NBL may remain that has been partially programmed into the NIC.
-                    // So that NBL is kept around until the end.
-
-                    m_queueDispatch->Cancel(m_queue);
-
-                    cancelIssued = true;
-                }
-
-                // The termination condition is that all packets have been returned from the NIC.
-                auto const pr = NetRingCollectionGetPacketRing(&m_rings);
-                auto const fr = NetRingCollectionGetFragmentRing(&m_rings);
-                if (pr->BeginIndex == pr->EndIndex && fr->BeginIndex == fr->EndIndex)
-                {
-                    EcRecoverBuffers();
-                    m_queueDispatch->Stop(m_queue);
-                    m_executionContext.SignalStopped();
-                    break;
-                }
-            }
         }
     }
 }
 
-NTSTATUS
-NxRxXlat::Initialize(
-    void
-)
+void
+NxRxXlat::EcStartRun()
 {
-    CX_RETURN_IF_NOT_NT_SUCCESS_MSG(CreateVariousPools(),
-                                    "Failed to create pools");
+    m_queueDispatch->Start(m_queue);
 
-    NET_CLIENT_QUEUE_CONFIG config;
-    NET_CLIENT_QUEUE_CONFIG_INIT(
-        &config,
-        m_rxNumPackets,
-        m_rxNumFragments);
+    m_cancelIssued = false;
+}
+
+bool
+NxRxXlat::EcRunIteration()
+{
+    EcReturnBuffers();
+
+    // provide buffers to NetAdapter only if running
+    if (! m_executionContext.IsStopping())
+    {
+        EcPrepareBuffersForNetAdapter();
+    }
+
+    EcUpdateAffinity();
+    EcYieldToNetAdapter();
+    EcIndicateNblsToNdis();
+
+    m_statisticsSampler.Sample(m_packetRing, m_executionContext);
+
+    WaitForWork();
+
+    // This represents the wind down of Rx
+    if (m_executionContext.IsStopping())
+    {
+        if (!m_cancelIssued)
+        {
+            // Indicate cancellation to the adapter
+            // and drop all outstanding NBLs.
+            //
+            // One NBL may remain that has been partially programmed into the NIC.
+            // So that NBL is kept around until the end.
+
+            m_queueDispatch->Cancel(m_queue);
+
+            m_cancelIssued = true;
+        }
+
+        // The termination condition is that all packets have been returned from the NIC.
+        auto const pr = NetRingCollectionGetPacketRing(&m_rings);
+        auto const fr = NetRingCollectionGetFragmentRing(&m_rings);
+        if (pr->BeginIndex == pr->EndIndex && fr->BeginIndex == fr->EndIndex)
+        {
+            EcRecoverBuffers();
+            m_queueDispatch->Stop(m_queue);
+            m_executionContext.SignalStopped();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+NTSTATUS
+NxRxXlat::Initialize(
+    void
+)
+{
+    NxXlatReadParameters(m_adapterProperties.NdisAdapterHandle, &m_parameters);
+
+    m_indicateBudget.Initialize(
+        m_parameters.RxIndicateBudget,
+        m_parameters.RxIndicateByteBudget,
+        m_parameters.AdaptiveBudgets != 0);
+
+    m_prepareBudget.Initialize(
+        m_parameters.RxPrepareBudget,
+        m_parameters.RxPrepareByteBudget,
+        m_parameters.AdaptiveBudgets != 0);
+
+    m_moderator.Initialize(m_parameters.NotificationModeration != 0);
+
+    m_coalescer.Initialize(m_parameters.RxCoalescingFlows);
+
+    //
+    // allocate the buffers, MDLs, NBLs and ring contexts on the node of the
+    // processors the queue is affinitized to, if it is affinitized already
+    //
+    NxNodeAllocationScope nodeScope(m_preferredNode);
+
+    CX_RETURN_IF_NOT_NT_SUCCESS_MSG(CreateVariousPools(),
+                                    "Failed to create pools");
+
+    NET_CLIENT_QUEUE_CONFIG config;
+    NET_CLIENT_QUEUE_CONFIG_INIT(
+        &config,
+        m_rxNumPackets,
+        m_rxNumFragments);
 
     Rtl::KArray<NET_CLIENT_PACKET_EXTENSION> addedPacketExtensions;
 
@@ -601,8 +1097,29 @@ NxRxXlat::Initialize(
         NET_PACKET_EXTENSION_CHECKSUM_VERSION_1,
         &m_checksumExtension);
 
+    NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES checksumHardwareCapabilities = {
+        sizeof(NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES)
+    };
+
+    if (m_checksumExtension.Enabled)
+    {
+        m_adapterDispatch->OffloadDispatch.GetChecksumHardwareCapabilities(m_adapter, &checksumHardwareCapabilities);
+    }
+
+    m_checksumEngine.Initialize(
+        m_parameters.SoftwareChecksum != 0,
+        checksumHardwareCapabilities);
+
     RtlCopyMemory(&m_rings, m_queueDispatch->GetNetDatapathDescriptor(m_queue), sizeof(m_rings));
 
+    m_packetRingOccupancy.ElementCount = NetRingCollectionGetPacketRing(&m_rings)->NumberOfElements;
+
+    CX_RETURN_IF_NOT_NT_SUCCESS_MSG(
+        m_packetRing.Initialize(NetRingCollectionGetPacketRing(&m_rings)),
+        "Failed to initialize packet ring buffer.");
+
+    m_statisticsSampler.Initialize(m_packetRing);
+
     CX_RETURN_IF_NOT_NT_SUCCESS_MSG(
         m_packetContext.Initialize(sizeof(PacketContext)),
         "Failed to initialize private packet context.");
@@ -611,9 +1128,14 @@ NxRxXlat::Initialize(
         m_fragmentContext.Initialize(sizeof(FragmentContext)),
         "Failed to initialize private fragment context.");
 
-    CX_RETURN_IF_NOT_NT_SUCCESS_MSG(
-        m_executionContext.Initialize(this, NetAdapterReceiveThread),
-        "Failed to start Rx execution context. NxRxXlat=%p", this);
+    if (! m_pollWorker || ! NT_SUCCESS(m_executionContext.InitializeShared(*this, *m_pollWorker)))
+    {
+        CX_RETURN_IF_NOT_NT_SUCCESS_MSG(
+            m_executionContext.Initialize(this, NetAdapterReceiveThread),
+            "Failed to start Rx execution context. NxRxXlat=%p", this);
+    }
+
+    m_executionContext.SetBusyPollPolicy(m_parameters.BusyPollTimeout, m_parameters.BusyPollIterations);
 
     m_executionContext.SetDebugNameHint(L"Receive", GetQueueId(), m_adapterProperties.NetLuid);
 
@@ -626,6 +1148,16 @@ NxRxXlat::Start(
     void
 )
 {
+    //
+    // the queue may have been moved to another node since the buffers were
+    // allocated. all buffers are owned by the translator while the queue is
+    // stopped, so this is where they can follow the queue.
+    //
+    if (m_bufferNode != m_preferredNode)
+    {
+        (void)ReplaceBufferPools();
+    }
+
     m_executionContext.Start();
 }
 
@@ -668,6 +1200,7 @@ NxRxXlat::CreateVariousPools()
     perfCharacteristics.MaximumFragmentBufferSize = datapathCapabilities.MaximumRxFragmentSize;
     perfCharacteristics.NominalLinkSpeed = datapathCapabilities.NominalMaxRxLinkSpeed;
     perfCharacteristics.MaxPacketSizeWithRsc = datapathCapabilities.MaximumRxFragmentSize + m_backfillSize;
+    perfCharacteristics.PacketRingNumberOfElementsHint = m_packetRingSizeHint;
 
     NxPerfTunerCalculateRxParameters(&perfCharacteristics, &perfParameters);
     m_rxNumPackets = perfParameters.PacketRingElementCount;
@@ -692,13 +1225,47 @@ NxRxXlat::CreateVariousPools()
         STATUS_INSUFFICIENT_RESOURCES,
         ! m_nblStack.resize(perfParameters.NumberOfNbls));
 
+    //
+    // partition the Rx buffers in classes, the large class holds a full frame
+    //
+    auto & largeClass = m_bufferClasses[RxBufferClassLarge];
+    largeClass.BufferSize = m_rxDataBufferSize;
+    largeClass.NumberOfBuffers = perfParameters.NumberOfBuffers;
+
+    if (m_rxBufferAllocationMode == NET_CLIENT_MEMORY_MANAGEMENT_MODE_OS_ALLOCATE_AND_ATTACH &&
+        m_parameters.RxSmallBufferSize != 0 &&
+        m_parameters.RxSmallBufferSize + m_backfillSize < m_rxDataBufferSize)
+    {
+        auto & smallClass = m_bufferClasses[RxBufferClassSmall];
+        smallClass.BufferSize = m_parameters.RxSmallBufferSize + m_backfillSize;
+        smallClass.NumberOfBuffers = perfParameters.NumberOfBuffers;
+
+        largeClass.NumberOfBuffers = perfParameters.NumberOfBuffers / RX_LARGE_BUFFER_CLASS_DIVISOR;
+        if (largeClass.NumberOfBuffers == 0)
+        {
+            largeClass.NumberOfBuffers = 1;
+        }
+
+        m_smallBufferPostRatio = RX_BUFFER_CLASS_RATIO_SCALE / 2;
+    }
+
+    size_t numberOfMdls = 0;
+    for (auto & bufferClass : m_bufferClasses)
+    {
+        CX_RETURN_NTSTATUS_IF(
+            STATUS_INSUFFICIENT_RESOURCES,
+            ! bufferClass.MdlStack.resize(bufferClass.NumberOfBuffers));
+
+        numberOfMdls += bufferClass.NumberOfBuffers;
+    }
+
     m_nblStorage.reset(NdisAllocateNetBufferListPool(m_adapterProperties.NdisAdapterHandle,
                                                             &poolParameters));
     CX_RETURN_NTSTATUS_IF(STATUS_INSUFFICIENT_RESOURCES, !m_nblStorage);
 
     size_t totalSize = 0;
-    size_t mdlSize = ALIGN_UP(MmSizeOfMdl(DUMMY_VA, m_rxDataBufferSize), PVOID);
-    CX_RETURN_IF_NOT_NT_SUCCESS(RtlSizeTMult(mdlSize, perfParameters.NumberOfBuffers, &totalSize));
+    size_t mdlSize = RX_MDL_CONTEXT_SIZE + ALIGN_UP(MmSizeOfMdl(DUMMY_VA, m_rxDataBufferSize), PVOID);
+    CX_RETURN_IF_NOT_NT_SUCCESS(RtlSizeTMult(mdlSize, numberOfMdls, &totalSize));
 
     m_MdlPool = MakeSizedPoolPtrNP<MDL>('prxc', totalSize);
     CX_RETURN_NTSTATUS_IF(STATUS_INSUFFICIENT_RESOURCES, !m_MdlPool);
@@ -706,21 +1273,31 @@ NxRxXlat::CreateVariousPools()
 
     if (m_rxBufferAllocationMode != NET_CLIENT_MEMORY_MANAGEMENT_MODE_DRIVER)
     {
-        // create buffer pool if the driver wants the OS to allocate Rx buffer
-        NET_CLIENT_BUFFER_POOL_CONFIG bufferPoolConfig = {
-            &datapathCapabilities.RxMemoryConstraints,
-            perfParameters.NumberOfBuffers,
-            m_rxDataBufferSize,
-            m_backfillSize,
-            0,
-            MM_ANY_NODE_OK,                      //default numa node
-            NET_CLIENT_BUFFER_POOL_FLAGS_NONE   //non-serialized version
-        };
+        // create buffer pools if the driver wants the OS to allocate Rx buffer
+        for (auto & bufferClass : m_bufferClasses)
+        {
+            if (bufferClass.NumberOfBuffers == 0)
+            {
+                continue;
+            }
 
-        CX_RETURN_IF_NOT_NT_SUCCESS(
-            m_dispatch->NetClientCreateBufferPool(&bufferPoolConfig,
-                                                  &m_bufferPool,
-                                                  &m_bufferPoolDispatch));
+            NET_CLIENT_BUFFER_POOL_CONFIG bufferPoolConfig = {
+                &datapathCapabilities.RxMemoryConstraints,
+                bufferClass.NumberOfBuffers,
+                bufferClass.BufferSize,
+                m_backfillSize,
+                0,
+                m_preferredNode,
+                NET_CLIENT_BUFFER_POOL_FLAGS_NONE   //non-serialized version
+            };
+
+            CX_RETURN_IF_NOT_NT_SUCCESS(
+                m_dispatch->NetClientCreateBufferPool(&bufferPoolConfig,
+                                                      &bufferClass.BufferPool,
+                                                      &bufferClass.BufferPoolDispatch));
+        }
+
+        m_bufferNode = m_preferredNode;
     }
 
     for (size_t i = 0; i < perfParameters.NumberOfNbls; i++)
@@ -736,40 +1313,62 @@ NxRxXlat::CreateVariousPools()
         CX_RETURN_NTSTATUS_IF(STATUS_INSUFFICIENT_RESOURCES, !nbl);
 
         PNET_BUFFER nb = NET_BUFFER_LIST_FIRST_NB(nbl);
-        PMDL mdl = reinterpret_cast<PMDL>(((size_t) m_MdlPool.get()) + i * mdlSize);
-        NET_BUFFER_FIRST_MDL(nb) = NET_BUFFER_CURRENT_MDL(nb) = mdl;
 
         auto internalAllocationOffset = (UCHAR*)nb - (UCHAR*)nbl;
         if (internalAllocationOffset < 4 * sizeof(NET_BUFFER_LIST))
             g_NetBufferOffset = internalAllocationOffset;
 
-        if (m_rxBufferAllocationMode == NET_CLIENT_MEMORY_MANAGEMENT_MODE_OS_ALLOCATE_AND_ATTACH)
-        {
-            //
-            // pre-built MDL if the driver wants the OS to automatic attach the Rx buffer
-            // to the NET_PACKETs
-            //
-
-
-
-
-
+        NblStackPush(nbl);
+    }
 
-            NET_FRAGMENT data;
+    size_t mdlIndex = 0;
+    for (UINT8 bufferClass = 0; bufferClass < RxBufferClassCount; bufferClass++)
+    {
+        auto & classPool = m_bufferClasses[bufferClass];
 
-            CX_RETURN_NTSTATUS_IF(
-                STATUS_INSUFFICIENT_RESOURCES,
-                1 != m_bufferPoolDispatch->NetClientAllocateBuffers(m_bufferPool,
-                                                                    &data,
-                                                                    1));
+        for (size_t i = 0; i < classPool.NumberOfBuffers; i++, mdlIndex++)
+        {
+            PMDL mdl = reinterpret_cast<PMDL>(((size_t) m_MdlPool.get()) + mdlIndex * mdlSize + RX_MDL_CONTEXT_SIZE);
+            GetRxContextFromMdl(mdl)->BufferClass = bufferClass;
 
-            GetRxContextFromNb(nb)->DmaLogicalAddress = data.Mapping.DmaLogicalAddress;
+            if (m_rxBufferAllocationMode == NET_CLIENT_MEMORY_MANAGEMENT_MODE_OS_ALLOCATE_AND_ATTACH)
+            {
+                //
+                // pre-built MDL if the driver wants the OS to automatic attach the Rx buffer
+                // to the NET_FRAGMENTs
+                //
+                NET_FRAGMENT data;
+
+                CX_RETURN_NTSTATUS_IF(
+                    STATUS_INSUFFICIENT_RESOURCES,
+                    1 != classPool.BufferPoolDispatch->NetClientAllocateBuffers(classPool.BufferPool,
+                                                                                &data,
+                                                                                1));
+
+                GetRxContextFromMdl(mdl)->DmaLogicalAddress = data.Mapping.DmaLogicalAddress;
+                GetRxContextFromMdl(mdl)->BufferSize = static_cast<ULONG>(data.Capacity);
+
+                MmInitializeMdl(mdl, data.VirtualAddress, data.Capacity);
+                MmBuildMdlForNonPagedPool(mdl);
+            }
 
-            MmInitializeMdl(mdl, data.VirtualAddress, data.Capacity);
-            MmBuildMdlForNonPagedPool(mdl);
+            MdlStackPush(mdl);
         }
+    }
 
-        NblStackPush(nbl);
+    if (IsSmallBufferClassEnabled())
+    {
+        auto const & smallClass = m_bufferClasses[RxBufferClassSmall];
+
+        TraceLoggingWrite(
+            g_hNetAdapterCxXlatProvider,
+            "RxBufferClasses",
+            TraceLoggingDescription("Receive buffer memory with a small buffer class"),
+            TraceLoggingHexUInt64(m_adapterProperties.NetLuid.Value, "AdapterNetLuid"),
+            TraceLoggingUInt64(GetQueueId(), "QueueId"),
+            TraceLoggingUInt64(smallClass.NumberOfBuffers * smallClass.BufferSize +
+                               largeClass.NumberOfBuffers * largeClass.BufferSize, "RxBufferBytes"),
+            TraceLoggingUInt64(perfParameters.NumberOfBuffers * m_rxDataBufferSize, "SinglePoolRxBufferBytes"));
     }
 
     return STATUS_SUCCESS;
@@ -820,6 +1419,88 @@ NxRxXlat::PreparePacketExtensions(
     return STATUS_SUCCESS;
 }
 
+//
+// Moves the Rx buffers to pools on the preferred node. Must only be called
+// while the queue is stopped and every MDL is back on its stack. If a new
+// pool cannot be created the old one is kept.
+//
+NTSTATUS
+NxRxXlat::ReplaceBufferPools()
+{
+    auto const node = m_preferredNode;
+
+    if (m_rxBufferAllocationMode == NET_CLIENT_MEMORY_MANAGEMENT_MODE_DRIVER)
+    {
+        m_bufferNode = node;
+        return STATUS_SUCCESS;
+    }
+
+    NET_CLIENT_ADAPTER_DATAPATH_CAPABILITIES datapathCapabilities;
+    m_adapterDispatch->GetDatapathCapabilities(m_adapter, &datapathCapabilities);
+
+    NxNodeAllocationScope nodeScope(node);
+
+    for (auto & classPool : m_bufferClasses)
+    {
+        if (! classPool.BufferPool)
+        {
+            continue;
+        }
+
+        NT_FRE_ASSERT(classPool.MdlStackIndex == classPool.MdlStack.count());
+
+        NET_CLIENT_BUFFER_POOL_CONFIG bufferPoolConfig = {
+            &datapathCapabilities.RxMemoryConstraints,
+            classPool.NumberOfBuffers,
+            classPool.BufferSize,
+            m_backfillSize,
+            0,
+            node,
+            NET_CLIENT_BUFFER_POOL_FLAGS_NONE
+        };
+
+        NET_CLIENT_BUFFER_POOL bufferPool;
+        NET_CLIENT_BUFFER_POOL_DISPATCH const * bufferPoolDispatch;
+
+        CX_RETURN_IF_NOT_NT_SUCCESS(
+            m_dispatch->NetClientCreateBufferPool(&bufferPoolConfig,
+                                                  &bufferPool,
+                                                  &bufferPoolDispatch));
+
+        if (m_rxBufferAllocationMode == NET_CLIENT_MEMORY_MANAGEMENT_MODE_OS_ALLOCATE_AND_ATTACH)
+        {
+            //
+            // rebuild every pre-built MDL over a buffer from the new pool. the new
+            // pool holds exactly as many buffers as there are MDLs in this class.
+            //
+            for (size_t i = 0; i < classPool.MdlStackIndex; i++)
+            {
+                auto mdl = classPool.MdlStack[i];
+                NET_FRAGMENT data;
+
+                NT_FRE_ASSERT(1 == bufferPoolDispatch->NetClientAllocateBuffers(bufferPool, &data, 1));
+
+                PVOID va = MmGetMdlVirtualAddress(mdl);
+                classPool.BufferPoolDispatch->NetClientFreeBuffers(classPool.BufferPool, &va, 1);
+
+                GetRxContextFromMdl(mdl)->DmaLogicalAddress = data.Mapping.DmaLogicalAddress;
+                GetRxContextFromMdl(mdl)->BufferSize = static_cast<ULONG>(data.Capacity);
+
+                MmInitializeMdl(mdl, data.VirtualAddress, data.Capacity);
+                MmBuildMdlForNonPagedPool(mdl);
+            }
+        }
+
+        classPool.BufferPoolDispatch->NetClientDestroyBufferPool(classPool.BufferPool);
+        classPool.BufferPool = bufferPool;
+        classPool.BufferPoolDispatch = bufferPoolDispatch;
+    }
+
+    m_bufferNode = node;
+
+    return STATUS_SUCCESS;
+}
+
 void
 NxRxXlat::EcRecoverBuffers()
 {
@@ -829,12 +1510,8 @@ NxRxXlat::EcRecoverBuffers()
     auto pr = NetRingCollectionGetPacketRing(&m_rings);
     auto fr = NetRingCollectionGetFragmentRing(&m_rings);
 
-    NT_FRE_ASSERT(pr->OSReserved0 == fr->OSReserved0);
-    NT_FRE_ASSERT(pr->BeginIndex == fr->BeginIndex);
-    NT_FRE_ASSERT(pr->EndIndex == fr->EndIndex);
-
     for (; pr->OSReserved0 != pr->BeginIndex;
-        fr->OSReserved0 = pr->OSReserved0 = NetRingIncrementIndex(pr, pr->OSReserved0))
+        pr->OSReserved0 = NetRingIncrementIndex(pr, pr->OSReserved0))
     {
 
         auto & context = m_packetContext.GetContext<PacketContext>(pr->OSReserved0);
@@ -846,23 +1523,28 @@ NxRxXlat::EcRecoverBuffers()
         context.NetBufferList = nullptr;
 
         if (! packet->Ignore &&
-             m_rxBufferAllocationMode == NET_CLIENT_MEMORY_MANAGEMENT_MODE_DRIVER)
+             m_rxBufferAllocationMode != NET_CLIENT_MEMORY_MANAGEMENT_MODE_OS_ALLOCATE_AND_ATTACH)
         {
             for (UINT32 i = 0; i < packet->FragmentCount; i++)
             {
-                auto fragment = NetRingGetFragmentAtIndex(fr, fr->OSReserved0);
+                auto fragment = NetRingGetFragmentAtIndex(fr, (packet->FragmentIndex + i) & fr->ElementIndexMask);
 
-                m_adapterDispatch->ReturnRxBuffer(
-                    m_adapter,
-                    fragment->VirtualAddress,
-                    fragment->RxBufferReturnContext);
+                ReturnDataBuffer(fragment->VirtualAddress, fragment->RxBufferReturnContext);
                 fragment->RxBufferReturnContext = nullptr;
             }
         }
     }
 
+    EcReclaimReturnedFragments(fr->BeginIndex);
+
     NT_FRE_ASSERT(pr->BeginIndex == pr->EndIndex);
+    NT_FRE_ASSERT(fr->BeginIndex == fr->EndIndex);
     NT_FRE_ASSERT(m_nblStackIndex == m_nblStack.count());
+
+    for (auto const & classPool : m_bufferClasses)
+    {
+        NT_FRE_ASSERT(classPool.MdlStackIndex == classPool.MdlStack.count());
+    }
 }
 
 NxRxXlat::~NxRxXlat()
@@ -872,23 +1554,31 @@ NxRxXlat::~NxRxXlat()
 
     while (! NblStackIsEmpty())
     {
-        auto nbl = NblStackPop();
+        NdisFreeNetBufferList(NblStackPop());
+    }
 
-        if (m_rxBufferAllocationMode == NET_CLIENT_MEMORY_MANAGEMENT_MODE_OS_ALLOCATE_AND_ATTACH)
+    for (UINT8 bufferClass = 0; bufferClass < RxBufferClassCount; bufferClass++)
+    {
+        auto & classPool = m_bufferClasses[bufferClass];
+
+        while (! MdlStackIsEmpty(static_cast<RxBufferClass>(bufferClass)))
         {
-            PVOID va = MmGetMdlVirtualAddress(NET_BUFFER_CURRENT_MDL(NET_BUFFER_LIST_FIRST_NB(nbl)));
-            m_bufferPoolDispatch->NetClientFreeBuffers(m_bufferPool,
-                                                       &va,
-                                                       1);
-        }
+            auto mdl = MdlStackPop(static_cast<RxBufferClass>(bufferClass));
 
-        NdisFreeNetBufferList(nbl);
-    }
+            if (m_rxBufferAllocationMode == NET_CLIENT_MEMORY_MANAGEMENT_MODE_OS_ALLOCATE_AND_ATTACH)
+            {
+                PVOID va = MmGetMdlVirtualAddress(mdl);
+                classPool.BufferPoolDispatch->NetClientFreeBuffers(classPool.BufferPool,
+                                                                   &va,
+                                                                   1);
+            }
+        }
 
-    if (m_bufferPool)
-    {
-        m_bufferPoolDispatch->NetClientDestroyBufferPool(m_bufferPool);
-        m_bufferPool = nullptr;
+        if (classPool.BufferPool)
+        {
+            classPool.BufferPoolDispatch->NetClientDestroyBufferPool(classPool.BufferPool);
+            classPool.BufferPool = nullptr;
+        }
     }
 
     if (m_queue)
@@ -914,274 +1604,202 @@ NxRxXlat::QueueReturnedNetBufferLists(
     }
 }
 
-static
-USHORT
-CalculateNblFrameTypeForEthernetPacket(
-    _In_ NET_RING_COLLECTION const * descriptor,
-    _In_ NET_PACKET const *packet
-)
-{
-    NT_ASSERT(packet->Layout.Layer2HeaderLength >= sizeof(ETHERNET_HEADER));
-
-    USHORT ethertype;
-    if (!NxGetPacketEtherType(descriptor, packet, &ethertype))
-        return 0;
-
-    return RtlUshortByteSwap(ethertype);
-}
-
-static
-USHORT
-CalculateNblFrameTypeForPacket(
-    _In_ NET_RING_COLLECTION const * descriptor,
-    _In_ NET_PACKET const &packet
-)
-{
-    switch (packet.Layout.Layer3Type)
-    {
-    case NET_PACKET_LAYER3_TYPE_IPV4_UNSPECIFIED_OPTIONS:
-    case NET_PACKET_LAYER3_TYPE_IPV4_WITH_OPTIONS:
-    case NET_PACKET_LAYER3_TYPE_IPV4_NO_OPTIONS:
-        return ByteSwap(ETHERNET_TYPE_IPV4);
-
-    case NET_PACKET_LAYER3_TYPE_IPV6_UNSPECIFIED_EXTENSIONS:
-    case NET_PACKET_LAYER3_TYPE_IPV6_WITH_EXTENSIONS:
-    case NET_PACKET_LAYER3_TYPE_IPV6_NO_EXTENSIONS:
-        return ByteSwap(ETHERNET_TYPE_IPV6);
-
-    case NET_PACKET_LAYER3_TYPE_UNSPECIFIED:
-    default:
-        // The NIC didn't tell us the frame type. Keep going and we'll try
-        // to compute it ourselves.
-        break;
-    }
-
-    // Next try to compute it by parsing the layer2 header.
-    switch (packet.Layout.Layer2Type)
-    {
-    case NET_PACKET_LAYER2_TYPE_ETHERNET:
-        return CalculateNblFrameTypeForEthernetPacket(descriptor, &packet);
-
-    case NET_PACKET_LAYER2_TYPE_UNSPECIFIED:
-    case NET_PACKET_LAYER2_TYPE_NULL:
-        // We don't know how to compute the Frame Type for non-Ethernet.
-        __fallthrough;
-    default:
-        return 0;
-    }
-}
-
 bool
 NxRxXlat::TransferDataBufferFromNetPacketToNbl(
     _In_ NET_PACKET * Packet,
-    _In_ PNET_BUFFER_LIST Nbl,
-    _In_ UINT32 PacketIndex)
+    _In_ PNET_BUFFER_LIST Nbl)
 {
     PNET_BUFFER nb = NET_BUFFER_LIST_FIRST_NB(Nbl);
-    bool shouldIndicate = false;
+    bool shouldIndicate = Packet->FragmentCount != 0;
     // ensure the NBL chain is broken
     Nbl->Next = nullptr;
 
+    if (! shouldIndicate)
+    {
+        return false;
+    }
+
     auto fr = NetRingCollectionGetFragmentRing(&m_rings);
     const auto firstFragment = NetRingGetFragmentAtIndex(fr, Packet->FragmentIndex);
-    PrefetchPacketPayloadForReceiveIndication(firstFragment);
 
     //
-    //1. packet metadata
+    //1. packet metadata, the layout, frame type, NBL flags and checksum
+    //   info were filled by EcParsePacket
     //
 
-
-
-    // Always compute packet layout in software on RX path now.
-    Packet->Layout = NxGetPacketLayout(m_adapterProperties.MediaType, &m_rings, Packet);
-
-    Nbl->NetBufferListInfo[TcpIpChecksumNetBufferListInfo] = 0;
-
-    if (IsPacketChecksumEnabled())
-    {
-        Nbl->NetBufferListInfo[TcpIpChecksumNetBufferListInfo] = NxTranslateRxPacketChecksum(Packet, &m_checksumExtension, PacketIndex).Value;
-    }
-
-    Nbl->NblFlags = 0;
-
-    auto frameType = CalculateNblFrameTypeForPacket(&m_rings, *Packet);
-    Nbl->NetBufferListInfo[NetBufferListFrameType] = (PVOID)frameType;
-    switch (frameType)
-    {
-    case ByteSwap(ETHERNET_TYPE_IPV4):
-        NdisSetNblFlag(Nbl, NDIS_NBL_FLAGS_IS_IPV4);
-        break;
-    case ByteSwap(ETHERNET_TYPE_IPV6):
-        NdisSetNblFlag(Nbl, NDIS_NBL_FLAGS_IS_IPV6);
-        break;
-    default:
-        break;
-    }
-
     // store which queue this NB comes from
     GetRxContextFromNbl(Nbl)->Queue = this;
 
     //
-    //2. packet's first fragment
+    //2. packet's fragments
     //
 
-    PMDL currMdl = NET_BUFFER_CURRENT_MDL(nb);
-    NET_BUFFER_DATA_LENGTH(nb) = firstFragment->ValidLength;
+    NET_BUFFER_DATA_LENGTH(nb) = 0;
     NET_BUFFER_DATA_OFFSET(nb) = firstFragment->Offset;
-
     NET_BUFFER_CURRENT_MDL_OFFSET(nb) = firstFragment->Offset;
 
-    shouldIndicate = ReInitializeMdlForDataBuffer(nb,
-                                                  firstFragment,
-                                                  currMdl,
-                                                  true);
-
-    //
-    //3. packet's additonal fragments
-    //
+    PMDL * mdlLink = &NET_BUFFER_FIRST_MDL(nb);
 
-    for (UINT32 i = 1; i < Packet->FragmentCount; ++i)
+    for (UINT32 i = 0; i < Packet->FragmentCount; ++i)
     {
-        auto currFragment = NetRingGetFragmentAtIndex(fr, (Packet->FragmentIndex + i) & fr->ElementIndexMask);
+        auto const fragmentIndex = (Packet->FragmentIndex + i) & fr->ElementIndexMask;
+        auto currFragment = NetRingGetFragmentAtIndex(fr, fragmentIndex);
+        auto currMdl = DetachFragmentMdl(fragmentIndex, currFragment);
+
+        if (! currMdl)
+        {
+            shouldIndicate = false;
+            continue;
+        }
+
+        *mdlLink = currMdl;
+        mdlLink = &NDIS_MDL_LINKAGE(currMdl);
+
+        shouldIndicate &= ReInitializeMdlForDataBuffer(currFragment,
+                                                       currMdl,
+                                                       i == 0);
 
         NET_BUFFER_DATA_LENGTH(nb) += (ULONG)currFragment->ValidLength;
+    }
 
+    *mdlLink = nullptr;
+    NET_BUFFER_CURRENT_MDL(nb) = NET_BUFFER_FIRST_MDL(nb);
 
+    return shouldIndicate;
+}
 
-        NT_ASSERT(false);
+PMDL
+NxRxXlat::DetachFragmentMdl(
+    _In_ UINT32 FragmentIndex,
+    _In_ NET_FRAGMENT const * Fragment)
+{
+    if (m_rxBufferAllocationMode == NET_CLIENT_MEMORY_MANAGEMENT_MODE_OS_ALLOCATE_AND_ATTACH)
+    {
+        //the MDL describing the buffer was attached to the fragment when it was posted
+        auto & context = m_fragmentContext.GetContext<FragmentContext>(FragmentIndex);
+        auto mdl = context.Mdl;
+        context.Mdl = nullptr;
 
-        currMdl = NDIS_MDL_LINKAGE(currMdl);
+        return mdl;
+    }
 
-        shouldIndicate &= ReInitializeMdlForDataBuffer(nb,
-            currFragment,
-            currMdl,
-            false);
+    if (MdlStackIsEmpty(RxBufferClassLarge))
+    {
+        //no MDL is left to describe the data buffer, give it back right away
+        ReturnDataBuffer(Fragment->VirtualAddress, Fragment->RxBufferReturnContext);
 
+        return nullptr;
     }
 
-    return shouldIndicate;
+    auto mdl = MdlStackPop(RxBufferClassLarge);
+    GetRxContextFromMdl(mdl)->RxBufferReturnContext = Fragment->RxBufferReturnContext;
+
+    //the data buffer size must confront to the rx capability declared by the NIC
+    if (Fragment->Capacity <= m_rxDataBufferSize)
+    {
+        MmInitializeMdl(mdl, Fragment->VirtualAddress, Fragment->Capacity);
+        MmBuildMdlForNonPagedPool(mdl);
+    }
+    else
+    {
+        //the MDL is too small to describe this buffer, keep only its address so
+        //the buffer can be returned once the packet is dropped
+        MmInitializeMdl(mdl, Fragment->VirtualAddress, 0);
+    }
+
+    return mdl;
 }
 
 bool
 NxRxXlat::ReInitializeMdlForDataBuffer(
-    _In_ PNET_BUFFER nb,
     _In_ NET_FRAGMENT const * fragment,
     _In_ PMDL fragmentMdl,
     _In_ bool isFirstFragment)
 {
-    bool mdlBuilt = false;
-
-    if (isFirstFragment || (fragment->Offset == 0)) //only the first fragment can have an offset
+    //only the first fragment can have an offset
+    if (! isFirstFragment && fragment->Offset != 0)
     {
-        if (m_rxBufferAllocationMode == NET_CLIENT_MEMORY_MANAGEMENT_MODE_OS_ALLOCATE_AND_ATTACH) //data buffer allocated by the translator
-        {
-            //all MDLs are pre-built
-            mdlBuilt = true;
-        }
-        else //data buffer allocated by the NIC
-        {
-            //the data buffer size must confront to the rx capability declared by the NIC
-            if (fragment->Capacity <= m_rxDataBufferSize)
-            {
-                MmInitializeMdl(fragmentMdl, fragment->VirtualAddress, fragment->Capacity);
-                MmBuildMdlForNonPagedPool(fragmentMdl);
-
-                NT_ASSERT(fragmentMdl->Next == nullptr);
-
-                if (m_rxBufferAllocationMode == NET_CLIENT_MEMORY_MANAGEMENT_MODE_DRIVER)
-                {
-                    if (isFirstFragment)
-                    {
-                        //first fragment's rx return context will be used for all fragments
-                        GetRxContextFromNb(nb)->RxBufferReturnContext = fragment->RxBufferReturnContext;
-                        mdlBuilt = true;
-                    }
-                    else
-                    {
-                        //if the NB has more than 1 fragment, all framgents must have the same
-                        //return context
-                        if (GetRxContextFromNb(nb)->RxBufferReturnContext == fragment->RxBufferReturnContext)
-                        {
-                            mdlBuilt = true;
-                        }
-                        else
-                        {
-                            //if the return context doesn't match, mark this packet to be dropped
-                            mdlBuilt = false;
-                        }
-                    }
-                }
-            }
-            else
-            {
-                //if the packet received is larger than the driver claimed to be able to support,
-                //mark this packet to be dropped
-                mdlBuilt = false;
-
-                //we still need to return the rx data buffer of the dropped packet back to the NIC
-                GetRxContextFromNb(nb)->RxBufferReturnContext = fragment->RxBufferReturnContext;
-            }
-        }
+        return false;
     }
-    else
+
+    auto const dataEnd = fragment->Offset + fragment->ValidLength;
+
+    //if the packet received is larger than the buffer the MDL describes,
+    //mark this packet to be dropped
+    if (dataEnd > MmGetMdlByteCount(fragmentMdl))
     {
-        mdlBuilt = false;
+        return false;
     }
 
-    return mdlBuilt;
-}
+    //trim the MDL to the received data so the MDL chain describes the packet
+    //without gaps when it spans several fragments
+    fragmentMdl->ByteCount = static_cast<ULONG>(dataEnd);
 
+    return true;
+}
 
-PNET_BUFFER_LIST
-NxRxXlat::FreeReceivedDataBuffer(PNET_BUFFER_LIST nbl)
+void
+NxRxXlat::ReturnDataBuffer(
+    _In_ PVOID VirtualAddress,
+    _In_opt_ PVOID RxBufferReturnContext)
 {
     switch (m_rxBufferAllocationMode)
     {
         case NET_CLIENT_MEMORY_MANAGEMENT_MODE_OS_ALLOCATE_AND_ATTACH:
+            //the data buffer stays attached to its MDL
             NOTHING
             break;
 
         case NET_CLIENT_MEMORY_MANAGEMENT_MODE_OS_ONLY_ALLOCATE:
         {
-            PMDL currMdl = NET_BUFFER_CURRENT_MDL(NET_BUFFER_LIST_FIRST_NB(nbl));
-
-            while (currMdl)
-            {
-                PVOID va = MmGetMdlVirtualAddress(currMdl);
-
-                m_bufferPoolDispatch->NetClientFreeBuffers(m_bufferPool,
-                                                           &va,
-                                                           1);
-
-                currMdl = NDIS_MDL_LINKAGE(currMdl);
-            }
-
+            auto const & classPool = m_bufferClasses[RxBufferClassLarge];
+            classPool.BufferPoolDispatch->NetClientFreeBuffers(classPool.BufferPool,
+                                                               &VirtualAddress,
+                                                               1);
             break;
         }
 
         case NET_CLIENT_MEMORY_MANAGEMENT_MODE_DRIVER:
-        {
-            PNET_BUFFER nb = NET_BUFFER_LIST_FIRST_NB(nbl);
-
-            PVOID rxReturnContext = GetRxContextFromNb(nb)->RxBufferReturnContext;
-            PMDL currMdl = NET_BUFFER_CURRENT_MDL(NET_BUFFER_LIST_FIRST_NB(nbl));
+            m_adapterDispatch->ReturnRxBuffer(m_adapter, VirtualAddress, RxBufferReturnContext);
+            break;
+    }
+}
 
-            NT_ASSERT(currMdl->Next == nullptr);
+PNET_BUFFER_LIST
+NxRxXlat::FreeReceivedDataBuffer(PNET_BUFFER_LIST nbl)
+{
+    PNET_BUFFER nb = NET_BUFFER_LIST_FIRST_NB(nbl);
+    PMDL currMdl = NET_BUFFER_FIRST_MDL(nb);
 
-            while (currMdl)
-            {
-                PVOID va = MmGetMdlVirtualAddress(currMdl);
-                m_adapterDispatch->ReturnRxBuffer(m_adapter, va, rxReturnContext);
+    while (currMdl)
+    {
+        PMDL nextMdl = NDIS_MDL_LINKAGE(currMdl);
+        auto const mdlContext = GetRxContextFromMdl(currMdl);
 
-                currMdl = NDIS_MDL_LINKAGE(currMdl);
-            }
+        if (mdlContext->TrimmedBytes != 0)
+        {
+            // map the whole buffer again
+            auto const buffer = static_cast<UCHAR *>(MmGetMdlVirtualAddress(currMdl)) - mdlContext->TrimmedBytes;
 
-            GetRxContextFromNb(nb)->RxBufferReturnContext = nullptr;
+            MmInitializeMdl(currMdl, buffer, MmGetMdlByteCount(currMdl) + mdlContext->TrimmedBytes);
+            MmBuildMdlForNonPagedPool(currMdl);
+            mdlContext->TrimmedBytes = 0;
+        }
 
-            break;
+        if (m_rxBufferAllocationMode != NET_CLIENT_MEMORY_MANAGEMENT_MODE_OS_ALLOCATE_AND_ATTACH)
+        {
+            ReturnDataBuffer(MmGetMdlVirtualAddress(currMdl), mdlContext->RxBufferReturnContext);
+            mdlContext->RxBufferReturnContext = nullptr;
         }
+
+        NDIS_MDL_LINKAGE(currMdl) = nullptr;
+        MdlStackPush(currMdl);
+
+        currMdl = nextMdl;
     }
 
+    NET_BUFFER_FIRST_MDL(nb) = NET_BUFFER_CURRENT_MDL(nb) = nullptr;
+
     PNET_BUFFER_LIST next = nbl->Next;
     NblStackPush(nbl);
 
@@ -1216,6 +1834,106 @@ NxRxXlat::NblStackIsEmpty(
     return m_nblStackIndex == 0;
 }
 
+MDL *
+NxRxXlat::MdlStackPop(
+    _In_ RxBufferClass BufferClass
+)
+{
+    NT_FRE_ASSERT(! MdlStackIsEmpty(BufferClass));
+
+    auto & classPool = m_bufferClasses[BufferClass];
+
+    return classPool.MdlStack[--classPool.MdlStackIndex];
+}
+
+void
+NxRxXlat::MdlStackPush(
+    _In_ MDL * Mdl
+)
+{
+    auto & classPool = m_bufferClasses[GetRxContextFromMdl(Mdl)->BufferClass];
+
+    NT_FRE_ASSERT(classPool.MdlStackIndex != classPool.MdlStack.count());
+
+    classPool.MdlStack[classPool.MdlStackIndex++] = Mdl;
+}
+
+bool
+NxRxXlat::MdlStackIsEmpty(
+    _In_ RxBufferClass BufferClass
+) const
+{
+    return m_bufferClasses[BufferClass].MdlStackIndex == 0;
+}
+
+bool
+NxRxXlat::IsSmallBufferClassEnabled(
+    void
+) const
+{
+    return m_bufferClasses[RxBufferClassSmall].NumberOfBuffers != 0;
+}
+
+NxRxXlat::RxBufferClass
+NxRxXlat::EcSelectBufferClass(
+    void
+)
+{
+    if (! IsSmallBufferClassEnabled())
+    {
+        return RxBufferClassLarge;
+    }
+
+    auto bufferClass = RxBufferClassLarge;
+
+    m_smallBufferPostCredit += m_smallBufferPostRatio;
+    if (m_smallBufferPostCredit >= RX_BUFFER_CLASS_RATIO_SCALE)
+    {
+        m_smallBufferPostCredit -= RX_BUFFER_CLASS_RATIO_SCALE;
+        bufferClass = RxBufferClassSmall;
+    }
+
+    // fall back to the other class rather than starving the NIC
+    if (MdlStackIsEmpty(bufferClass))
+    {
+        bufferClass = bufferClass == RxBufferClassSmall ? RxBufferClassLarge : RxBufferClassSmall;
+    }
+
+    return bufferClass;
+}
+
+void
+NxRxXlat::EcUpdateBufferClassRatio(
+    _In_ ULONG FrameLength
+)
+{
+    if (FrameLength + m_backfillSize <= m_bufferClasses[RxBufferClassSmall].BufferSize)
+    {
+        m_smallFrameCount++;
+    }
+
+    if (++m_sampledFrameCount < RX_BUFFER_CLASS_SAMPLE_FRAMES)
+    {
+        return;
+    }
+
+    auto ratio = m_smallFrameCount * RX_BUFFER_CLASS_RATIO_SCALE / m_sampledFrameCount;
+
+    if (ratio < RX_BUFFER_CLASS_MIN_SMALL_RATIO)
+    {
+        ratio = RX_BUFFER_CLASS_MIN_SMALL_RATIO;
+    }
+    else if (ratio > RX_BUFFER_CLASS_MAX_SMALL_RATIO)
+    {
+        ratio = RX_BUFFER_CLASS_MAX_SMALL_RATIO;
+    }
+
+    // smooth the ratio over consecutive windows
+    m_smallBufferPostRatio = (m_smallBufferPostRatio + ratio) / 2;
+    m_smallFrameCount = 0;
+    m_sampledFrameCount = 0;
+}
+
 bool
 NxRxXlat::IsPacketChecksumEnabled() const
 {
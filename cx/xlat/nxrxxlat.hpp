@@ -18,6 +18,14 @@ Abstract:
 #include "NxRingContext.hpp"
 #include "NxNbl.hpp"
 #include "NxNblQueue.hpp"
+#include "NxXlatParameters.hpp"
+#include "NxPerfTuner.hpp"
+#include "NxQueueStatistics.hpp"
+#include "NxWorkBudget.hpp"
+#include "NxNotificationModeration.hpp"
+#include "NxRxCoalescing.hpp"
+#include "NxChecksum.hpp"
+#include "NxRxSteering.hpp"
 
 class NxNblRx :
     public INxNblRx,
@@ -35,6 +43,7 @@ class NxNblRx :
 };
 
 class NxRxXlat :
+    public INxExecutionContextTask,
     public NxNonpagedAllocation<'lXRN'>
 {
 public:
@@ -88,6 +97,21 @@ public:
         void
     );
 
+    //
+    // INxExecutionContextTask
+    //
+    virtual
+    void
+    EcStartRun(
+        void
+    ) override;
+
+    virtual
+    bool
+    EcRunIteration(
+        void
+    ) override;
+
     NET_CLIENT_QUEUE
     GetQueue(
         void
@@ -105,6 +129,45 @@ public:
         GROUP_AFFINITY const & GroupAffinity
     );
 
+    // must be called before Initialize, runs the queue on a shared poll
+    // worker instead of a thread of its own
+    _IRQL_requires_(PASSIVE_LEVEL)
+    void
+    SetPollWorker(
+        _In_ NxPollWorker * PollWorker
+    );
+
+    // must be called before Initialize, a size recommended by a previous
+    // instance of the queue
+    _IRQL_requires_(PASSIVE_LEVEL)
+    void
+    SetPacketRingSizeHint(
+        _In_ UINT32 PacketRingSizeHint
+    );
+
+    // software receive scaling, packets are hashed and indicated on the
+    // processor their hash maps to. May be called while the queue runs.
+    _IRQL_requires_(PASSIVE_LEVEL)
+    void
+    SetRxSteering(
+        _In_opt_ NxRxSteering * RxSteering
+    );
+
+    // packet ring size to use the next time the queue is created, zero if
+    // the queue has not seen enough traffic to tell
+    _IRQL_requires_(PASSIVE_LEVEL)
+    UINT32
+    GetRecommendedPacketRingSize(
+        void
+    ) const;
+
+    // a snapshot of the counters, which keep changing while it is taken
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    void
+    GetStatistics(
+        _Out_ NxQueueStatistics & Statistics
+    ) const;
+
     void
     Notify(
         void
@@ -123,30 +186,61 @@ private:
 
     GROUP_AFFINITY m_groupAffinity = {};
 
+    // node derived from m_groupAffinity, and the node the Rx buffers were allocated on
+    NODE_REQUIREMENT m_preferredNode = MM_ANY_NODE_OK;
+    NODE_REQUIREMENT m_bufferNode = MM_ANY_NODE_OK;
+
     struct PAGED PacketContext
     {
         //
-        // this NBL's NET_BUFFER_MINIPORT_RESERVED(NET_BUFFER_LIST_FIRST_NB)[0]
-        // field is used for the following purpose:
-        //
-        // if Rx buffer allocation mode is none, it's storing the rx buffer
-        // return context supplied by the NIC driver
+        // the NBL carries no MDL while the packet is owned by the NIC, the
+        // MDL chain is built from the packet's fragments at indication time
         //
-        // if Rx buffer allocation mode is automatic, it's storing the
-        // DMA logical address of the Rx buffer automatically chose by the
-        // OS
+        PNET_BUFFER_LIST NetBufferList;
+
         //
-        // if Rx buffer allocation mode is manual, it's not used
+        // the parse stage strips the VLAN tag in place, a packet it already
+        // went over must not be parsed again when the byte budget leaves it
+        // to the next indication
         //
-        PNET_BUFFER_LIST NetBufferList;
+        bool Parsed;
     };
 
     struct PAGED FragmentContext
     {
+        //
+        // if Rx buffer allocation mode is automatic, the pre-built MDL of
+        // the Rx buffer attached to this fragment
+        //
+        // otherwise it's not used
+        //
         MDL *
             Mdl;
     };
 
+    //
+    // Receive buffers posted when the system fully manages the Rx buffers
+    // come from one pool per class. Only the large class exists unless a
+    // small buffer size is configured, the other modes only use the MDL
+    // stack of the large class.
+    //
+    enum RxBufferClass : UINT8
+    {
+        RxBufferClassLarge = 0,
+        RxBufferClassSmall,
+        RxBufferClassCount,
+    };
+
+    struct RxBufferClassPool
+    {
+        NET_CLIENT_BUFFER_POOL BufferPool = nullptr;
+        NET_CLIENT_BUFFER_POOL_DISPATCH const * BufferPoolDispatch = nullptr;
+        size_t BufferSize = 0;
+        size_t NumberOfBuffers = 0;
+        Rtl::KArray<MDL *, NonPagedPoolNx> MdlStack;
+        size_t MdlStackIndex = 0;
+    };
+
     struct ArmedNotifications
     {
         union
@@ -163,13 +257,14 @@ private:
     } m_lastArmedNotifications;
 
     NxExecutionContext m_executionContext;
+    NxPollWorker * m_pollWorker = nullptr;
+    bool m_cancelIssued = false;
 
     NET_CLIENT_DISPATCH const * m_dispatch = nullptr;
     NET_CLIENT_ADAPTER m_adapter = nullptr;
     NET_CLIENT_ADAPTER_DISPATCH const * m_adapterDispatch = nullptr;
     NET_CLIENT_ADAPTER_PROPERTIES m_adapterProperties = {};
-    NET_CLIENT_BUFFER_POOL m_bufferPool = nullptr;
-    NET_CLIENT_BUFFER_POOL_DISPATCH const * m_bufferPoolDispatch = nullptr;
+    NxXlatParameters m_parameters;
 
     NDIS_MEDIUM m_mediaType;
     INxNblDispatcher *m_nblDispatcher = nullptr;
@@ -185,12 +280,38 @@ private:
     size_t
         m_nblStackIndex = 0;
 
+    RxBufferClassPool
+        m_bufferClasses[RxBufferClassCount];
+
+    // share of small buffers posted to the NIC, adapted to the received frame sizes
+    UINT32 m_smallBufferPostRatio = 0;
+    UINT32 m_smallBufferPostCredit = 0;
+    UINT32 m_smallFrameCount = 0;
+    UINT32 m_sampledFrameCount = 0;
+
     NET_CLIENT_MEMORY_MANAGEMENT_MODE m_rxBufferAllocationMode = NET_CLIENT_MEMORY_MANAGEMENT_MODE_DRIVER;
     size_t m_rxDataBufferSize = 0;
     UINT32 m_rxNumPackets = 0;
     UINT32 m_rxNumFragments = 0;
     size_t m_backfillSize = 0;
 
+    // sizing feedback for NxPerfTuner, see NX_PERF_RING_OCCUPANCY
+    UINT32 m_packetRingSizeHint = 0;
+    NX_PERF_RING_OCCUPANCY m_packetRingOccupancy = {};
+
+    NxRingBuffer m_packetRing;
+    NxQueueStatisticsSampler m_statisticsSampler;
+
+    // per iteration limits, see NxXlatParameters
+    NxWorkBudget m_indicateBudget;
+    NxWorkBudget m_prepareBudget;
+
+    NxNotificationModerator m_moderator;
+    NxRxCoalescer m_coalescer;
+    NxChecksumEngine m_checksumEngine;
+    NxRxSteering * volatile m_rxSteering = nullptr;
+    bool m_lingered = false;
+
     NBL_QUEUE m_discardedNbl;
     NxNblQueue m_returnedNblQueue;
 
@@ -234,17 +355,25 @@ private:
     bool
     TransferDataBufferFromNetPacketToNbl(
         _In_ NET_PACKET * Packet,
-        _In_ PNET_BUFFER_LIST Nbl,
-        _In_ UINT32 PacketIndex
+        _In_ PNET_BUFFER_LIST Nbl
     );
 
+    PMDL
+    DetachFragmentMdl(
+        _In_ UINT32 FragmentIndex,
+        _In_ NET_FRAGMENT const * Fragment);
+
     bool
     ReInitializeMdlForDataBuffer(
-        _In_ PNET_BUFFER nb,
         _In_ NET_FRAGMENT const * fragment,
         _In_ PMDL fragmentMdl,
         _In_ bool isFirstFragment);
 
+    void
+    ReturnDataBuffer(
+        _In_ PVOID VirtualAddress,
+        _In_opt_ PVOID RxBufferReturnContext);
+
     NET_BUFFER_LIST *
     NblStackPop(
         void
@@ -260,6 +389,36 @@ private:
         void
     ) const;
 
+    MDL *
+    MdlStackPop(
+        _In_ RxBufferClass BufferClass
+    );
+
+    void
+    MdlStackPush(
+        _In_ MDL * Mdl
+    );
+
+    bool
+    MdlStackIsEmpty(
+        _In_ RxBufferClass BufferClass
+    ) const;
+
+    bool
+    IsSmallBufferClassEnabled(
+        void
+    ) const;
+
+    RxBufferClass
+    EcSelectBufferClass(
+        void
+    );
+
+    void
+    EcUpdateBufferClassRatio(
+        _In_ ULONG FrameLength
+    );
+
     PNET_BUFFER_LIST
     FreeReceivedDataBuffer(_In_ PNET_BUFFER_LIST nbl);
 
@@ -282,12 +441,36 @@ private:
     void
     EcIndicateNblsToNdis();
 
+    void
+    EcPrefetchPacket(
+        _In_ UINT32 PacketIndex
+    );
+
+    void
+    EcParsePacket(
+        _In_ UINT32 PacketIndex
+    );
+
+    bool
+    EcCoalescePacket(
+        _In_ NET_PACKET const * Packet,
+        _In_ NET_BUFFER_LIST * Nbl
+    );
+
+    void
+    EcReclaimReturnedFragments(
+        _In_ UINT32 EndIndex
+    );
+
     void
     WaitForWork();
 
     NTSTATUS
     CreateVariousPools();
 
+    NTSTATUS
+    ReplaceBufferPools();
+
     NTSTATUS
     PreparePacketExtensions(
         _Inout_ Rtl::KArray<NET_CLIENT_PACKET_EXTENSION>& addedPacketExtensions
@@ -0,0 +1,86 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+#include "NxXlatPrecomp.hpp"
+#include "NxXlatCommon.hpp"
+#include "NxToeplitz.tmh"
+
+#include "NxToeplitz.hpp"
+
+static_assert(NX_TOEPLITZ_MAXIMUM_INPUT_SIZE + sizeof(UINT32) <= NX_TOEPLITZ_KEY_SIZE,
+              "the key must cover a 32 bit window past the last input bit");
+
+//
+// The 32 bits of the key starting at bit Bit of byte Byte, the key being
+// read as a big endian bit string
+//
+static
+UINT32
+GetKeyWindow(
+    _In_reads_bytes_(NX_TOEPLITZ_KEY_SIZE) UINT8 const * Key,
+    _In_ size_t Byte,
+    _In_ size_t Bit
+)
+{
+    auto const window =
+        (static_cast<ULONG64>(Key[Byte + 0]) << 32) |
+        (static_cast<ULONG64>(Key[Byte + 1]) << 24) |
+        (static_cast<ULONG64>(Key[Byte + 2]) << 16) |
+        (static_cast<ULONG64>(Key[Byte + 3]) << 8) |
+        (static_cast<ULONG64>(Key[Byte + 4]));
+
+    return static_cast<UINT32>(window >> (8 - Bit));
+}
+
+_Use_decl_annotations_
+void
+NxToeplitzHash::SetKey(
+    UINT8 const * Key
+)
+{
+    for (size_t i = 0; i < NX_TOEPLITZ_MAXIMUM_INPUT_SIZE; i++)
+    {
+        UINT32 windows[8];
+
+        // bit 0 is the most significant bit of the input byte
+        for (size_t bit = 0; bit < 8; bit++)
+        {
+            windows[bit] = GetKeyWindow(Key, i, bit);
+        }
+
+        m_table[i][0] = 0;
+
+        // a value's entry is the one of the value without its lowest set
+        // bit, combined with the window of that bit
+        for (size_t value = 1; value < 256; value++)
+        {
+            auto const lowest = value & (~value + 1);
+            size_t bit = 7;
+
+            while ((1U << (7 - bit)) != lowest)
+            {
+                bit--;
+            }
+
+            m_table[i][value] = m_table[i][value & (value - 1)] ^ windows[bit];
+        }
+    }
+}
+
+_Use_decl_annotations_
+UINT32
+NxToeplitzHash::Hash(
+    UINT8 const * Input,
+    size_t Length
+) const
+{
+    NT_ASSERT(Length <= NX_TOEPLITZ_MAXIMUM_INPUT_SIZE);
+
+    UINT32 hash = 0;
+
+    for (size_t i = 0; i < Length; i++)
+    {
+        hash ^= m_table[i][Input[i]];
+    }
+
+    return hash;
+}
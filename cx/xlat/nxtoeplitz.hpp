@@ -0,0 +1,48 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+/*++
+
+Abstract:
+
+    Toeplitz hash as specified for NDIS receive side scaling, computed in
+    software for NICs that do not hash received packets.
+
+    The hash of an input is the XOR of a 32 bit window of the secret key
+    for every set bit of the input, the window starting at the bit's
+    position. The windows only depend on the key, so they are combined per
+    input byte value when the key is set: hashing is then one table lookup
+    and XOR per input byte instead of one per input bit.
+
+--*/
+
+#pragma once
+
+// size of the NDIS RSS secret key
+#define NX_TOEPLITZ_KEY_SIZE 40
+
+// longest input hashed, IPv6 addresses and TCP/UDP ports
+#define NX_TOEPLITZ_MAXIMUM_INPUT_SIZE 36
+
+class NxToeplitzHash
+{
+public:
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    void
+    SetKey(
+        _In_reads_bytes_(NX_TOEPLITZ_KEY_SIZE) UINT8 const * Key
+    );
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    UINT32
+    Hash(
+        _In_reads_bytes_(Length) UINT8 const * Input,
+        _In_ size_t Length
+    ) const;
+
+private:
+
+    // hash of every value of the input byte at each position
+    UINT32
+        m_table[NX_TOEPLITZ_MAXIMUM_INPUT_SIZE][256] = {};
+};
@@ -20,6 +20,7 @@ Abstract:
 #include "NxXlat.hpp"
 #include "NxTranslationApp.hpp"
 #include "NxPerfTuner.hpp"
+#include "NxPollScheduler.hpp"
 
 TRACELOGGING_DEFINE_PROVIDER(
     g_hNetAdapterCxXlatProvider,
@@ -211,6 +212,7 @@ NxTranslationApp::NxTranslationApp(
     m_dispatch(Dispatch),
     m_adapter(Adapter),
     m_adapterDispatch(AdapterDispatch),
+    m_txSteering(m_txQueues),
     m_offload(*this, AdapterDispatch->OffloadDispatch)
 {
 }
@@ -278,10 +280,14 @@ NxTranslationApp::ReceiveScalingInitialize(
     NT_FRE_ASSERT(! m_receiveScaling);
     NT_FRE_ASSERT(! m_receiveScalingDatapath);
 
+    CX_RETURN_IF_NOT_NT_SUCCESS(
+        CreateRxSteering());
+
     auto receiveScaling = wil::make_unique_nothrow<NxReceiveScaling>(
         *this,
         this->m_rxQueues,
-        this->m_adapterDispatch->ReceiveScalingDispatch);
+        this->m_adapterDispatch->ReceiveScalingDispatch,
+        this->m_rxSteering.get());
 
     CX_RETURN_NTSTATUS_IF(
         STATUS_INSUFFICIENT_RESOURCES,
@@ -334,6 +340,30 @@ NxTranslationApp::ReceiveScalingSetIndirectionEntries(
     return m_receiveScaling->SetIndirectionEntries(Request);
 }
 
+//
+// One transmit queue is created per processor, up to the number of
+// transmit queues the adapter supports.
+//
+_Use_decl_annotations_
+PAGEDX
+size_t
+NxTranslationApp::GetNumberOfTxQueues(
+    void
+) const
+{
+    size_t const maximumNumberOfTxQueues = GetDatapathCapabilities().MaximumNumberOfTxQueues;
+
+#if _KERNEL_MODE
+    size_t const numberOfProcessors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+#else
+    size_t const numberOfProcessors = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+#endif
+
+    auto const numberOfTxQueues = min(maximumNumberOfTxQueues, numberOfProcessors);
+
+    return numberOfTxQueues > 0 ? numberOfTxQueues : 1;
+}
+
 _Use_decl_annotations_
 PAGEDX
 NTSTATUS
@@ -341,18 +371,55 @@ NxTranslationApp::CreateDefaultQueues(
     void
 )
 {
-    auto txQueue = wil::make_unique_nothrow<NxTxXlat>(
-        0,
-        m_dispatch,
-        m_adapter,
-        m_adapterDispatch);
-
+    Rtl::KArray<wistd::unique_ptr<NxTxXlat>, NonPagedPoolNx> txQueues;
     CX_RETURN_NTSTATUS_IF(
         STATUS_INSUFFICIENT_RESOURCES,
-        ! txQueue);
+        ! txQueues.resize(GetNumberOfTxQueues()));
 
-    CX_RETURN_IF_NOT_NT_SUCCESS(
-        txQueue->Initialize());
+    for (size_t i = 0; i < txQueues.count(); i++)
+    {
+        auto txQueue = wil::make_unique_nothrow<NxTxXlat>(
+            i,
+            m_dispatch,
+            m_adapter,
+            m_adapterDispatch);
+
+        CX_RETURN_NTSTATUS_IF(
+            STATUS_INSUFFICIENT_RESOURCES,
+            ! txQueue);
+
+#if _KERNEL_MODE
+        //
+        // NBLs without a hash are steered to the queue of the sending
+        // processor, so place each queue's memory on the node of its processor
+        //
+        if (txQueues.count() > 1)
+        {
+            PROCESSOR_NUMBER processorNumber;
+            if (NT_SUCCESS(KeGetProcessorNumberFromIndex(static_cast<ULONG>(i), &processorNumber)))
+            {
+                GROUP_AFFINITY const groupAffinity = {
+                    1ULL << processorNumber.Number,
+                    processorNumber.Group
+                };
+
+                txQueue->SetGroupAffinity(groupAffinity);
+            }
+        }
+#endif
+
+        txQueue->SetPacketRingSizeHint(m_txPacketRingSizeHint);
+
+        if (m_pollScheduler)
+        {
+            txQueue->SetPollWorker(&m_pollScheduler->GetWorker(i));
+        }
+
+        CX_RETURN_IF_NOT_NT_SUCCESS(
+            txQueue->Initialize());
+
+        txQueues[i] = wistd::move(txQueue);
+    }
 
     auto rxQueue = wil::make_unique_nothrow<NxRxXlat>(
         0,
@@ -372,10 +439,24 @@ NxTranslationApp::CreateDefaultQueues(
         STATUS_INSUFFICIENT_RESOURCES,
         ! m_rxQueues.resize(1));
 
+    GROUP_AFFINITY groupAffinity;
+    if (m_receiveScaling && m_receiveScaling->GetQueueAffinity(0, groupAffinity))
+    {
+        rxQueue->SetGroupAffinity(groupAffinity);
+    }
+
+    rxQueue->SetPacketRingSizeHint(m_rxPacketRingSizeHint);
+    rxQueue->SetRxSteering(m_rxSteering.get());
+
+    if (m_pollScheduler)
+    {
+        rxQueue->SetPollWorker(&m_pollScheduler->GetWorker(0));
+    }
+
     CX_RETURN_IF_NOT_NT_SUCCESS(
         rxQueue->Initialize());
 
-    m_txQueue = wistd::move(txQueue);
+    m_txQueues = wistd::move(txQueues);
     m_rxQueues[0] = wistd::move(rxQueue);
 
     return STATUS_SUCCESS;
@@ -388,7 +469,11 @@ NxTranslationApp::StartDefaultQueues(
     void
 )
 {
-    m_txQueue->Start();
+    for (auto & queue : m_txQueues)
+    {
+        queue->Start();
+    }
+
     m_rxQueues[0]->Start();
 }
 
@@ -445,6 +530,23 @@ NxTranslationApp::CreateReceiveScalingQueues(
             STATUS_INSUFFICIENT_RESOURCES,
             ! rxQueue);
 
+        //
+        // a recreated queue allocates its memory on the node of the processor
+        // it was affinitized to before, Configure restores the affinity itself
+        //
+        GROUP_AFFINITY groupAffinity;
+        if (receiveScaling->GetQueueAffinity(i, groupAffinity))
+        {
+            rxQueue->SetGroupAffinity(groupAffinity);
+        }
+
+        rxQueue->SetPacketRingSizeHint(m_rxPacketRingSizeHint);
+
+        if (m_pollScheduler)
+        {
+            rxQueue->SetPollWorker(&m_pollScheduler->GetWorker(i));
+        }
+
         CX_RETURN_IF_NOT_NT_SUCCESS(
             rxQueue->Initialize());
 
@@ -500,7 +602,7 @@ NxTranslationApp::StartDatapath(
     m_adapterDispatch->GetProperties(m_adapter, &adapterProperties);
     m_NblDispatcher = static_cast<INxNblDispatcher *>(adapterProperties.NblDispatcher);
     m_NblDispatcher->SetRxHandler(&m_rxBufferReturn);
-    m_NblDispatcher->SetTxHandler(m_txQueue.get());
+    m_NblDispatcher->SetTxHandler(&m_txSteering);
 
     StartDefaultQueues();
 
@@ -522,9 +624,17 @@ NxTranslationApp::StopDatapath(
 
     m_NblDispatcher->SetRxHandler(nullptr);
 
-    m_txQueue->Cancel();
+    for (auto & queue : m_txQueues)
+    {
+        queue->Cancel();
+    }
+
     m_NblDispatcher->SetTxHandler(nullptr);
-    m_txQueue->Stop();
+
+    for (auto & queue : m_txQueues)
+    {
+        queue->Stop();
+    }
 
     for (auto & queue : m_rxQueues)
     {
@@ -545,6 +655,9 @@ NxTranslationApp::CreateDatapath(
     void
 )
 {
+    CX_RETURN_IF_NOT_NT_SUCCESS(
+        CreatePollScheduler());
+
     CX_RETURN_IF_NOT_NT_SUCCESS(
         CreateDefaultQueues());
 
@@ -564,8 +677,178 @@ NxTranslationApp::DestroyDatapath(
     m_datapathCreated = false;
     m_receiveScalingDatapath = false;
 
-    m_txQueue.reset();
+    UpdatePacketRingSizeHints();
+
+    m_txQueues.clear();
     m_rxQueues.clear();
+
+    // every queue detached from its poll worker when it was destroyed
+    m_pollScheduler.reset();
+}
+
+//
+// With the PollWorkers keyword set the adapter's queues share that many
+// poll workers instead of running a thread each. A scheduler that cannot
+// be created leaves the queues on threads of their own.
+//
+_Use_decl_annotations_
+NTSTATUS
+NxTranslationApp::CreatePollScheduler(
+    void
+)
+{
+    auto const adapterProperties = GetProperties();
+
+    NxXlatParameters parameters;
+    NxXlatReadParameters(adapterProperties.NdisAdapterHandle, &parameters);
+
+    if (parameters.PollWorkers == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    auto pollScheduler = wil::make_unique_nothrow<NxPollScheduler>();
+
+    CX_RETURN_NTSTATUS_IF(
+        STATUS_INSUFFICIENT_RESOURCES,
+        ! pollScheduler);
+
+    if (! NT_SUCCESS(pollScheduler->Initialize(parameters.PollWorkers, parameters.PollQuantum)))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    m_pollScheduler = wistd::move(pollScheduler);
+
+    return STATUS_SUCCESS;
+}
+
+//
+// With the SoftwareReceiveScaling keyword set and a NIC with a single
+// receive queue, receive scaling is done by the translator instead of the
+// NIC. Steering that cannot be set up leaves receive scaling to the NIC.
+//
+_Use_decl_annotations_
+NTSTATUS
+NxTranslationApp::CreateRxSteering(
+    void
+)
+{
+    // kept from an earlier receive scaling initialization
+    if (m_rxSteering)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    auto const adapterProperties = GetProperties();
+    auto const capabilities = GetReceiveScalingCapabilities();
+
+    NxXlatParameters parameters;
+    NxXlatReadParameters(adapterProperties.NdisAdapterHandle, &parameters);
+
+    if (parameters.SoftwareReceiveScaling == 0 || capabilities.NumberOfIndirectionQueues > 1)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    auto rxSteering = wil::make_unique_nothrow<NxRxSteering>();
+
+    CX_RETURN_NTSTATUS_IF(
+        STATUS_INSUFFICIENT_RESOURCES,
+        ! rxSteering);
+
+    if (! NT_SUCCESS(rxSteering->Initialize(
+        static_cast<INxNblDispatcher *>(adapterProperties.NblDispatcher),
+        &m_rxBufferReturn,
+        capabilities.NumberOfIndirectionTableEntries)))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    m_rxSteering = wistd::move(rxSteering);
+
+    // the default queue may already be running, steering stays disabled
+    // until receive scaling is enabled
+    if (m_rxQueues.count() > 0)
+    {
+        m_rxQueues[0]->SetRxSteering(m_rxSteering.get());
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//
+// The queues of the next datapath are sized for the busiest queue of the
+// one being destroyed. Queues that saw too little traffic to tell leave
+// the previous hint alone.
+//
+_Use_decl_annotations_
+void
+NxTranslationApp::UpdatePacketRingSizeHints(
+    void
+)
+{
+    UINT32 txPacketRingSize = 0;
+    for (auto & queue : m_txQueues)
+    {
+        txPacketRingSize = max(txPacketRingSize, queue->GetRecommendedPacketRingSize());
+    }
+
+    UINT32 rxPacketRingSize = 0;
+    for (auto & queue : m_rxQueues)
+    {
+        rxPacketRingSize = max(rxPacketRingSize, queue->GetRecommendedPacketRingSize());
+    }
+
+    if (txPacketRingSize != 0)
+    {
+        m_txPacketRingSizeHint = txPacketRingSize;
+    }
+
+    if (rxPacketRingSize != 0)
+    {
+        m_rxPacketRingSizeHint = rxPacketRingSize;
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS
+NxTranslationApp::QueryQueueStatistics(
+    NxQueueType QueueType,
+    size_t QueueId,
+    NxQueueStatistics & Statistics
+) const
+{
+    switch (QueueType)
+    {
+    case NxQueueType::Rx:
+        CX_RETURN_NTSTATUS_IF(STATUS_NOT_FOUND, QueueId >= m_rxQueues.count());
+        m_rxQueues[QueueId]->GetStatistics(Statistics);
+        break;
+
+    case NxQueueType::Tx:
+        CX_RETURN_NTSTATUS_IF(STATUS_NOT_FOUND, QueueId >= m_txQueues.count());
+        m_txQueues[QueueId]->GetStatistics(Statistics);
+        break;
+
+    default:
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+NxTranslationApp::QueryReceiveScalingCounters(
+    NxReceiveScalingCounters & Counters
+) const
+{
+    CX_RETURN_NTSTATUS_IF(STATUS_NOT_SUPPORTED, ! m_receiveScaling);
+
+    Counters = m_receiveScaling->GetCounters();
+
+    return STATUS_SUCCESS;
 }
 
 _Use_decl_annotations_
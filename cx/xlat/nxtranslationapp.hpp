@@ -16,6 +16,7 @@ Abstract:
 #include "NxRxXlat.hpp"
 #include "NxReceiveScaling.hpp"
 #include "NxOffload.hpp"
+#include "NxPollScheduler.hpp"
 
 class NxTranslationApp :
     public INxApp
@@ -120,6 +121,29 @@ public:
         _In_ NDIS_OID_REQUEST const & Request
         );
 
+    //
+    // Returns the statistics of a queue of the current datapath, or
+    // STATUS_NOT_FOUND past the last queue of that type. Must not race
+    // with the creation or destruction of the datapath.
+    //
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    NTSTATUS
+    QueryQueueStatistics(
+        _In_ NxQueueType QueueType,
+        _In_ size_t QueueId,
+        _Out_ NxQueueStatistics & Statistics
+    ) const;
+
+    //
+    // Returns the counters of the RSS indirection table updates, or
+    // STATUS_NOT_SUPPORTED if receive scaling was not initialized.
+    //
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    NTSTATUS
+    QueryReceiveScalingCounters(
+        _Out_ NxReceiveScalingCounters & Counters
+    ) const;
+
 private:
 
     _IRQL_requires_(PASSIVE_LEVEL)
@@ -129,6 +153,13 @@ private:
         void
     );
 
+    _IRQL_requires_(PASSIVE_LEVEL)
+    PAGEDX
+    size_t
+    GetNumberOfTxQueues(
+        void
+    ) const;
+
     _IRQL_requires_(PASSIVE_LEVEL)
     PAGEDX
     void
@@ -150,8 +181,35 @@ private:
         void
     );
 
-    wistd::unique_ptr<NxTxXlat>
-        m_txQueue;
+    _IRQL_requires_(PASSIVE_LEVEL)
+    void
+    UpdatePacketRingSizeHints(
+        void
+    );
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    NTSTATUS
+    CreatePollScheduler(
+        void
+    );
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    NTSTATUS
+    CreateRxSteering(
+        void
+    );
+
+    // declared before the queues, which are attached to its workers
+    wistd::unique_ptr<NxPollScheduler>
+        m_pollScheduler;
+
+    // software receive scaling, declared before the queues which steer
+    // their packets through it. Outlives the datapath.
+    wistd::unique_ptr<NxRxSteering>
+        m_rxSteering;
+
+    Rtl::KArray<wistd::unique_ptr<NxTxXlat>, NonPagedPoolNx>
+        m_txQueues;
 
     Rtl::KArray<wistd::unique_ptr<NxRxXlat>, NonPagedPoolNx>
         m_rxQueues;
@@ -171,6 +229,9 @@ private:
     NxNblRx
         m_rxBufferReturn;
 
+    NxNblTx
+        m_txSteering;
+
     wistd::unique_ptr<NxReceiveScaling>
         m_receiveScaling;
 
@@ -183,6 +244,13 @@ private:
     bool
         m_datapathStarted = false;
 
+    // packet ring sizes recommended by the queues of the previous datapath
+    UINT32
+        m_rxPacketRingSizeHint = 0;
+
+    UINT32
+        m_txPacketRingSizeHint = 0;
+
     NxTaskOffload
         m_offload;
 
@@ -0,0 +1,345 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+#include "NxXlatPrecomp.hpp"
+#include "NxXlatCommon.hpp"
+#include "NxTxSegmentation.tmh"
+
+#include "NxTxSegmentation.hpp"
+#include "NxPacketLayout.hpp"
+#include "NxChecksum.hpp"
+
+static
+ULONG
+ReadUlong(
+    _In_reads_bytes_(sizeof(ULONG)) UCHAR const * Buffer
+)
+{
+    return RtlUlongByteSwap(*reinterpret_cast<ULONG UNALIGNED const *>(Buffer));
+}
+
+static
+bool
+CopyMdlChain(
+    _Out_writes_bytes_(Length) UCHAR * Destination,
+    _In_ size_t Length,
+    _In_ PMDL Mdl,
+    _In_ size_t MdlOffset
+)
+{
+    for (size_t copied = 0; copied < Length; Mdl = Mdl->Next, MdlOffset = 0)
+    {
+        if (! Mdl)
+        {
+            return false;
+        }
+
+        size_t const mdlByteCount = MmGetMdlByteCount(Mdl);
+        if (MdlOffset >= mdlByteCount)
+        {
+            continue;
+        }
+
+        auto const mdlVa = static_cast<UCHAR const *>(MmGetSystemAddressForMdlSafe(Mdl, LowPagePriority | MdlMappingNoExecute));
+        if (! mdlVa)
+        {
+            return false;
+        }
+
+        auto const copySize = min(Length - copied, mdlByteCount - MdlOffset);
+
+        RtlCopyMemory(Destination + copied, mdlVa + MdlOffset, copySize);
+        copied += copySize;
+    }
+
+    return true;
+}
+
+static
+void
+AdvanceMdlChain(
+    _Inout_ PMDL & Mdl,
+    _Inout_ size_t & MdlOffset,
+    _In_ size_t Length
+)
+{
+    while (Mdl && Length > 0)
+    {
+        size_t const available = MmGetMdlByteCount(Mdl) - MdlOffset;
+
+        if (Length < available)
+        {
+            MdlOffset += Length;
+            return;
+        }
+
+        Length -= available;
+        Mdl = Mdl->Next;
+        MdlOffset = 0;
+    }
+}
+
+_Use_decl_annotations_
+void
+NxTxSegmenter::Initialize(
+    bool Enabled,
+    NDIS_MEDIUM MediaType,
+    NET_CLIENT_OFFLOAD_LSO_CAPABILITIES const & HardwareCapabilities,
+    size_t MaximumTxFragmentSize
+)
+{
+    m_enabled = Enabled;
+    m_mediaType = MediaType;
+    m_hardwareCapabilities = HardwareCapabilities;
+    m_maximumTxFragmentSize = MaximumTxFragmentSize;
+}
+
+_Use_decl_annotations_
+bool
+NxTxSegmenter::ShouldSegment(
+    NET_BUFFER_LIST const & NetBufferList,
+    NET_BUFFER const & NetBuffer
+) const
+{
+    if (! m_enabled)
+    {
+        return false;
+    }
+
+    auto const & lsoInfo =
+        *reinterpret_cast<NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO const *>(
+            &NetBufferList.NetBufferListInfo[TcpLargeSendNetBufferListInfo]);
+
+    if (lsoInfo.Value == 0)
+    {
+        return false;
+    }
+
+    auto const isIPv4 =
+        lsoInfo.Transmit.Type == NDIS_TCP_LARGE_SEND_OFFLOAD_V1_TYPE ||
+        lsoInfo.LsoV2Transmit.IPVersion == NDIS_TCP_LARGE_SEND_OFFLOAD_IPv4;
+
+    auto const hardwareSupported = isIPv4 ?
+        m_hardwareCapabilities.IPv4 :
+        m_hardwareCapabilities.IPv6;
+
+    // MaximumTxFragmentSize accounts for the NIC's largest offload
+    return ! hardwareSupported || NET_BUFFER_DATA_LENGTH(&NetBuffer) > m_maximumTxFragmentSize;
+}
+
+bool
+NxTxSegmenter::IsSegmenting(
+    void
+) const
+{
+    return m_netBuffer != nullptr && m_payloadOffset < m_payloadLength;
+}
+
+_Use_decl_annotations_
+NxTxSegmentStatus
+NxTxSegmenter::Start(
+    NET_BUFFER_LIST const & NetBufferList,
+    NET_BUFFER & NetBuffer
+)
+{
+    NT_ASSERT(! IsSegmenting());
+
+    Reset();
+
+    auto const & lsoInfo =
+        *reinterpret_cast<NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO const *>(
+            &NetBufferList.NetBufferListInfo[TcpLargeSendNetBufferListInfo]);
+
+    ULONG tcpHeaderOffset;
+
+    switch (lsoInfo.Transmit.Type)
+    {
+    case NDIS_TCP_LARGE_SEND_OFFLOAD_V1_TYPE:
+        tcpHeaderOffset = lsoInfo.LsoV1Transmit.TcpHeaderOffset;
+        m_mss = lsoInfo.LsoV1Transmit.MSS;
+        m_isIPv4 = true;
+        break;
+
+    case NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE:
+        tcpHeaderOffset = lsoInfo.LsoV2Transmit.TcpHeaderOffset;
+        m_mss = lsoInfo.LsoV2Transmit.MSS;
+        m_isIPv4 = lsoInfo.LsoV2Transmit.IPVersion == NDIS_TCP_LARGE_SEND_OFFLOAD_IPv4;
+        break;
+
+    default:
+        return NxTxSegmentStatus::CannotTranslate;
+    }
+
+    auto const dataLength = NET_BUFFER_DATA_LENGTH(&NetBuffer);
+    auto const templateLength = min(dataLength, static_cast<ULONG>(sizeof(m_header)));
+
+    m_mdl = NET_BUFFER_CURRENT_MDL(&NetBuffer);
+    m_mdlOffset = NET_BUFFER_CURRENT_MDL_OFFSET(&NetBuffer);
+
+    if (! CopyMdlChain(m_header, templateLength, m_mdl, m_mdlOffset))
+    {
+        return NxTxSegmentStatus::CannotTranslate;
+    }
+
+    m_layout = NxGetBufferLayout(m_mediaType, m_header, templateLength);
+
+    auto const layer3Matches = m_isIPv4 ?
+        (m_layout.Layer3Type == NET_PACKET_LAYER3_TYPE_IPV4_NO_OPTIONS ||
+            m_layout.Layer3Type == NET_PACKET_LAYER3_TYPE_IPV4_WITH_OPTIONS) :
+        (m_layout.Layer3Type == NET_PACKET_LAYER3_TYPE_IPV6_NO_EXTENSIONS ||
+            m_layout.Layer3Type == NET_PACKET_LAYER3_TYPE_IPV6_WITH_EXTENSIONS);
+
+    m_headerLength =
+        m_layout.Layer2HeaderLength +
+        m_layout.Layer3HeaderLength +
+        m_layout.Layer4HeaderLength;
+
+    // the headers must be whole within the template and agree with the stack
+    if (! layer3Matches ||
+        m_layout.Layer4Type != NET_PACKET_LAYER4_TYPE_TCP ||
+        m_layout.Layer4HeaderLength == 0 ||
+        m_layout.Layer2HeaderLength + m_layout.Layer3HeaderLength != tcpHeaderOffset ||
+        m_headerLength >= dataLength ||
+        m_mss == 0)
+    {
+        return NxTxSegmentStatus::CannotTranslate;
+    }
+
+    auto const ip = m_header + m_layout.Layer2HeaderLength;
+    auto const tcp = reinterpret_cast<TCP_HDR UNALIGNED const *>(ip + m_layout.Layer3HeaderLength);
+
+    if (m_isIPv4)
+    {
+        m_identification = RtlUshortByteSwap(reinterpret_cast<IPV4_HEADER UNALIGNED const *>(ip)->Identification);
+    }
+
+    m_sequenceNumber = ReadUlong(reinterpret_cast<UCHAR const *>(&tcp->th_seq));
+    m_payloadLength = dataLength - m_headerLength;
+    m_netBuffer = &NetBuffer;
+
+    AdvanceMdlChain(m_mdl, m_mdlOffset, m_headerLength);
+
+    return NxTxSegmentStatus::Success;
+}
+
+_Use_decl_annotations_
+NxTxSegmentStatus
+NxTxSegmenter::BuildSegment(
+    NxBounceBufferPool & BouncePool,
+    NET_RING_COLLECTION const * Rings,
+    NET_PACKET & Packet,
+    size_t & BytesCopied
+)
+{
+    NT_ASSERT(IsSegmenting());
+
+    BytesCopied = 0;
+
+    auto const segmentOffset = m_payloadOffset;
+    auto const segmentLength = min(m_mss, m_payloadLength - m_payloadOffset);
+
+    if (! BouncePool.BounceSegment(m_header, m_headerLength, m_mdl, m_mdlOffset, segmentLength, Packet))
+    {
+        return Packet.Ignore ?
+            NxTxSegmentStatus::CannotTranslate :
+            NxTxSegmentStatus::InsufficientResources;
+    }
+
+    Packet.Layout = m_layout;
+
+    FixupSegment(Rings, Packet, segmentOffset, segmentLength);
+
+    m_payloadOffset += segmentLength;
+    m_segmentIndex++;
+
+    BytesCopied = m_headerLength + segmentLength;
+
+    return NxTxSegmentStatus::Success;
+}
+
+_Use_decl_annotations_
+void
+NxTxSegmenter::FixupSegment(
+    NET_RING_COLLECTION const * Rings,
+    NET_PACKET const & Packet,
+    ULONG SegmentOffset,
+    ULONG SegmentLength
+) const
+{
+    auto const fr = NetRingCollectionGetFragmentRing(Rings);
+    auto const firstFragment = NetRingGetFragmentAtIndex(fr, Packet.FragmentIndex);
+
+    // BounceSegment never splits the headers
+    auto const ip = static_cast<UCHAR *>(firstFragment->VirtualAddress) +
+        firstFragment->Offset +
+        m_layout.Layer2HeaderLength;
+    auto const tcp = reinterpret_cast<TCP_HDR UNALIGNED *>(ip + m_layout.Layer3HeaderLength);
+    auto const tcpLength = m_layout.Layer4HeaderLength + SegmentLength;
+
+    if (m_isIPv4)
+    {
+        auto const ipv4 = reinterpret_cast<IPV4_HEADER UNALIGNED *>(ip);
+
+        ipv4->TotalLength = RtlUshortByteSwap(static_cast<USHORT>(m_layout.Layer3HeaderLength + tcpLength));
+        ipv4->Identification = RtlUshortByteSwap(static_cast<USHORT>(m_identification + m_segmentIndex));
+        ipv4->HeaderChecksum = 0;
+        ipv4->HeaderChecksum = NxChecksumFinish(NxChecksumAdd(0, ipv4, m_layout.Layer3HeaderLength));
+    }
+    else
+    {
+        auto const ipv6 = reinterpret_cast<IPV6_HEADER UNALIGNED *>(ip);
+
+        ipv6->PayloadLength = RtlUshortByteSwap(
+            static_cast<USHORT>(m_layout.Layer3HeaderLength - sizeof(IPV6_HEADER) + tcpLength));
+    }
+
+    tcp->th_seq = RtlUlongByteSwap(m_sequenceNumber + SegmentOffset);
+
+    // FIN and PSH belong to the last segment, CWR to the first
+    if (SegmentOffset + SegmentLength != m_payloadLength)
+    {
+        tcp->th_flags &= ~(TH_FIN | TH_PSH);
+    }
+
+    if (SegmentOffset != 0)
+    {
+        tcp->th_flags &= ~TH_CWR;
+    }
+
+    tcp->th_sum = 0;
+
+    auto sum = NxChecksumAddPseudoHeader(0, ip, m_isIPv4, IPPROTO_TCP, tcpLength);
+    sum = NxChecksumAddFragments(
+        sum,
+        Rings,
+        Packet,
+        m_layout.Layer2HeaderLength + m_layout.Layer3HeaderLength,
+        tcpLength);
+
+    tcp->th_sum = NxChecksumFinish(sum);
+}
+
+ULONG
+NxTxSegmenter::GetPayloadLength(
+    void
+) const
+{
+    return m_payloadLength;
+}
+
+void
+NxTxSegmenter::Reset(
+    void
+)
+{
+    m_netBuffer = nullptr;
+    m_layout = {};
+    m_headerLength = 0;
+    m_mss = 0;
+    m_payloadLength = 0;
+    m_payloadOffset = 0;
+    m_sequenceNumber = 0;
+    m_identification = 0;
+    m_segmentIndex = 0;
+    m_mdl = nullptr;
+    m_mdlOffset = 0;
+}
@@ -0,0 +1,159 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+/*++
+
+Abstract:
+
+    Software TCP segmentation. A large send the NIC cannot segment, because
+    it has no large send offload for the IP version, or because the send is
+    larger than the NIC's offload size, is split into MSS sized packets by
+    the transmit queue instead of being dropped.
+
+    The headers of the NET_BUFFER are copied once into a template. Every
+    segment is the template followed by a slice of the payload, copied into
+    bounce buffers, with the IPv4 identification and lengths, the TCP
+    sequence number and flags and both checksums fixed up for the segment.
+
+    A NET_BUFFER may need more segments than there are free packets in the
+    ring, NxTxSegmenter keeps the position within the NET_BUFFER between
+    translation passes.
+
+--*/
+
+#pragma once
+
+#include "NxBounceBufferPool.hpp"
+
+// what is advertised for an IP version only segmented in software
+#define NX_TX_SEGMENTATION_MAXIMUM_OFFLOAD_SIZE 64000U
+#define NX_TX_SEGMENTATION_MINIMUM_SEGMENT_COUNT 2U
+
+// largest header template, link layer through TCP options
+#define NX_TX_SEGMENTATION_MAXIMUM_HEADER_SIZE 256
+
+enum class NxTxSegmentStatus
+{
+    Success,
+    InsufficientResources,
+    CannotTranslate,
+};
+
+class NxTxSegmenter
+{
+public:
+
+    void
+    Initialize(
+        _In_ bool Enabled,
+        _In_ NDIS_MEDIUM MediaType,
+        _In_ NET_CLIENT_OFFLOAD_LSO_CAPABILITIES const & HardwareCapabilities,
+        _In_ size_t MaximumTxFragmentSize
+    );
+
+    // whether NetBuffer is a large send the NIC cannot segment itself
+    bool
+    ShouldSegment(
+        _In_ NET_BUFFER_LIST const & NetBufferList,
+        _In_ NET_BUFFER const & NetBuffer
+    ) const;
+
+    // whether a NET_BUFFER has segments left to build
+    bool
+    IsSegmenting(
+        void
+    ) const;
+
+    NxTxSegmentStatus
+    Start(
+        _In_ NET_BUFFER_LIST const & NetBufferList,
+        _In_ NET_BUFFER & NetBuffer
+    );
+
+    NxTxSegmentStatus
+    BuildSegment(
+        _In_ NxBounceBufferPool & BouncePool,
+        _In_ NET_RING_COLLECTION const * Rings,
+        _Inout_ NET_PACKET & Packet,
+        _Out_ size_t & BytesCopied
+    );
+
+    // TCP payload of the NET_BUFFER being segmented
+    ULONG
+    GetPayloadLength(
+        void
+    ) const;
+
+    void
+    Reset(
+        void
+    );
+
+private:
+
+    void
+    FixupSegment(
+        _In_ NET_RING_COLLECTION const * Rings,
+        _In_ NET_PACKET const & Packet,
+        _In_ ULONG SegmentOffset,
+        _In_ ULONG SegmentLength
+    ) const;
+
+private:
+
+    bool
+        m_enabled = false;
+
+    NDIS_MEDIUM
+        m_mediaType = NdisMedium802_3;
+
+    NET_CLIENT_OFFLOAD_LSO_CAPABILITIES
+        m_hardwareCapabilities = {};
+
+    size_t
+        m_maximumTxFragmentSize = 0;
+
+    //
+    // NET_BUFFER being segmented
+    //
+
+    NET_BUFFER *
+        m_netBuffer = nullptr;
+
+    NET_PACKET_LAYOUT
+        m_layout = {};
+
+    bool
+        m_isIPv4 = false;
+
+    ULONG
+        m_headerLength = 0;
+
+    ULONG
+        m_mss = 0;
+
+    ULONG
+        m_payloadLength = 0;
+
+    ULONG
+        m_payloadOffset = 0;
+
+    // host byte order
+    ULONG
+        m_sequenceNumber = 0;
+
+    USHORT
+        m_identification = 0;
+
+    USHORT
+        m_segmentIndex = 0;
+
+    // where the payload of the next segment starts
+    PMDL
+        m_mdl = nullptr;
+
+    size_t
+        m_mdlOffset = 0;
+
+    UCHAR
+        m_header[NX_TX_SEGMENTATION_MAXIMUM_HEADER_SIZE];
+};
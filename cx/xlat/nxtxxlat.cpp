@@ -14,6 +14,7 @@ Abstract:
 
 #include "NxTxXlat.tmh"
 #include "NxTxXlat.hpp"
+#include "NxNumaNode.hpp"
 
 #include <net/checksumtypes_p.h>
 #include <net/lsotypes_p.h>
@@ -38,6 +39,91 @@ static const NET_CLIENT_QUEUE_NOTIFY_DISPATCH QueueDispatch
 
 using PacketContext = NxNblTranslator::PacketContext;
 
+static
+size_t
+GetCurrentProcessorIndex(
+    void
+)
+{
+#if _KERNEL_MODE
+    return KeGetCurrentProcessorIndex();
+#else
+    return GetCurrentProcessorNumber();
+#endif
+}
+
+_Use_decl_annotations_
+NxNblTx::NxNblTx(
+    Rtl::KArray<wistd::unique_ptr<NxTxXlat>, NonPagedPoolNx> const & Queues
+) noexcept :
+    m_queues(Queues)
+{
+}
+
+_Use_decl_annotations_
+size_t
+NxNblTx::GetQueueIndex(
+    NET_BUFFER_LIST * Nbl,
+    size_t ProcessorQueueIndex
+) const
+{
+    if (NET_BUFFER_LIST_GET_HASH_FUNCTION(Nbl) != 0)
+    {
+        return NET_BUFFER_LIST_GET_HASH_VALUE(Nbl) % m_queues.count();
+    }
+
+    return ProcessorQueueIndex;
+}
+
+void
+NxNblTx::SendNetBufferLists(
+    _In_ NET_BUFFER_LIST * NblChain,
+    _In_ ULONG PortNumber,
+    _In_ ULONG NumberOfNbls,
+    _In_ ULONG SendFlags
+)
+{
+    if (m_queues.count() == 1)
+    {
+        m_queues[0]->SendNetBufferLists(NblChain, PortNumber, NumberOfNbls, SendFlags);
+        return;
+    }
+
+    auto const processorQueueIndex = GetCurrentProcessorIndex() % m_queues.count();
+
+    //
+    // Hand off the longest spans of NBLs steered to the same queue. The
+    // relative order of the NBLs within each queue is preserved.
+    //
+    auto nbl = NblChain;
+    auto queueIndex = GetQueueIndex(nbl, processorQueueIndex);
+
+    while (nbl)
+    {
+        auto const first = nbl;
+        auto const spanQueueIndex = queueIndex;
+        auto last = nbl;
+        ULONG numberOfNbls = 1;
+
+        for (nbl = nbl->Next; nbl; nbl = nbl->Next)
+        {
+            queueIndex = GetQueueIndex(nbl, processorQueueIndex);
+
+            if (queueIndex != spanQueueIndex)
+            {
+                break;
+            }
+
+            last = nbl;
+            numberOfNbls++;
+        }
+
+        last->Next = nullptr;
+
+        m_queues[spanQueueIndex]->SendNetBufferLists(first, PortNumber, numberOfNbls, SendFlags);
+    }
+}
+
 _Use_decl_annotations_
 NxTxXlat::NxTxXlat(
     size_t QueueId,
@@ -95,6 +181,8 @@ NxTxXlat::ArmNetBufferListArrivalNotification()
 void
 NxTxXlat::ArmAdapterTxNotification()
 {
+    m_moderator.OnArm();
+
     m_queueDispatch->SetArmed(m_queue, true);
 }
 
@@ -198,74 +286,90 @@ NxTxXlat::TransmitThread()
 
     while (! m_executionContext.IsTerminated())
     {
-        m_queueDispatch->Start(m_queue);
-
-        auto cancelIssued = false;
+        EcStartRun();
 
-        // This represents the core execution of the Tx path
-        while (true)
+        while (EcRunIteration())
         {
-            if (!cancelIssued)
-            {
-                // Check if the NBL serialization has any data
-                PollNetBufferLists();
+        }
+    }
+}
 
-                // Post NBLs to the producer side of the NBL
-                TranslateNbls();
-            }
+void
+NxTxXlat::EcStartRun()
+{
+    m_queueDispatch->Start(m_queue);
+
+    m_cancelIssued = false;
+}
+
+bool
+NxTxXlat::EcRunIteration()
+{
+    // This represents the core execution of the Tx path
+    if (!m_cancelIssued)
+    {
+        // Check if the NBL serialization has any data
+        PollNetBufferLists();
+
+        // Post NBLs to the producer side of the NBL
+        TranslateNbls();
+    }
+
+    // Allow the NetAdapter to return any packets that it is done with.
+    YieldToNetAdapter();
+
+    // Drain any packets that the NIC has completed.
+    // This means returning the associated NBLs for each completed
+    // NET_PACKET.
+    DrainCompletions();
+
+    m_statisticsSampler.Sample(m_packetRing, m_executionContext);
+
+    // Arms notifications if no forward progress was made in
+    // this loop.
+    WaitForWork();
 
-            // Allow the NetAdapter to return any packets that it is done with.
-            YieldToNetAdapter();
+    // This represents the wind down of Tx
+    if (m_executionContext.IsStopping())
+    {
+        if (!m_cancelIssued)
+        {
+            // Indicate cancellation to the adapter
+            // and drop all outstanding NBLs.
+            //
+            // One NBL may remain that has been partially programmed into the NIC.
+            // So that NBL is kept around until the end
 
-            // Drain any packets that the NIC has completed.
-            // This means returning the associated NBLs for each completed
-            // NET_PACKET.
-            DrainCompletions();
+            m_queueDispatch->Cancel(m_queue);
+            DropQueuedNetBufferLists();
 
-            // Arms notifications if no forward progress was made in
-            // this loop.
-            WaitForWork();
+            m_cancelIssued = true;
+        }
 
-            // This represents the wind down of Tx
-            if (m_executionContext.IsStopping())
+        // The termination condition is that the NIC has returned all its
+        // packets.
+        if (!m_packetRing.AnyNicPackets())
+        {
+            // the drain budget may take more than one pass
+            while (m_packetRing.AnyReturnedPackets())
             {
-                if (!cancelIssued)
-                {
-                    // Indicate cancellation to the adapter
-                    // and drop all outstanding NBLs.
-                    //
-                    // One NBL may remain that has been partially programmed into the NIC.
-                    // So that NBL is kept around until the end
-
-                    m_queueDispatch->Cancel(m_queue);
-                    DropQueuedNetBufferLists();
-
-                    cancelIssued = true;
-                }
-
-                // The termination condition is that the NIC has returned all its
-                // packets.
-                if (!m_packetRing.AnyNicPackets())
-                {
-                    if (m_packetRing.AnyReturnedPackets())
-                    {
-                        DrainCompletions();
-                        NT_ASSERT(!m_packetRing.AnyReturnedPackets());
-                    }
-
-                    // DropQueuedNetBufferLists had completed as many NBLs as possible, but there's
-                    // a chance that one parital NBL couldn't be completed up there.  Do it now.
-                    AbortNbls(m_currentNbl);
-                    m_currentNbl = nullptr;
-                    m_currentNetBuffer = nullptr;
-
-                    m_queueDispatch->Stop(m_queue);
-                    m_executionContext.SignalStopped();
-                    break;
-                }
+                DrainCompletions();
             }
+
+            // DropQueuedNetBufferLists had completed as many NBLs as possible, but there's
+            // a chance that one parital NBL couldn't be completed up there.  Do it now.
+            AbortNbls(m_currentNbl);
+            m_currentNbl = nullptr;
+            m_currentNetBuffer = nullptr;
+            m_segmenter.Reset();
+
+            m_queueDispatch->Stop(m_queue);
+            m_executionContext.SignalStopped();
+            return false;
         }
     }
+
+    return true;
 }
 
 void
@@ -274,7 +378,16 @@ NxTxXlat::DrainCompletions()
     NxNblTranslator translator{ m_nblTranslationStats, &m_rings, m_datapathCapabilities, m_dmaAdapter.get(), m_packetContext, m_adapterProperties.MediaType };
     translator.m_netPacketLsoExtension = m_lsoExtension;
 
-    auto const result = translator.CompletePackets(m_bounceBufferPool);
+    m_drainBudget.Begin();
+
+    auto const pr = NetRingCollectionGetPacketRing(&m_rings);
+    auto const osReserved0 = pr->OSReserved0;
+
+    auto const result = translator.CompletePackets(m_bounceBufferPool, m_drainBudget);
+
+    m_completedPacketCount = NetRingGetRangeCount(pr, osReserved0, pr->OSReserved0);
+
+    m_drainBudget.End(m_packetRing.AnyReturnedPackets());
 
     m_completedPackets = result.CompletedPackets;
 
@@ -290,14 +403,28 @@ NxTxXlat::TranslateNbls()
 {
     m_producedPackets = false;
 
+    m_translateBudget.Begin();
+
     if (!m_currentNbl)
+    {
+        m_translateBudget.End(false);
         return;
+    }
 
     NxNblTranslator translator{ m_nblTranslationStats, &m_rings, m_datapathCapabilities, m_dmaAdapter.get(), m_packetContext, m_adapterProperties.MediaType };
     translator.m_netPacketChecksumExtension = m_checksumExtension;
     translator.m_netPacketLsoExtension = m_lsoExtension;
+    translator.m_checksumEngine = &m_checksumEngine;
+
+    m_producedPackets = translator.TranslateNbls(m_currentNbl, m_currentNetBuffer, m_bounceBufferPool, m_segmenter, m_translateBudget);
+
+    m_translateBudget.End(m_currentNbl != nullptr);
 
-    m_producedPackets = translator.TranslateNbls(m_currentNbl, m_currentNetBuffer, m_bounceBufferPool);
+    if (m_producedPackets)
+    {
+        auto const pr = NetRingCollectionGetPacketRing(&m_rings);
+        NxPerfTunerSampleRingOccupancy(m_packetRingOccupancy, NetRingGetRangeCount(pr, pr->OSReserved0, pr->EndIndex));
+    }
 }
 
 void
@@ -305,13 +432,49 @@ NxTxXlat::WaitForWork()
 {
     auto notificationsToArm = GetNotificationsToArm();
 
+    m_moderator.Sample(m_completedPacketCount);
+
+    if (notificationsToArm.Value == 0)
+    {
+        m_lingered = false;
+    }
+
+    // poll a while longer before arming notifications and going to sleep
+    if (m_executionContext.ContinueBusyPoll(notificationsToArm.Value == 0))
+    {
+        return;
+    }
+
+    // at a high packet rate give the NIC a while to produce more work
+    // before arming its notification, once per idle period
+    if (notificationsToArm.Flags.ShouldArmTxCompletion && ! m_lingered)
+    {
+        auto const lingerTime = m_moderator.GetLingerTime();
+
+        if (lingerTime != 0 && m_executionContext.HasDedicatedThread())
+        {
+            m_lingered = true;
+            m_moderator.OnLinger();
+
+            m_executionContext.Linger(lingerTime);
+            return;
+        }
+    }
+
     // In order to handle race conditions, the notifications that should
     // be armed at halt cannot change between the halt preparation and the
     // actual halt. If they do change, re-arm the necessary notifications
     // and loop again.
     if (notificationsToArm.Value != 0 && notificationsToArm.Value == m_lastArmedNotifications.Value)
     {
-        m_executionContext.WaitForWork();
+        // a shared EC does not halt here, it gives the poll worker back with
+        // the notifications left armed
+        if (! m_executionContext.WaitForWork())
+        {
+            return;
+        }
+
+        m_moderator.OnWake();
 
         // after halting, don't arm any notifications
         notificationsToArm.Value = 0;
@@ -426,6 +589,24 @@ NxTxXlat::Initialize(
     void
 )
 {
+    NxXlatReadParameters(m_adapterProperties.NdisAdapterHandle, &m_parameters);
+
+    m_translateBudget.Initialize(
+        m_parameters.TxTranslateBudget,
+        m_parameters.TxTranslateByteBudget,
+        m_parameters.AdaptiveBudgets != 0);
+
+    // completions carry no byte count worth walking the fragments for
+    m_drainBudget.Initialize(
+        m_parameters.TxDrainBudget,
+        0,
+        m_parameters.AdaptiveBudgets != 0);
+
+    m_moderator.Initialize(m_parameters.NotificationModeration != 0);
+
+    auto const node = NxGetNodeFromGroupAffinity(m_groupAffinity);
+    NxNodeAllocationScope nodeScope(node);
+
     m_adapterDispatch->GetDatapathCapabilities(m_adapter, &m_datapathCapabilities);
 
     NX_PERF_TX_NIC_CHARACTERISTICS perfCharacteristics = {};
@@ -436,6 +617,7 @@ NxTxXlat::Initialize(
     perfCharacteristics.MaximumFragmentBufferSize = m_datapathCapabilities.MaximumTxFragmentSize;
     perfCharacteristics.NominalLinkSpeed = m_datapathCapabilities.NominalMaxTxLinkSpeed;
     perfCharacteristics.MaxPacketSizeWithLso = m_datapathCapabilities.MtuWithLso;
+    perfCharacteristics.PacketRingNumberOfElementsHint = m_packetRingSizeHint;
 
     NxPerfTunerCalculateTxParameters(&perfCharacteristics, &perfParameters);
 
@@ -478,12 +660,46 @@ NxTxXlat::Initialize(
         NET_PACKET_EXTENSION_LSO_VERSION_1,
         &m_lsoExtension);
 
+    // without the extension the NIC cannot be asked to compute any checksum
+    NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES checksumHardwareCapabilities = {
+        sizeof(NET_CLIENT_OFFLOAD_CHECKSUM_CAPABILITIES)
+    };
+
+    if (m_checksumExtension.Enabled)
+    {
+        m_adapterDispatch->OffloadDispatch.GetChecksumHardwareCapabilities(m_adapter, &checksumHardwareCapabilities);
+    }
+
+    m_checksumEngine.Initialize(
+        m_parameters.SoftwareChecksum != 0,
+        checksumHardwareCapabilities);
+
+    // without the extension the NIC cannot be asked to segment anything
+    NET_CLIENT_OFFLOAD_LSO_CAPABILITIES lsoHardwareCapabilities = {
+        sizeof(NET_CLIENT_OFFLOAD_LSO_CAPABILITIES)
+    };
+
+    if (m_lsoExtension.Enabled)
+    {
+        m_adapterDispatch->OffloadDispatch.GetLsoHardwareCapabilities(m_adapter, &lsoHardwareCapabilities);
+    }
+
+    m_segmenter.Initialize(
+        m_parameters.SoftwareSegmentation != 0,
+        m_adapterProperties.MediaType,
+        lsoHardwareCapabilities,
+        m_datapathCapabilities.MaximumTxFragmentSize);
+
     RtlCopyMemory(&m_rings, m_queueDispatch->GetNetDatapathDescriptor(m_queue), sizeof(m_rings));
 
+    m_packetRingOccupancy.ElementCount = NetRingCollectionGetPacketRing(&m_rings)->NumberOfElements;
+
     CX_RETURN_IF_NOT_NT_SUCCESS_MSG(
         m_packetRing.Initialize(NetRingCollectionGetPacketRing(&m_rings)),
         "Failed to initialize packet ring buffer.");
 
+    m_statisticsSampler.Initialize(m_packetRing);
+
     CX_RETURN_IF_NOT_NT_SUCCESS_MSG(
         m_packetContext.Initialize(sizeof(PacketContext)),
         "Failed to initialize private context.");
@@ -505,22 +721,80 @@ NxTxXlat::Initialize(
             *m_dispatch,
             &m_rings,
             m_datapathCapabilities,
-            perfParameters.NumberOfBounceBuffers));
+            m_dmaAdapter.get(),
+            perfParameters.NumberOfBounceBuffers,
+            node));
 
     for (auto i = 0ul; i < m_packetRing.Count(); i++)
     {
         new (&m_packetContext.GetContext<PacketContext>(i)) PacketContext();
     }
 
-    CX_RETURN_IF_NOT_NT_SUCCESS_MSG(
-        m_executionContext.Initialize(this, NetAdapterTransmitThread),
-        "Failed to start Tx execution context. NxTxXlat=%p", this);
+    if (! m_pollWorker || ! NT_SUCCESS(m_executionContext.InitializeShared(*this, *m_pollWorker)))
+    {
+        CX_RETURN_IF_NOT_NT_SUCCESS_MSG(
+            m_executionContext.Initialize(this, NetAdapterTransmitThread),
+            "Failed to start Tx execution context. NxTxXlat=%p", this);
+    }
+
+    m_executionContext.SetBusyPollPolicy(m_parameters.BusyPollTimeout, m_parameters.BusyPollIterations);
 
     m_executionContext.SetDebugNameHint(L"Transmit", GetQueueId(), m_adapterProperties.NetLuid);
 
     return STATUS_SUCCESS;
 }
 
+_Use_decl_annotations_
+void
+NxTxXlat::SetGroupAffinity(
+    GROUP_AFFINITY const & GroupAffinity
+)
+{
+    m_groupAffinity = GroupAffinity;
+}
+
+_Use_decl_annotations_
+void
+NxTxXlat::SetPollWorker(
+    NxPollWorker * PollWorker
+)
+{
+    m_pollWorker = PollWorker;
+}
+
+_Use_decl_annotations_
+void
+NxTxXlat::SetPacketRingSizeHint(
+    UINT32 PacketRingSizeHint
+)
+{
+    m_packetRingSizeHint = PacketRingSizeHint;
+}
+
+_Use_decl_annotations_
+UINT32
+NxTxXlat::GetRecommendedPacketRingSize(
+    void
+) const
+{
+    return NxPerfTunerRecommendPacketRingSize(m_packetRingOccupancy);
+}
+
+_Use_decl_annotations_
+void
+NxTxXlat::GetStatistics(
+    NxQueueStatistics & Statistics
+) const
+{
+    Statistics = {};
+    Statistics.Ring = m_packetRing.GetRingbufferCounters();
+    Statistics.ExecutionContext = m_executionContext.GetExecutionContextCounters();
+    Statistics.Notification = m_moderator.GetCounters();
+    Statistics.Translation = m_nblTranslationStats;
+
+    NxQueueStatisticsCalculateCyclesPerPacket(Statistics);
+}
+
 _Use_decl_annotations_
 void
 NxTxXlat::Start(
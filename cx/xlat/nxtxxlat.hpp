@@ -22,9 +22,14 @@ Abstract:
 #include "NxNblTranslation.hpp"
 #include "NxDma.hpp"
 #include "NxPerfTuner.hpp"
+#include "NxQueueStatistics.hpp"
+#include "NxXlatParameters.hpp"
+#include "NxWorkBudget.hpp"
+#include "NxNotificationModeration.hpp"
 
 class NxTxXlat :
     public INxNblTx,
+    public INxExecutionContextTask,
     public NxNonpagedAllocation<'xTxN'>
 {
 public:
@@ -54,6 +59,44 @@ public:
         void
     );
 
+    // must be called before Initialize, used to place the queue memory
+    _IRQL_requires_(PASSIVE_LEVEL)
+    void
+    SetGroupAffinity(
+        _In_ GROUP_AFFINITY const & GroupAffinity
+    );
+
+    // must be called before Initialize, runs the queue on a shared poll
+    // worker instead of a thread of its own
+    _IRQL_requires_(PASSIVE_LEVEL)
+    void
+    SetPollWorker(
+        _In_ NxPollWorker * PollWorker
+    );
+
+    // must be called before Initialize, a size recommended by a previous
+    // instance of the queue
+    _IRQL_requires_(PASSIVE_LEVEL)
+    void
+    SetPacketRingSizeHint(
+        _In_ UINT32 PacketRingSizeHint
+    );
+
+    // packet ring size to use the next time the queue is created, zero if
+    // the queue has not seen enough traffic to tell
+    _IRQL_requires_(PASSIVE_LEVEL)
+    UINT32
+    GetRecommendedPacketRingSize(
+        void
+    ) const;
+
+    // a snapshot of the counters, which keep changing while it is taken
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    void
+    GetStatistics(
+        _Out_ NxQueueStatistics & Statistics
+    ) const;
+
     _IRQL_requires_(PASSIVE_LEVEL)
     void
     Start(
@@ -77,6 +120,21 @@ public:
         void
     );
 
+    //
+    // INxExecutionContextTask
+    //
+    virtual
+    void
+    EcStartRun(
+        void
+    ) override;
+
+    virtual
+    bool
+    EcRunIteration(
+        void
+    ) override;
+
     void
     Notify(
         void
@@ -99,7 +157,11 @@ private:
 
     size_t m_queueId = ~0U;
 
+    GROUP_AFFINITY m_groupAffinity = {};
+
     NxExecutionContext m_executionContext;
+    NxPollWorker * m_pollWorker = nullptr;
+    bool m_cancelIssued = false;
 
     NET_CLIENT_DISPATCH const * m_dispatch = nullptr;
     NET_CLIENT_ADAPTER m_adapter = nullptr;
@@ -111,6 +173,20 @@ private:
     NxInterlockedFlag m_queueNotification;
     NxNblQueue m_synchronizedNblQueue;
     NxNblTranslationStats m_nblTranslationStats;
+    NxXlatParameters m_parameters;
+
+    // sizing feedback for NxPerfTuner, see NX_PERF_RING_OCCUPANCY
+    UINT32 m_packetRingSizeHint = 0;
+    NX_PERF_RING_OCCUPANCY m_packetRingOccupancy = {};
+    NxQueueStatisticsSampler m_statisticsSampler;
+
+    // per iteration limits, see NxXlatParameters
+    NxWorkBudget m_translateBudget;
+    NxWorkBudget m_drainBudget;
+
+    NxNotificationModerator m_moderator;
+    bool m_lingered = false;
+    UINT32 m_completedPacketCount = 0;
 
     NET_CLIENT_QUEUE m_queue = nullptr;
     NET_CLIENT_QUEUE_DISPATCH const * m_queueDispatch = nullptr;
@@ -124,6 +200,12 @@ private:
     NxBounceBufferPool m_bounceBufferPool;
     wistd::unique_ptr<NxDmaAdapter> m_dmaAdapter;
 
+    // large sends the NIC cannot segment, see NxXlatParameters
+    NxTxSegmenter m_segmenter;
+
+    // checksums the NIC cannot compute, see NxXlatParameters
+    NxChecksumEngine m_checksumEngine;
+
     //
     // Datapath variables
     // All below will change as TransmitThread runs
@@ -211,3 +293,45 @@ private:
 
 };
 
+//
+// Steers NBLs sent by NDIS across the transmit queues. NBLs carrying a
+// hash value are steered by hash so each flow stays on one queue and keeps
+// its ordering, the remaining NBLs are steered by the sending processor.
+//
+class NxNblTx :
+    public INxNblTx,
+    public NxNonpagedAllocation<'xTxN'>
+{
+public:
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    NxNblTx(
+        _In_ Rtl::KArray<wistd::unique_ptr<NxTxXlat>, NonPagedPoolNx> const & Queues
+    ) noexcept;
+
+    //
+    // INxNblTx
+    //
+
+    virtual
+    void
+    SendNetBufferLists(
+        _In_ NET_BUFFER_LIST * NblChain,
+        _In_ ULONG PortNumber,
+        _In_ ULONG NumberOfNbls,
+        _In_ ULONG SendFlags
+    );
+
+private:
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    size_t
+    GetQueueIndex(
+        _In_ NET_BUFFER_LIST * Nbl,
+        _In_ size_t ProcessorQueueIndex
+    ) const;
+
+    Rtl::KArray<wistd::unique_ptr<NxTxXlat>, NonPagedPoolNx> const &
+        m_queues;
+
+};
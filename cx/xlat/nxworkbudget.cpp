@@ -0,0 +1,69 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+#include "NxXlatPrecomp.hpp"
+#include "NxXlatCommon.hpp"
+#include "NxWorkBudget.tmh"
+
+#include "NxWorkBudget.hpp"
+
+_Use_decl_annotations_
+void
+NxWorkBudget::Initialize(
+    ULONG PacketLimit,
+    ULONG ByteLimit,
+    bool Adaptive
+)
+{
+    m_basePacketLimit = PacketLimit;
+    m_baseByteLimit = ByteLimit;
+    m_adaptive = Adaptive;
+    m_exhausted = false;
+
+    SetScale(1);
+}
+
+_Use_decl_annotations_
+void
+NxWorkBudget::SetScale(
+    ULONG Scale
+)
+{
+    m_scale = Scale;
+    m_packetLimit = static_cast<ULONG64>(m_basePacketLimit) * Scale;
+    m_byteLimit = static_cast<ULONG64>(m_baseByteLimit) * Scale;
+}
+
+_Use_decl_annotations_
+void
+NxWorkBudget::End(
+    bool MoreWork
+)
+{
+    m_exhausted = MoreWork && (! HasPackets() || ! HasBytes());
+
+    if (! m_adaptive)
+    {
+        return;
+    }
+
+    if (m_exhausted)
+    {
+        // the ring refills faster than the budget drains it
+        if (m_scale < NX_WORK_BUDGET_MAXIMUM_SCALE)
+        {
+            SetScale(m_scale * 2);
+        }
+    }
+    else if (m_scale > 1)
+    {
+        // a quarter of the budget would have done, give the other stages
+        // their share of the thread back
+        auto const packetsUnused = m_packetLimit == 0 || m_packets * 4 < m_packetLimit;
+        auto const bytesUnused = m_byteLimit == 0 || m_bytes * 4 < m_byteLimit;
+
+        if (packetsUnused && bytesUnused)
+        {
+            SetScale(m_scale / 2);
+        }
+    }
+}
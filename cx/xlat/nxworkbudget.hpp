@@ -0,0 +1,134 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+/*++
+
+Abstract:
+
+    Bounds the work one execution context iteration does in a single
+    stage (RX indication, RX buffer posting, TX translation, TX drain), so
+    that a large ring cannot hold the thread long enough to starve the
+    other stages.
+
+    A budget is counted in packets and in bytes, either limit ending the
+    stage. An adaptive budget grows while the stage keeps running out of
+    budget with work left in the ring, and shrinks back once the stage
+    uses a fraction of it.
+
+--*/
+
+#pragma once
+
+// an adaptive budget grows up to this many times its configured size
+#define NX_WORK_BUDGET_MAXIMUM_SCALE 16
+
+class NxWorkBudget
+{
+public:
+
+    // zero means no limit
+    void
+    Initialize(
+        _In_ ULONG PacketLimit,
+        _In_ ULONG ByteLimit,
+        _In_ bool Adaptive
+    );
+
+    // called before the stage runs
+    void
+    Begin(
+        void
+    )
+    {
+        m_packets = 0;
+        m_bytes = 0;
+    }
+
+    bool
+    HasPackets(
+        void
+    ) const
+    {
+        return m_packetLimit == 0 || m_packets < m_packetLimit;
+    }
+
+    bool
+    HasBytes(
+        void
+    ) const
+    {
+        return m_byteLimit == 0 || m_bytes < m_byteLimit;
+    }
+
+    // Available capped to the packets left in the budget
+    UINT32
+    GetPacketLimit(
+        _In_ UINT32 Available
+    ) const
+    {
+        if (m_packetLimit == 0)
+        {
+            return Available;
+        }
+
+        return static_cast<UINT32>(min(static_cast<ULONG64>(Available), m_packetLimit - min(m_packets, m_packetLimit)));
+    }
+
+    void
+    Consume(
+        _In_ ULONG Packets,
+        _In_ ULONG64 Bytes
+    )
+    {
+        m_packets += Packets;
+        m_bytes += Bytes;
+    }
+
+    // called after the stage ran, MoreWork tells whether it left work behind
+    void
+    End(
+        _In_ bool MoreWork
+    );
+
+    // the last run of the stage stopped on the budget with work left behind
+    bool
+    WasExhausted(
+        void
+    ) const
+    {
+        return m_exhausted;
+    }
+
+private:
+
+    void
+    SetScale(
+        _In_ ULONG Scale
+    );
+
+    ULONG
+        m_basePacketLimit = 0;
+
+    ULONG
+        m_baseByteLimit = 0;
+
+    bool
+        m_adaptive = false;
+
+    bool
+        m_exhausted = false;
+
+    ULONG
+        m_scale = 1;
+
+    ULONG64
+        m_packetLimit = 0;
+
+    ULONG64
+        m_byteLimit = 0;
+
+    ULONG64
+        m_packets = 0;
+
+    ULONG64
+        m_bytes = 0;
+};
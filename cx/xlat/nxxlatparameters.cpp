@@ -0,0 +1,139 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+/*++
+
+Abstract:
+
+    Reads the per-adapter tunables of the translator.
+
+--*/
+
+#include "NxXlatPrecomp.hpp"
+#include "NxXlatCommon.hpp"
+
+#include "NxXlatParameters.tmh"
+#include "NxXlatParameters.hpp"
+
+#ifdef _KERNEL_MODE
+
+_IRQL_requires_(PASSIVE_LEVEL)
+static
+ULONG
+ReadParameter(
+    _In_ NDIS_HANDLE ConfigurationHandle,
+    _In_ PCWSTR ParameterName,
+    _In_ ULONG DefaultValue,
+    _In_ ULONG ParameterLimit
+)
+{
+    NDIS_STRING name;
+    RtlInitUnicodeString(&name, ParameterName);
+
+    NDIS_STATUS status;
+    NDIS_CONFIGURATION_PARAMETER * parameter;
+    NdisReadConfiguration(&status, &parameter, ConfigurationHandle, &name, NdisParameterInteger);
+
+    if (status != NDIS_STATUS_SUCCESS)
+    {
+        return DefaultValue;
+    }
+
+    auto const value = parameter->ParameterData.IntegerData;
+
+    return value > ParameterLimit ? ParameterLimit : value;
+}
+
+#endif // _KERNEL_MODE
+
+_Use_decl_annotations_
+void
+NxXlatReadParameters(
+    NDIS_HANDLE NdisAdapterHandle,
+    NxXlatParameters * Parameters
+)
+{
+    *Parameters = {};
+
+#ifdef _KERNEL_MODE
+    NDIS_CONFIGURATION_OBJECT configurationObject = {
+        {
+            NDIS_OBJECT_TYPE_CONFIGURATION_OBJECT,
+            NDIS_CONFIGURATION_OBJECT_REVISION_1,
+            NDIS_SIZEOF_CONFIGURATION_OBJECT_REVISION_1
+        },
+        NdisAdapterHandle,
+        0,
+    };
+
+    NDIS_HANDLE handle;
+    if (NdisOpenConfigurationEx(&configurationObject, &handle) != NDIS_STATUS_SUCCESS)
+    {
+        return;
+    }
+
+    auto configurationHandle = wil::unique_any<NDIS_HANDLE,
+        decltype(&::NdisCloseConfiguration), &::NdisCloseConfiguration>(handle);
+
+    Parameters->RxSmallBufferSize = ReadParameter(
+        handle, L"RxSmallBufferSize", Parameters->RxSmallBufferSize, MAXUSHORT);
+
+    Parameters->RxPrefetchDistance = ReadParameter(
+        handle, L"RxPrefetchDistance", Parameters->RxPrefetchDistance, 64);
+
+    Parameters->BusyPollTimeout = ReadParameter(
+        handle, L"BusyPollTimeout", Parameters->BusyPollTimeout, 10000);
+
+    Parameters->BusyPollIterations = ReadParameter(
+        handle, L"BusyPollIterations", Parameters->BusyPollIterations, MAXULONG);
+
+    Parameters->PollWorkers = ReadParameter(
+        handle, L"PollWorkers", Parameters->PollWorkers, 64);
+
+    Parameters->PollQuantum = ReadParameter(
+        handle, L"PollQuantum", Parameters->PollQuantum, 1024);
+
+    Parameters->RxIndicateBudget = ReadParameter(
+        handle, L"RxIndicateBudget", Parameters->RxIndicateBudget, MAXUSHORT);
+
+    Parameters->RxIndicateByteBudget = ReadParameter(
+        handle, L"RxIndicateByteBudget", Parameters->RxIndicateByteBudget, MAXULONG);
+
+    Parameters->RxPrepareBudget = ReadParameter(
+        handle, L"RxPrepareBudget", Parameters->RxPrepareBudget, MAXUSHORT);
+
+    Parameters->RxPrepareByteBudget = ReadParameter(
+        handle, L"RxPrepareByteBudget", Parameters->RxPrepareByteBudget, MAXULONG);
+
+    Parameters->TxTranslateBudget = ReadParameter(
+        handle, L"TxTranslateBudget", Parameters->TxTranslateBudget, MAXUSHORT);
+
+    Parameters->TxTranslateByteBudget = ReadParameter(
+        handle, L"TxTranslateByteBudget", Parameters->TxTranslateByteBudget, MAXULONG);
+
+    Parameters->TxDrainBudget = ReadParameter(
+        handle, L"TxDrainBudget", Parameters->TxDrainBudget, MAXUSHORT);
+
+    Parameters->AdaptiveBudgets = ReadParameter(
+        handle, L"AdaptiveBudgets", Parameters->AdaptiveBudgets, 1);
+
+    Parameters->NotificationModeration = ReadParameter(
+        handle, L"NotificationModeration", Parameters->NotificationModeration, 1);
+
+    Parameters->RxCoalescing = ReadParameter(
+        handle, L"RxCoalescing", Parameters->RxCoalescing, 1);
+
+    Parameters->RxCoalescingFlows = ReadParameter(
+        handle, L"RxCoalescingFlows", Parameters->RxCoalescingFlows, 64);
+
+    Parameters->SoftwareSegmentation = ReadParameter(
+        handle, L"SoftwareSegmentation", Parameters->SoftwareSegmentation, 1);
+
+    Parameters->SoftwareChecksum = ReadParameter(
+        handle, L"SoftwareChecksum", Parameters->SoftwareChecksum, 1);
+
+    Parameters->SoftwareReceiveScaling = ReadParameter(
+        handle, L"SoftwareReceiveScaling", Parameters->SoftwareReceiveScaling, 1);
+#else
+    UNREFERENCED_PARAMETER(NdisAdapterHandle);
+#endif // _KERNEL_MODE
+}
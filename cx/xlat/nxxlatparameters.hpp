@@ -0,0 +1,117 @@
+// Copyright (C) Microsoft Corporation. All rights reserved.
+
+/*++
+
+Abstract:
+
+    Per-adapter tunables of the translator. The values are read from the
+    adapter's NDIS keywords when the datapath is created, keywords that
+    are absent leave the defaults below in place.
+
+--*/
+
+#pragma once
+
+struct NxXlatParameters
+{
+    //
+    // Size of the small receive buffer class, in bytes. When non-zero and
+    // smaller than the maximum frame size, receive buffers are posted from
+    // a small and a large class. Frames larger than a small buffer then
+    // span several fragments, so this is only enabled on request.
+    //
+    ULONG RxSmallBufferSize = 0;
+
+    //
+    // Number of packets the receive indication loop prefetches ahead of the
+    // packet it is translating. Packet layouts are parsed half way between
+    // the prefetch and the translation. Zero disables the pipeline.
+    //
+    ULONG RxPrefetchDistance = 8;
+
+    //
+    // Longest time, in microseconds, an execution context keeps polling
+    // after running out of work before it arms notifications and sleeps.
+    // The actual spin is adapted to the recent gaps between bursts, see
+    // NxExecutionContext::ContinueBusyPoll. Zero disables busy polling.
+    //
+    ULONG BusyPollTimeout = 0;
+
+    //
+    // Most polling iterations spent in one busy poll, zero for no limit
+    // other than BusyPollTimeout.
+    //
+    ULONG BusyPollIterations = 0;
+
+    //
+    // Number of poll workers the adapter's queues share, one per processor
+    // at most. Zero gives every queue an execution context thread of its
+    // own.
+    //
+    ULONG PollWorkers = 0;
+
+    //
+    // Iterations a queue with work runs before the poll worker moves on to
+    // the next queue.
+    //
+    ULONG PollQuantum = 4;
+
+    //
+    // Work a single execution context iteration does in each stage, in
+    // packets and in bytes. Zero leaves the stage unbounded, it then runs
+    // until the ring is empty or full.
+    //
+    ULONG RxIndicateBudget = 0;
+    ULONG RxIndicateByteBudget = 0;
+    ULONG RxPrepareBudget = 0;
+    ULONG RxPrepareByteBudget = 0;
+    ULONG TxTranslateBudget = 0;
+    ULONG TxTranslateByteBudget = 0;
+    ULONG TxDrainBudget = 0;
+
+    //
+    // Non-zero lets the budgets above grow while a stage keeps running out
+    // of budget with work left in the ring, see NxWorkBudget.
+    //
+    ULONG AdaptiveBudgets = 0;
+
+    //
+    // Non-zero delays arming the NIC notifications by a linger time picked
+    // from the queue's packet rate, see NxNotificationModerator.
+    //
+    ULONG NotificationModeration = 0;
+
+    //
+    // Non-zero merges in order TCP segments of a flow received in the same
+    // indication batch into one NBL, see NxRxCoalescer. RxCoalescingFlows
+    // is the number of flows tracked at once within a batch.
+    //
+    ULONG RxCoalescing = 0;
+    ULONG RxCoalescingFlows = 8;
+
+    //
+    // Non-zero advertises large send offload for IP versions the NIC cannot
+    // segment and segments those sends in software, as well as sends larger
+    // than the NIC's limits, see NxTxSegmenter.
+    //
+    ULONG SoftwareSegmentation = 0;
+
+    //
+    // Non-zero advertises the checksum offloads the NIC lacks, computing and
+    // validating those checksums in software, see NxChecksumEngine.
+    //
+    ULONG SoftwareChecksum = 0;
+
+    //
+    // Non-zero hashes and spreads received packets over processors in
+    // software when the NIC has a single receive queue, see NxRxSteering.
+    //
+    ULONG SoftwareReceiveScaling = 0;
+};
+
+_IRQL_requires_(PASSIVE_LEVEL)
+void
+NxXlatReadParameters(
+    _In_ NDIS_HANDLE NdisAdapterHandle,
+    _Out_ NxXlatParameters * Parameters
+);